@@ -33,6 +33,7 @@
 #include "aws-s3fs.h"
 #include "filecache.h"
 #include "socket.h"
+#include "trace.h"
 
 
 /* If the parent process is terminated, terminate also this pid, if > 0. */
@@ -174,6 +175,11 @@ StartProcesses(
 		sigaction( SIGTSTP, &sigAction, NULL );
 		sigaction( SIGTTOU, &sigAction, NULL );
 		sigaction( SIGTTIN, &sigAction, NULL );
+		/* Write the trace spans to a file on request. */
+		if( RegisterTraceSignal( ) < 0 )
+		{
+			perror( "Cannot register trace signal handler" );
+		}
 
 		/* Initialize the child process, which runs the file cache module. */
 		if( forkPid == 0 )
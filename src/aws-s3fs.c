@@ -29,6 +29,7 @@
 #include "aws-s3fs.h"
 #include "fuseif.h"
 #include "s3if.h"
+#include "trace.h"
 
 
 struct Configuration globalConfig;
@@ -48,7 +49,8 @@ main( int argc, char **argv )
     int         fuseStatus;
     struct stat st;
     int         fuseArgc;
-    char        *fuseArgv[ ] = { NULL, NULL, NULL, NULL };
+    char        *fuseArgv[ ] = { NULL, NULL, NULL, NULL, NULL };
+    char        timeoutOptions[ 80 ];
 
     /* Initialize modules. */
     InitializeConfiguration( &globalConfig );
@@ -58,6 +60,8 @@ main( int argc, char **argv )
     Configure( &globalConfig, argc, (const char * const *) argv );
     InitializeS3If( );
     InitLog( globalConfig.logfile, globalConfig.logLevel );
+    /* Write the trace spans to a file on request. */
+    RegisterTraceSignal( );
 
     stat( globalConfig.mountPoint, &st );
     if( ( st.st_mode & S_IFDIR ) == 0 )
@@ -80,6 +84,13 @@ main( int argc, char **argv )
     */
     fuseArgv[ 0] = globalConfig.bucketName;
     fuseArgv[ 1 ] = globalConfig.mountPoint;
+    /* Let the kernel cache entries and attributes so that repeated stats
+       are answered without calling getattr. */
+    sprintf( timeoutOptions,
+	     "-oentry_timeout=%d,attr_timeout=%d,negative_timeout=%d",
+	     globalConfig.entryTimeout, globalConfig.attrTimeout,
+	     globalConfig.negativeTimeout );
+    fuseArgv[ fuseArgc++ ] = timeoutOptions;
     fuseStatus = fuse_main( fuseArgc, fuseArgv, &s3fsOperations, NULL );
     return( fuseStatus );
 }
@@ -53,7 +53,7 @@
 /* Define a file cache size of 1 GByte. */
 #define FILE_CACHE_SIZE ( 1 * 1024 * (1024*1024) )
 
-/* Make room for 2,000 files in the stat cache. */
+/* Make room for 2,000 files in the stat cache by default. */
 #define MAX_STAT_CACHE_SIZE 2000l
 
 /* Default, system-wide aws-s3fs.conf file. */
@@ -82,6 +82,16 @@
 #define DEFAULT_LOG_FILE   "/var/log/aws-s3fs.log"
 #define DEFAULT_VERBOSE    false
 
+/** Default kernel cache timeouts in seconds, which are those of FUSE. The
+    kernel does not see changes made to the bucket by other clients until an
+    entry times out, so longer timeouts must be configured explicitly. */
+#define DEFAULT_ENTRY_TIMEOUT    1
+#define DEFAULT_ATTR_TIMEOUT     1
+#define DEFAULT_NEGATIVE_TIMEOUT 0
+
+/** Default interval in seconds between cache snapshots. */
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+
 
 struct ConfigurationBoolean {
     bool value;
@@ -96,6 +106,13 @@ enum LogLevels {
     log_DEBUG   = LOG_DEBUG
 };
 
+/** Checksums that protect the transfers to and from S3: MD5 digests in
+    Content-MD5 headers, or CRC32C checksums that S3 stores with the file. */
+enum ChecksumModes {
+    CHECKSUM_MD5,
+    CHECKSUM_CRC32C
+};
+
 
 struct Configuration {
     enum bucketRegions          region;
@@ -108,6 +125,13 @@ struct Configuration {
     struct ConfigurationBoolean verbose;
     enum LogLevels              logLevel;
     bool                        daemonize;
+    int                         entryTimeout;
+    int                         attrTimeout;
+    int                         negativeTimeout;
+    /*@null@*/ char             *cacheSnapshot;
+    int                         snapshotInterval;
+    long                        statCacheSize;
+    enum ChecksumModes          checksum;
 };
 
 struct CmdlineConfiguration {
@@ -185,6 +209,27 @@ ConfigSetPath(
     const char *configPath
 );
 
+void
+ConfigSetTimeout(
+    int  *timeout,
+    int  configValue,
+    bool *configError
+);
+
+void
+ConfigSetCacheSize(
+    long *cacheSize,
+    int  configValue,
+    bool *configError
+);
+
+void
+ConfigSetChecksum(
+    enum ChecksumModes *checksum,
+    const char         *configValue,
+    bool               *configError
+);
+
 
 /* In common.c. */
 
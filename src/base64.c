@@ -24,244 +24,547 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include "base64.h"
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define BASE64_X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+
+#ifdef AUTOTEST
+#define STATIC
+#else
+#define STATIC static
+#endif
 
-#include <stdio.h>
 
 static const char const *toBase64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                                     "abcdefghijklmnopqrstuvwxyz"
                                     "0123456789"
                                     "+/";
 
-static const char const fromBase64_idx43[ ] =
+/* Value of each base64 character, or 0x80 for characters that are not part
+   of the base64 alphabet, including the '=' padding. */
+static const unsigned char fromBase64[ 256 ] =
 {
-    /* '+' */  62,
-               0, 0, 0,
-    /* '/' */  63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 0,
-               0, 0, 0, 0, 0, 0,
-    /* 'A' */  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
-               15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
-               0, 0, 0, 0, 0, 0,
-    /* 'a' */  26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38,
-               39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
 };
 
 
+/* Instruction set extensions that the base64 kernels use. The SSSE3
+   kernels translate 16 characters at a time, and the AVX2 kernels 32. */
+#define BASE64_ACCEL_SSSE3 0x01
+#define BASE64_ACCEL_AVX2  0x02
 
-char*
-EncodeBase64(
-    const unsigned char *source,
-    int                 length
-	     )
-{
-    int           ch;
-    unsigned char array3[ 3 ];
-    unsigned char array4[ 4 ];
-    int           a3Idx = 0;
-    int           i;
+/* Supported extensions, or -1 until the processor has been examined. */
+STATIC int base64Acceleration = -1;
 
-#ifdef AUTOTEST
-    char buildBuffer[ 100 ];
-#else
-    char buildBuffer[ 2048 ];
-#endif
-    unsigned int buildIdx = 0;
-    char         *result;
-    int          allocCount;
-    char         *toReturn;
 
-    result     = malloc( sizeof( buildBuffer ) );
-    allocCount = 1;
-    *result    = '\0';
 
-    /* Expand input string to 4/3. */
-    for( ch = 0; ch < length; ch++ )
-    {
-        array3[ a3Idx++ ] = source[ ch ];
+/**
+ * Determine which instruction set extensions the processor and the
+ * operating system support for the base64 kernels.
+ * @return Bitmask of BASE64_ACCEL_* flags.
+ */
+static int
+GetBase64Acceleration(
+    void
+		      )
+{
+    int          accel = __atomic_load_n( &base64Acceleration,
+					  __ATOMIC_RELAXED );
+#ifdef BASE64_X86_KERNELS
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int features;
+    unsigned int xcr0Low, xcr0High;
+#endif
 
-	if( a3Idx == 3 )
+    if( accel >= 0 )
+    {
+        return( accel );
+    }
+    accel = 0;
+#ifdef BASE64_X86_KERNELS
+    if( __get_cpuid( 1, &eax, &ebx, &features, &edx ) )
+    {
+        if( features & ( 1u << 9 ) )
 	{
-	    /* Expand 3 characters into 4. */
-	    array4[ 0 ] = (   array3[ 0 ] & 0xfc ) >> 2;
-	    array4[ 1 ] = ( ( array3[ 0 ] & 0x03 ) << 4 ) |
-	                  ( ( array3[ 1 ] & 0xf0 ) >> 4 );
-	    array4[ 2 ] = ( ( array3[ 1 ] & 0x0f ) << 2 ) |
-	                  ( ( array3[ 2 ] & 0xc0 ) >> 6 );
-	    array4[ 3 ] = (   array3[ 2 ] & 0x3f );
-	    /* Change to BASE64 character representation. */
-	    for( i = 0; i < 4; i++ )
-	    {
-	        buildBuffer[ buildIdx++ ] = toBase64[ array4[ i ] ];
-	    }
-	    /* Allocate a new block if the current block is full. "-6" because
-	      we want to leave room for another four characters. sizeof-1 is
-	      the last item, and we also need room for a '\0'. */
-	    if( buildIdx >= sizeof( buildBuffer ) - 6 )
+	    accel |= BASE64_ACCEL_SSSE3;
+	}
+	/* AVX2 also requires that the operating system saves the YMM
+	   registers, which it indicates with OSXSAVE and XCR0. */
+	if( ( features & ( 1u << 27 ) ) && ( features & ( 1u << 28 ) )
+	    && __get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx )
+	    && ( ebx & ( 1u << 5 ) ) )
+	{
+	    __asm__( "xgetbv" : "=a" ( xcr0Low ), "=d" ( xcr0High )
+		              : "c" ( 0 ) );
+	    if( ( xcr0Low & 0x06 ) == 0x06 )
 	    {
-	        buildBuffer[ buildIdx ] = '\0';
-		strcat( result, buildBuffer );
-		result = realloc( result,
-				  ( ++allocCount ) * sizeof( buildBuffer ) );
-		buildIdx = 0;
-		buildBuffer[ buildIdx ] = '\0';
+	        accel |= BASE64_ACCEL_AVX2;
 	    }
-	    a3Idx = 0;
 	}
     }
+#endif
+    __atomic_store_n( &base64Acceleration, accel, __ATOMIC_RELAXED );
+    return( accel );
+}
+
 
-    /* Process remaining array3[ ] entries. */
-    if( a3Idx > 0 )
+
+#ifdef BASE64_X86_KERNELS
+/**
+ * Translate 6-bit values into base64 characters.
+ * @param indices [in] Values in the range 0..63.
+ * @return Base64 characters.
+ */
+__attribute__(( target( "ssse3" ) ))
+static inline __m128i
+Base64LookupSsse3(
+    __m128i indices
+		  )
+{
+    /* Map each value to one of 14 ranges, whose offset to the base64
+       character is looked up: 0..25 to 13, 26..51 to 0, and 52..63 to
+       1..12. */
+    const __m128i offsets = _mm_setr_epi8( 'a' - 26, '0' - 52, '0' - 52,
+					   '0' - 52, '0' - 52, '0' - 52,
+					   '0' - 52, '0' - 52, '0' - 52,
+					   '0' - 52, '0' - 52, '+' - 62,
+					   '/' - 63, 'A', 0, 0 );
+    __m128i       range;
+
+    range = _mm_subs_epu8( indices, _mm_set1_epi8( 51 ) );
+    range = _mm_or_si128( range,
+			  _mm_and_si128( _mm_cmpgt_epi8( _mm_set1_epi8( 26 ),
+							 indices ),
+					 _mm_set1_epi8( 13 ) ) );
+    return( _mm_add_epi8( _mm_shuffle_epi8( offsets, range ), indices ) );
+}
+
+
+
+/**
+ * Encode 12 bytes into 16 base64 characters.
+ * @param source [in] Bytes to encode. 16 bytes must be readable.
+ * @param encoded [out] Destination for the 16 characters.
+ * @return Nothing.
+ */
+__attribute__(( target( "ssse3" ) ))
+static void
+EncodeBlockSsse3(
+    const unsigned char *source,
+    char                *encoded
+		 )
+{
+    __m128i in;
+    __m128i indices;
+
+    /* Place each group of three bytes in a 32-bit word, and move the four
+       6-bit fields to one byte each with shifts carried out by
+       multiplications. */
+    in = _mm_loadu_si128( (const __m128i*) source );
+    in = _mm_shuffle_epi8( in, _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4,
+					      7, 6, 8, 7, 10, 9, 11, 10 ) );
+    indices = _mm_or_si128(
+        _mm_mulhi_epu16( _mm_and_si128( in, _mm_set1_epi32( 0x0fc0fc00 ) ),
+			 _mm_set1_epi32( 0x04000040 ) ),
+	_mm_mullo_epi16( _mm_and_si128( in, _mm_set1_epi32( 0x003f03f0 ) ),
+			 _mm_set1_epi32( 0x01000010 ) ) );
+    _mm_storeu_si128( (__m128i*) encoded, Base64LookupSsse3( indices ) );
+}
+
+
+
+/**
+ * Encode 24 bytes into 32 base64 characters.
+ * @param source [in] Bytes to encode. 28 bytes must be readable.
+ * @param encoded [out] Destination for the 32 characters.
+ * @return Nothing.
+ */
+__attribute__(( target( "avx2" ) ))
+static void
+EncodeBlockAvx2(
+    const unsigned char *source,
+    char                *encoded
+		)
+{
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 );
+    __m256i       in;
+    __m256i       indices;
+    __m256i       range;
+
+    /* Each 128-bit lane encodes 12 bytes as in the SSSE3 kernel. */
+    in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*) source ) ),
+	_mm_loadu_si128( (const __m128i*) ( source + 12 ) ), 1 );
+    in = _mm256_shuffle_epi8( in, _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+	1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 ) );
+    indices = _mm256_or_si256(
+        _mm256_mulhi_epu16( _mm256_and_si256( in,
+					      _mm256_set1_epi32( 0x0fc0fc00 ) ),
+			    _mm256_set1_epi32( 0x04000040 ) ),
+	_mm256_mullo_epi16( _mm256_and_si256( in,
+					      _mm256_set1_epi32( 0x003f03f0 ) ),
+			    _mm256_set1_epi32( 0x01000010 ) ) );
+
+    range = _mm256_subs_epu8( indices, _mm256_set1_epi8( 51 ) );
+    range = _mm256_or_si256(
+        range,
+	_mm256_and_si256( _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), indices ),
+			  _mm256_set1_epi8( 13 ) ) );
+    _mm256_storeu_si256( (__m256i*) encoded,
+			 _mm256_add_epi8( _mm256_shuffle_epi8( offsets, range ),
+					  indices ) );
+}
+
+
+
+/**
+ * Decode 16 base64 characters into 12 bytes, unless one of them is not in
+ * the base64 alphabet.
+ * @param source [in] Characters to decode.
+ * @param decoded [out] Destination for the bytes. 16 bytes are written.
+ * @return 1 if the characters were decoded, or 0 if nothing was written.
+ */
+__attribute__(( target( "ssse3" ) ))
+static int
+DecodeBlockSsse3(
+    const char    *source,
+    unsigned char *decoded
+		 )
+{
+    /* A character is valid if the bits looked up by its low and high
+       nibbles have nothing in common. */
+    const __m128i validLow  = _mm_setr_epi8( 0x15, 0x11, 0x11, 0x11, 0x11,
+					     0x11, 0x11, 0x11, 0x11, 0x11,
+					     0x13, 0x1a, 0x1b, 0x1b, 0x1b,
+					     0x1a );
+    const __m128i validHigh = _mm_setr_epi8( 0x10, 0x10, 0x01, 0x02, 0x04,
+					     0x08, 0x04, 0x08, 0x10, 0x10,
+					     0x10, 0x10, 0x10, 0x10, 0x10,
+					     0x10 );
+    /* Offsets to the values of '/' (moved to index 1), '+' and digits,
+       upper case, and lower case letters, by the high nibble. */
+    const __m128i offsets   = _mm_setr_epi8( 0, 16, 19, 4, -65, -65, -71,
+					     -71, 0, 0, 0, 0, 0, 0, 0, 0 );
+    const __m128i nibble    = _mm_set1_epi8( 0x0f );
+    __m128i       in;
+    __m128i       high;
+    __m128i       low;
+
+    in   = _mm_loadu_si128( (const __m128i*) source );
+    high = _mm_and_si128( _mm_srli_epi32( in, 4 ), nibble );
+    low  = _mm_and_si128( in, nibble );
+    /* Characters with the top bit set have a high nibble of 8..15. */
+    if( _mm_movemask_epi8( _mm_cmpeq_epi8(
+            _mm_and_si128( _mm_shuffle_epi8( validLow, low ),
+			   _mm_shuffle_epi8( validHigh, high ) ),
+	    _mm_setzero_si128( ) ) ) != 0xffff )
     {
-        /* Clear last one/two characters in array3. */
-        for( i = a3Idx; i < 3; i++ )
-	{
-  	    array3[ i ] = '\0';
-	}
+        return( 0 );
+    }
+    high = _mm_add_epi8( high, _mm_cmpeq_epi8( in, _mm_set1_epi8( '/' ) ) );
+    in   = _mm_add_epi8( in, _mm_shuffle_epi8( offsets, high ) );
 
-	/* Expand 3 characters into 4. */
-	array4[ 0 ] = (   array3[ 0 ] & 0xfc ) >> 2;
-	array4[ 1 ] = ( ( array3[ 0 ] & 0x03 ) << 4 ) |
-	              ( ( array3[ 1 ] & 0xf0 ) >> 4 );
-	array4[ 2 ] = ( ( array3[ 1 ] & 0x0f ) << 2 ) |
-	              ( ( array3[ 2 ] & 0xc0 ) >> 6 );
-	array4[ 3 ] = (   array3[ 2 ] & 0x3f );
+    /* Merge the four 6-bit values of each 32-bit word into 24 bits, and
+       gather the three bytes of each word in big-endian order. */
+    in = _mm_maddubs_epi16( in, _mm_set1_epi32( 0x01400140 ) );
+    in = _mm_madd_epi16( in, _mm_set1_epi32( 0x00011000 ) );
+    in = _mm_shuffle_epi8( in, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8,
+					      14, 13, 12, -1, -1, -1, -1 ) );
+    _mm_storeu_si128( (__m128i*) decoded, in );
+    return( 1 );
+}
 
-	for( i = 0; i <= a3Idx; i++ )
-	{
-	    buildBuffer[ buildIdx++ ] = toBase64[ array4[ i ] ];
-	}
-	/* "Zero"-pad until the length is divisible by 3. */
-	for( ; i < 4; i++ )
-	{
-	    buildBuffer[ buildIdx++ ] = '=';
-	}
-	buildBuffer[ buildIdx ] = '\0';
-	strcat( result, buildBuffer );
+
+
+/**
+ * Decode 32 base64 characters into 24 bytes, unless one of them is not in
+ * the base64 alphabet.
+ * @param source [in] Characters to decode.
+ * @param decoded [out] Destination for the bytes. 32 bytes are written.
+ * @return 1 if the characters were decoded, or 0 if nothing was written.
+ */
+__attribute__(( target( "avx2" ) ))
+static int
+DecodeBlockAvx2(
+    const char    *source,
+    unsigned char *decoded
+		)
+{
+    const __m256i validLow  = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a );
+    const __m256i validHigh = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+    const __m256i offsets   = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 );
+    const __m256i nibble    = _mm256_set1_epi8( 0x0f );
+    __m256i       in;
+    __m256i       high;
+    __m256i       low;
+
+    in   = _mm256_loadu_si256( (const __m256i*) source );
+    high = _mm256_and_si256( _mm256_srli_epi32( in, 4 ), nibble );
+    low  = _mm256_and_si256( in, nibble );
+    if( ! _mm256_testz_si256( _mm256_shuffle_epi8( validLow, low ),
+			      _mm256_shuffle_epi8( validHigh, high ) ) )
+    {
+        return( 0 );
     }
+    high = _mm256_add_epi8( high,
+			    _mm256_cmpeq_epi8( in, _mm256_set1_epi8( '/' ) ) );
+    in   = _mm256_add_epi8( in, _mm256_shuffle_epi8( offsets, high ) );
 
-    /* Copy the working buffer to a result, which probably requires less
-       memory. */
-    toReturn = malloc( strlen( result ) + sizeof( char ) );
-    strcpy( toReturn, result );
-    free( result );
-    return toReturn;
+    in = _mm256_maddubs_epi16( in, _mm256_set1_epi32( 0x01400140 ) );
+    in = _mm256_madd_epi16( in, _mm256_set1_epi32( 0x00011000 ) );
+    in = _mm256_shuffle_epi8( in, _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ) );
+    /* Move the 12 bytes of the upper lane next to those of the lower. */
+    in = _mm256_permutevar8x32_epi32( in, _mm256_setr_epi32( 0, 1, 2, 4, 5,
+							     6, 3, 7 ) );
+    _mm256_storeu_si256( (__m256i*) decoded, in );
+    return( 1 );
 }
+#endif /* BASE64_X86_KERNELS */
 
 
 
-static inline int isBase64( char ch )
+/**
+ * Encode binary data as base64 into a buffer provided by the caller.
+ * @param source [in] Binary data.
+ * @param length [in] Number of bytes of binary data.
+ * @param encoded [out] Destination for the zero-terminated base64 string,
+ *        which must hold at least BASE64_ENCODED_SIZE( length ) characters.
+ * @return Number of characters written, excluding the zero terminator.
+ * Test: unit test (test-hash.c).
+ */
+int
+EncodeBase64Buffer(
+    const unsigned char *source,
+    int                 length,
+    char                *encoded
+		   )
 {
-    if( isalnum( ch ) || ( ch == '/' ) || ( ch == '+' ) )
+    int srcIdx = 0;
+    int dstIdx = 0;
+#ifdef BASE64_X86_KERNELS
+    int accel  = GetBase64Acceleration( );
+
+    /* The kernels read four bytes beyond those they encode. */
+    if( accel & BASE64_ACCEL_AVX2 )
+    {
+        while( length - srcIdx >= 28 )
+	{
+	    EncodeBlockAvx2( &source[ srcIdx ], &encoded[ dstIdx ] );
+	    srcIdx += 24;
+	    dstIdx += 32;
+	}
+    }
+    if( accel & BASE64_ACCEL_SSSE3 )
+    {
+        while( length - srcIdx >= 16 )
+	{
+	    EncodeBlockSsse3( &source[ srcIdx ], &encoded[ dstIdx ] );
+	    srcIdx += 12;
+	    dstIdx += 16;
+	}
+    }
+#endif
+
+    /* Expand 3 bytes into 4 characters. */
+    while( length - srcIdx >= 3 )
     {
-        return 1;
+        encoded[ dstIdx++ ] = toBase64[ source[ srcIdx ] >> 2 ];
+	encoded[ dstIdx++ ] = toBase64[ ( ( source[ srcIdx ] & 0x03 ) << 4 )
+					| ( source[ srcIdx + 1 ] >> 4 ) ];
+	encoded[ dstIdx++ ] = toBase64[ ( ( source[ srcIdx + 1 ] & 0x0f ) << 2 )
+					| ( source[ srcIdx + 2 ] >> 6 ) ];
+	encoded[ dstIdx++ ] = toBase64[ source[ srcIdx + 2 ] & 0x3f ];
+	srcIdx += 3;
     }
-    else
+
+    /* "Zero"-pad the remaining one or two bytes. */
+    if( length - srcIdx == 1 )
     {
-        return(0 );
+        encoded[ dstIdx++ ] = toBase64[ source[ srcIdx ] >> 2 ];
+	encoded[ dstIdx++ ] = toBase64[ ( source[ srcIdx ] & 0x03 ) << 4 ];
+	encoded[ dstIdx++ ] = '=';
+	encoded[ dstIdx++ ] = '=';
     }
+    else if( length - srcIdx == 2 )
+    {
+        encoded[ dstIdx++ ] = toBase64[ source[ srcIdx ] >> 2 ];
+	encoded[ dstIdx++ ] = toBase64[ ( ( source[ srcIdx ] & 0x03 ) << 4 )
+					| ( source[ srcIdx + 1 ] >> 4 ) ];
+	encoded[ dstIdx++ ] = toBase64[ ( source[ srcIdx + 1 ] & 0x0f ) << 2 ];
+	encoded[ dstIdx++ ] = '=';
+    }
+    encoded[ dstIdx ] = '\0';
+
+    return( dstIdx );
 }
 
 
 
-unsigned char*
-DecodeBase64( const char *source, int *length )
+/**
+ * Encode binary data as base64.
+ * @param source [in] Binary data.
+ * @param length [in] Number of bytes of binary data.
+ * @return Zero-terminated base64 string, which the caller must free.
+ * Test: unit test (test-hash.c).
+ */
+char*
+EncodeBase64(
+    const unsigned char *source,
+    int                 length
+	     )
 {
-    int           sourceLength;
-    int           sourceIdx = 0;
-    unsigned char array4[ 4 ] = { 0 }; /* Initialized to avoid compiler warn. */
-    int           a4Idx = 0;
-    unsigned char array3[ 3 ];
-    int           i;
+    char *encoded;
 
-#ifdef AUTOTEST
-    unsigned char buildBuffer[ 100 ];
-#else
-    unsigned char buildBuffer[ 2048 ];
-#endif
-    int           buildIdx      = 0;
-    int           decodedLength;
-    int           blockBegin;
-    unsigned char *result;
-    int           allocCount;
-    unsigned char *toReturn;
-
-    result        = malloc( sizeof( buildBuffer ) );
-    allocCount    = 1;
-    blockBegin    = 0;
-    decodedLength = 0;
+    encoded = malloc( BASE64_ENCODED_SIZE( length ) );
+    EncodeBase64Buffer( source, length, encoded );
+    return( encoded );
+}
 
-    sourceLength = strlen( source );
-    while( ( sourceIdx < sourceLength ) && ( source[ sourceIdx ] != '=' ) &&
-	   isBase64( source[ sourceIdx ] ) )
+
+
+/**
+ * Decode base64 characters into a buffer provided by the caller. Decoding
+ * stops at the '=' padding or at the first character that is not in the
+ * base64 alphabet.
+ * @param source [in] Base64 characters.
+ * @param sourceLength [in] Number of characters.
+ * @param decoded [out] Destination for the binary data, which must hold at
+ *        least BASE64_DECODED_SIZE( sourceLength ) bytes.
+ * @return Number of bytes decoded.
+ * Test: unit test (test-hash.c).
+ */
+int
+DecodeBase64Buffer(
+    const char    *source,
+    int           sourceLength,
+    unsigned char *decoded
+		   )
+{
+    const unsigned char *characters = (const unsigned char*) source;
+    unsigned char       array4[ 4 ];
+    int                 srcIdx = 0;
+    int                 dstIdx = 0;
+    int                 a4Idx;
+#ifdef BASE64_X86_KERNELS
+    int                 accel  = GetBase64Acceleration( );
+
+    /* The kernels write 8 and 4 bytes beyond those they decode, which the
+       destination has room for as long as this many characters remain. A
+       block with invalid characters is left to the portable code, which
+       decodes the characters that precede them. */
+    if( accel & BASE64_ACCEL_AVX2 )
     {
-        /* Compact 4 characters into 3. */
-	array4[ a4Idx++ ] = source[ sourceIdx++ ];
-	if( a4Idx == 4 )
+        while( ( sourceLength - srcIdx >= 48 )
+	       && DecodeBlockAvx2( &source[ srcIdx ], &decoded[ dstIdx ] ) )
 	{
-	    for( i = 0; i < 4; i++ )
-	    {
-	        array4[ i ] = fromBase64_idx43[ array4[ i ] - 43 ];
-	    }
-	    array3[ 0 ] =   ( array4[ 0 ]          << 2 ) |
-	                  ( ( array4[ 1 ] & 0x30 ) >> 4 );
-	    array3[ 1 ] = ( ( array4[ 1 ] & 0x0f ) << 4 ) |
-	                  ( ( array4[ 2 ] & 0x3c ) >> 2 );
-	    array3[ 2 ] = ( ( array4[ 2 ] & 0x03 ) << 6 ) |
-	                      array4[ 3 ];
-	    for( i = 0; i < 3; i++ )
-	    {
-		buildBuffer[ buildIdx++ ] = array3[ i ];
-	    }
-	    decodedLength = decodedLength + 3;
-
-	    /* Allocate a new block if the current block is full. "-5" because
-	       we want to leave room for another three characters. sizeof-1 is
-	       the last item, and we also need room for a '\0'. */
-	    if( buildIdx >= (int) sizeof( buildBuffer ) - 5 )
-	    {
-		memcpy( &result[ blockBegin ], buildBuffer, buildIdx );
-		result = realloc( result,
-				  ( ++allocCount ) * sizeof( buildBuffer ) );
-		blockBegin = blockBegin + buildIdx;
-		buildIdx   = 0;
-	    }
-	    a4Idx = 0;
+	    srcIdx += 32;
+	    dstIdx += 24;
 	}
     }
- 
-   /* Process remaining characters. */
-    if( a4Idx != 0 )
+    if( accel & BASE64_ACCEL_SSSE3 )
     {
-	for( i = 0; i < a4Idx; i++ )
+        while( ( sourceLength - srcIdx >= 24 )
+	       && DecodeBlockSsse3( &source[ srcIdx ], &decoded[ dstIdx ] ) )
 	{
-	    array4[ i ] = fromBase64_idx43[ array4[ i ] - 43 ];
+	    srcIdx += 16;
+	    dstIdx += 12;
 	}
-        for( ; i < 4; i++ )
+    }
+#endif
+
+    /* Compact 4 characters into 3 bytes. */
+    for( ;; )
+    {
+        for( a4Idx = 0; ( a4Idx < 4 ) && ( srcIdx + a4Idx < sourceLength );
+	     a4Idx++ )
 	{
-	    array4[ i ] = 0;
+	    array4[ a4Idx ] = fromBase64[ characters[ srcIdx + a4Idx ] ];
+	    if( array4[ a4Idx ] & 0x80 )
+	    {
+	        break;
+	    }
 	}
-	array3[ 0 ] =   ( array4[ 0 ]          << 2 ) |
-                      ( ( array4[ 1 ] & 0x30 ) >> 4 );
-	array3[ 1 ] = ( ( array4[ 1 ] & 0x0f ) << 4 ) |
-	              ( ( array4[ 2 ] & 0x3c ) >> 2 );
-	array3[ 2 ] = ( ( array4[ 2 ] & 0x03 ) << 6 ) |
-	                  array4[ 3 ];
-
-	for( i = 0; i < a4Idx - 1; i++ )
-        {
-	    buildBuffer[ buildIdx++ ] = array3[ i ];
-	    decodedLength++;
+	if( a4Idx < 4 )
+	{
+	    break;
 	}
-	memcpy( &result[ blockBegin ], buildBuffer, buildIdx );
+	decoded[ dstIdx++ ] = ( array4[ 0 ] << 2 ) | ( array4[ 1 ] >> 4 );
+	decoded[ dstIdx++ ] = ( array4[ 1 ] << 4 ) | ( array4[ 2 ] >> 2 );
+	decoded[ dstIdx++ ] = ( array4[ 2 ] << 6 ) | array4[ 3 ];
+	srcIdx += 4;
     }
 
-    /* Copy the working buffer to a result, which probably requires less
-       memory. */
-    toReturn = malloc( decodedLength );
-    memcpy( toReturn, result, decodedLength );
-    free( result );
+    /* Process the remaining characters; n characters hold n - 1 bytes. */
+    if( a4Idx >= 2 )
+    {
+        decoded[ dstIdx++ ] = ( array4[ 0 ] << 2 ) | ( array4[ 1 ] >> 4 );
+    }
+    if( a4Idx >= 3 )
+    {
+        decoded[ dstIdx++ ] = ( array4[ 1 ] << 4 ) | ( array4[ 2 ] >> 2 );
+    }
 
-    *length = decodedLength;
-    return toReturn;
+    return( dstIdx );
 }
 
+
+
+/**
+ * Decode a base64 string. Decoding stops at the '=' padding or at the first
+ * character that is not in the base64 alphabet.
+ * @param source [in] Zero-terminated base64 string.
+ * @param length [out] Number of bytes decoded.
+ * @return Binary data, which the caller must free.
+ * Test: unit test (test-hash.c).
+ */
+unsigned char*
+DecodeBase64(
+    const char *source,
+    int        *length
+	     )
+{
+    int           sourceLength;
+    unsigned char *decoded;
+
+    sourceLength = strlen( source );
+    decoded      = malloc( BASE64_DECODED_SIZE( sourceLength ) );
+    *length      = DecodeBase64Buffer( source, sourceLength, decoded );
+    return( decoded );
+}
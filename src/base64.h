@@ -24,8 +24,20 @@
 #define __BASE64_H
 
 
+/* Size of the buffer that holds the zero-terminated base64 encoding of
+   LENGTH bytes. */
+#define BASE64_ENCODED_SIZE( length ) ( ( ( length ) + 2 ) / 3 * 4 + 1 )
+/* Size of the buffer that holds the decoding of LENGTH base64 characters. */
+#define BASE64_DECODED_SIZE( length ) ( ( ( length ) + 3 ) / 4 * 3 )
+
+
 char* EncodeBase64( const unsigned char *source, int length );
 unsigned char* DecodeBase64( const char *source, int *length );
 
+int EncodeBase64Buffer( const unsigned char *source, int length,
+			char *encoded );
+int DecodeBase64Buffer( const char *source, int sourceLength,
+			unsigned char *decoded );
+
 
 #endif /* __BASE64_H */
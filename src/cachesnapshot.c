@@ -0,0 +1,835 @@
+/**
+ * \file cachesnapshot.c
+ * \brief Persistent snapshot of the stat and directory caches.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aws-s3fs.h"
+#include "s3if.h"
+#include "statcache.h"
+#include "dircache.h"
+#include "cachesnapshot.h"
+
+
+#define SNAPSHOT_MAGIC      "S3FSSNAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+/* The snapshot file consists of a header, a table of stat records sorted by
+   path, a table of directory records sorted by path, the filename lists of
+   the directories, and a pool of NUL-terminated strings. All references
+   within the file are offsets, so the file is used directly from a read-only
+   memory mapping and only the pages that are looked up are ever read. */
+struct SnapshotHeader
+{
+	char     magic[ 8 ];
+	uint32_t version;
+	uint32_t byteOrder;
+	/* Bucket and path of the mount that wrote the snapshot. */
+	uint32_t mountKey;
+	uint32_t statCount;
+	uint32_t statOffset;
+	uint32_t dirCount;
+	uint32_t dirOffset;
+	uint32_t stringsOffset;
+	uint32_t stringsLength;
+	uint32_t reserved;
+	int64_t  written;
+};
+
+#define SNAPSHOT_EXEUID       0x01
+#define SNAPSHOT_EXEGID       0x02
+#define SNAPSHOT_STICKY       0x04
+#define SNAPSHOT_FILENOTFOUND 0x08
+
+struct SnapshotStat
+{
+	uint32_t path;
+	/* The string pool begins with an empty string, so 0 means no target. */
+	uint32_t symlinkTarget;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t permissions;
+	uint8_t  fileType;
+	uint8_t  flags;
+	uint16_t reserved;
+	int64_t  size;
+	int64_t  atime;
+	int64_t  mtime;
+	int64_t  ctime;
+};
+
+struct SnapshotDir
+{
+	uint32_t path;
+	uint32_t count;
+	/* File offset of an array of \a count string offsets. */
+	uint32_t names;
+	uint32_t reserved;
+};
+
+
+/* The currently mapped snapshot. Each record is handed out at most once;
+   after that the live caches are authoritative for the path. */
+static struct
+{
+	pthread_mutex_t             mutex;
+	const unsigned char         *map;
+	size_t                      length;
+	const struct SnapshotHeader *header;
+	const struct SnapshotStat   *stats;
+	const struct SnapshotDir    *dirs;
+	const char                  *strings;
+	unsigned char               *consumed;
+} snapshot =
+{
+	PTHREAD_MUTEX_INITIALIZER,
+	NULL,
+	0,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+
+/* Cache contents collected for a new snapshot. */
+struct PendingStat
+{
+	char                *path;
+	char                *symlinkTarget;
+	struct SnapshotStat record;
+};
+
+struct PendingDir
+{
+	char *path;
+	int  count;
+	char **names;
+};
+
+struct SnapshotBuilder
+{
+	struct PendingStat *stats;
+	int                statCount;
+	int                statAlloc;
+	struct PendingDir  *dirs;
+	int                dirCount;
+	int                dirAlloc;
+	char               *strings;
+	size_t             stringsLength;
+	size_t             stringsAlloc;
+};
+
+
+
+/**
+ * Return the string at the specified offset in the string pool of the mapped
+ * snapshot. The snapshot mutex must be held.
+ * @param offset [in] Offset into the string pool.
+ * @return The string, or \a NULL if the offset is out of range.
+ */
+static const char*
+SnapshotString(
+	uint32_t offset
+	           )
+{
+	if( offset < snapshot.header->stringsLength )
+	{
+		return( &snapshot.strings[ offset ] );
+	}
+	return( NULL );
+}
+
+
+
+/**
+ * Determine whether a table of \a count records of \a size bytes each at
+ * \a offset lies within the mapped snapshot.
+ * @param offset [in] File offset of the table.
+ * @param count [in] Number of records.
+ * @param size [in] Size of each record.
+ * @param length [in] Length of the file.
+ * @return \a true if the table fits within the file, or \a false otherwise.
+ */
+static bool
+TableFits(
+	uint32_t offset,
+	uint32_t count,
+	size_t   size,
+	size_t   length
+	      )
+{
+	return( ( offset % sizeof( uint32_t ) == 0 )
+			&& ( (uint64_t) offset + (uint64_t) count * size <= length ) );
+}
+
+
+
+/**
+ * Map a cache snapshot into memory. Only the header is validated; the
+ * records are read on demand when the caches miss. A snapshot that was
+ * written for a different bucket or path is ignored.
+ * @param snapshotFile [in] Filename of the snapshot.
+ * @param mountKey [in] Bucket and path of the mount.
+ * @return \a true if the snapshot was mapped, or \a false otherwise.
+ */
+bool
+OpenCacheSnapshot(
+	const char *snapshotFile,
+	const char *mountKey
+	              )
+{
+	int                         fd;
+	struct stat                 fileStat;
+	void                        *map;
+	const struct SnapshotHeader *header;
+	const char                  *strings;
+	bool                        valid;
+
+	fd = open( snapshotFile, O_RDONLY );
+	if( fd < 0 )
+	{
+		return( false );
+	}
+	if( ( fstat( fd, &fileStat ) != 0 )
+		|| ( fileStat.st_size < (off_t) sizeof( struct SnapshotHeader ) ) )
+	{
+		close( fd );
+		return( false );
+	}
+	map = mmap( NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED )
+	{
+		return( false );
+	}
+
+	header  = map;
+	strings = (const char*) map + header->stringsOffset;
+	valid   = ( memcmp( header->magic, SNAPSHOT_MAGIC, 8 ) == 0 )
+		&& ( header->version == SNAPSHOT_VERSION )
+		&& ( header->byteOrder == SNAPSHOT_BYTE_ORDER )
+		&& TableFits( header->statOffset, header->statCount,
+					  sizeof( struct SnapshotStat ), fileStat.st_size )
+		&& TableFits( header->dirOffset, header->dirCount,
+					  sizeof( struct SnapshotDir ), fileStat.st_size )
+		&& ( 0 < header->stringsLength )
+		&& ( (uint64_t) header->stringsOffset + header->stringsLength
+			 <= (uint64_t) fileStat.st_size );
+	/* The pool must end with a terminator so that no string can run past
+	   it, and the snapshot must belong to this mount. */
+	if( valid )
+	{
+		valid = ( strings[ header->stringsLength - 1 ] == '\0' )
+			&& ( header->mountKey < header->stringsLength )
+			&& ( strcmp( &strings[ header->mountKey ], mountKey ) == 0 );
+	}
+	if( ! valid )
+	{
+		Syslog( log_WARNING, "Ignoring cache snapshot %s\n", snapshotFile );
+		munmap( map, fileStat.st_size );
+		return( false );
+	}
+
+	pthread_mutex_lock( &snapshot.mutex );
+	if( snapshot.map != NULL )
+	{
+		munmap( (void*) snapshot.map, snapshot.length );
+		free( snapshot.consumed );
+	}
+	snapshot.map      = map;
+	snapshot.length   = fileStat.st_size;
+	snapshot.header   = header;
+	snapshot.stats    = (const void*) ( (const char*) map
+										+ header->statOffset );
+	snapshot.dirs     = (const void*) ( (const char*) map
+										+ header->dirOffset );
+	snapshot.strings  = strings;
+	snapshot.consumed = calloc( (size_t) header->statCount
+								+ header->dirCount + 1, sizeof( char ) );
+	assert( snapshot.consumed != NULL );
+	pthread_mutex_unlock( &snapshot.mutex );
+
+	Syslog( log_INFO, "Cache snapshot with %u files and %u directories "
+			"mapped\n", header->statCount, header->dirCount );
+
+	return( true );
+}
+
+
+
+/**
+ * Unmap the cache snapshot, if any.
+ * @return Nothing.
+ */
+void
+CloseCacheSnapshot(
+	void
+	               )
+{
+	pthread_mutex_lock( &snapshot.mutex );
+	if( snapshot.map != NULL )
+	{
+		munmap( (void*) snapshot.map, snapshot.length );
+		free( snapshot.consumed );
+		snapshot.map      = NULL;
+		snapshot.length   = 0;
+		snapshot.header   = NULL;
+		snapshot.consumed = NULL;
+	}
+	pthread_mutex_unlock( &snapshot.mutex );
+}
+
+
+
+/**
+ * Binary search a sorted snapshot table for a path. The snapshot mutex must
+ * be held.
+ * @param table [in] First record of the table.
+ * @param count [in] Number of records.
+ * @param recordSize [in] Size of each record; the record must begin with
+ *        the string offset of its path.
+ * @param path [in] Path to search for.
+ * @return Index of the record, or \a -1 if not found.
+ */
+static long
+FindSnapshotRecord(
+	const void *table,
+	uint32_t   count,
+	size_t     recordSize,
+	const char *path
+	               )
+{
+	long       low  = 0;
+	long       high = (long) count - 1;
+	long       middle;
+	const char *recordPath;
+	int        comparison;
+
+	while( low <= high )
+	{
+		middle     = low + ( high - low ) / 2;
+		recordPath = SnapshotString( *(const uint32_t*)
+									 ( (const char*) table
+									   + middle * recordSize ) );
+		if( recordPath == NULL )
+		{
+			break;
+		}
+		comparison = strcmp( path, recordPath );
+		if( comparison == 0 )
+		{
+			return( middle );
+		}
+		else if( comparison < 0 )
+		{
+			high = middle - 1;
+		}
+		else
+		{
+			low = middle + 1;
+		}
+	}
+
+	return( -1 );
+}
+
+
+
+/**
+ * Look up the stat information for a file in the cache snapshot. A record is
+ * returned only once; the caller must cache it and revalidate it against S3.
+ * @param filename [in] Path of the file.
+ * @return S3 File Info allocated with \a AllocateS3FileInfo, or \a NULL if
+ *         the file is not in the snapshot.
+ */
+struct S3FileInfo*
+LookupStatSnapshot(
+	const char *filename
+	               )
+{
+	long                      index;
+	const struct SnapshotStat *record;
+	const char                *symlinkTarget;
+	struct S3FileInfo         *fileInfo = NULL;
+
+	pthread_mutex_lock( &snapshot.mutex );
+	if( snapshot.map != NULL )
+	{
+		index = FindSnapshotRecord( snapshot.stats, snapshot.header->statCount,
+									sizeof( struct SnapshotStat ), filename );
+		if( ( index != -1 ) && ( ! snapshot.consumed[ index ] ) )
+		{
+			snapshot.consumed[ index ] = true;
+			record   = &snapshot.stats[ index ];
+			fileInfo = AllocateS3FileInfo( );
+			fileInfo->uid          = record->uid;
+			fileInfo->gid          = record->gid;
+			fileInfo->permissions  = record->permissions;
+			fileInfo->fileType     = record->fileType;
+			fileInfo->exeUid       = ( record->flags & SNAPSHOT_EXEUID ) != 0;
+			fileInfo->exeGid       = ( record->flags & SNAPSHOT_EXEGID ) != 0;
+			fileInfo->sticky       = ( record->flags & SNAPSHOT_STICKY ) != 0;
+			fileInfo->filenotfound =
+				( record->flags & SNAPSHOT_FILENOTFOUND ) != 0;
+			fileInfo->statonly     = true;
+			fileInfo->size         = record->size;
+			fileInfo->atime        = record->atime;
+			fileInfo->mtime        = record->mtime;
+			fileInfo->ctime        = record->ctime;
+			symlinkTarget = SnapshotString( record->symlinkTarget );
+			if( ( record->symlinkTarget != 0 ) && ( symlinkTarget != NULL ) )
+			{
+				fileInfo->symlinkTarget = strdup( symlinkTarget );
+			}
+		}
+	}
+	pthread_mutex_unlock( &snapshot.mutex );
+
+	return( fileInfo );
+}
+
+
+
+/**
+ * Look up the contents of a directory in the cache snapshot. A record is
+ * returned only once; the caller must cache it and revalidate it against S3.
+ * @param dirname [in] Path of the directory.
+ * @param size [out] Number of filenames in the directory.
+ * @return Newly allocated array of newly allocated filenames, or \a NULL if
+ *         the directory is not in the snapshot.
+ */
+char**
+LookupDirectorySnapshot(
+	const char *dirname,
+	int        *size
+	                    )
+{
+	long                     index;
+	const struct SnapshotDir *record;
+	const uint32_t           *names;
+	const char               *name;
+	char                     **contents = NULL;
+	uint32_t                 i;
+
+	pthread_mutex_lock( &snapshot.mutex );
+	if( snapshot.map != NULL )
+	{
+		index = FindSnapshotRecord( snapshot.dirs, snapshot.header->dirCount,
+									sizeof( struct SnapshotDir ), dirname );
+		if( index != -1 )
+		{
+			record = &snapshot.dirs[ index ];
+			index += snapshot.header->statCount;
+			if( ( ! snapshot.consumed[ index ] )
+				&& TableFits( record->names, record->count,
+							  sizeof( uint32_t ), snapshot.length ) )
+			{
+				snapshot.consumed[ index ] = true;
+				names    = (const void*) ( snapshot.map + record->names );
+				contents = malloc( ( record->count + 1 ) * sizeof( char* ) );
+				assert( contents != NULL );
+				for( i = 0; i < record->count; i++ )
+				{
+					name = SnapshotString( names[ i ] );
+					contents[ i ] = strdup( name != NULL ? name : "" );
+				}
+				*size = record->count;
+			}
+		}
+	}
+	pthread_mutex_unlock( &snapshot.mutex );
+
+	return( contents );
+}
+
+
+
+/**
+ * Add a string to the string pool of a new snapshot.
+ * @param builder [in/out] Snapshot under construction.
+ * @param string [in] String to add.
+ * @return Offset of the string in the pool.
+ */
+static uint32_t
+AddSnapshotString(
+	struct SnapshotBuilder *builder,
+	const char             *string
+	              )
+{
+	size_t   length = strlen( string ) + sizeof( char );
+	uint32_t offset;
+
+	while( builder->stringsAlloc < builder->stringsLength + length )
+	{
+		builder->stringsAlloc = builder->stringsAlloc * 2 + 4096;
+		builder->strings = realloc( builder->strings, builder->stringsAlloc );
+		assert( builder->strings != NULL );
+	}
+	offset = builder->stringsLength;
+	memcpy( &builder->strings[ offset ], string, length );
+	builder->stringsLength += length;
+
+	return( offset );
+}
+
+
+
+/**
+ * Collect a stat cache entry for a new snapshot. Called with the caches
+ * locked.
+ * @param filename [in] Path of the file.
+ * @param data [in] S3 File Info for the file.
+ * @param context [in/out] Snapshot under construction.
+ * @return Nothing.
+ */
+static void
+CollectStatEntry(
+	const char *filename,
+	void       *data,
+	void       *context
+	             )
+{
+	struct SnapshotBuilder *builder  = context;
+	struct S3FileInfo      *fileInfo = data;
+	struct PendingStat     *pending;
+
+	if( fileInfo == NULL )
+	{
+		return;
+	}
+	if( builder->statCount == builder->statAlloc )
+	{
+		builder->statAlloc = builder->statAlloc * 2 + 64;
+		builder->stats = realloc( builder->stats, builder->statAlloc
+								  * sizeof( struct PendingStat ) );
+		assert( builder->stats != NULL );
+	}
+	pending = &builder->stats[ builder->statCount++ ];
+	memset( pending, 0, sizeof( struct PendingStat ) );
+	pending->path          = strdup( filename );
+	pending->symlinkTarget = fileInfo->symlinkTarget != NULL ?
+		strdup( fileInfo->symlinkTarget ) : NULL;
+	pending->record.uid         = fileInfo->uid;
+	pending->record.gid         = fileInfo->gid;
+	pending->record.permissions = fileInfo->permissions;
+	pending->record.fileType    = fileInfo->fileType;
+	pending->record.flags       =
+		( fileInfo->exeUid ? SNAPSHOT_EXEUID : 0 )
+		| ( fileInfo->exeGid ? SNAPSHOT_EXEGID : 0 )
+		| ( fileInfo->sticky ? SNAPSHOT_STICKY : 0 )
+		| ( fileInfo->filenotfound ? SNAPSHOT_FILENOTFOUND : 0 );
+	pending->record.size        = fileInfo->size;
+	pending->record.atime       = fileInfo->atime;
+	pending->record.mtime       = fileInfo->mtime;
+	pending->record.ctime       = fileInfo->ctime;
+}
+
+
+
+/**
+ * Collect a directory cache entry for a new snapshot. Called with the
+ * directory cache locked.
+ * @param dirname [in] Path of the directory.
+ * @param size [in] Number of filenames in the directory.
+ * @param contents [in] Filenames in the directory.
+ * @param context [in/out] Snapshot under construction.
+ * @return Nothing.
+ */
+static void
+CollectDirectoryEntry(
+	const char *dirname,
+	int        size,
+	const char **contents,
+	void       *context
+	                  )
+{
+	struct SnapshotBuilder *builder = context;
+	struct PendingDir      *pending;
+	int                    i;
+
+	if( builder->dirCount == builder->dirAlloc )
+	{
+		builder->dirAlloc = builder->dirAlloc * 2 + 8;
+		builder->dirs = realloc( builder->dirs, builder->dirAlloc
+								 * sizeof( struct PendingDir ) );
+		assert( builder->dirs != NULL );
+	}
+	pending = &builder->dirs[ builder->dirCount++ ];
+	pending->path  = strdup( dirname );
+	pending->count = size;
+	pending->names = malloc( ( size + 1 ) * sizeof( char* ) );
+	assert( pending->names != NULL );
+	for( i = 0; i < size; i++ )
+	{
+		pending->names[ i ] = strdup( contents[ i ] != NULL ?
+									  contents[ i ] : "" );
+	}
+}
+
+
+
+/**
+ * Comparison function for sorting stat records by path.
+ */
+static int
+ComparePendingStats(
+	const void *a,
+	const void *b
+	                )
+{
+	return( strcmp( ( (const struct PendingStat*) a )->path,
+					( (const struct PendingStat*) b )->path ) );
+}
+
+
+
+/**
+ * Comparison function for sorting directory records by path.
+ */
+static int
+ComparePendingDirs(
+	const void *a,
+	const void *b
+	               )
+{
+	return( strcmp( ( (const struct PendingDir*) a )->path,
+					( (const struct PendingDir*) b )->path ) );
+}
+
+
+
+/**
+ * Free the memory held by a snapshot under construction.
+ * @param builder [in/out] Snapshot under construction.
+ * @return Nothing.
+ */
+static void
+FreeSnapshotBuilder(
+	struct SnapshotBuilder *builder
+	                )
+{
+	int i;
+	int j;
+
+	for( i = 0; i < builder->statCount; i++ )
+	{
+		free( builder->stats[ i ].path );
+		free( builder->stats[ i ].symlinkTarget );
+	}
+	free( builder->stats );
+	for( i = 0; i < builder->dirCount; i++ )
+	{
+		for( j = 0; j < builder->dirs[ i ].count; j++ )
+		{
+			free( builder->dirs[ i ].names[ j ] );
+		}
+		free( builder->dirs[ i ].names );
+		free( builder->dirs[ i ].path );
+	}
+	free( builder->dirs );
+	free( builder->strings );
+}
+
+
+
+/**
+ * Copy the contents of the stat cache and the directory cache for a new
+ * snapshot. The caller must hold the lock under which the S3 interface
+ * modifies cached entries, so that no entry is changed while it is copied.
+ * @return Snapshot under construction, which is passed to
+ *         WriteCacheSnapshot( ).
+ */
+struct SnapshotBuilder*
+CollectCacheSnapshot(
+	void
+	                 )
+{
+	struct SnapshotBuilder *builder;
+
+	builder = calloc( 1, sizeof( struct SnapshotBuilder ) );
+	assert( builder != NULL );
+	ForEachStatEntry( CollectStatEntry, builder );
+	ForEachDirectoryCacheEntry( CollectDirectoryEntry, builder );
+
+	return( builder );
+}
+
+
+
+/**
+ * Write a snapshot of the stat cache and the directory cache to a file. The
+ * snapshot is written to a temporary file which then replaces the old
+ * snapshot, so a mapping of the old snapshot remains valid.
+ * @param snapshotFile [in] Filename of the snapshot.
+ * @param mountKey [in] Bucket and path of the mount.
+ * @param collected [in/out] Snapshot from CollectCacheSnapshot( ), which is
+ *        freed.
+ * @return \a true if the snapshot was written, or \a false otherwise.
+ */
+bool
+WriteCacheSnapshot(
+	const char             *snapshotFile,
+	const char             *mountKey,
+	struct SnapshotBuilder *collected
+	               )
+{
+	struct SnapshotBuilder builder = *collected;
+	struct SnapshotHeader  header;
+	struct SnapshotDir     *dirRecords;
+	uint32_t               *names;
+	uint32_t               nameCount;
+	uint32_t               namesOffset;
+	char                   *tempFile;
+	FILE                   *out;
+	bool                   success;
+	int                    i;
+	int                    j;
+
+	free( collected );
+	qsort( builder.stats, builder.statCount, sizeof( struct PendingStat ),
+		   ComparePendingStats );
+	qsort( builder.dirs, builder.dirCount, sizeof( struct PendingDir ),
+		   ComparePendingDirs );
+
+	/* Lay out the file: header, stat records, directory records, directory
+	   filename lists, and the string pool, which begins with the empty
+	   string. */
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, SNAPSHOT_MAGIC, 8 );
+	header.version    = SNAPSHOT_VERSION;
+	header.byteOrder  = SNAPSHOT_BYTE_ORDER;
+	header.written    = time( NULL );
+	AddSnapshotString( &builder, "" );
+	header.mountKey   = AddSnapshotString( &builder, mountKey );
+	header.statCount  = builder.statCount;
+	header.statOffset = sizeof( struct SnapshotHeader );
+	for( i = 0; i < builder.statCount; i++ )
+	{
+		builder.stats[ i ].record.path =
+			AddSnapshotString( &builder, builder.stats[ i ].path );
+		if( builder.stats[ i ].symlinkTarget != NULL )
+		{
+			builder.stats[ i ].record.symlinkTarget =
+				AddSnapshotString( &builder, builder.stats[ i ].symlinkTarget );
+		}
+	}
+	header.dirCount  = builder.dirCount;
+	header.dirOffset = header.statOffset
+		+ builder.statCount * sizeof( struct SnapshotStat );
+	dirRecords = calloc( builder.dirCount + 1, sizeof( struct SnapshotDir ) );
+	assert( dirRecords != NULL );
+	nameCount = 0;
+	for( i = 0; i < builder.dirCount; i++ )
+	{
+		nameCount += builder.dirs[ i ].count;
+	}
+	names = malloc( ( nameCount + 1 ) * sizeof( uint32_t ) );
+	assert( names != NULL );
+	namesOffset = header.dirOffset
+		+ builder.dirCount * sizeof( struct SnapshotDir );
+	nameCount   = 0;
+	for( i = 0; i < builder.dirCount; i++ )
+	{
+		dirRecords[ i ].path  = AddSnapshotString( &builder,
+												   builder.dirs[ i ].path );
+		dirRecords[ i ].count = builder.dirs[ i ].count;
+		dirRecords[ i ].names = namesOffset + nameCount * sizeof( uint32_t );
+		for( j = 0; j < builder.dirs[ i ].count; j++ )
+		{
+			names[ nameCount++ ] =
+				AddSnapshotString( &builder, builder.dirs[ i ].names[ j ] );
+		}
+	}
+	header.stringsOffset = namesOffset + nameCount * sizeof( uint32_t );
+	header.stringsLength = builder.stringsLength;
+
+	tempFile = malloc( strlen( snapshotFile ) + sizeof( ".tmp" ) );
+	assert( tempFile != NULL );
+	strcpy( tempFile, snapshotFile );
+	strcat( tempFile, ".tmp" );
+	out = fopen( tempFile, "w" );
+	success = ( out != NULL );
+	if( success )
+	{
+		success = fwrite( &header, sizeof( header ), 1, out ) == 1;
+		for( i = 0; success && ( i < builder.statCount ); i++ )
+		{
+			success = fwrite( &builder.stats[ i ].record,
+							  sizeof( struct SnapshotStat ), 1, out ) == 1;
+		}
+		if( success && ( 0 < builder.dirCount ) )
+		{
+			success = fwrite( dirRecords, sizeof( struct SnapshotDir ),
+							  builder.dirCount, out )
+				== (size_t) builder.dirCount;
+		}
+		if( success && ( 0 < nameCount ) )
+		{
+			success = fwrite( names, sizeof( uint32_t ), nameCount, out )
+				== nameCount;
+		}
+		success = success
+			&& ( fwrite( builder.strings, builder.stringsLength, 1, out ) == 1 )
+			&& ( fflush( out ) == 0 )
+			&& ( fsync( fileno( out ) ) == 0 );
+		success = ( fclose( out ) == 0 ) && success;
+		if( success )
+		{
+			success = rename( tempFile, snapshotFile ) == 0;
+		}
+		if( ! success )
+		{
+			unlink( tempFile );
+		}
+	}
+	if( success )
+	{
+		Syslog( log_INFO, "Cache snapshot with %d files and %d directories "
+				"written\n", builder.statCount, builder.dirCount );
+	}
+	else
+	{
+		Syslog( log_WARNING, "Cannot write cache snapshot %s\n",
+				snapshotFile );
+	}
+
+	free( tempFile );
+	free( names );
+	free( dirRecords );
+	FreeSnapshotBuilder( &builder );
+
+	return( success );
+}
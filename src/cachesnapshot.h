@@ -0,0 +1,43 @@
+/**
+ * \file cachesnapshot.h
+ * \brief Persistent snapshot of the stat and directory caches.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CACHE_SNAPSHOT_H
+#define __CACHE_SNAPSHOT_H
+
+
+#include <config.h>
+#include <stdbool.h>
+#include "s3if.h"
+
+
+struct SnapshotBuilder;
+
+bool OpenCacheSnapshot( const char *snapshotFile, const char *mountKey );
+void CloseCacheSnapshot( void );
+struct S3FileInfo *LookupStatSnapshot( const char *filename );
+char **LookupDirectorySnapshot( const char *dirname, int *size );
+struct SnapshotBuilder *CollectCacheSnapshot( void );
+bool WriteCacheSnapshot( const char *snapshotFile, const char *mountKey,
+						 struct SnapshotBuilder *collected );
+
+
+#endif /* __CACHE_SNAPSHOT_H */
@@ -0,0 +1,432 @@
+/**
+ * \file cachestatus.c
+ * \brief Shared-memory table of the file cache status.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aws-s3fs.h"
+#include "cachestatus.h"
+
+
+/* Identifies a table in the current layout. The low octet is the layout
+   version. */
+#define CACHE_STATUS_MAGIC 0x53335302
+
+/* Number of times a client reads a slot that is being updated before it
+   asks the file cache instead. */
+#define CACHE_STATUS_RETRIES 8
+
+
+/* The file cache is the only writer of a slot. It makes the sequence number
+   odd while it updates the slot, and even again when it is done; a reader
+   that sees the same even sequence number before and after copying the slot
+   has a consistent copy. */
+struct CacheStatusSlot
+{
+	uint32_t sequence;
+	uint32_t generation;
+	/* Hash of the remote name, or 0 if the slot is unused. */
+	uint64_t pathHash;
+	/* Independent hash of the remote name, which tells apart files whose
+	   pathHash collide. */
+	uint64_t pathCheck;
+	int64_t  fileId;
+	char     localpath[ 6 + 1 + 6 + 1 ];
+	uint8_t  iscached;
+};
+
+/* Files are placed in the slot indicated by their hash, or in one of the
+   slots that follow it. Slots are never released, so a reader can stop at
+   the first unused slot. */
+struct CacheStatusTable
+{
+	uint32_t               magic;
+	uint32_t               slots;
+	struct CacheStatusSlot slot[ CACHE_STATUS_SLOTS ];
+};
+
+
+/* The file cache's writable mapping of the table. */
+static pthread_mutex_t         publishedTable_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct CacheStatusTable *publishedTable = NULL;
+
+/* The client's read-only mapping of the table. */
+static const struct CacheStatusTable *mappedTable = NULL;
+
+
+
+/**
+ * Hash a remote filename with the 64-bit FNV-1a function.
+ * @param remotename [in] Remote filename.
+ * @return Non-zero hash value.
+ */
+static uint64_t
+HashRemoteName(
+	const char *remotename
+	           )
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	while( *remotename != '\0' )
+	{
+		hash = ( hash ^ (unsigned char) *remotename++ ) * 0x100000001b3ull;
+	}
+	/* 0 denotes an unused slot. */
+	return( hash != 0 ? hash : 1 );
+}
+
+
+
+/**
+ * Hash a remote filename with a function that is independent of
+ * HashRemoteName( ), so that a file is only mistaken for another if both
+ * hashes collide.
+ * @param remotename [in] Remote filename.
+ * @return Hash value.
+ */
+static uint64_t
+CheckRemoteName(
+	const char *remotename
+	            )
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ull;
+
+	while( *remotename != '\0' )
+	{
+		hash  = ( hash + (unsigned char) *remotename++ )
+			* 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	return( hash );
+}
+
+
+
+/**
+ * Create the cache status table and map it into memory. Any table left by a
+ * previous instance of the file cache is replaced.
+ * @return \a true if the table was created, or \a false otherwise.
+ * Test: unit test (test-filecache.c).
+ */
+bool
+CreateCacheStatusTable(
+	void
+	                   )
+{
+	struct CacheStatusTable *table;
+	int                     fd;
+
+	/* Clients that still have the old table mapped continue to see the old
+	   contents, and the file cache never updates them again. */
+	unlink( CACHE_STATUS_TABLE );
+	/* The table reveals which files are cached, so only the file cache's
+	   group may read it. */
+	fd = open( CACHE_STATUS_TABLE, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+			   0640 );
+	if( fd < 0 )
+	{
+		fprintf( stderr, "Cannot create %s\n", CACHE_STATUS_TABLE );
+		return( false );
+	}
+	if( ftruncate( fd, sizeof( struct CacheStatusTable ) ) != 0 )
+	{
+		close( fd );
+		unlink( CACHE_STATUS_TABLE );
+		return( false );
+	}
+	table = mmap( NULL, sizeof( struct CacheStatusTable ),
+				  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( table == MAP_FAILED )
+	{
+		unlink( CACHE_STATUS_TABLE );
+		return( false );
+	}
+
+	/* The file is zero-filled, so all slots are unused. */
+	table->slots = CACHE_STATUS_SLOTS;
+	__atomic_store_n( &table->magic, CACHE_STATUS_MAGIC, __ATOMIC_RELEASE );
+
+	pthread_mutex_lock( &publishedTable_mutex );
+	publishedTable = table;
+	pthread_mutex_unlock( &publishedTable_mutex );
+
+	return( true );
+}
+
+
+
+/**
+ * Invalidate the cache status table and unmap it. Clients that have mapped
+ * the table stop using it.
+ * @return Nothing.
+ * Test: none.
+ */
+void
+DestroyCacheStatusTable(
+	void
+	                    )
+{
+	pthread_mutex_lock( &publishedTable_mutex );
+	if( publishedTable != NULL )
+	{
+		__atomic_store_n( &publishedTable->magic, 0, __ATOMIC_RELEASE );
+		munmap( publishedTable, sizeof( struct CacheStatusTable ) );
+		publishedTable = NULL;
+		unlink( CACHE_STATUS_TABLE );
+	}
+	pthread_mutex_unlock( &publishedTable_mutex );
+}
+
+
+
+/**
+ * Publish the status of a file in the cache status table. If the file's
+ * slots are all taken by other files, the file is not published and the
+ * clients ask the file cache about it instead.
+ * @param remotename [in] Remote filename.
+ * @param fileId [in] ID of the file.
+ * @param parentname [in] Local name of the file's parent directory.
+ * @param localname [in] Local name of the file.
+ * @param iscached [in] Whether the file has been downloaded.
+ * @return Nothing.
+ * Test: unit test (test-filecache.c).
+ */
+void
+PublishCacheStatus(
+	const char *remotename,
+	int64_t    fileId,
+	const char *parentname,
+	const char *localname,
+	bool       iscached
+	               )
+{
+	struct CacheStatusSlot *slot = NULL;
+	uint64_t               hash;
+	uint64_t               check;
+	uint32_t               sequence;
+	int                    probe;
+
+	hash  = HashRemoteName( remotename );
+	check = CheckRemoteName( remotename );
+
+	pthread_mutex_lock( &publishedTable_mutex );
+	if( publishedTable != NULL )
+	{
+		for( probe = 0; probe < CACHE_STATUS_PROBES; probe++ )
+		{
+			slot = &publishedTable->slot[ ( hash + probe )
+										  & ( CACHE_STATUS_SLOTS - 1 ) ];
+			if( ( ( slot->pathHash == hash ) && ( slot->pathCheck == check ) )
+				|| ( slot->pathHash == 0 ) )
+			{
+				break;
+			}
+			slot = NULL;
+		}
+	}
+	if( slot != NULL )
+	{
+		sequence = slot->sequence;
+		__atomic_store_n( &slot->sequence, sequence + 1, __ATOMIC_RELAXED );
+		__atomic_thread_fence( __ATOMIC_RELEASE );
+
+		slot->pathHash  = hash;
+		slot->pathCheck = check;
+		slot->fileId    = fileId;
+		snprintf( slot->localpath, sizeof( slot->localpath ), "%s/%s",
+				  parentname, localname );
+		slot->iscached = iscached ? 1 : 0;
+		slot->generation++;
+
+		__atomic_store_n( &slot->sequence, sequence + 2, __ATOMIC_RELEASE );
+	}
+	pthread_mutex_unlock( &publishedTable_mutex );
+}
+
+
+
+/**
+ * Map the cache status table that the file cache publishes.
+ * @return \a true if the table was mapped, or \a false if the file cache
+ *         does not publish a table.
+ * Test: unit test (test-filecache.c).
+ */
+bool
+OpenCacheStatusTable(
+	void
+	                 )
+{
+	const struct CacheStatusTable *table;
+	struct stat                   tableStat;
+	int                           fd;
+
+	fd = open( CACHE_STATUS_TABLE, O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		return( false );
+	}
+	if( ( fstat( fd, &tableStat ) != 0 )
+		|| ( tableStat.st_size < (off_t) sizeof( struct CacheStatusTable ) ) )
+	{
+		close( fd );
+		return( false );
+	}
+	table = mmap( NULL, sizeof( struct CacheStatusTable ), PROT_READ,
+				  MAP_SHARED, fd, 0 );
+	close( fd );
+	if( table == MAP_FAILED )
+	{
+		return( false );
+	}
+	if( ( __atomic_load_n( &table->magic, __ATOMIC_ACQUIRE )
+		  != CACHE_STATUS_MAGIC )
+		|| ( table->slots != CACHE_STATUS_SLOTS ) )
+	{
+		munmap( (void*) table, sizeof( struct CacheStatusTable ) );
+		return( false );
+	}
+	mappedTable = table;
+
+	return( true );
+}
+
+
+
+/**
+ * Unmap the cache status table. No lookups may be in progress.
+ * @return Nothing.
+ * Test: none.
+ */
+void
+CloseCacheStatusTable(
+	void
+	                  )
+{
+	if( mappedTable != NULL )
+	{
+		munmap( (void*) mappedTable, sizeof( struct CacheStatusTable ) );
+		mappedTable = NULL;
+	}
+}
+
+
+
+/**
+ * Make a consistent copy of a slot in the cache status table.
+ * @param slot [in] Slot in the table.
+ * @param copy [out] Copy of the slot.
+ * @return \a true if the copy is consistent, or \a false if the slot kept
+ *         changing while it was copied.
+ */
+static bool
+ReadCacheStatusSlot(
+	const struct CacheStatusSlot *slot,
+	struct CacheStatusSlot       *copy
+	                )
+{
+	uint32_t sequence;
+	int      attempt;
+
+	for( attempt = 0; attempt < CACHE_STATUS_RETRIES; attempt++ )
+	{
+		sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+		if( ( sequence & 1 ) == 0 )
+		{
+			memcpy( copy, (const void*) slot, sizeof( *copy ) );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &slot->sequence, __ATOMIC_RELAXED )
+				== sequence )
+			{
+				return( true );
+			}
+		}
+	}
+	return( false );
+}
+
+
+
+/**
+ * Look up the status of a file in the cache status table, without asking
+ * the file cache.
+ * @param remotename [in] Remote filename.
+ * @param status [out] Status of the file.
+ * @return \a true if the file was found, or \a false if the client must ask
+ *         the file cache instead.
+ * Test: unit test (test-filecache.c).
+ */
+bool
+LookupCacheStatus(
+	const char         *remotename,
+	struct CacheStatus *status
+	              )
+{
+	const struct CacheStatusTable *table = mappedTable;
+	struct CacheStatusSlot        slot;
+	uint64_t                      hash;
+	uint64_t                      check;
+	int                           probe;
+
+	if( ( table == NULL )
+		|| ( __atomic_load_n( &table->magic, __ATOMIC_ACQUIRE )
+			 != CACHE_STATUS_MAGIC ) )
+	{
+		return( false );
+	}
+
+	hash  = HashRemoteName( remotename );
+	check = CheckRemoteName( remotename );
+	for( probe = 0; probe < CACHE_STATUS_PROBES; probe++ )
+	{
+		if( ! ReadCacheStatusSlot(
+				&table->slot[ ( hash + probe ) & ( CACHE_STATUS_SLOTS - 1 ) ],
+				&slot ) )
+		{
+			return( false );
+		}
+		if( slot.pathHash == 0 )
+		{
+			return( false );
+		}
+		if( ( slot.pathHash == hash ) && ( slot.pathCheck == check ) )
+		{
+			status->fileId   = slot.fileId;
+			memcpy( status->localpath, slot.localpath,
+					sizeof( status->localpath ) );
+			status->localpath[ sizeof( status->localpath ) - 1 ] = '\0';
+			status->iscached   = slot.iscached != 0;
+			status->generation = slot.generation;
+			return( true );
+		}
+	}
+	return( false );
+}
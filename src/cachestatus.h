@@ -0,0 +1,67 @@
+/**
+ * \file cachestatus.h
+ * \brief Shared-memory table of the file cache status.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CACHE_STATUS_H
+#define __CACHE_STATUS_H
+
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "aws-s3fs.h"
+
+
+/* File that the file cache maps into shared memory. */
+#define CACHE_STATUS_TABLE CACHE_DIR "/status.tbl"
+
+/* Number of slots in the table, which must be a power of two, and the
+   number of slots that are probed for a file before giving up. */
+#define CACHE_STATUS_SLOTS  8192
+#define CACHE_STATUS_PROBES 16
+
+
+/* The status of a file in the cache, as published by the file cache. */
+struct CacheStatus
+{
+	int64_t  fileId;
+	/* Local path relative to CACHE_FILES, e.g. "DIR001/FILE01". */
+	char     localpath[ 6 + 1 + 6 + 1 ];
+	bool     iscached;
+	/* Number of times the file cache has updated the entry. */
+	uint32_t generation;
+};
+
+
+/* File cache side. */
+bool CreateCacheStatusTable( void );
+void DestroyCacheStatusTable( void );
+void PublishCacheStatus( const char *remotename, int64_t fileId,
+						 const char *parentname, const char *localname,
+						 bool iscached );
+
+/* Client side. */
+bool OpenCacheStatusTable( void );
+void CloseCacheStatusTable( void );
+bool LookupCacheStatus( const char *remotename, struct CacheStatus *status );
+
+
+#endif /* __CACHE_STATUS_H */
@@ -139,6 +139,96 @@ ConfigSetPath(
 
 
 
+/**
+ * Set a kernel cache timeout. If the timeout is negative, the timeout is left
+ * as is; the \a configError flag is set; and an error is printed to stderr.
+ * @param timeout [out] Pointer to the timeout value container.
+ * @param configValue [in] Timeout in seconds.
+ * @param configError [out] Configuration error flag.
+ * @return Nothing.
+ */
+void
+ConfigSetTimeout(
+    int  *timeout,
+    int  configValue,
+    bool *configError
+	      )
+{
+    if( configValue < 0 )
+    {
+        fprintf( stderr, "Invalid cache timeout: %d\n", configValue );
+	*configError = true;
+    }
+    else
+    {
+        *timeout = configValue;
+    }
+}
+
+
+
+/**
+ * Set the number of entries in the stat cache. If the size is not positive,
+ * the size is left as is; the \a configError flag is set; and an error is
+ * printed to stderr.
+ * @param cacheSize [out] Pointer to the cache size container.
+ * @param configValue [in] Number of entries.
+ * @param configError [out] Configuration error flag.
+ * @return Nothing.
+ */
+void
+ConfigSetCacheSize(
+    long *cacheSize,
+    int  configValue,
+    bool *configError
+	      )
+{
+    if( configValue <= 0 )
+    {
+        fprintf( stderr, "Invalid stat cache size: %d\n", configValue );
+	*configError = true;
+    }
+    else
+    {
+        *cacheSize = configValue;
+    }
+}
+
+
+
+/**
+ * Set the checksum that protects file transfers. If the checksum name is
+ * invalid, the checksum is left as is; the \a configError flag is set; and
+ * an error is printed to stderr.
+ * @param checksum [out] Pointer to the checksum mode container.
+ * @param configValue [in] Checksum name, "md5" or "crc32c".
+ * @param configError [out] Configuration error flag.
+ * @return Nothing.
+ */
+void
+ConfigSetChecksum(
+    enum ChecksumModes *checksum,
+    const char         *configValue,
+    bool               *configError
+	      )
+{
+    if( strcasecmp( configValue, "md5" ) == 0 )
+    {
+        *checksum = CHECKSUM_MD5;
+    }
+    else if( strcasecmp( configValue, "crc32c" ) == 0 )
+    {
+        *checksum = CHECKSUM_CRC32C;
+    }
+    else
+    {
+        fprintf( stderr, "Invalid checksum: %s\n", configValue );
+	*configError = true;
+    }
+}
+
+
+
 /**
  * Set the log verbosity.
  * @param loglevel [out] One of log_ERR, log_WARNING, log_NOTICE, log_INFO, or
@@ -371,8 +461,15 @@ InitializeConfiguration(
     /*@+null@*/
     configuration->verbose.value = DEFAULT_VERBOSE;
     configuration->verbose.isset = false;
-    configuration->logLevel      = log_WARNING;
-    configuration->daemonize     = true;
+    configuration->logLevel        = log_WARNING;
+    configuration->daemonize       = true;
+    configuration->entryTimeout    = DEFAULT_ENTRY_TIMEOUT;
+    configuration->attrTimeout     = DEFAULT_ATTR_TIMEOUT;
+    configuration->negativeTimeout = DEFAULT_NEGATIVE_TIMEOUT;
+    configuration->cacheSnapshot    = NULL;
+    configuration->snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+    configuration->statCacheSize    = MAX_STAT_CACHE_SIZE;
+    configuration->checksum         = CHECKSUM_MD5;
 }
 
 
@@ -533,7 +630,14 @@ Configure(
 		.isset = false
 	    },
 	    .logLevel    = log_WARNING,
-	    .daemonize   = true
+	    .daemonize   = true,
+	    .entryTimeout    = DEFAULT_ENTRY_TIMEOUT,
+	    .attrTimeout     = DEFAULT_ATTR_TIMEOUT,
+	    .negativeTimeout = DEFAULT_NEGATIVE_TIMEOUT,
+	    .cacheSnapshot    = NULL,
+	    .snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL,
+	    .statCacheSize    = MAX_STAT_CACHE_SIZE,
+	    .checksum         = CHECKSUM_MD5
 	},
         .configFile          = NULL,
 	.regionSpecified     = false,
@@ -674,11 +778,22 @@ Configure(
     VerboseOutput( configuration->verbose.value,
 		   "Configuration:\n  Region: %s\n  Bucket: %s\n"
 		   "  Path: %s\n  Log: %s\n  Log level: %s\n"
+		   "  Kernel cache timeouts: entry %ds, attr %ds, negative %ds\n"
+		   "  Cache snapshot: %s, every %ds\n"
+		   "  Stat cache size: %ld entries\n"
+		   "  Checksum: %s\n"
                    "Mount point:\n  %s\n",
 		   regionNames[ configuration->region ],
 		   ShowStringValue( configuration->bucketName ),
 		   ShowStringValue( configuration->path ),
 		   ShowStringValue( configuration->logfile ),
 		   ShowLogLevel( configuration->logLevel ),
+		   configuration->entryTimeout,
+		   configuration->attrTimeout,
+		   configuration->negativeTimeout,
+		   ShowStringValue( configuration->cacheSnapshot ),
+		   configuration->snapshotInterval,
+		   configuration->statCacheSize,
+		   configuration->checksum == CHECKSUM_CRC32C ? "CRC32C" : "MD5",
 		   ShowStringValue( configuration->mountPoint ) );
 }
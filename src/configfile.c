@@ -75,7 +75,11 @@ ReadConfigFile(
     const char      *configPath;
     const char      *configKey;
     const char      *configLogfile;
+    const char      *configSnapshot;
+    const char      *configChecksum;
     int             configVerbose;
+    int             configTimeout;
+    int             configCacheSize;
 
     /* Open the config file. */
     /*@-compdef@*/
@@ -140,6 +144,48 @@ ReadConfigFile(
 	{
 	     ConfigSetBoolean( &configuration->verbose, configVerbose );
 	}
+	/* Read the kernel cache timeouts from the config file. */
+	if( config_lookup_int( &config, "entry_timeout", &configTimeout ) )
+	{
+	    ConfigSetTimeout( &configuration->entryTimeout, configTimeout,
+			      &configError );
+	}
+	if( config_lookup_int( &config, "attr_timeout", &configTimeout ) )
+	{
+	    ConfigSetTimeout( &configuration->attrTimeout, configTimeout,
+			      &configError );
+	}
+	if( config_lookup_int( &config, "negative_timeout", &configTimeout ) )
+	{
+	    ConfigSetTimeout( &configuration->negativeTimeout, configTimeout,
+			      &configError );
+	}
+	/* Read the cache snapshot settings from the config file. */
+        /*@-compdef@*/
+	if( config_lookup_string( &config, "cache_snapshot", &configSnapshot ) )
+        /*@+compdef@*/
+	{
+	    ConfigSetPath( &configuration->cacheSnapshot, configSnapshot );
+	}
+	if( config_lookup_int( &config, "snapshot_interval", &configTimeout ) )
+	{
+	    ConfigSetTimeout( &configuration->snapshotInterval, configTimeout,
+			      &configError );
+	}
+	/* Read the stat cache size from the config file. */
+	if( config_lookup_int( &config, "stat_cache_size", &configCacheSize ) )
+	{
+	    ConfigSetCacheSize( &configuration->statCacheSize, configCacheSize,
+				&configError );
+	}
+	/* Read the transfer checksum from the config file. */
+        /*@-compdef@*/
+	if( config_lookup_string( &config, "checksum", &configChecksum ) )
+        /*@+compdef@*/
+	{
+	    ConfigSetChecksum( &configuration->checksum, configChecksum,
+			       &configError );
+	}
     }
     config_destroy( &config );
 
@@ -50,9 +50,23 @@
 #include <memory.h>
 #include <assert.h>
 #include <endian.h>
+#include <pthread.h>
 #include "digest.h"
 #include "base64.h"
 
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define DIGEST_X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+
+#ifdef AUTOTEST
+#define STATIC
+#else
+#define STATIC static
+#endif
+
 
 /* Set to define functions as inline functions rather than macros. */
 #define NO_MACRO_FUNCTIONS
@@ -261,6 +275,10 @@ struct DigestState
     uint32_t      C;
     uint32_t      D;
     uint32_t      E;
+    /* SHA256 only. */
+    uint32_t      F;
+    uint32_t      G;
+    uint32_t      H;
     uint32_t      total[ 2 ];
     uint32_t      buflen;
     unsigned char buffer[ 128 ];
@@ -269,6 +287,15 @@ struct DigestState
     int Corrupted;
 };
 
+/* Key prepared for HMAC signing: the digest states after hashing the inner
+   and the outer padded key. */
+struct HmacKey
+{
+    enum HashFunctions function;
+    struct DigestState inner;
+    struct DigestState outer;
+};
+
 
 /*
  *  Function Prototypes
@@ -286,9 +313,17 @@ MD5ProcessContinuous( const unsigned char *buffer, size_t len,
 		      struct DigestState *ctx );
 
 static int SHA1Result( struct DigestState* );
-static void SHA1Input( struct DigestState*, const unsigned char*, unsigned );
+static void SHA1Input( struct DigestState*, const unsigned char*, size_t );
 static void SHA1ProcessMessageBlock(struct DigestState *);
+static void SHA1ProcessBlocks( struct DigestState *state,
+			       const unsigned char *blocks, size_t nBlocks );
 static void SHA1PadMessage(struct DigestState *);
+static void SHA256ProcessBlocks( struct DigestState *state,
+				 const unsigned char *blocks, size_t nBlocks );
+static void InitializeSha256State( struct DigestState *state );
+static void SHA256Input( struct DigestState *state,
+			 const unsigned char *buffer, size_t length );
+static void SHA256Result( struct DigestState *state, unsigned char *out );
 
 
 
@@ -297,7 +332,7 @@ static void SHA1PadMessage(struct DigestState *);
  * ASCII hex representation.
  * @param binary [in] binary digest.
  * @param digest [out] ASCII digest.
- * @param function [in] Hash function; HASH_MD5 or HASH_SHA1.
+ * @param function [in] Hash function; HASH_MD5, HASH_SHA1, or HASH_SHA256.
  * @return Nothing.
  */
 static void
@@ -318,6 +353,9 @@ BinDigestToHexDigest(
         case HASH_SHA1:
 	    size = 160 / 8;
 	    break;
+        case HASH_SHA256:
+	    size = 256 / 8;
+	    break;
         default:
 	    size = 0;
 	    break;
@@ -481,6 +519,118 @@ Sha1StateToBinDigest(
 
 
 
+/**
+ * Return the size of a binary message digest.
+ * @param function [in] Hash function.
+ * @return Number of bytes in the digest.
+ */
+static int
+DigestSize(
+    enum HashFunctions function
+	   )
+{
+    switch( function )
+    {
+        case HASH_MD5:
+	    return( 16 );
+        case HASH_SHA1:
+	    return( 20 );
+        case HASH_SHA256:
+	    return( 32 );
+        default:
+	    return( 0 );
+    }
+}
+
+
+
+/**
+ * Initialize the digest state variables for a hash function.
+ * @param state [out] Digest state variables.
+ * @param function [in] Hash function.
+ * @return Nothing.
+ */
+static void
+DigestInitialize(
+    struct DigestState *state,
+    enum HashFunctions function
+		 )
+{
+    if( function == HASH_SHA256 )
+    {
+        InitializeSha256State( state );
+    }
+    else
+    {
+        InitializeDigestState( state );
+    }
+}
+
+
+
+/**
+ * Add a part of the message to the digest.
+ * @param state [in/out] Digest state variables.
+ * @param function [in] Hash function.
+ * @param buffer [in] Part of the message.
+ * @param length [in] Number of bytes in the buffer.
+ * @return Nothing.
+ */
+static void
+DigestUpdate(
+    struct DigestState  *state,
+    enum HashFunctions  function,
+    const unsigned char *buffer,
+    size_t              length
+	     )
+{
+    switch( function )
+    {
+        case HASH_MD5:
+	    MD5ProcessContinuous( buffer, length, state );
+	    break;
+        case HASH_SHA1:
+	    SHA1Input( state, buffer, length );
+	    break;
+        case HASH_SHA256:
+	    SHA256Input( state, buffer, length );
+	    break;
+    }
+}
+
+
+
+/**
+ * Pad the message and produce the binary digest.
+ * @param state [in/out] Digest state variables.
+ * @param function [in] Hash function.
+ * @param resblock [out] Binary digest of DigestSize( function ) bytes.
+ * @return Nothing.
+ */
+static void
+DigestFinal(
+    struct DigestState *state,
+    enum HashFunctions function,
+    unsigned char      *resblock
+	    )
+{
+    switch( function )
+    {
+        case HASH_MD5:
+	    MD5FlushState( state, resblock );
+	    break;
+        case HASH_SHA1:
+	    SHA1Result( state );
+	    Sha1StateToBinDigest( state, resblock );
+	    break;
+        case HASH_SHA256:
+	    SHA256Result( state, resblock );
+	    break;
+    }
+}
+
+
+
 static void
 EncodeDigest(
     const unsigned char *resblock,
@@ -490,9 +640,8 @@ EncodeDigest(
 )
 {
     int  size;
-    char *base64;
 
-    size = ( function == HASH_MD5 ? 16 : 20 );
+    size = DigestSize( function );
 
     if( encoding == HASHENC_HEX )
     {
@@ -500,9 +649,7 @@ EncodeDigest(
     }
     else if( encoding == HASHENC_BASE64 )
     {
-        base64 = EncodeBase64( resblock, size );
-	strcpy( digest, base64 );
-	free( base64 );
+        EncodeBase64Buffer( resblock, size, digest );
     }
     else
     {
@@ -520,7 +667,7 @@ EncodeDigest(
  * digest is returned in the specified format.
  * @param stream [in] File to generate the digest of.
  * @param digest [out] Destination string for the digest.
- * @param function [in] Hash function; MD5 or SHA1.
+ * @param function [in] Hash function; MD5, SHA1, or SHA256.
  * @param encoding [in] Encoding of the digest; BASE64, binary, or hex.
  * @return 0 if the digest was computed, or 1 on file errors.
  */
@@ -539,7 +686,7 @@ DigestStream(
     /* Important: BLOCKSIZE must be a multiple of 64.  */
     const unsigned int BLOCKSIZE = 4096;
     struct DigestState state;
-    unsigned char      resblock[ 20 ];
+    unsigned char      resblock[ 32 ];
     unsigned char      *buffer;
     size_t             sum;
 
@@ -550,7 +697,7 @@ DigestStream(
     }
 
     /* Initialize the computation context.  */
-    InitializeDigestState( &state );
+    DigestInitialize( &state, function );
 
     /* Iterate over full file contents.  */
     while( 1 )
@@ -577,43 +724,20 @@ DigestStream(
 	if( bytesRead == 0 )
 	break;
 
-	if( function == HASH_MD5 )
-	{
-	    /* Process buffer with BLOCKSIZE bytes. Note that
-	       BLOCKSIZE % 64 = 0. */
-	    MD5ProcessBlock( buffer, BLOCKSIZE, &state );
-	}
-	if( function == HASH_SHA1 )
-	{
-	    SHA1Input( &state, buffer, sum );
-	}
+	/* Process buffer with BLOCKSIZE bytes. Note that
+	   BLOCKSIZE % 64 = 0. */
+	DigestUpdate( &state, function, buffer, sum );
     }
 
-    if( function == HASH_MD5 )
+    /* Add the remaining bytes if necessary, if any.  */
+    if( sum > 0 )
     {
-        /* Add the remaining bytes if necessary, if any.  */
-        if( sum > 0 )
-	{
-	    MD5ProcessContinuous( buffer, sum, &state );
-	}
-
-	/* Construct result in desired memory.  */
-	MD5FlushState( &state, resblock );
+        DigestUpdate( &state, function, buffer, sum );
     }
-    if( function == HASH_SHA1 )
-    {
-        /* Add the remaining bytes if necessary, if any.  */
-        if( sum > 0 )
-	{
-	    SHA1Input( &state, buffer, sum );
-	}
-	
-	/* Pad the result. */
-	SHA1Result( &state );
 
-	/* Put result in designated memory area.  */
-	Sha1StateToBinDigest( &state, resblock );
-    }
+    /* Pad the result and put it in designated memory area. */
+    DigestFinal( &state, function, resblock );
+    free( buffer );
 
     /* Encode the digest, which is stored in binary format in resblock. */
     EncodeDigest( resblock, digest, function, encoding );
@@ -671,7 +795,7 @@ MD5ProcessContinuous(
     }
 
     /* Process available complete blocks.  */
-    if (len > 64)
+    if (len >= 64)
     {
         MD5ProcessBlock( buffer, len & ~63, ctx );
 	buffer = buffer + ( len & ~63 );
@@ -837,7 +961,7 @@ MD5ProcessBlock(
  * @param buffer [in] Buffer with the message to generate the digest of.
  * @param len [in] Number of bytes in the buffer.
  * @param digest [out] Destination string for the digest.
- * @param function [in] Hash function; MD5 or SHA1.
+ * @param function [in] Hash function; MD5, SHA1, or SHA256.
  * @param encoding [in] Encoding of the digest; binary, hex, or BASE64.
  * @return Nothing.
  */
@@ -855,30 +979,14 @@ DigestBuffer(
        output yields to the wanted ASCII representation of the message
        digest. */
     struct DigestState state;
-    unsigned char      resblock[ 20 ];
+    unsigned char      resblock[ 32 ];
 
     /* Initialize the digest state variables.  */
-    InitializeDigestState( &state );
-
-    if( function == HASH_MD5 )
-    {
-        /* Process the whole buffer but the last len % 64 bytes.  */
-        MD5ProcessContinuous( buffer, len, &state );
-
-	/* Finish the remaining bytes. */
-	MD5FlushState( &state, resblock );
-    }
-
-    if( function == HASH_SHA1 )
-    {
-        /* Process the whole buffer but the last len % 64 bytes.  */
-	SHA1Input( &state, buffer, len );
-	/* Pad the result. */
-	SHA1Result( &state );
+    DigestInitialize( &state, function );
 
-	/* Put result in designated memory area.  */
-	Sha1StateToBinDigest( &state, resblock );
-    }
+    /* Process the whole buffer, then finish the remaining bytes. */
+    DigestUpdate( &state, function, buffer, len );
+    DigestFinal( &state, function, resblock );
 
     /* Encode the digest, which is stored in binary format in resblock. */
     EncodeDigest( resblock, digest, function, encoding );
@@ -951,9 +1059,13 @@ static void
 SHA1Input(
     struct DigestState  *context,
     const unsigned char *message_array,
-    unsigned            length
+    size_t              length
 	  )
 {
+    uint64_t bits;
+    uint64_t addedBits;
+    size_t   toAdd;
+
     if (!length)
     {
         return;
@@ -965,32 +1077,47 @@ SHA1Input(
         return;
     }
 
-    while(length-- && !context->Corrupted)
+    /* Count the message length in bits. */
+    bits      = ( (uint64_t) context->total[ 1 ] << 32 ) | context->total[ 0 ];
+    addedBits = (uint64_t) length << 3;
+    if( ( ( addedBits >> 3 ) != length ) || ( bits + addedBits < bits ) )
     {
-        context->buffer[context->buflen++] =
-                                                (*message_array & 0xFF);
-
-        context->total[ 0 ] += 8;
-        /* Force it to 32 bits */
-        context->total[ 0 ] &= 0xFFFFFFFF;
-        if (context->total[ 0 ] == 0)
-        {
-            context->total[ 1 ]++;
-            /* Force it to 32 bits */
-            context->total[ 1 ] &= 0xFFFFFFFF;
-            if (context->total[ 1 ] == 0)
-            {
-                /* Message is too long */
-                context->Corrupted = 1;
-            }
-        }
+        /* Message is too long */
+        context->Corrupted = 1;
+        return;
+    }
+    bits = bits + addedBits;
+    context->total[ 0 ] = (uint32_t) bits;
+    context->total[ 1 ] = (uint32_t) ( bits >> 32 );
 
-        if (context->buflen == 64)
-        {
-            SHA1ProcessMessageBlock(context);
-        }
+    /* Complete a buffered block first. */
+    if( context->buflen != 0 )
+    {
+        toAdd = 64 - context->buflen;
+	if( length < toAdd )
+	{
+	    toAdd = length;
+	}
+	memcpy( &context->buffer[ context->buflen ], message_array, toAdd );
+	context->buflen = context->buflen + toAdd;
+	message_array   = message_array + toAdd;
+	length          = length - toAdd;
+	if( context->buflen < 64 )
+	{
+	    return;
+	}
+	SHA1ProcessMessageBlock( context );
+    }
 
-        message_array++;
+    /* Hash complete blocks directly from the message and buffer the
+       rest. */
+    SHA1ProcessBlocks( context, message_array, length / 64 );
+    message_array = message_array + ( length & ~63 );
+    length        = length & 63;
+    if( length > 0 )
+    {
+        memcpy( context->buffer, message_array, length );
+	context->buflen = length;
     }
 }
 
@@ -1010,6 +1137,37 @@ SHA1Input(
  *      Nothing.
  *
  *  Comments:
+ *
+ */
+static void
+SHA1ProcessMessageBlock(
+    struct DigestState *context
+			)
+{
+    SHA1ProcessBlocks( context, context->buffer, 1 );
+    context->buflen = 0;
+}
+
+
+
+/*  
+ *  SHA1ProcessBlocksPortable
+ *
+ *  Description:
+ *      This function will process 512-bit blocks of the message.
+ *
+ *  Parameters:
+ *      context: [in/out]
+ *          The SHA-1 context to update
+ *      blocks: [in]
+ *          The message blocks.
+ *      nBlocks: [in]
+ *          Number of blocks.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
  *      Many of the variable names in the SHAContext, especially the
  *      single character names, were used because those were the names
  *      used in the publication.
@@ -1017,9 +1175,11 @@ SHA1Input(
  *
  */
 static void
-SHA1ProcessMessageBlock(
-    struct DigestState *context
-			)
+SHA1ProcessBlocksPortable(
+    struct DigestState  *context,
+    const unsigned char *blocks,
+    size_t              nBlocks
+			  )
 {
     const unsigned K[] =            /* Constants defined in SHA-1   */      
     {
@@ -1033,81 +1193,84 @@ SHA1ProcessMessageBlock(
     unsigned    W[80];              /* Word sequence                */
     unsigned    A, B, C, D, E;      /* Word buffers                 */
 
-    /*
-     *  Initialize the first 16 words in the array W
-     */
-    for(t = 0; t < 16; t++)
+    while( nBlocks-- > 0 )
     {
-        W[t]  = ((unsigned) context->buffer[t * 4]) << 24;
-        W[t] |= ((unsigned) context->buffer[t * 4 + 1]) << 16;
-        W[t] |= ((unsigned) context->buffer[t * 4 + 2]) << 8;
-        W[t] |= ((unsigned) context->buffer[t * 4 + 3]);
-    }
+        /*
+         *  Initialize the first 16 words in the array W
+         */
+        for(t = 0; t < 16; t++)
+        {
+            W[t]  = ((unsigned) blocks[t * 4]) << 24;
+            W[t] |= ((unsigned) blocks[t * 4 + 1]) << 16;
+            W[t] |= ((unsigned) blocks[t * 4 + 2]) << 8;
+            W[t] |= ((unsigned) blocks[t * 4 + 3]);
+        }
 
-    for(t = 16; t < 80; t++)
-    {
-       W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
+        for(t = 16; t < 80; t++)
+        {
+           W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+        }
 
-    A = context->A;
-    B = context->B;
-    C = context->C;
-    D = context->D;
-    E = context->E;
+        A = context->A;
+        B = context->B;
+        C = context->C;
+        D = context->D;
+        E = context->E;
 
-    for(t = 0; t < 20; t++)
-    {
-        temp =  SHA1CircularShift(5,A) +
-                ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 0; t < 20; t++)
+        {
+            temp =  SHA1CircularShift(5,A) +
+                    ((B & C) | ((~B) & D)) + E + W[t] + K[0];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    for(t = 20; t < 40; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 20; t < 40; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    for(t = 40; t < 60; t++)
-    {
-        temp = SHA1CircularShift(5,A) +
-               ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 40; t < 60; t++)
+        {
+            temp = SHA1CircularShift(5,A) +
+                   ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    for(t = 60; t < 80; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 60; t < 80; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    context->A = ( context->A + A ) & 0xFFFFFFFF;
-    context->B = ( context->B + B ) & 0xFFFFFFFF;
-    context->C = ( context->C + C ) & 0xFFFFFFFF;
-    context->D = ( context->D + D ) & 0xFFFFFFFF;
-    context->E = ( context->E + E ) & 0xFFFFFFFF;
+        context->A = ( context->A + A ) & 0xFFFFFFFF;
+        context->B = ( context->B + B ) & 0xFFFFFFFF;
+        context->C = ( context->C + C ) & 0xFFFFFFFF;
+        context->D = ( context->D + D ) & 0xFFFFFFFF;
+        context->E = ( context->E + E ) & 0xFFFFFFFF;
 
-    context->buflen = 0;
+        blocks = blocks + 64;
+    }
 }
 
 
@@ -1187,172 +1350,1545 @@ SHA1PadMessage(
 
 
 
+/* SHA256 round constants (FIPS 180-4, section 4.2.2). */
+static const uint32_t sha256Constants[ 64 ] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+
+static inline uint32_t
+Sha256RotateRight(
+    uint32_t word,
+    int      bits
+		  )
+{
+    return( ( word >> bits ) | ( word << ( 32 - bits ) ) );
+}
+
+
+
 /**
- * Bytewise XOR a section of memory with a constant and store the result in
- * another place.
- * @param dest [out] Destination for the XOR operation.
- * @param src [in] Memory that is to be XOR'ed.
- * @param ch [in] Constant for the XOR operation.
- * @param length [in] Number of bytes to XOR.
+ * Initialize the digest state variables for a SHA256 computation.
+ * @param state [out] Digest state variables.
  * @return Nothing.
  */
 static void
-XorMemory(
-    unsigned char       *dest,
-    const unsigned char *src,
-    unsigned char       ch,
-    int                 length
-	  )
+InitializeSha256State(
+    struct DigestState *state
+		      )
 {
-    int i;
-
-    for( i = 0; i < length; i++ )
-    {
-        dest[ i ] = src[ i ] ^ ch;
-    }
+    InitializeDigestState( state );
+    state->A = 0x6a09e667;
+    state->B = 0xbb67ae85;
+    state->C = 0x3c6ef372;
+    state->D = 0xa54ff53a;
+    state->E = 0x510e527f;
+    state->F = 0x9b05688c;
+    state->G = 0x1f83d9ab;
+    state->H = 0x5be0cd19;
 }
 
 
 
 /**
- * HMAC sign a message with an MD5 or SHA1 hash.
- *
- * Let:
- * H(·) be a cryptographic hash function,
- * K    be a secret key padded to the right with extra zeros to the input
- *      block size of the hash function, or the hash of the original key if
- *      it's longer than that block size,
- * m    be the message to be authenticated,
- * ∥   denote concatenation,
- * ⊕    denote exclusive or (XOR),
- *      opad be the outer padding (0x5c5c5c…5c5c, one-block-long hexadecimal
- *      constant), and
- *      ipad be the inner padding (0x363636…3636, one-block-long hexadecimal
- *      constant).
- *
- * Then HMAC(K,m) is mathematically defined by:
- *
- *      HMAC(K,m) = H((K ⊕ opad) ∥ H((K ⊕ ipad) ∥ m)).
- *
- * In pseudo-code:
- *
- * Shorten key if it is longer than blocksize:
- *   if key.length > blocksize then
- *       key = hash(key)
- *   end if
- * Zero-pad key if it is shorter than blocksize:
- *   if key.length < blocksize then
- *       key = key ∥ [0x00 * (blocksize - key.length)]
- *   end if
- *
- * Outer XOR: 
- *   o_key_pad = [0x5c * blocksize] ⊕ key
- * Inner XOR:
- *   i_key_pad = [0x36 * blocksize] ⊕ key
- *
- * Return hash(o_key_pad ∥ hash(i_key_pad ∥ message))
- *
- * @param message [in] Message to sign.
- * @param length [in] Length of the message.
- * @param key [in] Key to sign the message with.
- * @param function [in] Type of hash function to sign with; MD5 og SHA1.
- * @param encoding [in] Encoding of the signature; BASE64, binary, or hex.
- * @return Allocated buffer with signature as a string.
+ * Process 64-byte blocks of a message with the SHA256 compression function.
+ * @param state [in/out] Digest state variables.
+ * @param blocks [in] The message blocks.
+ * @param nBlocks [in] Number of blocks.
+ * @return Nothing.
  */
-
-const char*
-HMAC(
-    const unsigned char *message,
-    int                 length,
-    const char          *key,
-    enum HashFunctions  function,
-    enum HashEncodings  encoding
-     )
+static void
+SHA256ProcessBlocksPortable(
+    struct DigestState  *state,
+    const unsigned char *blocks,
+    size_t              nBlocks
+			    )
 {
-    char                workKey[ 64 ];
-    int                 padding;
-    int                 i;
-    unsigned char       outerXor[ 64 ];
-    unsigned char       innerXor[ 64 ];
-    struct DigestState  state;
-    unsigned char       md5hashPass1[ 16 ];
-    unsigned char       md5hashPass2[ 16 ];
-    unsigned char       sha1hashPass1[ 20 ];
-    unsigned char       sha1hashPass2[ 20 ];
-    const unsigned char *binSignature;
-    char                *signature = NULL;
+    uint32_t W[ 64 ];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t s0, s1;
+    uint32_t temp1, temp2;
+    int      t;
 
-    /* Shorten key to its hash if it is longer than blocksize. */
-    if( strlen( key ) > 64 )
-    {
-        DigestBuffer( (const unsigned char*) key, strlen( key ),
-		      workKey, function, HASHENC_BIN );
-    }
-    else
-    {
-        strncpy( workKey, key, 64 );
-    }
-    /* Zero-pad key if it is shorter than blocksize. */
-    padding = 64 - strlen( workKey );
-    if( padding > 0 )
+    while( nBlocks-- > 0 )
     {
-        for( i = 64 - padding; i < 64; i++ )
+        for( t = 0; t < 16; t++ )
 	{
-	    workKey[ i ] = 0;
+	    W[ t ] = ( (uint32_t) blocks[ t * 4     ] << 24 )
+	           | ( (uint32_t) blocks[ t * 4 + 1 ] << 16 )
+	           | ( (uint32_t) blocks[ t * 4 + 2 ] <<  8 )
+	           |   (uint32_t) blocks[ t * 4 + 3 ];
 	}
-    }
+	for( t = 16; t < 64; t++ )
+	{
+	    s0 = Sha256RotateRight( W[ t - 15 ], 7 )
+	       ^ Sha256RotateRight( W[ t - 15 ], 18 ) ^ ( W[ t - 15 ] >> 3 );
+	    s1 = Sha256RotateRight( W[ t - 2 ], 17 )
+	       ^ Sha256RotateRight( W[ t - 2 ], 19 ) ^ ( W[ t - 2 ] >> 10 );
+	    W[ t ] = W[ t - 16 ] + s0 + W[ t - 7 ] + s1;
+	}
+
+	a = state->A;
+	b = state->B;
+	c = state->C;
+	d = state->D;
+	e = state->E;
+	f = state->F;
+	g = state->G;
+	h = state->H;
+	for( t = 0; t < 64; t++ )
+	{
+	    s1 = Sha256RotateRight( e, 6 ) ^ Sha256RotateRight( e, 11 )
+	       ^ Sha256RotateRight( e, 25 );
+	    temp1 = h + s1 + ( ( e & f ) ^ ( ~e & g ) )
+	          + sha256Constants[ t ] + W[ t ];
+	    s0 = Sha256RotateRight( a, 2 ) ^ Sha256RotateRight( a, 13 )
+	       ^ Sha256RotateRight( a, 22 );
+	    temp2 = s0 + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+	    h = g;
+	    g = f;
+	    f = e;
+	    e = d + temp1;
+	    d = c;
+	    c = b;
+	    b = a;
+	    a = temp1 + temp2;
+	}
+	state->A += a;
+	state->B += b;
+	state->C += c;
+	state->D += d;
+	state->E += e;
+	state->F += f;
+	state->G += g;
+	state->H += h;
+
+	blocks = blocks + 64;
+    }
+}
+
+
+
+/**
+ * Add a part of the message to a SHA256 digest. Complete blocks are hashed
+ * directly from the message; only a partial block is buffered.
+ * @param state [in/out] Digest state variables.
+ * @param buffer [in] Part of the message.
+ * @param length [in] Number of bytes in the buffer.
+ * @return Nothing.
+ */
+static void
+SHA256Input(
+    struct DigestState  *state,
+    const unsigned char *buffer,
+    size_t              length
+	    )
+{
+    uint64_t total;
+    size_t   toAdd;
+
+    /* Count the message length in bytes. */
+    total = ( (uint64_t) state->total[ 1 ] << 32 ) | state->total[ 0 ];
+    total = total + length;
+    state->total[ 0 ] = (uint32_t) total;
+    state->total[ 1 ] = (uint32_t) ( total >> 32 );
+
+    /* Complete a buffered block first. */
+    if( state->buflen != 0 )
+    {
+        toAdd = 64 - state->buflen;
+	if( length < toAdd )
+	{
+	    toAdd = length;
+	}
+	memcpy( &state->buffer[ state->buflen ], buffer, toAdd );
+	state->buflen = state->buflen + toAdd;
+	buffer = buffer + toAdd;
+	length = length - toAdd;
+	if( state->buflen < 64 )
+	{
+	    return;
+	}
+	SHA256ProcessBlocks( state, state->buffer, 1 );
+	state->buflen = 0;
+    }
+
+    SHA256ProcessBlocks( state, buffer, length / 64 );
+    buffer = buffer + ( length & ~63 );
+    length = length & 63;
+    if( length > 0 )
+    {
+        memcpy( state->buffer, buffer, length );
+	state->buflen = length;
+    }
+}
+
+
+
+/**
+ * Pad the message and produce the binary SHA256 digest.
+ * @param state [in/out] Digest state variables.
+ * @param out [out] 32 bytes of storage for the binary digest.
+ * @return Nothing.
+ */
+static void
+SHA256Result(
+    struct DigestState *state,
+    unsigned char      *out
+	     )
+{
+    uint64_t bits;
+    uint32_t words[ 8 ];
+    size_t   padding;
+    int      i;
+
+    bits = ( ( (uint64_t) state->total[ 1 ] << 32 ) | state->total[ 0 ] ) << 3;
+
+    /* Pad with 0x80 and zeros up to the last 8 bytes of a block, then add
+       the message length in bits. */
+    padding = ( state->buflen < 56 ) ? 56 - state->buflen
+                                     : 64 + 56 - state->buflen;
+    memcpy( &state->buffer[ state->buflen ], fillbuf, padding );
+    for( i = 0; i < 8; i++ )
+    {
+        state->buffer[ state->buflen + padding + i ] =
+	    ( bits >> ( 56 - i * 8 ) ) & 0xff;
+    }
+    SHA256ProcessBlocks( state, state->buffer,
+			 ( state->buflen + padding + 8 ) / 64 );
+    state->buflen = 0;
+
+    words[ 0 ] = state->A;
+    words[ 1 ] = state->B;
+    words[ 2 ] = state->C;
+    words[ 3 ] = state->D;
+    words[ 4 ] = state->E;
+    words[ 5 ] = state->F;
+    words[ 6 ] = state->G;
+    words[ 7 ] = state->H;
+    for( i = 0; i < 8; i++ )
+    {
+        Sha1StatePartToBinDigest( words[ i ], &out[ i * 4 ] );
+    }
+}
+
+
+
+/* Instruction set extensions that the digest kernels use: the SHA
+   extensions for SHA1 and SHA256, AVX2 for hashing eight MD5 messages at
+   once, and SSE4.2 for CRC32C checksums. */
+#define DIGEST_ACCEL_SHA  0x01
+#define DIGEST_ACCEL_AVX2 0x02
+#define DIGEST_ACCEL_CRC  0x04
+
+/* Supported extensions, or -1 until the processor has been examined. The
+   portable kernels are used for the extensions that are not supported. */
+STATIC int digestAcceleration = -1;
+
+
+
+/**
+ * Determine which instruction set extensions the processor and the
+ * operating system support for the digest kernels.
+ * @return Bitmask of DIGEST_ACCEL_* flags.
+ */
+static int
+GetDigestAcceleration(
+    void
+		      )
+{
+    int          accel = __atomic_load_n( &digestAcceleration,
+					  __ATOMIC_RELAXED );
+#ifdef DIGEST_X86_KERNELS
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int features;
+    unsigned int xcr0Low, xcr0High;
+    int          osSavesYmm = 0;
+#endif
+
+    if( accel >= 0 )
+    {
+        return( accel );
+    }
+    accel = 0;
+#ifdef DIGEST_X86_KERNELS
+    if( __get_cpuid( 1, &eax, &ebx, &features, &edx ) )
+    {
+        /* SSE4.2 provides the CRC32C instruction. */
+        if( features & ( 1u << 20 ) )
+	{
+	    accel |= DIGEST_ACCEL_CRC;
+	}
+	if( __get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+	{
+	    /* The SHA kernels also use SSSE3 and SSE4.1 instructions. */
+	    if( ( ebx & ( 1u << 29 ) )
+		&& ( features & ( 1u << 9 ) ) && ( features & ( 1u << 19 ) ) )
+	    {
+	        accel |= DIGEST_ACCEL_SHA;
+	    }
+	    /* AVX2 also requires that the operating system saves the YMM
+	       registers, which it indicates with OSXSAVE and XCR0. */
+	    if( ( features & ( 1u << 27 ) ) && ( features & ( 1u << 28 ) ) )
+	    {
+	        __asm__( "xgetbv" : "=a" ( xcr0Low ), "=d" ( xcr0High )
+			          : "c" ( 0 ) );
+		osSavesYmm = ( xcr0Low & 0x06 ) == 0x06;
+	    }
+	    if( ( ebx & ( 1u << 5 ) ) && osSavesYmm )
+	    {
+	        accel |= DIGEST_ACCEL_AVX2;
+	    }
+	}
+    }
+#endif
+    __atomic_store_n( &digestAcceleration, accel, __ATOMIC_RELAXED );
+    return( accel );
+}
+
+
+
+#ifdef DIGEST_X86_KERNELS
+/**
+ * Process 64-byte blocks of a message with the SHA1 compression function,
+ * using the SHA extensions.
+ * @param state [in/out] Digest state variables.
+ * @param blocks [in] The message blocks.
+ * @param nBlocks [in] Number of blocks.
+ * @return Nothing.
+ */
+__attribute__(( target( "sha,ssse3,sse4.1" ) ))
+static void
+SHA1ProcessBlocksShaNi(
+    struct DigestState  *state,
+    const unsigned char *blocks,
+    size_t              nBlocks
+		       )
+{
+    const __m128i byteSwap = _mm_set_epi64x( 0x0001020304050607ull,
+					     0x08090a0b0c0d0e0full );
+    __m128i       abcd;
+    __m128i       e;
+    __m128i       abcdSave;
+    __m128i       eSave;
+    __m128i       previousAbcd;
+    __m128i       msg[ 4 ];
+    int           i;
+
+    abcd = _mm_set_epi32( state->A, state->B, state->C, state->D );
+    e    = _mm_set_epi32( state->E, 0, 0, 0 );
+
+    while( nBlocks-- > 0 )
+    {
+        abcdSave = abcd;
+	eSave    = e;
+	for( i = 0; i < 4; i++ )
+	{
+	    msg[ i ] = _mm_shuffle_epi8(
+	        _mm_loadu_si128( (const __m128i*) &blocks[ i * 16 ] ),
+		byteSwap );
+	}
+
+	/* Each iteration performs four rounds. From the fifth iteration,
+	   the message schedule is extended by four words in the slot of the
+	   words that are no longer needed. */
+	previousAbcd = abcd;
+	for( i = 0; i < 20; i++ )
+	{
+	    if( i >= 4 )
+	    {
+	        msg[ i & 3 ] = _mm_sha1msg2_epu32(
+		    _mm_xor_si128( _mm_sha1msg1_epu32( msg[ i & 3 ],
+						       msg[ ( i + 1 ) & 3 ] ),
+				   msg[ ( i + 2 ) & 3 ] ),
+		    msg[ ( i + 3 ) & 3 ] );
+	    }
+	    if( i == 0 )
+	    {
+	        e = _mm_add_epi32( e, msg[ 0 ] );
+	    }
+	    else
+	    {
+	        e = _mm_sha1nexte_epu32( previousAbcd, msg[ i & 3 ] );
+	    }
+	    previousAbcd = abcd;
+	    /* The round function changes every five iterations; the
+	       immediate operand selects it. */
+	    switch( i / 5 )
+	    {
+	        case 0:
+		    abcd = _mm_sha1rnds4_epu32( abcd, e, 0 );
+		    break;
+	        case 1:
+		    abcd = _mm_sha1rnds4_epu32( abcd, e, 1 );
+		    break;
+	        case 2:
+		    abcd = _mm_sha1rnds4_epu32( abcd, e, 2 );
+		    break;
+	        default:
+		    abcd = _mm_sha1rnds4_epu32( abcd, e, 3 );
+		    break;
+	    }
+	}
+
+	e    = _mm_sha1nexte_epu32( previousAbcd, eSave );
+	abcd = _mm_add_epi32( abcd, abcdSave );
+	blocks = blocks + 64;
+    }
+
+    state->A = _mm_extract_epi32( abcd, 3 );
+    state->B = _mm_extract_epi32( abcd, 2 );
+    state->C = _mm_extract_epi32( abcd, 1 );
+    state->D = _mm_extract_epi32( abcd, 0 );
+    state->E = _mm_extract_epi32( e, 3 );
+}
+
+
+
+/**
+ * Process 64-byte blocks of a message with the SHA256 compression function,
+ * using the SHA extensions.
+ * @param state [in/out] Digest state variables.
+ * @param blocks [in] The message blocks.
+ * @param nBlocks [in] Number of blocks.
+ * @return Nothing.
+ */
+__attribute__(( target( "sha,ssse3,sse4.1" ) ))
+static void
+SHA256ProcessBlocksShaNi(
+    struct DigestState  *state,
+    const unsigned char *blocks,
+    size_t              nBlocks
+			 )
+{
+    const __m128i byteSwap = _mm_set_epi64x( 0x0c0d0e0f08090a0bull,
+					     0x0405060700010203ull );
+    __m128i       abef;
+    __m128i       cdgh;
+    __m128i       abefSave;
+    __m128i       cdghSave;
+    __m128i       msg[ 4 ];
+    __m128i       words;
+    int           i;
+
+    /* The instructions keep the state as the halves A, B, E, F and C, D,
+       G, H. */
+    abef = _mm_set_epi32( state->A, state->B, state->E, state->F );
+    cdgh = _mm_set_epi32( state->C, state->D, state->G, state->H );
+
+    while( nBlocks-- > 0 )
+    {
+        abefSave = abef;
+	cdghSave = cdgh;
+	for( i = 0; i < 4; i++ )
+	{
+	    msg[ i ] = _mm_shuffle_epi8(
+	        _mm_loadu_si128( (const __m128i*) &blocks[ i * 16 ] ),
+		byteSwap );
+	}
+
+	/* Each iteration performs four rounds and extends the message
+	   schedule by four words in the slot of the words it has used. */
+	for( i = 0; i < 16; i++ )
+	{
+	    words = _mm_add_epi32( msg[ i & 3 ],
+				   _mm_loadu_si128( (const __m128i*)
+						    &sha256Constants[ i * 4 ] ) );
+	    cdgh  = _mm_sha256rnds2_epu32( cdgh, abef, words );
+	    words = _mm_shuffle_epi32( words, 0x0e );
+	    abef  = _mm_sha256rnds2_epu32( abef, cdgh, words );
+	    if( i < 12 )
+	    {
+	        msg[ i & 3 ] = _mm_sha256msg2_epu32(
+		    _mm_add_epi32( _mm_sha256msg1_epu32( msg[ i & 3 ],
+							 msg[ ( i + 1 ) & 3 ] ),
+				   _mm_alignr_epi8( msg[ ( i + 3 ) & 3 ],
+						    msg[ ( i + 2 ) & 3 ], 4 ) ),
+		    msg[ ( i + 3 ) & 3 ] );
+	    }
+	}
+
+	abef   = _mm_add_epi32( abef, abefSave );
+	cdgh   = _mm_add_epi32( cdgh, cdghSave );
+	blocks = blocks + 64;
+    }
+
+    state->A = _mm_extract_epi32( abef, 3 );
+    state->B = _mm_extract_epi32( abef, 2 );
+    state->E = _mm_extract_epi32( abef, 1 );
+    state->F = _mm_extract_epi32( abef, 0 );
+    state->C = _mm_extract_epi32( cdgh, 3 );
+    state->D = _mm_extract_epi32( cdgh, 2 );
+    state->G = _mm_extract_epi32( cdgh, 1 );
+    state->H = _mm_extract_epi32( cdgh, 0 );
+}
+
+
+
+/* MD5 round constants and rotations (RFC 1321, 3.4), and the message word
+   that each of the 64 steps adds. */
+static const uint32_t md5Constants[ 64 ] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const unsigned char md5Rotations[ 4 ][ 4 ] =
+{
+    { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+};
+static const unsigned char md5WordIndex[ 64 ] =
+{
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+
+
+/**
+ * Perform one step of the MD5 compression function on eight messages.
+ * @param a [in] State variable that the step replaces.
+ * @param b [in] State variable that the step adds to.
+ * @param f [in] Result of the round function of b, c, and d.
+ * @param word [in] Message word of the step.
+ * @param step [in] Step number, which selects the constant and rotation.
+ * @return New value of the state variable.
+ */
+__attribute__(( target( "avx2" ) ))
+static inline __m256i
+MD5StepAvx2(
+    __m256i a,
+    __m256i b,
+    __m256i f,
+    __m256i word,
+    int     step
+	    )
+{
+    int rotation = md5Rotations[ step / 16 ][ step & 3 ];
+
+    f = _mm256_add_epi32( _mm256_add_epi32( a, f ),
+			  _mm256_add_epi32( word, _mm256_set1_epi32(
+						md5Constants[ step ] ) ) );
+    f = _mm256_or_si256( _mm256_slli_epi32( f, rotation ),
+			 _mm256_srli_epi32( f, 32 - rotation ) );
+    return( _mm256_add_epi32( b, f ) );
+}
+
+
+
+/**
+ * Transpose eight rows of eight 32-bit words.
+ * @param rows [in/out] Rows to transpose.
+ * @return Nothing.
+ */
+__attribute__(( target( "avx2" ) ))
+static inline void
+TransposeAvx2(
+    __m256i rows[ 8 ]
+	      )
+{
+    __m256i pairs[ 8 ];
+    __m256i quads[ 8 ];
+    int     i;
+
+    for( i = 0; i < 8; i += 2 )
+    {
+        pairs[ i     ] = _mm256_unpacklo_epi32( rows[ i ], rows[ i + 1 ] );
+	pairs[ i + 1 ] = _mm256_unpackhi_epi32( rows[ i ], rows[ i + 1 ] );
+    }
+    for( i = 0; i < 8; i += 4 )
+    {
+        quads[ i     ] = _mm256_unpacklo_epi64( pairs[ i     ], pairs[ i + 2 ] );
+	quads[ i + 1 ] = _mm256_unpackhi_epi64( pairs[ i     ], pairs[ i + 2 ] );
+	quads[ i + 2 ] = _mm256_unpacklo_epi64( pairs[ i + 1 ], pairs[ i + 3 ] );
+	quads[ i + 3 ] = _mm256_unpackhi_epi64( pairs[ i + 1 ], pairs[ i + 3 ] );
+    }
+    for( i = 0; i < 4; i++ )
+    {
+        rows[ i     ] = _mm256_permute2x128_si256( quads[ i ], quads[ i + 4 ],
+						   0x20 );
+	rows[ i + 4 ] = _mm256_permute2x128_si256( quads[ i ], quads[ i + 4 ],
+						   0x31 );
+    }
+}
+
+
+
+/**
+ * Process 64-byte blocks of eight independent messages with the MD5
+ * compression function, using AVX2. Each 32-bit lane of the vectors holds
+ * the state of one message.
+ * @param state [in/out] MD5 state variables A, B, C, and D of each message.
+ * @param lanes [in] The message blocks of each message.
+ * @param nBlocks [in] Number of blocks to process in each message.
+ * @return Nothing.
+ */
+__attribute__(( target( "avx2" ) ))
+static void
+MD5ProcessBlocksAvx2(
+    uint32_t            state[ 4 ][ 8 ],
+    const unsigned char *lanes[ 8 ],
+    size_t              nBlocks
+		     )
+{
+    __m256i a, b, c, d;
+    __m256i aSave, bSave, cSave, dSave;
+    __m256i f;
+    __m256i temp;
+    __m256i words[ 16 ];
+    __m256i ones = _mm256_set1_epi32( -1 );
+    size_t  offset;
+    int     step;
+    int     lane;
+
+    a = _mm256_loadu_si256( (const __m256i*) state[ 0 ] );
+    b = _mm256_loadu_si256( (const __m256i*) state[ 1 ] );
+    c = _mm256_loadu_si256( (const __m256i*) state[ 2 ] );
+    d = _mm256_loadu_si256( (const __m256i*) state[ 3 ] );
+
+    for( offset = 0; offset < nBlocks * 64; offset += 64 )
+    {
+        /* Transpose the blocks so that each vector holds the same message
+	   word of every message. (x86 is little endian, like MD5.) */
+        for( lane = 0; lane < 8; lane++ )
+	{
+	    words[ lane ] = _mm256_loadu_si256(
+	        (const __m256i*) &lanes[ lane ][ offset ] );
+	    words[ lane + 8 ] = _mm256_loadu_si256(
+	        (const __m256i*) &lanes[ lane ][ offset + 32 ] );
+	}
+	TransposeAvx2( &words[ 0 ] );
+	TransposeAvx2( &words[ 8 ] );
+
+	aSave = a;
+	bSave = b;
+	cSave = c;
+	dSave = d;
+	for( step = 0; step < 64; step++ )
+	{
+	    if( step < 16 )
+	    {
+	        /* F = d ^ ( b & ( c ^ d ) ) */
+	        f = _mm256_xor_si256( d, _mm256_and_si256(
+					  b, _mm256_xor_si256( c, d ) ) );
+	    }
+	    else if( step < 32 )
+	    {
+	        /* G = c ^ ( d & ( b ^ c ) ) */
+	        f = _mm256_xor_si256( c, _mm256_and_si256(
+					  d, _mm256_xor_si256( b, c ) ) );
+	    }
+	    else if( step < 48 )
+	    {
+	        /* H = b ^ c ^ d */
+	        f = _mm256_xor_si256( _mm256_xor_si256( b, c ), d );
+	    }
+	    else
+	    {
+	        /* I = c ^ ( b | ~d ) */
+	        f = _mm256_xor_si256( c, _mm256_or_si256(
+					  b, _mm256_xor_si256( d, ones ) ) );
+	    }
+	    temp = MD5StepAvx2( a, b, f, words[ md5WordIndex[ step ] ], step );
+	    a = d;
+	    d = c;
+	    c = b;
+	    b = temp;
+	}
+	a = _mm256_add_epi32( a, aSave );
+	b = _mm256_add_epi32( b, bSave );
+	c = _mm256_add_epi32( c, cSave );
+	d = _mm256_add_epi32( d, dSave );
+    }
+
+    _mm256_storeu_si256( (__m256i*) state[ 0 ], a );
+    _mm256_storeu_si256( (__m256i*) state[ 1 ], b );
+    _mm256_storeu_si256( (__m256i*) state[ 2 ], c );
+    _mm256_storeu_si256( (__m256i*) state[ 3 ], d );
+}
+#endif /* DIGEST_X86_KERNELS */
+
+
+
+/**
+ * Process 64-byte blocks of a message with the SHA1 compression function,
+ * using the fastest kernel that the processor supports.
+ * @param state [in/out] Digest state variables.
+ * @param blocks [in] The message blocks.
+ * @param nBlocks [in] Number of blocks.
+ * @return Nothing.
+ */
+static void
+SHA1ProcessBlocks(
+    struct DigestState  *state,
+    const unsigned char *blocks,
+    size_t              nBlocks
+		  )
+{
+    if( nBlocks == 0 )
+    {
+        return;
+    }
+#ifdef DIGEST_X86_KERNELS
+    if( GetDigestAcceleration( ) & DIGEST_ACCEL_SHA )
+    {
+        SHA1ProcessBlocksShaNi( state, blocks, nBlocks );
+	return;
+    }
+#endif
+    SHA1ProcessBlocksPortable( state, blocks, nBlocks );
+}
+
+
+
+/**
+ * Process 64-byte blocks of a message with the SHA256 compression function,
+ * using the fastest kernel that the processor supports.
+ * @param state [in/out] Digest state variables.
+ * @param blocks [in] The message blocks.
+ * @param nBlocks [in] Number of blocks.
+ * @return Nothing.
+ */
+static void
+SHA256ProcessBlocks(
+    struct DigestState  *state,
+    const unsigned char *blocks,
+    size_t              nBlocks
+		    )
+{
+    if( nBlocks == 0 )
+    {
+        return;
+    }
+#ifdef DIGEST_X86_KERNELS
+    if( GetDigestAcceleration( ) & DIGEST_ACCEL_SHA )
+    {
+        SHA256ProcessBlocksShaNi( state, blocks, nBlocks );
+	return;
+    }
+#endif
+    SHA256ProcessBlocksPortable( state, blocks, nBlocks );
+}
+
+
+
+/**
+ * Compute the message digests of several in-memory buffers. MD5 digests of
+ * up to eight buffers are computed at once if the processor supports AVX2,
+ * which is how the parts of a multipart upload are best hashed. The message
+ * digests are returned in the specified format.
+ * @param buffers [in] Buffers with the messages to generate the digests of.
+ * @param lengths [in] Number of bytes in each buffer.
+ * @param count [in] Number of buffers.
+ * @param digests [out] Destination strings for the digests.
+ * @param function [in] Hash function; MD5, SHA1, or SHA256.
+ * @param encoding [in] Encoding of the digests; binary, hex, or BASE64.
+ * @return Nothing.
+ */
+void
+DigestBuffers(
+    const unsigned char *const buffers[ ],
+    const size_t        lengths[ ],
+    int                 count,
+    char                *digests[ ],
+    enum HashFunctions  function,
+    enum HashEncodings  encoding
+	      )
+{
+#ifdef DIGEST_X86_KERNELS
+    struct DigestState  state;
+    unsigned char       resblock[ 16 ];
+    uint32_t            laneStates[ 4 ][ 8 ];
+    const unsigned char *lanes[ 8 ];
+    size_t              nBlocks;
+    size_t              processed;
+    int                 nLanes;
+    int                 lane;
+#endif
+    int                 first = 0;
+
+#ifdef DIGEST_X86_KERNELS
+    if( ( function == HASH_MD5 )
+	&& ( GetDigestAcceleration( ) & DIGEST_ACCEL_AVX2 ) )
+    {
+        for( ; count - first >= 2; first += nLanes )
+	{
+	    nLanes = count - first < 8 ? count - first : 8;
+
+	    /* Hash the blocks that all the messages have in common in
+	       parallel. Unused lanes repeat the first message. */
+	    nBlocks = lengths[ first ] / 64;
+	    for( lane = 0; lane < 8; lane++ )
+	    {
+	        if( lane < nLanes )
+		{
+		    lanes[ lane ] = buffers[ first + lane ];
+		    if( lengths[ first + lane ] / 64 < nBlocks )
+		    {
+		        nBlocks = lengths[ first + lane ] / 64;
+		    }
+		}
+		else
+		{
+		    lanes[ lane ] = buffers[ first ];
+		}
+		laneStates[ 0 ][ lane ] = 0x67452301;
+		laneStates[ 1 ][ lane ] = 0xefcdab89;
+		laneStates[ 2 ][ lane ] = 0x98badcfe;
+		laneStates[ 3 ][ lane ] = 0x10325476;
+	    }
+	    MD5ProcessBlocksAvx2( laneStates, lanes, nBlocks );
+
+	    /* Finish each message on its own. */
+	    processed = nBlocks * 64;
+	    for( lane = 0; lane < nLanes; lane++ )
+	    {
+	        InitializeDigestState( &state );
+		state.A = laneStates[ 0 ][ lane ];
+		state.B = laneStates[ 1 ][ lane ];
+		state.C = laneStates[ 2 ][ lane ];
+		state.D = laneStates[ 3 ][ lane ];
+		state.total[ 0 ] = (uint32_t) processed;
+		state.total[ 1 ] = (uint32_t) ( (uint64_t) processed >> 32 );
+		MD5ProcessContinuous( &lanes[ lane ][ processed ],
+				      lengths[ first + lane ] - processed,
+				      &state );
+		MD5FlushState( &state, resblock );
+		EncodeDigest( resblock, digests[ first + lane ],
+			      function, encoding );
+	    }
+	}
+    }
+#endif
+
+    for( ; first < count; first++ )
+    {
+        DigestBuffer( buffers[ first ], lengths[ first ], digests[ first ],
+		      function, encoding );
+    }
+}
+
+
+
+/**
+ * Bytewise XOR a section of memory with a constant and store the result in
+ * another place.
+ * @param dest [out] Destination for the XOR operation.
+ * @param src [in] Memory that is to be XOR'ed.
+ * @param ch [in] Constant for the XOR operation.
+ * @param length [in] Number of bytes to XOR.
+ * @return Nothing.
+ */
+static void
+XorMemory(
+    unsigned char       *dest,
+    const unsigned char *src,
+    unsigned char       ch,
+    int                 length
+	  )
+{
+    int i;
+
+    for( i = 0; i < length; i++ )
+    {
+        dest[ i ] = src[ i ] ^ ch;
+    }
+}
+
+
+
+/**
+ * HMAC sign a message with an MD5 or SHA1 hash.
+ *
+ * Let:
+ * H(·) be a cryptographic hash function,
+ * K    be a secret key padded to the right with extra zeros to the input
+ *      block size of the hash function, or the hash of the original key if
+ *      it's longer than that block size,
+ * m    be the message to be authenticated,
+ * ∥   denote concatenation,
+ * ⊕    denote exclusive or (XOR),
+ *      opad be the outer padding (0x5c5c5c…5c5c, one-block-long hexadecimal
+ *      constant), and
+ *      ipad be the inner padding (0x363636…3636, one-block-long hexadecimal
+ *      constant).
+ *
+ * Then HMAC(K,m) is mathematically defined by:
+ *
+ *      HMAC(K,m) = H((K ⊕ opad) ∥ H((K ⊕ ipad) ∥ m)).
+ *
+ * In pseudo-code:
+ *
+ * Shorten key if it is longer than blocksize:
+ *   if key.length > blocksize then
+ *       key = hash(key)
+ *   end if
+ * Zero-pad key if it is shorter than blocksize:
+ *   if key.length < blocksize then
+ *       key = key ∥ [0x00 * (blocksize - key.length)]
+ *   end if
+ *
+ * Outer XOR: 
+ *   o_key_pad = [0x5c * blocksize] ⊕ key
+ * Inner XOR:
+ *   i_key_pad = [0x36 * blocksize] ⊕ key
+ *
+ * Return hash(o_key_pad ∥ hash(i_key_pad ∥ message))
+ *
+ * @param message [in] Message to sign.
+ * @param length [in] Length of the message.
+ * @param key [in] Key to sign the message with.
+ * @param function [in] Type of hash function to sign with; MD5 og SHA1.
+ * @param encoding [in] Encoding of the signature; BASE64, binary, or hex.
+ * @return Allocated buffer with signature as a string.
+ */
+
+const char*
+HMAC(
+    const unsigned char *message,
+    int                 length,
+    const char          *key,
+    enum HashFunctions  function,
+    enum HashEncodings  encoding
+     )
+{
+    struct HmacKey *hmacKey;
+    const char     *signature;
 
-    /* Create outer and inner key XOR. */
-    XorMemory( outerXor, ( unsigned char*) workKey, 0x5c, 64 );
-    XorMemory( innerXor, ( unsigned char*) workKey, 0x36, 64 );
-    /* Overwrite work copy of the key for security. */
-    memset( workKey, 0x00, 64 );
+    hmacKey   = CreateHmacKey( key, function );
+    signature = HMACWithKey( hmacKey, message, length, encoding );
+    DestroyHmacKey( hmacKey );
 
-    /* Pass 1: hash ( inner XOR concatenated with message ). */
-    InitializeDigestState( &state );
-    if( function == HASH_MD5 )
+    return( signature );
+}
+
+
+
+/**
+ * Prepare a key for HMAC signing of any number of messages. The key is
+ * padded and XORed with the inner and outer pads as described for
+ * \a HMAC( ), and the digest states after hashing the two padded keys are
+ * stored, so signing a message only requires hashing the message and the
+ * inner hash.
+ * @param key [in] Key to sign the messages with.
+ * @param function [in] Type of hash function to sign with; MD5, SHA1, or
+ *        SHA256.
+ * @return Allocated key, which must be released with \a DestroyHmacKey( ).
+ */
+struct HmacKey*
+CreateHmacKey(
+    const char         *key,
+    enum HashFunctions function
+	      )
+{
+    return( CreateBinaryHmacKey( (const unsigned char*) key, strlen( key ),
+				 function ) );
+}
+
+
+
+/**
+ * Prepare a binary key, such as a digest, for HMAC signing of any number of
+ * messages.
+ * @param key [in] Key to sign the messages with.
+ * @param keyLength [in] Number of bytes in the key.
+ * @param function [in] Type of hash function to sign with; MD5, SHA1, or
+ *        SHA256.
+ * @return Allocated key, which must be released with \a DestroyHmacKey( ).
+ */
+struct HmacKey*
+CreateBinaryHmacKey(
+    const unsigned char *key,
+    size_t              keyLength,
+    enum HashFunctions  function
+		    )
+{
+    struct HmacKey *hmacKey;
+    unsigned char  workKey[ 64 ];
+    unsigned char  pad[ 64 ];
+
+    hmacKey = malloc( sizeof( struct HmacKey ) );
+    assert( hmacKey != NULL );
+    hmacKey->function = function;
+
+    /* Shorten key to its hash if it is longer than blocksize, and zero-pad
+       it if it is shorter than blocksize. */
+    memset( workKey, 0, sizeof( workKey ) );
+    if( keyLength > 64 )
+    {
+        DigestBuffer( key, keyLength, (char*) workKey, function, HASHENC_BIN );
+    }
+    else
     {
-        MD5ProcessContinuous( innerXor, 64, &state );
-	MD5ProcessContinuous( message, length, &state );
-	MD5FlushState( &state, md5hashPass1 );
+        memcpy( workKey, key, keyLength );
     }
-    if( function == HASH_SHA1 )
+
+    /* Hash the inner and outer key XOR. Both are exactly one block, so the
+       states hold no buffered bytes. */
+    XorMemory( pad, workKey, 0x36, 64 );
+    DigestInitialize( &hmacKey->inner, function );
+    DigestUpdate( &hmacKey->inner, function, pad, 64 );
+    XorMemory( pad, workKey, 0x5c, 64 );
+    DigestInitialize( &hmacKey->outer, function );
+    DigestUpdate( &hmacKey->outer, function, pad, 64 );
+
+    /* Overwrite work copies of the key for security. */
+    memset( workKey, 0x00, sizeof( workKey ) );
+    memset( pad, 0x00, sizeof( pad ) );
+
+    return( hmacKey );
+}
+
+
+
+/**
+ * Release a key that was prepared for HMAC signing.
+ * @param hmacKey [in] The key, or \a NULL.
+ * @return Nothing.
+ */
+void
+DestroyHmacKey(
+    struct HmacKey *hmacKey
+	       )
+{
+    if( hmacKey != NULL )
     {
-        SHA1Input( &state, innerXor, 64 );
-	SHA1Input( &state, message, length );
-	SHA1Result( &state );
-	Sha1StateToBinDigest( &state, sha1hashPass1 );
+        memset( hmacKey, 0x00, sizeof( struct HmacKey ) );
+	free( hmacKey );
     }
+}
+
+
+
+/**
+ * HMAC sign a message with a key that was prepared with
+ * \a CreateHmacKey( ). The key is not modified, so several threads may sign
+ * with the same key.
+ * @param hmacKey [in] Key to sign the message with.
+ * @param message [in] Message to sign.
+ * @param length [in] Length of the message.
+ * @param encoding [in] Encoding of the signature; BASE64, binary, or hex.
+ * @return Allocated buffer with signature as a string.
+ */
+const char*
+HMACWithKey(
+    const struct HmacKey *hmacKey,
+    const unsigned char  *message,
+    int                  length,
+    enum HashEncodings   encoding
+	    )
+{
+    char *signature;
+
+    signature = malloc( 65 );
+    assert( signature != NULL );
+    HMACWithKeyToBuffer( hmacKey, message, length, signature, encoding );
+    return( signature );
+}
+
+
+
+/**
+ * HMAC sign a message with a key that was prepared with
+ * \a CreateHmacKey( ), and store the signature in a buffer.
+ * @param hmacKey [in] Key to sign the message with.
+ * @param message [in] Message to sign.
+ * @param length [in] Length of the message.
+ * @param signature [out] Destination for the signature, which must hold the
+ *        encoded digest and, unless the encoding is binary, a terminating
+ *        zero.
+ * @param encoding [in] Encoding of the signature; BASE64, binary, or hex.
+ * @return Nothing.
+ */
+void
+HMACWithKeyToBuffer(
+    const struct HmacKey *hmacKey,
+    const unsigned char  *message,
+    size_t               length,
+    char                 *signature,
+    enum HashEncodings   encoding
+		    )
+{
+    struct DigestState state;
+    unsigned char      hashPass1[ 32 ];
+    unsigned char      hashPass2[ 32 ];
+    int                hashSize = DigestSize( hmacKey->function );
+
+    /* Pass 1: hash ( inner XOR concatenated with message ). */
+    state = hmacKey->inner;
+    DigestUpdate( &state, hmacKey->function, message, length );
+    DigestFinal( &state, hmacKey->function, hashPass1 );
 
     /* Pass 2: hash ( outer XOR concatenated with first hash ). */
-    InitializeDigestState( &state );
-    if( function == HASH_MD5 )
+    state = hmacKey->outer;
+    DigestUpdate( &state, hmacKey->function, hashPass1, hashSize );
+    DigestFinal( &state, hmacKey->function, hashPass2 );
+
+    /* Encode the digest, which is stored in binary format in hashPass2. */
+    EncodeDigest( hashPass2, signature, hmacKey->function, encoding );
+}
+
+
+
+/* Reversed Castagnoli polynomial of the CRC32C checksum. */
+#define CRC32C_POLYNOMIAL 0x82f63b78u
+
+/* The hardware kernel checksums three streams of this many bytes at once,
+   which hides the latency of the crc32 instruction, and then combines the
+   checksums. Streams of the short length are used for the remainder. */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+/* Slicing-by-8 tables for the portable kernel, and tables that shift a
+   checksum over CRC32C_LONG and CRC32C_SHORT zero bytes. */
+static uint32_t        crc32cTable[ 8 ][ 256 ];
+static uint32_t        crc32cLongShift[ 4 ][ 256 ];
+static uint32_t        crc32cShortShift[ 4 ][ 256 ];
+static pthread_once_t  crc32cTablesOnce = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * Multiply a vector by a 32x32 matrix over GF(2).
+ * @param matrix [in] Matrix, one column per element.
+ * @param vector [in] Vector.
+ * @return The product.
+ */
+static uint32_t
+Gf2MatrixTimes(
+    const uint32_t *matrix,
+    uint32_t       vector
+	       )
+{
+    uint32_t sum = 0;
+
+    while( vector != 0 )
+    {
+        if( vector & 1 )
+	{
+	    sum ^= *matrix;
+	}
+	vector >>= 1;
+	matrix++;
+    }
+    return( sum );
+}
+
+
+
+/**
+ * Square a 32x32 matrix over GF(2).
+ * @param square [out] The squared matrix.
+ * @param matrix [in] Matrix to square.
+ * @return Nothing.
+ */
+static void
+Gf2MatrixSquare(
+    uint32_t       *square,
+    const uint32_t *matrix
+	        )
+{
+    int n;
+
+    for( n = 0; n < 32; n++ )
     {
-        MD5ProcessContinuous( outerXor, 64, &state );
-	MD5ProcessContinuous( md5hashPass1, 16, &state );
-	MD5FlushState( &state, md5hashPass2 );
+        square[ n ] = Gf2MatrixTimes( matrix, matrix[ n ] );
     }
-    if( function == HASH_SHA1 )
+}
+
+
+
+/**
+ * Build the tables that shift a CRC32C checksum over a number of zero
+ * bytes, which is how the checksums of consecutive streams are combined.
+ * @param shift [out] Tables, one per byte of the checksum.
+ * @param length [in] Number of zero bytes, which must be a power of two.
+ * @return Nothing.
+ */
+static void
+Crc32cBuildShiftTable(
+    uint32_t shift[ 4 ][ 256 ],
+    size_t   length
+		      )
+{
+    uint32_t even[ 32 ];
+    uint32_t odd[ 32 ];
+    uint32_t row;
+    int      n;
+
+    /* Operator for one zero bit. */
+    odd[ 0 ] = CRC32C_POLYNOMIAL;
+    row = 1;
+    for( n = 1; n < 32; n++ )
+    {
+        odd[ n ] = row;
+	row <<= 1;
+    }
+    /* Square it into the operators for two and four zero bits, and then
+       for one, two, four, ... zero bytes until the length is reached. */
+    Gf2MatrixSquare( even, odd );
+    Gf2MatrixSquare( odd, even );
+    for( ; ; )
+    {
+        Gf2MatrixSquare( even, odd );
+	length >>= 1;
+	if( length == 0 )
+	{
+	    break;
+	}
+	Gf2MatrixSquare( odd, even );
+	length >>= 1;
+	if( length == 0 )
+	{
+	    memcpy( even, odd, sizeof( even ) );
+	    break;
+	}
+    }
+
+    for( n = 0; n < 256; n++ )
+    {
+        shift[ 0 ][ n ] = Gf2MatrixTimes( even, n );
+	shift[ 1 ][ n ] = Gf2MatrixTimes( even, n << 8 );
+	shift[ 2 ][ n ] = Gf2MatrixTimes( even, n << 16 );
+	shift[ 3 ][ n ] = Gf2MatrixTimes( even, (uint32_t) n << 24 );
+    }
+}
+
+
+
+/**
+ * Build the CRC32C tables. Called once.
+ * @return Nothing.
+ */
+static void
+Crc32cBuildTables(
+    void
+		  )
+{
+    uint32_t crc;
+    int      n;
+    int      k;
+
+    for( n = 0; n < 256; n++ )
+    {
+        crc = n;
+	for( k = 0; k < 8; k++ )
+	{
+	    crc = ( crc & 1 ) ? ( crc >> 1 ) ^ CRC32C_POLYNOMIAL : crc >> 1;
+	}
+	crc32cTable[ 0 ][ n ] = crc;
+    }
+    for( n = 0; n < 256; n++ )
     {
-        SHA1Input( &state, outerXor, 64 );
-	SHA1Input( &state, sha1hashPass1, 20 );
-	SHA1Result( &state );
-	Sha1StateToBinDigest( &state, sha1hashPass2 );
+        crc = crc32cTable[ 0 ][ n ];
+	for( k = 1; k < 8; k++ )
+	{
+	    crc = crc32cTable[ 0 ][ crc & 0xff ] ^ ( crc >> 8 );
+	    crc32cTable[ k ][ n ] = crc;
+	}
     }
+    Crc32cBuildShiftTable( crc32cLongShift, CRC32C_LONG );
+    Crc32cBuildShiftTable( crc32cShortShift, CRC32C_SHORT );
+}
+
+
+
+/**
+ * Shift a CRC32C checksum over the number of zero bytes that a shift table
+ * was built for.
+ * @param shift [in] Shift table.
+ * @param crc [in] Checksum.
+ * @return The shifted checksum.
+ */
+static inline uint32_t
+Crc32cShift(
+    const uint32_t shift[ 4 ][ 256 ],
+    uint32_t       crc
+	    )
+{
+    return( shift[ 0 ][ crc & 0xff ] ^ shift[ 1 ][ ( crc >> 8 ) & 0xff ]
+	    ^ shift[ 2 ][ ( crc >> 16 ) & 0xff ] ^ shift[ 3 ][ crc >> 24 ] );
+}
 
-    /* Return an ASCII output. */
-    if( function == HASH_MD5 )
+
+
+/**
+ * Update a CRC32C checksum eight bytes at a time with lookup tables.
+ * @param crc [in] Inverted checksum so far.
+ * @param next [in] Data.
+ * @param length [in] Number of bytes of data.
+ * @return The inverted, updated checksum.
+ */
+static uint32_t
+Crc32cPortable(
+    uint32_t            crc,
+    const unsigned char *next,
+    size_t              length
+	       )
+{
+    while( ( length != 0 ) && ( ( (uintptr_t) next & 7 ) != 0 ) )
+    {
+        crc = crc32cTable[ 0 ][ ( crc ^ *next++ ) & 0xff ] ^ ( crc >> 8 );
+	length--;
+    }
+    while( length >= 8 )
     {
-        signature = malloc( 33 );
-	binSignature = &md5hashPass2[ 0 ];
+        crc ^= (uint32_t) next[ 0 ] | ( (uint32_t) next[ 1 ] << 8 )
+	       | ( (uint32_t) next[ 2 ] << 16 ) | ( (uint32_t) next[ 3 ] << 24 );
+	crc = crc32cTable[ 7 ][ crc & 0xff ]
+	      ^ crc32cTable[ 6 ][ ( crc >> 8 ) & 0xff ]
+	      ^ crc32cTable[ 5 ][ ( crc >> 16 ) & 0xff ]
+	      ^ crc32cTable[ 4 ][ crc >> 24 ]
+	      ^ crc32cTable[ 3 ][ next[ 4 ] ]
+	      ^ crc32cTable[ 2 ][ next[ 5 ] ]
+	      ^ crc32cTable[ 1 ][ next[ 6 ] ]
+	      ^ crc32cTable[ 0 ][ next[ 7 ] ];
+	next   += 8;
+	length -= 8;
     }
-    if( function == HASH_SHA1 )
+    while( length != 0 )
     {
-        signature = malloc( 41 );
-	binSignature = &sha1hashPass2[ 0 ];
+        crc = crc32cTable[ 0 ][ ( crc ^ *next++ ) & 0xff ] ^ ( crc >> 8 );
+	length--;
     }
+    return( crc );
+}
 
-    /* Encode the digest, which is stored in binary format in resblock. */
-    EncodeDigest( binSignature, signature, function, encoding );
-    return( signature );
+
+
+#if defined( DIGEST_X86_KERNELS ) && defined( __x86_64__ )
+/**
+ * Update a CRC32C checksum of three interleaved streams of data.
+ * @param crc [in/out] Inverted checksum so far.
+ * @param next [in/out] Data, which is advanced past the streams.
+ * @param length [in/out] Number of bytes of data, which is reduced.
+ * @param stream [in] Length of each stream.
+ * @param shift [in] Shift table for the stream length.
+ * @return Nothing.
+ */
+__attribute__((target("sse4.2")))
+static inline void
+Crc32cSse42Streams(
+    uint64_t            *crc,
+    const unsigned char **next,
+    size_t              *length,
+    size_t              stream,
+    const uint32_t      shift[ 4 ][ 256 ]
+		   )
+{
+    uint64_t            crc0 = *crc;
+    uint64_t            crc1;
+    uint64_t            crc2;
+    uint64_t            words[ 3 ];
+    const unsigned char *end;
+
+    while( *length >= stream * 3 )
+    {
+        crc1 = 0;
+	crc2 = 0;
+	end = *next + stream;
+	do
+	{
+	    memcpy( &words[ 0 ], *next, 8 );
+	    memcpy( &words[ 1 ], *next + stream, 8 );
+	    memcpy( &words[ 2 ], *next + stream * 2, 8 );
+	    crc0 = _mm_crc32_u64( crc0, words[ 0 ] );
+	    crc1 = _mm_crc32_u64( crc1, words[ 1 ] );
+	    crc2 = _mm_crc32_u64( crc2, words[ 2 ] );
+	    *next += 8;
+	} while( *next < end );
+	crc0 = Crc32cShift( shift, crc0 ) ^ crc1;
+	crc0 = Crc32cShift( shift, crc0 ) ^ crc2;
+	*next   += stream * 2;
+	*length -= stream * 3;
+    }
+    *crc = crc0;
+}
+
+
+
+/**
+ * Update a CRC32C checksum with the SSE4.2 crc32 instruction.
+ * @param crc [in] Inverted checksum so far.
+ * @param next [in] Data.
+ * @param length [in] Number of bytes of data.
+ * @return The inverted, updated checksum.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+Crc32cSse42(
+    uint32_t            crc,
+    const unsigned char *next,
+    size_t              length
+	    )
+{
+    uint64_t crc0 = crc;
+    uint64_t word;
+
+    while( ( length != 0 ) && ( ( (uintptr_t) next & 7 ) != 0 ) )
+    {
+        crc0 = _mm_crc32_u8( (uint32_t) crc0, *next++ );
+	length--;
+    }
+    Crc32cSse42Streams( &crc0, &next, &length, CRC32C_LONG,
+			crc32cLongShift );
+    Crc32cSse42Streams( &crc0, &next, &length, CRC32C_SHORT,
+			crc32cShortShift );
+    while( length >= 8 )
+    {
+        memcpy( &word, next, 8 );
+	crc0 = _mm_crc32_u64( crc0, word );
+	next   += 8;
+	length -= 8;
+    }
+    while( length != 0 )
+    {
+        crc0 = _mm_crc32_u8( (uint32_t) crc0, *next++ );
+	length--;
+    }
+    return( (uint32_t) crc0 );
+}
+#endif /* DIGEST_X86_KERNELS && __x86_64__ */
+
+
+
+/**
+ * Update a CRC32C checksum, the checksum that S3 stores as
+ * x-amz-checksum-crc32c. The checksum of a message may be computed in any
+ * number of pieces.
+ * @param crc [in] Checksum of the preceding data, or \a 0 initially.
+ * @param buffer [in] Data.
+ * @param length [in] Number of bytes of data.
+ * @return The updated checksum.
+ */
+uint32_t
+Crc32c(
+    uint32_t   crc,
+    const void *buffer,
+    size_t     length
+       )
+{
+    pthread_once( &crc32cTablesOnce, Crc32cBuildTables );
+
+    crc = ~crc;
+#if defined( DIGEST_X86_KERNELS ) && defined( __x86_64__ )
+    if( GetDigestAcceleration( ) & DIGEST_ACCEL_CRC )
+    {
+        return( ~Crc32cSse42( crc, buffer, length ) );
+    }
+#endif
+    return( ~Crc32cPortable( crc, buffer, length ) );
+}
+
+
+
+/**
+ * Combine the CRC32C checksums of two consecutive pieces of a message into
+ * the checksum of the whole message.
+ * @param crc1 [in] Checksum of the first piece.
+ * @param crc2 [in] Checksum of the second piece.
+ * @param length2 [in] Number of bytes in the second piece.
+ * @return The checksum of the two pieces.
+ */
+uint32_t
+Crc32cCombine(
+    uint32_t crc1,
+    uint32_t crc2,
+    uint64_t length2
+	      )
+{
+    uint32_t even[ 32 ];
+    uint32_t odd[ 32 ];
+    uint32_t row;
+    int      n;
+
+    /* Shift the first checksum over the second piece, as though the second
+       piece were zeros, by applying the operators for one, two, four, ...
+       zero bytes that correspond to the bits in its length. */
+    odd[ 0 ] = CRC32C_POLYNOMIAL;
+    row = 1;
+    for( n = 1; n < 32; n++ )
+    {
+        odd[ n ] = row;
+	row <<= 1;
+    }
+    Gf2MatrixSquare( even, odd );
+    Gf2MatrixSquare( odd, even );
+    while( length2 != 0 )
+    {
+        Gf2MatrixSquare( even, odd );
+	if( length2 & 1 )
+	{
+	    crc1 = Gf2MatrixTimes( even, crc1 );
+	}
+	length2 >>= 1;
+	if( length2 == 0 )
+	{
+	    break;
+	}
+	Gf2MatrixSquare( odd, even );
+	if( length2 & 1 )
+	{
+	    crc1 = Gf2MatrixTimes( odd, crc1 );
+	}
+	length2 >>= 1;
+    }
+    return( crc1 ^ crc2 );
+}
+
+
+
+/**
+ * Encode a CRC32C checksum the way S3 transfers it: the big-endian bytes of
+ * the checksum in BASE64.
+ * @param crc [in] Checksum.
+ * @param encoded [out] Destination for the encoded checksum, which must
+ *        hold at least 9 characters.
+ * @return Nothing.
+ */
+void
+EncodeCrc32c(
+    uint32_t crc,
+    char     *encoded
+	     )
+{
+    unsigned char bytes[ 4 ];
+
+    bytes[ 0 ] = (unsigned char) ( crc >> 24 );
+    bytes[ 1 ] = (unsigned char) ( crc >> 16 );
+    bytes[ 2 ] = (unsigned char) ( crc >> 8 );
+    bytes[ 3 ] = (unsigned char) crc;
+    EncodeBase64Buffer( bytes, 4, encoded );
 }
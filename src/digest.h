@@ -25,28 +25,59 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <stdint.h>
 
 
-enum HashFunctions { HASH_MD5, HASH_SHA1 };
+enum HashFunctions { HASH_MD5, HASH_SHA1, HASH_SHA256 };
 enum HashEncodings { HASHENC_BASE64, HASHENC_BIN, HASHENC_HEX };
 
 
-/* Compute the MD5 or SHA1 message digest for bytes read from stream. The
-   resulting message digest number will be written into the 16 bytes
-   (for MD5) or 20 bytes (for SHA1) of ascDigest. */
+/* Compute the MD5, SHA1, or SHA256 message digest for bytes read from
+   stream. The resulting message digest number will be written into the 16
+   bytes (for MD5), 20 bytes (for SHA1), or 32 bytes (for SHA256) of
+   ascDigest. */
 int DigestStream( FILE *stream, char *ascDigest, enum HashFunctions function,
 		  enum HashEncodings encoding );
 
-/* Compute MD5 or SHA1 message digest for len bytes stored in buffer. The
-   resulting message digest number will be written into the 16 bytes
-   (for MD5) or 20 bytes (for SHA1) of ascDigest. */
+/* Compute MD5, SHA1, or SHA256 message digest for len bytes stored in
+   buffer. The resulting message digest number will be written into the 16
+   bytes (for MD5), 20 bytes (for SHA1), or 32 bytes (for SHA256) of
+   ascDigest. */
 void DigestBuffer( const unsigned char *buffer, size_t len, char *ascDigest,
 		   enum HashFunctions function, enum HashEncodings encoding );
 
+/* Compute the message digests of several buffers, hashing the buffers in
+   parallel where the processor supports it. */
+void DigestBuffers( const unsigned char *const buffers[ ],
+		    const size_t lengths[ ], int count, char *digests[ ],
+		    enum HashFunctions function, enum HashEncodings encoding );
+
 /* Compute the HMAC-hash signature for an in-memory message. */
 const char* HMAC( const unsigned char *message, int length,
 		  const char *key, enum HashFunctions function,
 		  enum HashEncodings encoding );
 
+/* Prepare a key for computing HMAC-hash signatures of several messages
+   without deriving the padded keys again for every message. */
+struct HmacKey;
+struct HmacKey *CreateHmacKey( const char *key, enum HashFunctions function );
+struct HmacKey *CreateBinaryHmacKey( const unsigned char *key,
+				     size_t keyLength,
+				     enum HashFunctions function );
+void DestroyHmacKey( struct HmacKey *hmacKey );
+const char* HMACWithKey( const struct HmacKey *hmacKey,
+			 const unsigned char *message, int length,
+			 enum HashEncodings encoding );
+void HMACWithKeyToBuffer( const struct HmacKey *hmacKey,
+			  const unsigned char *message, size_t length,
+			  char *signature, enum HashEncodings encoding );
+
+/* Compute the CRC32C checksum of a message in one or more pieces, combine
+   the checksums of consecutive pieces, and encode a checksum for the
+   x-amz-checksum-crc32c header. */
+uint32_t Crc32c( uint32_t crc, const void *buffer, size_t length );
+uint32_t Crc32cCombine( uint32_t crc1, uint32_t crc2, uint64_t length2 );
+void EncodeCrc32c( uint32_t crc, char *encoded );
+
 
 #endif /* __DIGEST_H */
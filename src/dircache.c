@@ -154,26 +154,64 @@ InsertInDirectoryCache(
 
 
 /**
- * Find a directory in the cache, and return its contents. This operation
- * moves the directory to the front of the cache, marking it as most recently
- * used.
+ * Find a directory in the cache, and return a copy of its contents. The
+ * cached contents may be freed by another thread as soon as the cache is
+ * unlocked, so the caller receives its own copy, which it must free. This
+ * operation moves the directory to the front of the cache, marking it as
+ * most recently used.
  * @param dirname [in] Name of the directory to locate in the cache.
  * @param size [out] Number of elements in the directory contents.
- * @return Contents of the directory, or \a NULL if not found.
+ * @return Copy of the contents of the directory, or \a NULL if not found.
  */
-const char**
+char**
 LookupInDirectoryCache(
     const char *dirname,
     int        *size
 		       )
 {
     const char **contents;
+    char       **copy = NULL;
 
     pthread_mutex_lock( &dirCache_mutex );
     contents = LookupInDirectoryCacheWithoutMutex( dirname, size );
+    if( contents != NULL )
+    {
+        copy = CopyDirectoryContents( *size, contents );
+    }
     pthread_mutex_unlock( &dirCache_mutex );
 
-    return( contents );
+    return( copy );
+}
+
+
+
+/**
+ * Copy the filenames of a directory, such that the copy may be used after
+ * the original has been handed to the directory cache.
+ * @param size [in] Number of filenames in the directory.
+ * @param contents [in] String array with filenames.
+ * @return Copy of the string array, which the caller must free.
+ */
+char**
+CopyDirectoryContents(
+    int        size,
+    const char **contents
+		      )
+{
+    char **copy;
+    int  i;
+
+    copy = malloc( ( size + 1 ) * sizeof( char* ) );
+    for( i = 0; i < size; i++ )
+    {
+        copy[ i ] = NULL;
+	if( contents[ i ] != NULL )
+	{
+	    copy[ i ] = strdup( contents[ i ] );
+	}
+    }
+
+    return( copy );
 }
 
 
@@ -297,3 +335,35 @@ DeleteDirectoryEntry(
     }
 }
 
+
+
+/**
+ * Call a function for every directory in the cache. The cache is locked
+ * while the function is called, so the function must not access the cache
+ * itself.
+ * @param callback [in] Function that is called with the name, the number of
+ *        filenames, and the filenames of each directory.
+ * @param context [in] Passed on to \a callback.
+ * @return Nothing.
+ */
+void
+ForEachDirectoryCacheEntry(
+    void       (*callback)( const char *dirname, int size,
+			    const char **contents, void *context ),
+    void       *context
+			   )
+{
+    int i;
+
+    pthread_mutex_lock( &dirCache_mutex );
+    for( i = 0; i < DIR_CACHE_SIZE; i++ )
+    {
+        if( ( directoryCache[ i ].dirname != NULL )
+	    && ( directoryCache[ i ].contents != NULL ) )
+	{
+	    callback( directoryCache[ i ].dirname, directoryCache[ i ].size,
+		      directoryCache[ i ].contents, context );
+	}
+    }
+    pthread_mutex_unlock( &dirCache_mutex );
+}
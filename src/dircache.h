@@ -34,9 +34,15 @@
 void InitializeDirectoryCache( void );
 void InsertInDirectoryCache( const char *dirname, int size,
 			     const char **contents );
-const char **LookupInDirectoryCache( const char *dirname, int *size );
+char **LookupInDirectoryCache( const char *dirname, int *size );
+char **CopyDirectoryContents( int size, const char **contents );
 void InvalidateDirectoryCacheElement( const char *dirname );
 void ShutdownDirectoryCache( void );
+void ForEachDirectoryCacheEntry( void (*callback)( const char *dirname,
+						   int size,
+						   const char **contents,
+						   void *context ),
+				 void *context );
 
 
 #endif /* __DIR_CACHE_H */
@@ -29,6 +29,8 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <glib-2.0/glib.h>
 #include <errno.h>
@@ -36,6 +38,9 @@
 #include "filecache.h"
 #include "s3comms.h"
 #include "socket.h"
+#include "digest.h"
+#include "base64.h"
+#include "trace.h"
 
 
 STATIC GQueue downloadQueue = G_QUEUE_INIT;
@@ -75,6 +80,30 @@ struct DownloadSubscription
 };
 
 
+/**
+ * A request to the permissions grant module that is waiting for its reply.
+ * The replies for all the transfer threads arrive on the same socket, so
+ * whichever thread is currently reading the socket hands each reply to the
+ * request with the matching request ID.
+ */
+struct GrantReply
+{
+	unsigned long     requestId;
+	bool              received;
+	char              *reply;
+	int               replyMaxLength;
+	int               replyLength;
+	struct GrantReply *next;
+};
+
+/* Requests waiting for replies from the permissions grant module. */
+static pthread_mutex_t   grant_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    grant_cond  = PTHREAD_COND_INITIALIZER;
+static struct GrantReply *pendingGrantReplies = NULL;
+static unsigned long     nextGrantRequestId = 0;
+static bool              grantReceiverActive = false;
+
+
 /**
  * Thread state information for a file download request.
  */
@@ -97,6 +126,34 @@ struct UploadStarter
 };
 
 
+/* Size of the chunks in which a part is uploaded when its checksum is sent
+   in a trailer after the data. */
+#define AWS_CHUNK_SIZE ( 64 * 1024 )
+
+/**
+ * A transfer whose CRC32C checksum is computed while curl passes the data
+ * between the network and the local file.  Uploads are sent with aws-chunked
+ * encoding, so that the checksum can follow the data in a trailer.
+ */
+struct ChecksummedTransfer
+{
+	FILE          *file;
+	uint32_t      crc;
+	/* Upload: bytes of the file that remain to be sent, bytes that remain
+	   in the current chunk, and chunk framing that has not been sent. */
+	long long int remaining;
+	int           chunkRemaining;
+	char          framing[ 64 ];
+	int           framingLength;
+	int           framingSent;
+	bool          trailerSent;
+	/* Checksum that S3 stored with the file, or that was sent in the
+	   trailer, and the ETag of an uploaded part. */
+	char          checksum[ 16 ];
+	char          etag[ 72 ];
+};
+
+
 
 STATIC int FindAvailableTransferer( void );
 STATIC void *BeginDownload( void *threadCtx );
@@ -293,12 +350,20 @@ ProcessTransferQueues(
 	   it only for reading the region, the bucket, the keyId, and the
 	   secretKey entries.  All we need to do is specify these values in
 	   the handle for each upload or download. */
-	curl_global_init( CURL_GLOBAL_ALL );
+	s3_InitializeCurl( );
 	for( i = 0; i < MAX_SIMULTANEOUS_TRANSFERS; i++ )
 	{
-		transferers[ i ].curl    = curl_easy_init( );
+		/* The transferers share the DNS cache and the TLS session cache,
+		   so that only the first transfer to a host performs a full
+		   handshake. */
+		transferers[ i ].curl    = s3_CreateCurlHandle( );
 		transferers[ i ].s3Comm  = malloc( sizeof( S3COMM ) );
 		transferers[ i ].isReady = true;
+		/* The signing key is prepared when the transferer first signs a
+		   request, and again whenever it changes to another user. */
+		transferers[ i ].s3Comm->signingKey    = NULL;
+		transferers[ i ].s3Comm->signingSecret = NULL;
+		transferers[ i ].s3Comm->signatureV4   = true;
 	}
 
 	/* Main loop. */
@@ -370,14 +435,16 @@ ProcessTransferQueues(
 	{
 		curl_easy_cleanup( transferers[ i ].curl );
 	}
-	curl_global_cleanup( );
+	s3_ShutdownCurl( );
 }
 #pragma GCC diagnostic pop
 
 
 
 /**
- * Find any transferer that is not currently busy.
+ * Find any transferer that is not currently busy. No transferer is returned
+ * while the number of busy transferers has reached the concurrency limit that
+ * the S3 congestion controller currently allows.
  * @return Handle of an available transferer, or \a -1 if all transferers are
  *         currently busy.
  * Test: unit test (test-downloadqueue.c).
@@ -388,15 +455,27 @@ FindAvailableTransferer(
 	                    )
 {
 	int i;
+	int busy;
+	int available;
 
 	/* Find an available downloader. */
+	busy      = 0;
+	available = -1;
 	for( i = 0; i < MAX_SIMULTANEOUS_TRANSFERS; i++ )
 	{
-		if( transferers[ i ].isReady )
+		if( ! transferers[ i ].isReady )
+		{
+			busy++;
+		}
+		else if( available == -1 )
 		{
-			return( i );
+			available = i;
 		}
 	}
+	if( ( available != -1 ) && ( busy < s3_ConcurrencyLimit( ) ) )
+	{
+		return( available );
+	}
 	/* Return -1 if no transferer was available. */
 	return( -1 );
 }
@@ -454,6 +533,284 @@ HostnameToRegion(
 
 
 
+/**
+ * Prepare a transfer for being checksummed, or for being restarted.
+ * @param transfer [out] Transfer state.
+ * @param file [in] Local file, positioned at the start of the data.
+ * @param length [in] Number of bytes to upload, or \a 0 for a download.
+ * @return Nothing.
+ */
+static void
+StartChecksummedTransfer(
+	struct ChecksummedTransfer *transfer,
+	FILE                       *file,
+	long long int              length
+	                     )
+{
+	memset( transfer, 0, sizeof( struct ChecksummedTransfer ) );
+	transfer->file      = file;
+	transfer->remaining = length;
+}
+
+
+
+/**
+ * Compute the number of bytes that an upload occupies with aws-chunked
+ * encoding and a checksum trailer.
+ * @param length [in] Number of bytes of data.
+ * @return Number of bytes in the request body.
+ */
+static long long int
+AwsChunkedLength(
+	long long int length
+	             )
+{
+	char          chunkSize[ 16 ];
+	long long int encodedLength = 0;
+	int           chunk;
+
+	while( length > 0 )
+	{
+		chunk = length < AWS_CHUNK_SIZE ? (int) length : AWS_CHUNK_SIZE;
+		encodedLength += sprintf( chunkSize, "%x\r\n", chunk ) + chunk + 2;
+		length        -= chunk;
+	}
+	/* The final, empty chunk and the trailer with an 8-character checksum. */
+	return( encodedLength + strlen( "0\r\nx-amz-checksum-crc32c:" ) + 8
+			+ strlen( "\r\n\r\n" ) );
+}
+
+
+
+/**
+ * Curl callback that writes downloaded data to the local file and adds it
+ * to the checksum.
+ * @param data [in] Downloaded data.
+ * @param size [in] Size of a data element.
+ * @param nmemb [in] Number of data elements.
+ * @param ctx [in] ChecksummedTransfer structure.
+ * @return Number of bytes written.
+ */
+static size_t
+WriteChecksummedData(
+	char   *data,
+	size_t size,
+	size_t nmemb,
+	void   *ctx
+	                 )
+{
+	struct ChecksummedTransfer *transfer = ctx;
+	size_t                     written;
+
+	written = fwrite( data, 1, size * nmemb, transfer->file );
+	transfer->crc = Crc32c( transfer->crc, data, written );
+	return( written );
+}
+
+
+
+/**
+ * Curl callback that reads the next part of an upload from the local file,
+ * adds it to the checksum, and wraps it in aws-chunked framing.  The
+ * checksum is sent in a trailer after the last chunk.
+ * @param buffer [out] Destination for the request body.
+ * @param size [in] Size of a data element.
+ * @param nmemb [in] Number of data elements that fit in the buffer.
+ * @param ctx [in] ChecksummedTransfer structure.
+ * @return Number of bytes placed in the buffer, \a 0 at the end of the
+ *         body, or \a CURL_READFUNC_ABORT if the file cannot be read.
+ */
+static size_t
+ReadChecksummedData(
+	char   *buffer,
+	size_t size,
+	size_t nmemb,
+	void   *ctx
+	                )
+{
+	struct ChecksummedTransfer *transfer = ctx;
+	size_t                     space = size * nmemb;
+	size_t                     copied = 0;
+	size_t                     length;
+
+	while( copied < space )
+	{
+		/* Send pending framing first. */
+		if( transfer->framingSent < transfer->framingLength )
+		{
+			length = transfer->framingLength - transfer->framingSent;
+			if( space - copied < length )
+			{
+				length = space - copied;
+			}
+			memcpy( &buffer[ copied ],
+					&transfer->framing[ transfer->framingSent ], length );
+			transfer->framingSent += length;
+			copied                += length;
+		}
+		/* Then the data of the current chunk, followed by its CRLF. */
+		else if( 0 < transfer->chunkRemaining )
+		{
+			length = (size_t) transfer->chunkRemaining;
+			if( space - copied < length )
+			{
+				length = space - copied;
+			}
+			length = fread( &buffer[ copied ], 1, length, transfer->file );
+			if( length == 0 )
+			{
+				return( CURL_READFUNC_ABORT );
+			}
+			transfer->crc             = Crc32c( transfer->crc,
+												&buffer[ copied ], length );
+			transfer->chunkRemaining -= length;
+			transfer->remaining      -= length;
+			copied                   += length;
+			if( transfer->chunkRemaining == 0 )
+			{
+				strcpy( transfer->framing, "\r\n" );
+				transfer->framingLength = 2;
+				transfer->framingSent   = 0;
+			}
+		}
+		else if( transfer->trailerSent )
+		{
+			break;
+		}
+		/* Start the next chunk. */
+		else if( 0 < transfer->remaining )
+		{
+			transfer->chunkRemaining = transfer->remaining < AWS_CHUNK_SIZE
+				? (int) transfer->remaining : AWS_CHUNK_SIZE;
+			transfer->framingLength  = sprintf( transfer->framing, "%x\r\n",
+												transfer->chunkRemaining );
+			transfer->framingSent    = 0;
+		}
+		/* Finish with an empty chunk and the checksum trailer. */
+		else
+		{
+			EncodeCrc32c( transfer->crc, transfer->checksum );
+			transfer->framingLength = sprintf( transfer->framing,
+											   "0\r\nx-amz-checksum-crc32c:"
+											   "%s\r\n\r\n",
+											   transfer->checksum );
+			transfer->framingSent   = 0;
+			transfer->trailerSent   = true;
+		}
+	}
+
+	return( copied );
+}
+
+
+
+/**
+ * Copy the value of a response header if it has the specified name.
+ * @param header [in] Response header line.
+ * @param length [in] Length of the header line.
+ * @param name [in] Header name, including the colon.
+ * @param value [out] Destination for the value.
+ * @param valueSize [in] Size of the destination.
+ * @return Nothing.
+ */
+static void
+CopyResponseHeader(
+	const char *header,
+	size_t     length,
+	const char *name,
+	char       *value,
+	size_t     valueSize
+	               )
+{
+	size_t nameLength = strlen( name );
+
+	if( ( length <= nameLength )
+		|| ( strncasecmp( header, name, nameLength ) != 0 ) )
+	{
+		return;
+	}
+	header += nameLength;
+	length -= nameLength;
+	while( ( 0 < length ) && ( *header == ' ' ) )
+	{
+		header++;
+		length--;
+	}
+	while( ( 0 < length ) && ( ( header[ length - 1 ] == '\r' )
+							   || ( header[ length - 1 ] == '\n' )
+							   || ( header[ length - 1 ] == ' ' ) ) )
+	{
+		length--;
+	}
+	if( length < valueSize )
+	{
+		memcpy( value, header, length );
+		value[ length ] = '\0';
+	}
+}
+
+
+
+/**
+ * Curl callback that picks the checksum and the ETag out of the response
+ * headers.
+ * @param header [in] Response header line, which is not zero-terminated.
+ * @param size [in] Size of a data element.
+ * @param nmemb [in] Number of data elements.
+ * @param ctx [in] ChecksummedTransfer structure.
+ * @return Number of bytes processed.
+ */
+static size_t
+ReadChecksumHeaders(
+	char   *header,
+	size_t size,
+	size_t nmemb,
+	void   *ctx
+	                )
+{
+	struct ChecksummedTransfer *transfer = ctx;
+
+	CopyResponseHeader( header, size * nmemb, "x-amz-checksum-crc32c:",
+						transfer->checksum, sizeof( transfer->checksum ) );
+	CopyResponseHeader( header, size * nmemb, "ETag:",
+						transfer->etag, sizeof( transfer->etag ) );
+	return( size * nmemb );
+}
+
+
+
+/**
+ * Verify a download against the checksum that S3 stored with the file.
+ * Files that S3 stores without a checksum, or with a composite checksum of
+ * their multipart upload parts, cannot be verified and are accepted.
+ * @param transfer [in] Completed download.
+ * @return \a true if the download matches the checksum, or \a false if it
+ *         was corrupted.
+ */
+static bool
+VerifyChecksummedDownload(
+	const struct ChecksummedTransfer *transfer
+	                      )
+{
+	char checksum[ 16 ];
+
+	if( ( transfer->checksum[ 0 ] == '\0' )
+		|| ( strchr( transfer->checksum, '-' ) != NULL ) )
+	{
+		return( true );
+	}
+	EncodeCrc32c( transfer->crc, checksum );
+	if( strcmp( checksum, transfer->checksum ) != 0 )
+	{
+		fprintf( stderr, "Download checksum %s does not match %s\n",
+				 checksum, transfer->checksum );
+		return( false );
+	}
+	return( true );
+}
+
+
+
 /**
  * Start the next download in the download queue. This function must be
  * started as a thread so that it does not block other downloads.
@@ -485,6 +842,9 @@ BeginDownload(
 	const char        *hostname;
 	GMatchInfo        *matchInfo;
 	int               status;
+	long              httpStatus;
+	bool              retry;
+	int               attempt;
 	const char        *filepath;
 
 	char              *parentname;
@@ -498,6 +858,14 @@ BeginDownload(
 	struct timeval    now;
 	struct timespec   oneMinute;
 
+	enum ChecksumModes         checksum;
+	struct ChecksummedTransfer transfer;
+
+	/* The thread exits with pthread_exit( ), which skips cleanup handlers,
+	   so the span is ended explicitly. */
+	struct TraceScope          trace = { "download", "BeginDownload",
+										 TraceClock( ) };
+
 	downloadStarter = (struct DownloadStarter*) ctx;
 	downloader      = downloadStarter->downloader;
 	subscription    = downloadStarter->subscription;
@@ -507,11 +875,11 @@ BeginDownload(
 	curl   = transferers[ downloader ].curl;
 	s3Comm = transferers[ downloader ].s3Comm;
 
-	/* Fetch local filename, remote filename, bucket, keyId, and
-	   secretKey. */
+	/* Fetch local filename, remote filename, bucket, keyId, secretKey, and
+	   checksum mode. */
 	pthread_mutex_lock( &mainLoop_mutex );
 	Query_GetDownload( subscription->fileId, &bucket, &remotePath,
-					   &downloadPath, &keyId, &secretKey );
+					   &downloadPath, &keyId, &secretKey, &checksum );
 	/* Set the path for the local file and open it for writing. */
 	downloadFile = malloc( strlen( CACHE_INPROGRESS )
 						   + strlen( downloadPath ) + sizeof( char ) );
@@ -539,32 +907,77 @@ BeginDownload(
 	g_regex_ref( regexes.hostname );
 	g_regex_match( regexes.removeHost, remotePath, 0, &matchInfo );
 	filepath = g_match_info_fetch( matchInfo, 1 );
-	headers = BuildS3Request( s3Comm, "GET", hostname, NULL, filepath );
-	free( bucket );
-	free( keyId );
-	free( secretKey );
-	free( (char*) hostname );
-	free( (char*) filepath );
 	g_match_info_free( matchInfo );
 	g_regex_unref( regexes.hostname );
+	pthread_mutex_unlock( &mainLoop_mutex );
 
-	/* Download the file and wait until it has been received. */
-	curl_easy_reset( curl );
-	curl_easy_setopt( curl, CURLOPT_WRITEDATA, downFile );
-	curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
-
-	curl_easy_setopt( curl, CURLOPT_URL, remotePath );
+	/* Download the file and wait until it has been received. If S3 fails
+	   transiently, or if the file does not match its checksum, discard what
+	   was received and try again. */
+	attempt = 0;
+	do
+	{
+		headers = NULL;
+		if( checksum == CHECKSUM_CRC32C )
+		{
+			/* Ask S3 to return the checksum it stored with the file. */
+			headers = curl_slist_append( NULL,
+										 strdup( "x-amz-checksum-mode:ENABLED" ) );
+		}
+		headers = BuildS3Request( s3Comm, "GET", hostname, headers, filepath );
+		curl_easy_reset( curl );
+		if( checksum == CHECKSUM_CRC32C )
+		{
+			StartChecksummedTransfer( &transfer, downFile, 0 );
+			curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION,
+							  WriteChecksummedData );
+			curl_easy_setopt( curl, CURLOPT_WRITEDATA, &transfer );
+			curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION,
+							  ReadChecksumHeaders );
+			curl_easy_setopt( curl, CURLOPT_HEADERDATA, &transfer );
+		}
+		else
+		{
+			curl_easy_setopt( curl, CURLOPT_WRITEDATA, downFile );
+		}
+		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
+		curl_easy_setopt( curl, CURLOPT_URL, remotePath );
 
-	pthread_mutex_unlock( &mainLoop_mutex );
+		httpStatus = 0;
+		s3_AcquireRequestSlot( );
 #ifdef AUTOTEST_SKIP_COMMUNICATIONS
-	status = 0;
+		status = 0;
 #else
-	printf( "Executing HTTP request\n" );
-	status = curl_easy_perform( curl );
+		printf( "Executing HTTP request\n" );
+		status = curl_easy_perform( curl );
+		curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
 #endif
-	DeleteCurlSlistAndContents( headers );
+		retry = s3_ReleaseRequestSlot( status, httpStatus );
+		DeleteCurlSlistAndContents( headers );
+		if( ( status == 0 ) && ( ! retry ) && ( checksum == CHECKSUM_CRC32C )
+			&& ( ! VerifyChecksummedDownload( &transfer ) ) )
+		{
+			status = -EIO;
+			retry  = true;
+		}
+		if( retry )
+		{
+			/* Give up if the partial download cannot be discarded. */
+			rewind( downFile );
+			if( ftruncate( fileno( downFile ), 0 ) != 0 )
+			{
+				retry = false;
+			}
+		}
+	} while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+	free( bucket );
+	free( keyId );
+	free( secretKey );
+	free( (char*) hostname );
+	free( (char*) filepath );
 	free( remotePath );
 	fclose( downFile );
+	EndTraceScope( &trace );
 
 	if( status == 0 )
 	{
@@ -590,6 +1003,11 @@ BeginDownload(
 		/* Remove the file from the download queue and the downloads table. */
 		g_queue_remove( &downloadQueue, subscription );
 		status = Query_DeleteTransfer( subscription->fileId );
+		if( ( checksum == CHECKSUM_CRC32C )
+			&& ( transfer.checksum[ 0 ] != '\0' ) )
+		{
+			Query_SetFileChecksum( subscription->fileId, transfer.checksum );
+		}
 		Query_MarkFileAsCached( subscription->fileId );
 		/* Mark the downloader as ready for another download. */
 		transferers[ downloader ].isReady = true;
@@ -684,41 +1102,42 @@ MoveToSharedCache(
 	gid_t      gid
 	              )
 {
-	char *chownRequest;
-	char *publishRequest;
+	char parentChown[ GRANT_MESSAGE_SIZE ];
+	char fileChown[ GRANT_MESSAGE_SIZE ];
+	char publish[ GRANT_MESSAGE_SIZE ];
+	char *batch;
 	char reply[ 40 ];
 
 	/* Give the directory its original owners. It was created with proper
 	   permissions to begin with. */
-	chownRequest = malloc( strlen( parentname ) + strlen( "chown xxxxx xxxxx " )
-						   + sizeof( char ) );
-	sprintf( chownRequest, "CHOWN %d:%d:", (int) parentUid, (int) parentGid );
-	strcat( chownRequest, parentname );
-	SendGrantMessage( socketHandle, chownRequest, reply, sizeof( reply ) );
+	snprintf( parentChown, sizeof( parentChown ), "CHOWN %d:%d:%s",
+			  (int) parentUid, (int) parentGid, parentname );
 #ifdef AUTOTEST
-	printf( "1: %s\n", chownRequest );
+	printf( "1: %s\n", parentChown );
 #endif
-	free( chownRequest );
 
 	/* Similarly, give the downloaded file appropriate ownership. */
-	chownRequest = malloc( strlen( parentname ) + sizeof( char )
-						   + strlen( filename ) + strlen( "chown xxxxx xxxxx " )
-						   + sizeof( char ) );
-	sprintf( chownRequest, "CHOWN %d:%d:", (int) uid, (int) gid );
-	strcat( chownRequest, parentname );
-	strcat( chownRequest, "/" );
-	strcat( chownRequest, filename );
-	SendGrantMessage( socketHandle, chownRequest, reply, sizeof( reply ) );
+	snprintf( fileChown, sizeof( fileChown ), "CHOWN %d:%d:%s/%s",
+			  (int) uid, (int) gid, parentname, filename );
 #ifdef AUTOTEST
-	printf( "2: %s\n", chownRequest );
+	printf( "2: %s\n", fileChown );
 #endif
-	free( chownRequest );
 
 	/* Move the file to the shared directory. */
-	publishRequest = malloc( strlen( parentname ) + strlen( filename ) +
-							 strlen( "publish :" ) + sizeof( char ) );
-	sprintf( publishRequest, "PUBLISH %s:%s", parentname, filename );
-	SendGrantMessage( socketHandle, publishRequest, reply, sizeof( reply ) );
+	snprintf( publish, sizeof( publish ), "PUBLISH %s:%s",
+			  parentname, filename );
+#ifdef AUTOTEST
+	printf( "3: %s\n", publish );
+#endif
+
+	/* Send all three operations in one message, so that publishing a file
+	   costs a single round trip. The grant module performs them in order. */
+	batch = malloc( strlen( parentChown ) + strlen( fileChown )
+					+ strlen( publish ) + 3 * sizeof( char ) );
+	assert( batch != NULL );
+	sprintf( batch, "%s\n%s\n%s", parentChown, fileChown, publish );
+	SendGrantMessage( socketHandle, batch, reply, sizeof( reply ) );
+	free( batch );
 
 	return( true );
 }
@@ -730,12 +1149,15 @@ MoveToSharedCache(
 
 /**
  * Send a message to the privileged process. The function does not return
- * until a reply is received from the privileged process.
+ * until a reply is received from the privileged process. The message may
+ * hold several operations separated by newlines. Any number of threads may
+ * wait for replies at the same time; the message is tagged with a request ID
+ * so that the reply is returned to the thread that sent the message.
  * @param socketHandle [in] Socket for the permissions grant module.
  * @param privopRequest [in] Request message.
  * @param reply [out] Buffer for the reply.
  * @param replyMaxLength [in] Size of the reply buffer.
- * @return Nothing.
+ * @return Length of the reply, or -1 on error.
  * Test: unit test (test-process.c).
  */
 int
@@ -746,27 +1168,106 @@ SendGrantMessage(
 	int        replyMaxLength
 	             )
 {
-	bool status;
-	int  nBytes;
-	int  fileHandle;
+	struct GrantReply request;
+	struct GrantReply *waiting;
+	struct GrantReply **link;
+	char              *message;
+	char              received[ GRANT_MESSAGE_SIZE ];
+	unsigned long     repliedId;
+	int               nBytes;
+	int               fileHandle;
+	bool              status;
+	TRACE_SCOPE( "grant", "SendGrantMessage" );
+
+	/* Register the request before sending it, because the reply may be
+	   picked up by another thread. */
+	pthread_mutex_lock( &grant_mutex );
+	request.requestId      = ++nextGrantRequestId;
+	request.received       = false;
+	request.reply          = reply;
+	request.replyMaxLength = replyMaxLength;
+	request.replyLength    = -1;
+	request.next           = pendingGrantReplies;
+	pendingGrantReplies    = &request;
+	pthread_mutex_unlock( &grant_mutex );
 
 	/* Send the message to the privileged process. */
-	status = SocketSendDatagramToServer( socketHandle, privopRequest,
-										 strlen( privopRequest ) + 1 );
-	if( status == true )
+	message = malloc( strlen( privopRequest ) + 25 * sizeof( char ) );
+	assert( message != NULL );
+	sprintf( message, "REQ %lu\n%s", request.requestId, privopRequest );
+	status = SocketSendDatagramToServer( socketHandle, message,
+										 strlen( message ) + 1 );
+	free( message );
+
+	pthread_mutex_lock( &grant_mutex );
+	if( status == false )
 	{
-		/* Receive the reply; the reply message is not used but serves only
-		   to block the thread until the server has completed its task. */
-		nBytes = SocketReceiveDatagramFromServer( socketHandle, reply,
-												  replyMaxLength,
+		request.received = true;
+	}
+	/* One thread at a time reads replies from the socket and hands them to
+	   the waiting requests; the others wait until their replies have been
+	   handed to them. */
+	while( ! request.received )
+	{
+		if( grantReceiverActive )
+		{
+			pthread_cond_wait( &grant_cond, &grant_mutex );
+			continue;
+		}
+		grantReceiverActive = true;
+		pthread_mutex_unlock( &grant_mutex );
+		memset( received, 0, sizeof( received ) );
+		nBytes = SocketReceiveDatagramFromServer( socketHandle, received,
+												  sizeof( received ) - 1,
 												  &fileHandle );
+		pthread_mutex_lock( &grant_mutex );
+		grantReceiverActive = false;
+
+		/* A reply without a known request ID is taken to be the reply to
+		   this thread's request. */
+		waiting = &request;
+		if( ( 0 < nBytes ) && ( sscanf( received, "ACK %lu", &repliedId ) == 1 ) )
+		{
+			for( waiting = pendingGrantReplies; waiting != NULL;
+				 waiting = waiting->next )
+			{
+				if( waiting->requestId == repliedId )
+				{
+					break;
+				}
+			}
+			if( waiting == NULL )
+			{
+				waiting = &request;
+			}
+		}
+		if( nBytes < 0 )
+		{
+			waiting->replyLength = -1;
+		}
+		else
+		{
+			strncpy( waiting->reply, received, waiting->replyMaxLength );
+			waiting->reply[ waiting->replyMaxLength - 1 ] = '\0';
+			waiting->replyLength = strlen( waiting->reply );
+		}
+		waiting->received = true;
+		pthread_cond_broadcast( &grant_cond );
+	}
+	/* Unregister the request. */
+	for( link = &pendingGrantReplies; *link != &request;
+		 link = &( *link )->next )
+	{
 	}
-	if( ( status == false ) || ( nBytes < 0 ) )
+	*link = request.next;
+	pthread_mutex_unlock( &grant_mutex );
+
+	if( ( status == false ) || ( request.replyLength < 0 ) )
 	{
 		fprintf( stderr, "Error communicating with permissions grant\n" );
 	}
 
-	return( nBytes );
+	return( request.replyLength );
 }
 
 
@@ -865,6 +1366,7 @@ ExtractHostAndFilepath(
  * @param gid [in] gid of the file.
  * @param permissions [in] File permissions.
  * @param filepath [in] Remote filename.
+ * @param checksum [in] Checksum that protects the upload.
  * @return Upload ID for the multipart uploads.
  */
 #ifdef AUTOTEST
@@ -880,7 +1382,8 @@ InitiateMultipartUpload(
 	uid_t         uid,
 	gid_t         gid,
 	int           permissions,
-	char          *filepath
+	char          *filepath,
+	enum ChecksumModes checksum
 	                    )
 {
 	struct curl_slist *headers;
@@ -900,6 +1403,15 @@ InitiateMultipartUpload(
 	headers = curl_slist_append( headers, strdup( amzHeader ) );
 	sprintf( amzHeader, "x-amz-meta-mode:%d", (int) permissions );
 	headers = curl_slist_append( headers, strdup( amzHeader ) );
+	/* Have S3 keep a CRC32C checksum of the whole file, which it can
+	   combine from the checksums of the parts. */
+	if( checksum == CHECKSUM_CRC32C )
+	{
+		headers = curl_slist_append( headers,
+									 strdup( "x-amz-checksum-algorithm:CRC32C" ) );
+		headers = curl_slist_append( headers,
+									 strdup( "x-amz-checksum-type:FULL_OBJECT" ) );
+	}
 	curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
 	/* Send a multipart upload initiation request. */
 	url = malloc( strlen( filepath ) + sizeof( "?uploads" ) );
@@ -953,6 +1465,7 @@ InitiateMultipartUpload(
  * @param hostname [in] Host name for the S3 request.
  * @param filepath [in] Remote file path of the file.
  * @param uploadId [in] Upload ID for the multipart upload.
+ * @param filesize [in] Size of the file in bytes.
  * @return Nothing.
  */
 STATIC void
@@ -963,7 +1476,8 @@ CompleteMultipartUpload(
 	int           parts,
 	const char    *hostname,
 	const char    *filepath,
-	const char    *uploadId
+	const char    *uploadId,
+	long long int filesize
 	                    )
 {
 	struct curl_slist *headers;
@@ -972,6 +1486,14 @@ CompleteMultipartUpload(
 	FILE              *upFile;
 	const char        *etag;
 	int               status;
+	char              *partChecksum;
+	unsigned char     *partCrc;
+	int               partCrcLength;
+	long long int     partLength;
+	uint32_t          crc = 0;
+	bool              checksummed = true;
+	char              fileChecksum[ 16 ];
+	char              amzHeader[ 50 ];
 
 	/* Build the parts list. */
 	if( Query_AllPartsUploaded( fileId ) )
@@ -980,17 +1502,64 @@ CompleteMultipartUpload(
 		fputs( "<CompleteMultipartUpload>\n", upFile );
 		for( i = 1; i < parts + 1; i++ )
 		{
-			etag = Query_GetPartETag( fileId, i );
-			fprintf( upFile, "<Part><PartNumber>%d</PartNumber>"
-					 "<ETag>%s</ETag></Part>\n", i, etag );
+			etag = Query_GetPartETag( fileId, i, &partChecksum );
+			if( partChecksum == NULL )
+			{
+				fprintf( upFile, "<Part><PartNumber>%d</PartNumber>"
+						 "<ETag>%s</ETag></Part>\n", i, etag );
+				checksummed = false;
+			}
+			else
+			{
+				fprintf( upFile, "<Part><PartNumber>%d</PartNumber>"
+						 "<ETag>%s</ETag><ChecksumCRC32C>%s</ChecksumCRC32C>"
+						 "</Part>\n", i, etag, partChecksum );
+				/* Append the part's checksum to the checksum of the
+				   preceding parts. All parts but the last have the same
+				   size. */
+				partCrc = DecodeBase64( partChecksum, &partCrcLength );
+				if( ( partCrc != NULL ) && ( partCrcLength == 4 ) )
+				{
+					partLength = PREFERRED_CHUNK_SIZE * 1024ll * 1024ll;
+					if( i == parts )
+					{
+						partLength = filesize - ( parts - 1 ) * partLength;
+					}
+					crc = Crc32cCombine( crc,
+										 ( (uint32_t) partCrc[ 0 ] << 24 )
+										 | ( (uint32_t) partCrc[ 1 ] << 16 )
+										 | ( (uint32_t) partCrc[ 2 ] << 8 )
+										 | (uint32_t) partCrc[ 3 ],
+										 partLength );
+				}
+				else
+				{
+					checksummed = false;
+				}
+				free( partCrc );
+				free( partChecksum );
+			}
+			free( (char*) etag );
 		}
 		fputs( "</CompleteMultipartUpload>\n", upFile );
 
+		/* Pass the checksum of the whole file, which S3 verifies against
+		   the checksums of the parts. */
+		headers = NULL;
+		if( checksummed )
+		{
+			EncodeCrc32c( crc, fileChecksum );
+			sprintf( amzHeader, "x-amz-checksum-crc32c:%s", fileChecksum );
+			headers = curl_slist_append( headers, strdup( amzHeader ) );
+			headers = curl_slist_append( headers,
+										 strdup( "x-amz-checksum-type:FULL_OBJECT" ) );
+		}
+
 		/* Upload the parts list. */
 		url = malloc( strlen( filepath )
 					  + strlen( "?uploadId=" )
 					  + strlen( uploadId ) + sizeof( char ) );
-		headers = BuildS3Request( s3Comm, "POST", hostname, NULL, url );
+		headers = BuildS3Request( s3Comm, "POST", hostname, headers, url );
 		curl_easy_reset( curl );
 		curl_easy_setopt( curl, CURLOPT_READDATA, upFile );
 		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
@@ -1000,6 +1569,10 @@ CompleteMultipartUpload(
 		{
 			fprintf( stderr, "Could not complete multipart upload.\n" );
 		}
+		else if( checksummed )
+		{
+			Query_SetFileChecksum( fileId, fileChecksum );
+		}
 		DeleteCurlSlistAndContents( headers );
 		fclose( upFile );
 	}
@@ -1045,13 +1618,23 @@ BeginUpload(
 	char              amzHeader[ 50 ];
 	const char        *hostname;
 	int               status;
+	long              httpStatus;
+	bool              retry;
+	int               attempt;
 	char              *filepath;
 	char              *url;
+	char              *requestUrl;
 	uid_t             uid;
 	gid_t             gid;
 	int               permissions;
 	const char        *localFilePartPath;
 
+	enum ChecksumModes        checksum;
+	struct ChecksummedTransfer transfer;
+
+	struct TraceScope         trace = { "upload", "BeginUpload",
+										TraceClock( ) };
+
 	uploadStarter = (struct UploadStarter*) ctx;
 	uploader      = uploadStarter->uploader;
 	fileId        = uploadStarter->fileId;
@@ -1066,7 +1649,7 @@ BeginUpload(
 	uploadPending = Query_GetUpload( fileId, &part, &bucket,
 									 &remotePath, &uploadId, &uid, &gid,
 									 &permissions, &filesize, &localPath,
-									 &keyId, &secretKey );
+									 &keyId, &secretKey, &checksum );
 	if( uploadPending )
 	{
 		/* Extract the hostname and remote file path from the remote
@@ -1090,7 +1673,7 @@ BeginUpload(
 				free( uploadId );
 				uploadId = InitiateMultipartUpload( s3Comm, curl, fileId,
 													uid, gid, permissions,
-													filepath );
+													filepath, checksum );
 			}
 			/* Prepare the upload part request. */
 			url = malloc( strlen( filepath )
@@ -1098,13 +1681,18 @@ BeginUpload(
 						  + strlen( uploadId ) + sizeof( char ) );
 			sprintf( url, "%s?partNumber=%d&uploadId=%s", filepath,
 					 part, uploadId );
-			free( (char*) filepath );
 		}
 		/* Otherwise, if single-part, put the file without multipart upload. */
 		else
 		{
-			url = filepath;
+			url = strdup( filepath );
 		}
+		/* The request is signed for the path, but curl needs the host, too.
+		   The path ends the remote filename. */
+		requestUrl = malloc( strlen( remotePath ) + strlen( url )
+							 - strlen( filepath ) + sizeof( char ) );
+		strcpy( requestUrl, remotePath );
+		strcat( requestUrl, &url[ strlen( filepath ) ] );
 
 		/* Extract the upload chunk from the file and place it in the
 		   in-progress directory. */
@@ -1116,45 +1704,121 @@ BeginUpload(
 		strcpy( localFile, CACHE_INPROGRESS );
 		strcat( localFile, localFilePartPath );
 
-		/* Generate the MD5 digest and the headers. */
-		upFile = fopen( localFile, "r" );
-		DigestStream( upFile, md5sum, HASH_MD5, HASHENC_BASE64 );
-		rewind( upFile );
-		Query_SetPartETag( fileId, part, md5sum );
-		headers = NULL;
-		sprintf( amzHeader, "Content-MD5:%s", md5sum );
-		headers = curl_slist_append( NULL, strdup( amzHeader ) );
-		sprintf( amzHeader, "Content-Length:%d", partLength );
-		headers = curl_slist_append( headers, strdup( amzHeader ) );
-		headers = BuildS3Request( s3Comm, "PUT", hostname, headers, url );
-		/* Make the upload request. */
-		curl_easy_reset( curl );
-		curl_easy_setopt( curl, CURLOPT_READDATA, upFile );
-		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
-		curl_easy_setopt( curl, CURLOPT_URL, remotePath );
+		/* The part could not be extracted from the file. */
+		if( partLength < 0 )
+		{
+			status = -EIO;
+		}
+		else
+		{
+			/* Generate the MD5 digest, which requires a pass over the part
+			   before it is sent. A CRC32C checksum is instead computed while
+			   the part is sent, and follows the data in a trailer. */
+			upFile = fopen( localFile, "r" );
+			if( checksum == CHECKSUM_MD5 )
+			{
+				DigestStream( upFile, md5sum, HASH_MD5, HASHENC_BASE64 );
+				rewind( upFile );
+				Query_SetPartETag( fileId, part, md5sum, NULL );
+			}
+			attempt = 0;
+			do
+			{
+				headers = NULL;
+				if( checksum == CHECKSUM_CRC32C )
+				{
+					headers = curl_slist_append( headers,
+												 strdup( "Content-Encoding:aws-chunked" ) );
+					headers = curl_slist_append( headers,
+												 strdup( "x-amz-content-sha256:"
+														 "STREAMING-UNSIGNED-PAYLOAD-TRAILER" ) );
+					headers = curl_slist_append( headers,
+												 strdup( "x-amz-trailer:"
+														 "x-amz-checksum-crc32c" ) );
+					sprintf( amzHeader, "x-amz-decoded-content-length:%d",
+							 partLength );
+					headers = curl_slist_append( headers, strdup( amzHeader ) );
+					sprintf( amzHeader, "Content-Length:%lld",
+							 AwsChunkedLength( partLength ) );
+					headers = curl_slist_append( headers, strdup( amzHeader ) );
+				}
+				else
+				{
+					sprintf( amzHeader, "Content-MD5:%s", md5sum );
+					headers = curl_slist_append( NULL, strdup( amzHeader ) );
+					sprintf( amzHeader, "Content-Length:%d", partLength );
+					headers = curl_slist_append( headers, strdup( amzHeader ) );
+				}
+				headers = BuildS3Request( s3Comm, "PUT", hostname, headers, url );
+				/* Make the upload request, resending the part from the start
+				   if S3 fails transiently. */
+				rewind( upFile );
+				curl_easy_reset( curl );
+				if( checksum == CHECKSUM_CRC32C )
+				{
+					StartChecksummedTransfer( &transfer, upFile, partLength );
+					curl_easy_setopt( curl, CURLOPT_UPLOAD, 1L );
+					curl_easy_setopt( curl, CURLOPT_INFILESIZE_LARGE,
+									  (curl_off_t) AwsChunkedLength( partLength ) );
+					curl_easy_setopt( curl, CURLOPT_READFUNCTION,
+									  ReadChecksummedData );
+					curl_easy_setopt( curl, CURLOPT_READDATA, &transfer );
+					curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION,
+									  ReadChecksumHeaders );
+					curl_easy_setopt( curl, CURLOPT_HEADERDATA, &transfer );
+				}
+				else
+				{
+					curl_easy_setopt( curl, CURLOPT_UPLOAD, 1L );
+					curl_easy_setopt( curl, CURLOPT_INFILESIZE_LARGE,
+									  (curl_off_t) partLength );
+					curl_easy_setopt( curl, CURLOPT_READDATA, upFile );
+				}
+				curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
+				curl_easy_setopt( curl, CURLOPT_URL, requestUrl );
+				httpStatus = 0;
+				s3_AcquireRequestSlot( );
 #ifdef AUTOTEST_SKIP_COMMUNICATIONS
-		status = 0;
+				status = 0;
 #else
-		printf( "Executing HTTP request\n" );
-		status = curl_easy_perform( curl );
+				printf( "Executing HTTP request\n" );
+				status = curl_easy_perform( curl );
+				curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
 #endif
-		DeleteCurlSlistAndContents( headers );
-		free( (char*) url );
-		fclose( upFile );
+				retry = s3_ReleaseRequestSlot( status, httpStatus );
+				DeleteCurlSlistAndContents( headers );
+			} while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+			fclose( upFile );
+		}
+		free( url );
+		free( requestUrl );
 		unlink( localFile );
 
+		/* S3 returns the ETag that identifies the part when the multipart
+		   upload is completed. */
+		if( ( status == 0 ) && ( checksum == CHECKSUM_CRC32C ) )
+		{
+			Query_SetPartETag( fileId, part, transfer.etag, transfer.checksum );
+			if( parts == 1 )
+			{
+				Query_SetFileChecksum( fileId, transfer.checksum );
+			}
+		}
+
 		/* If a multipart session is in progress, complete the multipart upload
 		   once all the parts have been uploaded. */
 		if( 1 < parts )
 		{
 			CompleteMultipartUpload( s3Comm, curl, fileId,
-									 parts, hostname, filepath, uploadId );
+									 parts, hostname, filepath, uploadId,
+									 filesize );
 		}
 
 		free( bucket );
 		free( keyId );
 		free( secretKey );
 		free( (char*) hostname );
+		free( filepath );
 		free( remotePath );
 
 		if( status == 0 )
@@ -1169,6 +1833,7 @@ BeginUpload(
 		}
 	}
 
+	EndTraceScope( &trace );
 	pthread_exit( NULL );
 }
 
@@ -1207,7 +1872,8 @@ GetSubscriptionFromUploadQueue(
  *        the chunk size and offset).
  * @param fileChunkPath [out] File name of the chunk file, relative to the
  *        in-progress cache directory.
- * @return Number of bytes in the file chunk.
+ * @return Number of bytes in the file chunk, or -1 if the chunk could not be
+ *         copied.
  */
 #ifdef AUTOTEST
 #pragma GCC diagnostic push
@@ -1223,20 +1889,21 @@ CreateFilePart(
 	const char    **fileChunkPath
 	           )
 {
-	int  partsize;
-	int  parts;
-	char *chunkfile;
-	int  filehandle;
-	char *request;
-	char reply[ 10 ];
+	int         partsize;
+	int         parts;
+	char        *chunkfile;
+	int         filehandle;
+	char        *request;
+	char        reply[ 10 ];
+	struct stat chunkStat;
 
 	/* Calculate the part size to extract. */
 	partsize = PREFERRED_CHUNK_SIZE * 1024l * 1024l;
-	/* The last part is the remainder of the division. */
+	/* The last part holds the remainder of the file. */
 	parts = NumberOfMultiparts( filesize );
 	if( part == parts )
 	{
-		partsize = filesize % partsize;
+		partsize = filesize - (long long int) ( parts - 1 ) * partsize;
 	}
 
 	/* Create a destination file that receives a copy of the file chunk. */
@@ -1252,6 +1919,12 @@ CreateFilePart(
 	sprintf( request, "CHUNK %d:%s:%s", part, filepath, *fileChunkPath );
 #ifndef AUTOTEST
 	SendGrantMessage( socketHandle, request, reply, sizeof( reply ) );
+	/* The grant module empties a chunk that it could not copy completely. */
+	if( ( stat( chunkfile, &chunkStat ) != 0 )
+		|| ( chunkStat.st_size != partsize ) )
+	{
+		partsize = -1;
+	}
 #endif
 
 	/* Return the size of the file chunk. */
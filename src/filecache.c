@@ -32,11 +32,12 @@
 #include <assert.h>
 #include <pthread.h>
 #include <glib-2.0/glib.h>
-#include <poll.h>
 #include <errno.h>
+#include <sys/epoll.h>
 #include "aws-s3fs.h"
 #include "socket.h"
 #include "filecache.h"
+#include "trace.h"
 
 
 #ifdef AUTOTEST
@@ -50,6 +51,22 @@
 
 static pthread_t clientConnectionsListener;
 
+/* Client connections with a pending request, waiting for a worker thread.
+   The connections listener blocks while the queue is full, which holds
+   further requests back in the clients' sockets. */
+static int             clientEpollFd = -1;
+static GQueue          readyConnections = G_QUEUE_INIT;
+static pthread_mutex_t readyConnections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  readyConnections_notEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  readyConnections_notFull = PTHREAD_COND_INITIALIZER;
+
+/* Download requests waiting for a download-wait thread.  A worker that reads
+   a download request blocks while the queue is full. */
+static GQueue          waitingDownloads = G_QUEUE_INIT;
+static pthread_mutex_t waitingDownloads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  waitingDownloads_notEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  waitingDownloads_notFull = PTHREAD_COND_INITIALIZER;
+
 /* Used as a constant for blocking the SIGPIPE signal. */
 static sigset_t sigpipeMask;
 
@@ -61,14 +78,32 @@ extern int SendGrantMessage( int socketHandle, const char *privopRequest,
 
 struct CacheClientConnection
 {
-	int       connectionHandle;
-	pthread_t thread;
-	pid_t     pid;
-	uid_t     uid;
-	gid_t     gid;
-	char      *bucket;
-	char      keyId[ 21 ];
-	char      secretKey[ 41 ];
+	int             connectionHandle;
+	pthread_t       thread;
+	pid_t           pid;
+	uid_t           uid;
+	gid_t           gid;
+	char            *bucket;
+	char            keyId[ 21 ];
+	char            secretKey[ 41 ];
+	/* Replies from concurrent requests are written one at a time.  The
+	   mutex also protects the bucket name and the keys above, and the fields
+	   below. */
+	pthread_mutex_t sendMutex;
+	/* Set when the connection is shut down; the socket is not closed until
+	   the last reference is released, so that its file descriptor cannot be
+	   reused while a worker may still read from it. */
+	bool            closed;
+	int             references;
+};
+
+/* A request that is served by a download-wait thread, because it may block
+   until a download completes. */
+struct DeferredRequest
+{
+	struct CacheClientConnection *clientConnection;
+	struct CacheMessageHeader    header;
+	char                         payload[ ];
 };
 
 
@@ -77,36 +112,67 @@ struct RegularExpressions regexes;
 
 STATIC void CompileRegexes( void );
 static void FreeRegexes( void );
-STATIC void *ReceiveRequests( void* );
+STATIC int ServeClientRequest( struct CacheClientConnection* );
 static void *ClientConnectionsListener( void* );
 #ifdef AUTOTEST_SKIP_COMMUNICATIONS
-extern int ReadEntireMessage( int connectionHandle, char **clientMessage );
+extern int ReadClientMessage( int connectionHandle,
+							  struct CacheMessageHeader *header,
+							  char *payload );
 #else
-static int ReadEntireMessage( int connectionHandle, char **clientMessage );
+static int ReadClientMessage( int connectionHandle,
+							  struct CacheMessageHeader *header,
+							  char *payload );
 #endif
 STATIC int CommandDispatcher( struct CacheClientConnection *clientConnection,
-							  const char *message );
+							  const struct CacheMessageHeader *request,
+							  const char *payload );
 STATIC char *TrimString( char *original );
 
 STATIC int ClientConnects(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 STATIC int ClientRequestsCreate(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 STATIC int ClientDisconnects(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 STATIC int
 ClientRequestsLocalFilename(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 STATIC int
 ClientRequestsShutdown(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 static int
 ClientRequestsDebugMessage(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 static int ClientRequestsDownload(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
 static int ClientRequestsFileClose(
-	struct CacheClientConnection *clientConnection, const char *request );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
+
+
+/* Names of the opcodes, for diagnostic output. */
+static const char *const opcodeNames[ ] =
+{
+	[ CACHE_CONNECT ]    = "CONNECT",
+	[ CACHE_DISCONNECT ] = "DISCONNECT",
+	[ CACHE_FILE ]       = "FILE",
+	[ CACHE_CREATE ]     = "CREATE",
+	[ CACHE_DOWNLOAD ]   = "CACHE",
+	[ CACHE_DROP ]       = "DROP",
+	[ CACHE_QUIT ]       = "QUIT",
+	[ CACHE_DEBUG ]      = "DEBUG"
+};
+
+#define OPCODE_NAME( opcode ) \
+	( ( ( 0 < ( opcode ) ) && ( ( opcode ) <= CACHE_DEBUG ) ) \
+	  ? opcodeNames[ opcode ] : "UNKNOWN" )
 
 
 
@@ -195,38 +261,57 @@ RestoreSigpipeSignal(
 
 
 /**
- * Send a message to a client via a socket connection.  The message is sent
- * including its string-terminating null character.
- * @param connectionHandle [in] Connection handle for the socket.
- * @param message [in] Message to send.
- * @return >= 0 if the message was sent, or \a -errno if an error occurred.
- * Test: none.
+ * Send the reply to a request to a client via a socket connection.  Replies
+ * may be sent from several threads at once, and are written in the order in
+ * which the requests complete.
+ * @param clientConnection [in] Client Connection structure.
+ * @param request [in] Header of the request that is answered.
+ * @param status [in] 0 on success, or \a -errno if the request failed.
+ * @param fields [in] Fixed reply fields, or \a NULL.
+ * @param fieldsLength [in] Size of the fixed reply fields.
+ * @param tail [in] String that follows the fixed fields, or \a NULL.
+ * @param fileHandle [in] File descriptor to pass to the client, or \a -1.
+ * @return 0 if the reply was sent, or \a -errno if an error occurred.
+ * Test: implied blackbox (test-filecache.c).
  */
 static int
-SendMessageToClient(
-	int        connectionHandle,
-	const char *message
-	                )
+SendReplyToClient(
+	struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	int                             status,
+	const void                      *fields,
+	size_t                          fieldsLength,
+	const char                      *tail,
+	int                             fileHandle
+	              )
 {
-	int status;
-	bool wasPending;
-	bool wasBlocked;
+	int sendStatus;
 
-	/* Block the SIGPIPE signal if the client happens to have disconnected. */
-	BlockSigpipeSignal( &wasPending, &wasBlocked );
-	/* Send the message to the client. */
+	/* The reply is sent with MSG_NOSIGNAL, so a client that has disconnected
+	   yields -EPIPE rather than a SIGPIPE signal. */
 #ifdef AUTOTEST_SKIP_COMMUNICATIONS
-	status = strlen( message ) + sizeof( char );
+	sendStatus = 0;
 #else
-	status = write( connectionHandle, message,
-					strlen( message ) + sizeof( char ) );
+	pthread_mutex_lock( &clientConnection->sendMutex );
+	if( clientConnection->closed )
+	{
+		sendStatus = -ENOTCONN;
+	}
+	else
+	{
+		sendStatus = SocketSendCacheMessage( clientConnection->connectionHandle,
+											 request->opcode,
+											 request->requestId, status,
+											 fields, fieldsLength, tail,
+											 fileHandle );
+	}
+	pthread_mutex_unlock( &clientConnection->sendMutex );
 #endif
 #ifdef AUTOTEST
-	printf( "Sent: \"%s\"\n", message );
+	printf( "Sent: %s %d \"%s\"\n", OPCODE_NAME( request->opcode ), status,
+			tail != NULL ? tail : "" );
 #endif
-	/* Restore the SIGPIPE signal action. */
-	RestoreSigpipeSignal( wasPending, wasBlocked );
-	return( status );
+	return( sendStatus );
 }
 
 
@@ -314,10 +399,12 @@ ShutdownFileCache(
 
 
 /**
- * Read the entire pending message and place it in a buffer.
+ * Read the next message from a client.
  * @param connectionHandle [in] Socket connection handle.
- * @param clientMessage [out] Message received from the client.
- * @return Number of bytes read.
+ * @param header [out] Header of the message.
+ * @param payload [out] Zero-terminated payload of the message, with room for
+ *        CACHE_MAX_PAYLOAD bytes plus the terminator.
+ * @return Length of the payload, or \a -errno on failure.
  * Test: none (however, it is used in so frequently that defects would cause
  *       several unit tests to report errors).
  */
@@ -325,195 +412,365 @@ ShutdownFileCache(
    simulation. */
 #ifndef AUTOTEST_SKIP_COMMUNICATIONS
 static int
-ReadEntireMessage(
-    int  connectionHandle,
-	char **clientMessage
+ReadClientMessage(
+    int                       connectionHandle,
+	struct CacheMessageHeader *header,
+	char                      *payload
                   )
 {
-	char buffer[ 256 ];
-	int  nBytes;
-	char *message     = NULL;
-	int  messageSize  = 0;
-	struct pollfd fds = { connectionHandle, POLLIN, 0 };
-	int  pollRes;
-
-
-	/* Read partial message and expand the buffer as necessary until the
-	   entire message is received. */
-	while( 0 < ( nBytes = recv( connectionHandle, buffer,
-								sizeof( buffer ), 0 ) ) )
+	/* Clients do not pass file descriptors; any that arrive are closed. */
+	return( SocketReceiveCacheMessage( connectionHandle, header, payload,
+									   CACHE_MAX_PAYLOAD, NULL ) );
+}
+#endif /* AUTOTEST_SKIP_COMMUNICATIONS */
+
+
+
+/**
+ * Take a reference to a client connection, which keeps the connection
+ * structure and its socket alive.
+ * @param clientConnection [in/out] Client Connection structure.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+AcquireClientConnection(
+	struct CacheClientConnection *clientConnection
+	                    )
+{
+	pthread_mutex_lock( &clientConnection->sendMutex );
+	clientConnection->references++;
+	pthread_mutex_unlock( &clientConnection->sendMutex );
+}
+
+
+
+/**
+ * Release a reference to a client connection.  The socket is closed and the
+ * structure is freed when the last reference is released.
+ * @param clientConnection [in/out] Client Connection structure.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+ReleaseClientConnection(
+	struct CacheClientConnection *clientConnection
+	                    )
+{
+	bool lastReference;
+
+	pthread_mutex_lock( &clientConnection->sendMutex );
+	lastReference = ( --clientConnection->references == 0 );
+	pthread_mutex_unlock( &clientConnection->sendMutex );
+
+	if( lastReference )
+	{
+		close( clientConnection->connectionHandle );
+		pthread_mutex_destroy( &clientConnection->sendMutex );
+		free( clientConnection->bucket );
+		free( clientConnection );
+	}
+}
+
+
+
+/**
+ * Shut down a client connection and stop listening for its requests.
+ * Requests that are still being served find the connection closed when they
+ * reply.  The function may be called more than once.
+ * @param clientConnection [in/out] Client Connection structure.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+CloseClientConnection(
+	struct CacheClientConnection *clientConnection
+	                  )
+{
+	bool wasOpen;
+
+	pthread_mutex_lock( &clientConnection->sendMutex );
+	wasOpen = ! clientConnection->closed;
+	if( wasOpen )
+	{
+		clientConnection->closed = true;
+#ifndef AUTOTEST_SKIP_COMMUNICATIONS
+		epoll_ctl( clientEpollFd, EPOLL_CTL_DEL,
+				   clientConnection->connectionHandle, NULL );
+		shutdown( clientConnection->connectionHandle, SHUT_RDWR );
+#endif
+	}
+	pthread_mutex_unlock( &clientConnection->sendMutex );
+
+	/* Drop the reference held by the connections listener. */
+	if( wasOpen )
+	{
+		ReleaseClientConnection( clientConnection );
+	}
+}
+
+
+
+/**
+ * Tell the connections listener to report the next request on a client
+ * connection.  Client sockets are registered with EPOLLONESHOT so that only
+ * one worker reads from a socket at a time.
+ * @param clientConnection [in] Client Connection structure.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+RearmClientConnection(
+	struct CacheClientConnection *clientConnection
+	                  )
+{
+#ifndef AUTOTEST_SKIP_COMMUNICATIONS
+	struct epoll_event event;
+
+	event.events   = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = clientConnection;
+	pthread_mutex_lock( &clientConnection->sendMutex );
+	if( ! clientConnection->closed )
+	{
+		epoll_ctl( clientEpollFd, EPOLL_CTL_MOD,
+				   clientConnection->connectionHandle, &event );
+	}
+	pthread_mutex_unlock( &clientConnection->sendMutex );
+#endif
+}
+
+
+
+/**
+ * Download-wait thread that serves the download requests, which may block
+ * for a long time, so that the worker threads are not held up by them.  A
+ * fixed number of these threads is started, which bounds the number of
+ * downloads that are waited for at any time.
+ * @param dummy [in] Unused.
+ * @return Thread status (never returns).
+ * Test: none.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void*
+DownloadWaitWorker(
+	void *dummy
+	               )
+{
+	struct DeferredRequest *request;
+
+	while( true )
 	{
-		if( message == NULL )
+		pthread_mutex_lock( &waitingDownloads_mutex );
+		while( g_queue_is_empty( &waitingDownloads ) )
 		{
-			message = malloc( nBytes + sizeof( char ) );
+			pthread_cond_wait( &waitingDownloads_notEmpty,
+							   &waitingDownloads_mutex );
 		}
-		else
+		request = g_queue_pop_head( &waitingDownloads );
+		pthread_cond_signal( &waitingDownloads_notFull );
+		pthread_mutex_unlock( &waitingDownloads_mutex );
+
+		CommandDispatcher( request->clientConnection, &request->header,
+						   request->payload );
+		/* Drop the reference taken when the request was queued. */
+		ReleaseClientConnection( request->clientConnection );
+		free( request );
+	}
+
+	return( NULL );
+}
+#pragma GCC diagnostic pop
+
+
+
+/**
+ * Read one request from a client connection and handle it appropriately.
+ * The connection is rearmed before the request is handled, so another worker
+ * may serve the client's next request in the meantime; the replies then
+ * arrive out of order.  A connect request is served before the connection is
+ * rearmed.  A request that waits for a download is handed to the download-wait
+ * threads; if too many are already waiting, the worker blocks until one is
+ * served.
+ * @param clientConnection [in/out] Client Connection structure.
+ * @return Length of the request, or \a -errno if the connection should be
+ *         closed.
+ * Test: unit test (test-filecache.c).
+ */
+STATIC int
+ServeClientRequest(
+	struct CacheClientConnection *clientConnection
+                   )
+{
+	struct CacheMessageHeader header;
+	char                      payload[ CACHE_MAX_PAYLOAD + sizeof( char ) ];
+	int                       status;
+	struct DeferredRequest    *deferred;
+
+	status = ReadClientMessage( clientConnection->connectionHandle,
+								&header, payload );
+	if( 0 <= status )
+	{
+		/* A connect request changes the client's bucket and keys, so the
+		   client's next request is not read until it has been served. */
+		if( header.opcode != CACHE_CONNECT )
 		{
-			message = realloc( message, messageSize + nBytes + sizeof( char ) );
+			RearmClientConnection( clientConnection );
 		}
 
-		memcpy( &message[ messageSize ], buffer, nBytes );
-		messageSize += nBytes;
-		/* Check if the entire buffer has been read, using poll( ) with
-		   a timeout of 0 to avoid blocking. */
-		pollRes = poll( &fds, 1, 0 );
-		if( ( pollRes <= 0 ) || ( ( fds.revents & POLLHUP ) == POLLHUP ) )
+		deferred = NULL;
+		if( header.opcode == CACHE_DOWNLOAD )
 		{
-			break;
+			deferred = malloc( sizeof( struct DeferredRequest )
+							   + header.length + sizeof( char ) );
 		}
-	}
-	/* Check if the client has disconnected and return an empty string
-	   and -ENOTCONN. */
-	if( nBytes == 0 )
-	{
-		(void) poll( &fds, 1, 0 );
-		if( ( fds.revents & POLLHUP ) == POLLHUP )
+		if( deferred != NULL )
 		{
-			if( message != NULL )
+			AcquireClientConnection( clientConnection );
+			deferred->clientConnection = clientConnection;
+			memcpy( &deferred->header, &header, sizeof( header ) );
+			memcpy( deferred->payload, payload,
+					header.length + sizeof( char ) );
+			pthread_mutex_lock( &waitingDownloads_mutex );
+			while( DOWNLOAD_WAIT_QUEUE_LIMIT <= waitingDownloads.length )
 			{
-				message[ 0 ] = '\0';
+				pthread_cond_wait( &waitingDownloads_notFull,
+								   &waitingDownloads_mutex );
 			}
-			messageSize = -ENOTCONN;
+			g_queue_push_tail( &waitingDownloads, deferred );
+			pthread_cond_signal( &waitingDownloads_notEmpty );
+			pthread_mutex_unlock( &waitingDownloads_mutex );
+		}
+		/* Serve the request on this thread unless it was handed to the
+		   download-wait threads. */
+		else
+		{
+			CommandDispatcher( clientConnection, &header, payload );
+		}
+		if( header.opcode == CACHE_CONNECT )
+		{
+			RearmClientConnection( clientConnection );
 		}
 	}
-	else
+	/* A client that speaks another protocol version, or sends a message
+	   that is too large, is told so before it is disconnected.  The rest of
+	   its message cannot be trusted. */
+	else if( ( status == -EPROTO ) || ( status == -EMSGSIZE ) )
 	{
-		/* Zero-terminate for good measure. */
-		message[ messageSize ] = '\0';
+		printf( "Rejecting client: %s\n", strerror( -status ) );
+		SendReplyToClient( clientConnection, &header, status,
+						   NULL, 0, NULL, -1 );
 	}
 
-	*clientMessage = message;
-	return( messageSize );
+	return( status );
 }
-#endif /* AUTOTEST_SKIP_COMMUNICATIONS */
 
 
 
 /**
- * Thread that waits for requests and handles them appropriately.  Each client
- * connection gets its own thread so that one thread may wait for a message
- * without blocking other threads.
- * @param data [in] Thread context: the client connection.
- * @return Thread status (always 0 ).
- * Test: unit test (test-filecache.c).
+ * Worker thread that serves requests on the client connections that the
+ * connections listener reports as readable.
+ * @param dummy [in] Unused.
+ * @return Thread status (never returns).
+ * Test: none.
  */
-STATIC void*
-ReceiveRequests(
-	void *data
-                )
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void*
+ClientRequestsWorker(
+	void *dummy
+	                 )
 {
-	struct CacheClientConnection *clientConnection = data;
+	struct CacheClientConnection *clientConnection;
+	bool                         closed;
 
-	char         *message;
-	int          status;
-	struct ucred credentials;
-	socklen_t    credentialsLength = sizeof( struct ucred );
-	bool         connected         = true;
-
-	while( connected )
+	while( true )
 	{
-#ifdef AUTOTEST
-		printf( "Waiting for message...\n" );
-#endif
-
-		status = ReadEntireMessage( clientConnection->connectionHandle,
-									&message );
-		if( 0 <= status )
+		pthread_mutex_lock( &readyConnections_mutex );
+		while( g_queue_is_empty( &readyConnections ) )
 		{
-			getsockopt( clientConnection->connectionHandle, SOL_SOCKET,
-						SO_PEERCRED, &credentials, &credentialsLength );
-			clientConnection->uid = credentials.uid;
-			clientConnection->gid = credentials.gid;
-			clientConnection->pid = credentials.pid;
-			CommandDispatcher( clientConnection, message );
-			free( message );
+			pthread_cond_wait( &readyConnections_notEmpty,
+							   &readyConnections_mutex );
 		}
-		else
+		clientConnection = g_queue_pop_head( &readyConnections );
+		pthread_cond_signal( &readyConnections_notFull );
+		pthread_mutex_unlock( &readyConnections_mutex );
+
+		pthread_mutex_lock( &clientConnection->sendMutex );
+		closed = clientConnection->closed;
+		pthread_mutex_unlock( &clientConnection->sendMutex );
+		if( ! closed && ( ServeClientRequest( clientConnection ) < 0 ) )
 		{
-			connected = false;
-		}
-		if( status == 0 )
-		{
-			printf( "Exiting\n" );
-			exit( 1 );
+			printf( "Lost connection\n" );
+			CloseClientConnection( clientConnection );
 		}
+		/* Drop the reference taken when the connection was queued. */
+		ReleaseClientConnection( clientConnection );
 	}
-	printf( "Lost connection, connection thread exiting\n" );
-	pthread_exit( NULL );
 
 	return( NULL );
 }
+#pragma GCC diagnostic pop
 
 
 
 /**
- * Invoke the appropriate function depending on the message received from the
- * cache client.
+ * Invoke the appropriate function depending on the opcode of the message
+ * received from the cache client.
  * @param clientConnection [in] Client Information structure with information
  *        about the cache client.
- * @param message [in] Client message.
- * @return Nothing.
+ * @param request [in] Header of the client message.
+ * @param payload [in] Zero-terminated payload of the client message.
+ * @return Status of the request, or \a -EBADRQC if the opcode is unknown.
  * Test: unit test (test-filecache.c).
  */
 STATIC int
 CommandDispatcher(
-	struct CacheClientConnection *clientConnection,
-	const char                   *message
+	struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	              )
 {
-	const char *command;
-	int        (*commandFunction)( struct CacheClientConnection*, const char* );
-	int        entry;
-	int        status = 0;
+	int (*commandFunction)( struct CacheClientConnection*,
+							const struct CacheMessageHeader*, const char* );
+	int status;
 
-	/* List of commands and functions to handle the command. */
-	const struct
-	{
-		const char *command;
-		int        (*commandFunction)( struct CacheClientConnection *clientInfo,
-									   const char *message );
-	} dispatchTable[ ] =
+	/* Functions that handle the opcodes, indexed by opcode. */
+	static int (*const dispatchTable[ ])(
+		struct CacheClientConnection *clientInfo,
+		const struct CacheMessageHeader *request, const char *payload ) =
 	    {
-			{ "FILE",       ClientRequestsLocalFilename },
-			{ "CREATE",     ClientRequestsCreate },
-			{ "CACHE",      ClientRequestsDownload },
-			{ "DROP",       ClientRequestsFileClose },
-			{ "CONNECT",    ClientConnects },
-			{ "DISCONNECT", ClientDisconnects },
-			{ "QUIT",       ClientRequestsShutdown },
-			{ "DEBUG",      ClientRequestsDebugMessage },
-			{ NULL, NULL }
+			[ CACHE_CONNECT ]    = ClientConnects,
+			[ CACHE_DISCONNECT ] = ClientDisconnects,
+			[ CACHE_FILE ]       = ClientRequestsLocalFilename,
+			[ CACHE_CREATE ]     = ClientRequestsCreate,
+			[ CACHE_DOWNLOAD ]   = ClientRequestsDownload,
+			[ CACHE_DROP ]       = ClientRequestsFileClose,
+			[ CACHE_QUIT ]       = ClientRequestsShutdown,
+			[ CACHE_DEBUG ]      = ClientRequestsDebugMessage
 		};
 
-	/* Find the command in the list and execute it. */
-	entry = 0;
-	while( ( command = dispatchTable[ entry ].command ) != NULL )
+	if( ( 0 < request->opcode ) && ( request->opcode <= CACHE_DEBUG ) )
 	{
-		if( strncasecmp( message, command, strlen( command ) ) == 0 )
-		{
-			printf( "executing command %s\n", command );
-			commandFunction = dispatchTable[ entry ].commandFunction;
-			status = commandFunction( clientConnection,
-									  &message[ strlen( command ) + 1 ] );
-			break;
-		}
-		entry++;
+		TRACE_SCOPE( "cache", OPCODE_NAME( request->opcode ) );
+		printf( "executing command %s\n", OPCODE_NAME( request->opcode ) );
+		commandFunction = dispatchTable[ request->opcode ];
+		status = commandFunction( clientConnection, request, payload );
 	}
-	if( command == NULL )
+	else
 	{
 		printf( "unknown command.\n" );
-		status = SendMessageToClient( clientConnection->connectionHandle,
-									  "ERROR: unknown command" );
-		/* If the client has terminated, the pipe is broken.  Terminate
-		   the receiving thread. */
-		if( status == -EPIPE )
+		status = -EBADRQC;
+		/* If the client has terminated, the pipe is broken.  The connection
+		   is closed when the worker finds it disconnected. */
+		if( SendReplyToClient( clientConnection, request,
+							   status, NULL, 0, NULL, -1 ) == -EPIPE )
 		{
-			printf( "Pipe broken, exiting thread\n" );
-			pthread_exit( NULL );
+			printf( "Pipe broken\n" );
 		}
 	}
 
-	return (status );
+	return( status );
 }
 
 
@@ -639,10 +896,11 @@ CreateLocalDir(
 
 
 /**
- * Thread that listens to new connections and adds client connections as
- * they are detected.  A new thread is initiated for each new connection
- * so that the process is able to wait for activity on them without blocking
- * the other threads.
+ * Thread that listens to new connections and to requests on the client
+ * connections.  All client sockets are watched by a single epoll instance;
+ * a readable connection is queued for a fixed pool of worker threads, so the
+ * number of threads does not grow with the number of clients.  While all
+ * workers are busy and the queue is full, the listener stops taking events.
  * @return Thread status (always 0 ).
  * Test: none (however, if the function failed, several unit tests would
  *       report errors).
@@ -658,37 +916,112 @@ ClientConnectionsListener(
     struct sockaddr_un socketAddressServer;
     int                connectionFd;
     struct sockaddr_un socketAddressClient;
-    socklen_t          clientAddressLength = sizeof( struct sockaddr_un );
+    socklen_t          clientAddressLength;
+	struct epoll_event event;
+	struct epoll_event events[ CLIENT_EPOLL_EVENTS ];
+	int                nEvents;
+	int                i;
+	pthread_t          worker;
+	struct ucred       credentials;
+	socklen_t          credentialsLength;
 
 	struct CacheClientConnection *clientInfo;
 
 
     CreateServerStreamSocket( SOCKET_NAME, &socketFd, &socketAddressServer );
+	clientEpollFd = epoll_create1( EPOLL_CLOEXEC );
+	event.events   = EPOLLIN;
+	event.data.ptr = NULL;
+	if( ( clientEpollFd < 0 )
+		|| ( epoll_ctl( clientEpollFd, EPOLL_CTL_ADD, socketFd, &event ) != 0 ) )
+	{
+		fprintf( stderr, "Couldn't watch the client connections socket\n" );
+		return( 0 );
+	}
+	for( i = 0; i < CLIENT_WORKER_THREADS; i++ )
+	{
+		if( pthread_create( &worker, NULL, ClientRequestsWorker, NULL ) != 0 )
+		{
+			fprintf( stderr, "Couldn't start client requests worker thread" );
+		}
+	}
+	for( i = 0; i < DOWNLOAD_WAIT_THREADS; i++ )
+	{
+		if( pthread_create( &worker, NULL, DownloadWaitWorker, NULL ) != 0 )
+		{
+			fprintf( stderr, "Couldn't start download wait thread" );
+		}
+	}
 	printf( "Waiting for connections...\n" );
 
-    /* Wait for client connections and start a new thread when a connection
-	   is initiated. */
-    while( ( connectionFd = accept( socketFd, &socketAddressClient,
-                                    &clientAddressLength ) ) > -1 )
-    {
-		printf( "Connection established.\n" );
-
-		/* Create new thread information structure and fill it with
-		   partial data. */
-		clientInfo = malloc( sizeof( struct CacheClientConnection ) );
-		memset( clientInfo, 0, sizeof( struct CacheClientConnection ) );
-		clientInfo->connectionHandle = connectionFd;
-		/* Start a message receiver thread. */
-		if( pthread_create( &clientInfo->thread, NULL,
-							ReceiveRequests, clientInfo ) != 0 )
+	while( true )
+	{
+		nEvents = epoll_wait( clientEpollFd, events, CLIENT_EPOLL_EVENTS, -1 );
+		if( nEvents < 0 )
 		{
-			fprintf( stderr, "Couldn't start message receiver thread" );
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			break;
 		}
-		else
+
+		for( i = 0; i < nEvents; i++ )
 		{
-			/* Connected. No action required. */
+			clientInfo = events[ i ].data.ptr;
+			/* Add new client connections to the epoll set. */
+			if( clientInfo == NULL )
+			{
+				clientAddressLength = sizeof( struct sockaddr_un );
+				connectionFd = accept( socketFd, &socketAddressClient,
+									   &clientAddressLength );
+				if( connectionFd < 0 )
+				{
+					continue;
+				}
+				printf( "Connection established.\n" );
+
+				clientInfo = malloc( sizeof( struct CacheClientConnection ) );
+				memset( clientInfo, 0, sizeof( struct CacheClientConnection ) );
+				clientInfo->connectionHandle = connectionFd;
+				/* The credentials of the client process are fixed when it
+				   connects, so they are read once for all its requests. */
+				credentialsLength = sizeof( struct ucred );
+				getsockopt( connectionFd, SOL_SOCKET, SO_PEERCRED,
+							&credentials, &credentialsLength );
+				clientInfo->uid = credentials.uid;
+				clientInfo->gid = credentials.gid;
+				clientInfo->pid = credentials.pid;
+				pthread_mutex_init( &clientInfo->sendMutex, NULL );
+				/* The listener holds a reference until the connection is
+				   closed. */
+				clientInfo->references = 1;
+				event.events   = EPOLLIN | EPOLLONESHOT;
+				event.data.ptr = clientInfo;
+				if( epoll_ctl( clientEpollFd, EPOLL_CTL_ADD, connectionFd,
+							   &event ) != 0 )
+				{
+					fprintf( stderr, "Couldn't watch client connection\n" );
+					ReleaseClientConnection( clientInfo );
+				}
+			}
+			/* Hand a request to the workers, waiting while they are
+			   saturated. */
+			else
+			{
+				AcquireClientConnection( clientInfo );
+				pthread_mutex_lock( &readyConnections_mutex );
+				while( CLIENT_QUEUE_LIMIT <= readyConnections.length )
+				{
+					pthread_cond_wait( &readyConnections_notFull,
+									   &readyConnections_mutex );
+				}
+				g_queue_push_tail( &readyConnections, clientInfo );
+				pthread_cond_signal( &readyConnections_notEmpty );
+				pthread_mutex_unlock( &readyConnections_mutex );
+			}
 		}
-    }
+	}
 	printf( "Exiting\n" );
     unlink( SOCKET_NAME );
 
@@ -699,9 +1032,10 @@ ClientConnectionsListener(
 
 
 /**
- * Close the connection and terminate the connection thread.
+ * Close the connection.
  * @param clientConnection [in] Client Connection structure.
- * @param request [in] Request parameters (unused).
+ * @param request [in] Request header (unused).
+ * @param payload [in] Request payload (unused).
  * @return Nothing.
  * Test: implied blackbox (test-filecache.c).
  */
@@ -709,12 +1043,12 @@ ClientConnectionsListener(
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 STATIC int
 ClientDisconnects(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	              )
 {
-	close( clientConnection->connectionHandle );
-	pthread_exit( NULL );
+	CloseClientConnection( clientConnection );
 	return( 0 );
 }
 #pragma GCC diagnostic pop
@@ -725,7 +1059,8 @@ ClientDisconnects(
  * Shutdown the file cache.  This function requires the client to either be
  * root or have the same uid as the file cache.
  * @param clientConnection [in] Client Connection structure.
- * @param request [in] Request parameters (unused).
+ * @param request [in] Request header (unused).
+ * @param payload [in] Request payload (unused).
  * @return Nothing.
  * Test: implied blackbox (in test-process.c).
  */
@@ -733,8 +1068,9 @@ ClientDisconnects(
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 STATIC int
 ClientRequestsShutdown(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	                   )
 {
 	if( ( clientConnection->uid == 0 ) || clientConnection->uid == getuid( ) )
@@ -750,72 +1086,86 @@ ClientRequestsShutdown(
 
 
 /**
- * The client sends a connect message passing the bucket, the key ID, and the
- * secret key.  The CacheClientConnection structure for the client is updated
- * with this information.
- * The server responds with CONNECTED or ERROR.
+ * The client sends a connect message passing the bucket, the key ID, the
+ * secret key, and the checksum that protects the client's transfers.  The
+ * CacheClientConnection structure for the client is updated with this
+ * information, and the keys are registered for the uid that the kernel
+ * reported for the peer, never for a uid named by the client.
+ * The server responds with the status of the connection.
  * @param clientConnection [in/out] CacheClientConnection structure for the
  *        client.
- * @param request [in] Connection request parameters.
+ * @param request [in] Request header.
+ * @param payload [in] Connection request: a CacheConnectRequest structure
+ *        followed by the bucket name.
  * @return 0 on success, or \a -errno on failure.
  * Test: unit test (test-filecache.c).
  */
 STATIC int
 ClientConnects(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	          )
 {
-	char       *bucket;
-	char       *uidStr;
-	char       *keyId;
-	char       *secretKey;
-	GMatchInfo *matchInfo;
-    uid_t      uid;
-	int        status = -EINVAL;
-
-	/* Grep the bucket, the key, and the secret key. */
-	g_regex_ref( regexes.connectAuth );
-	if( g_regex_match( regexes.connectAuth, request, 0, &matchInfo ) )
+	/* Characters allowed in bucket names and in the keys. */
+	static const char *bucketCharacters =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-+_";
+	static const char *keyCharacters =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/=";
+
+	struct CacheConnectRequest connect;
+	const char                 *bucket;
+	size_t                     bucketLength;
+	char                       keyId[ 21 ];
+	char                       secretKey[ 41 ];
+	int                        status;
+
+	if( request->length <= sizeof( struct CacheConnectRequest ) )
 	{
-		bucket    = g_match_info_fetch( matchInfo, 1 );
-		uidStr    = g_match_info_fetch( matchInfo, 2 );
-		keyId     = g_match_info_fetch( matchInfo, 3 );
-		secretKey = g_match_info_fetch( matchInfo, 4 );
-		g_match_info_free( matchInfo );
-
+		status = -EINVAL;
+	}
+	else
+	{
+		memcpy( &connect, payload, sizeof( struct CacheConnectRequest ) );
+		bucket       = &payload[ sizeof( struct CacheConnectRequest ) ];
+		bucketLength = request->length - sizeof( struct CacheConnectRequest );
+		memcpy( keyId, connect.keyId, 20 );
+		keyId[ 20 ] = '\0';
+		memcpy( secretKey, connect.secretKey, 40 );
+		secretKey[ 40 ] = '\0';
+
+		if( ( strlen( bucket ) != bucketLength )
+			|| ( strspn( bucket, bucketCharacters ) != bucketLength )
+			|| ( ( connect.checksum != CHECKSUM_MD5 )
+				 && ( connect.checksum != CHECKSUM_CRC32C ) ) )
+		{
+			status = -EINVAL;
+		}
 		/* Store the bucket name and the keys in the client connection info
-		   structure, and return a success message if the keys have the
-		   correct length. */
-		if( ( strlen( keyId ) == 20 ) && ( strlen( secretKey ) == 40 ) )
+		   structure if the keys are well-formed. */
+		else if( ( strspn( keyId, keyCharacters ) != 20 )
+				 || ( strspn( secretKey, keyCharacters ) != 40 ) )
 		{
-			clientConnection->bucket = bucket;
-			strncpy( clientConnection->keyId, keyId,
-					 sizeof( clientConnection->keyId ) );
-			strncpy( clientConnection->secretKey, secretKey,
-					 sizeof( clientConnection->secretKey ) );
-			/* Add the user to the database. */
-			uid = atoi( uidStr );
-			Query_AddUser( uid, keyId, secretKey );
-			SendMessageToClient( clientConnection->connectionHandle,
-								 "CONNECTED" );
-			status = 0;
+			status = -EKEYREJECTED;
 		}
 		else
 		{
-			g_free( bucket );
-			status = -EKEYREJECTED;
+			/* Requests that were read before the connect request may still
+			   be served, so the bucket name is replaced under the lock. */
+			pthread_mutex_lock( &clientConnection->sendMutex );
+			free( clientConnection->bucket );
+			clientConnection->bucket = strdup( bucket );
+			strcpy( clientConnection->keyId, keyId );
+			strcpy( clientConnection->secretKey, secretKey );
+			pthread_mutex_unlock( &clientConnection->sendMutex );
+			/* Add the user to the database under the peer's uid. */
+			Query_AddUser( clientConnection->uid, keyId, secretKey, connect.checksum );
+			status = 0;
 		}
-		g_free( keyId );
-		g_free( secretKey );
 	}
-	g_regex_unref( regexes.connectAuth );
 
-	if( status != 0 )
-	{
-		SendMessageToClient( clientConnection->connectionHandle,
-							 "ERROR: unable to parse keys" );
-	}
+	SendReplyToClient( clientConnection, request, status,
+					   NULL, 0, NULL, -1 );
 
 	return( status );
 }
@@ -828,42 +1178,135 @@ ClientConnects(
  * file name.
  * @param clientConnection [in/out] CacheClientConnection structure for the
  *        client.
- * @param request [in] Creation request parameters with the filename of the
- *        remove file.
- * @return Name of the local file, or \a NULL the file was not cached.
+ * @param request [in] Request header.
+ * @param payload [in] Filename of the remote file.
+ * @return 0 if the file is known, or \a -ENOENT otherwise.
  * Test: unit test (test-filecache.c).
  */
 STATIC int
 ClientRequestsLocalFilename(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	                        )
 {
-	const char *trimmed;
 	const char *localpath;
-	char message[ 5 + 7 + 6 + 1 ];
+	int        status;
 
-	/* Trim the request string, but do not free it, as happens in the TrimString
-	   function. */
-	g_regex_ref( regexes.trimString );
-	trimmed = g_regex_replace( regexes.trimString, request,
-							   -1, 0, "", 0, NULL );
-	g_regex_unref( regexes.trimString );
+	localpath = Query_GetLocalPath( payload );
+	status = ( localpath != NULL ) ? 0 : -ENOENT;
+	SendReplyToClient( clientConnection, request, status,
+					   NULL, 0, localpath, -1 );
+	free( (char*) localpath );
 
-	localpath = Query_GetLocalPath( trimmed );
-	if( localpath == NULL )
+	return( status );
+}
+
+
+
+/**
+ * Determine whether the client may read a cached file.  The file cache runs
+ * as root, so the check stands in for the one that the kernel makes when the
+ * client opens the file by name.  Only the primary group of the client is
+ * known; a client that is denied access may still open the file by name.
+ * @param clientConnection [in] Client Connection structure.
+ * @param fileId [in] Database ID of the file.
+ * @return \a true if the client may read the file, or \a false otherwise.
+ * Test: none.
+ */
+static bool
+ClientMayReadFile(
+	const struct CacheClientConnection *clientConnection,
+	sqlite3_int64                      fileId
+	              )
+{
+	char  *parentname;
+	char  *filename;
+	uid_t parentUid;
+	gid_t parentGid;
+	uid_t uid;
+	gid_t gid;
+	int   permissions;
+	int   readable = 0;
+
+	if( clientConnection->uid == 0 )
 	{
-		sprintf( message, "FILE -" );
+		return( true );
 	}
-	else
+	if( Query_GetOwners( fileId, &parentname, &parentUid, &parentGid,
+						 &filename, &uid, &gid, &permissions ) )
 	{
-		sprintf( message, "FILE %s", localpath );
+		if( clientConnection->uid == uid )
+		{
+			readable = permissions & S_IRUSR;
+		}
+		else if( clientConnection->gid == gid )
+		{
+			readable = permissions & S_IRGRP;
+		}
+		else
+		{
+			readable = permissions & S_IROTH;
+		}
+		free( parentname );
+		free( filename );
 	}
-	free( (char*) trimmed );
-	free( (char*) localpath );
-	SendMessageToClient( clientConnection->connectionHandle, message );
 
-	return( 0 );
+	return( readable != 0 );
+}
+
+
+
+/**
+ * Open a read-only file descriptor for the local copy of a remote file, so
+ * that it can be passed to the client.  A file that has not yet been
+ * downloaded is opened in the unfinished directory; the download writes to
+ * the same file, and the file is moved rather than copied into the cache,
+ * so the descriptor remains valid.  No file is opened unless the file's
+ * owner and permissions allow the client to read it.
+ * @param clientConnection [in] Client Connection structure.
+ * @param fileId [in] Database ID of the file.
+ * @param remotename [in] Remote name of the file.
+ * @return File descriptor, or \a -1 if the file could not be opened or the
+ *         client may not read it.
+ * Test: none.
+ */
+static int
+OpenLocalFile(
+	const struct CacheClientConnection *clientConnection,
+	sqlite3_int64                      fileId,
+	const char                         *remotename
+	          )
+{
+	const char *localpath;
+	char       *filepath;
+	int        fileHandle = -1;
+
+	if( ! ClientMayReadFile( clientConnection, fileId ) )
+	{
+		return( -1 );
+	}
+	localpath = Query_GetLocalPath( remotename );
+	if( localpath != NULL )
+	{
+		filepath = malloc( strlen( CACHE_FILES ) + strlen( localpath )
+						   + sizeof( char ) );
+		if( Query_IsFileCached( fileId ) )
+		{
+			strcpy( filepath, CACHE_FILES );
+			strcat( filepath, localpath );
+		}
+		else
+		{
+			strcpy( filepath, CACHE_INPROGRESS );
+			strcat( filepath, strrchr( localpath, '/' ) + 1 );
+		}
+		fileHandle = open( filepath, O_RDONLY | O_CLOEXEC );
+		free( filepath );
+		free( (char*) localpath );
+	}
+
+	return( fileHandle );
 }
 
 
@@ -871,115 +1314,93 @@ ClientRequestsLocalFilename(
 /**
  * Enter client subscribtion to a file for download.
  * @param clientConnection [in] Client Connection structure.
- * @param request [in] Request parameters.
- * @return Always \a 0.
+ * @param request [in] Request header.
+ * @param payload [in] Filename of the remote file.
+ * @return 0 on success, or \a -ENOENT if the file is not known.  The reply
+ *         passes a file descriptor for the downloaded file.
  */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 STATIC int
 ClientRequestsDownload(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	                  )
 {
 	sqlite3_uint64 fileId;
 	char           localname[ 7 ]; /* unused */
 	bool           isCached;
+	int            status = 0;
+	int            fileHandle = -1;
 
 	/* Determine the file ID for the path. */
-	fileId = FindFile( request, localname );
+	fileId = FindFile( payload, localname );
 	isCached = Query_IsFileCached( fileId );
-	if( isCached )
-	{
-		SendMessageToClient( clientConnection->connectionHandle, "OK" );
-	}
-	else
+	if( ! isCached )
 	{
 		if( 0 < fileId )
 		{
 			ReceiveDownload( fileId, clientConnection->uid );
-			SendMessageToClient( clientConnection->connectionHandle, "OK" );
 		}
 		else
 		{
-			SendMessageToClient( clientConnection->connectionHandle, "ERROR " );
+			status = -ENOENT;
 		}
 	}
-	return( 0 );
+	if( status == 0 )
+	{
+		fileHandle = OpenLocalFile( clientConnection, fileId, payload );
+	}
+	SendReplyToClient( clientConnection, request, status,
+					   NULL, 0, NULL, fileHandle );
+	if( 0 <= fileHandle )
+	{
+		close( fileHandle );
+	}
+	return( status );
 }
 
 
 
 /**
- * 
+ * Create a local file, and the local directory that holds it, for a remote
+ * file that the client opens.  The server responds with the database ID and
+ * the local name of the file, and passes a file descriptor for the file.
  * @param clientConnection [in/out] CacheClientConnection structure for the
  *        client.
- * @param request [in] Subscription request parameters.
+ * @param request [in] Request header.
+ * @param payload [in] Creation request: a CacheCreateRequest structure
+ *        followed by the path name of the file.
  * @return 0 on success, or \a -errno on failure.
  * Test: implied blackbox (test-filecache.c and test-process.c).
  */
 STATIC int ClientRequestsCreate(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	                           )
 {
-	int         status;
-
-	GMatchInfo *matchInfo;
-	gchar      *parentUidStr;
-	gchar      *parentGidStr;
-	gchar      *parentPermissionsStr;
-	gchar      *uidStr;
-	gchar      *gidStr;
-	gchar      *permissionsStr;
-	gchar      *mtimeStr;
-	gchar      *path;
-
-	char          *parentdir;
-	int           parentUid;
-	int           parentGid;
-	int           parentPermissions;
-	sqlite3_int64 parentId;
-	int           uid;
-	int           gid;
-	int           permissions;
-	long long     mtime;
-	char          *filename;
-	char          *localfile;
-	char          *reply;
-	sqlite3_int64 fileId;
-
-	/* Extract parent uid, parent gid, parent permissions, uid, gid,
-	   permissions, mtime, and filename. */
-	g_regex_ref( regexes.createFileOptions );
-	if( g_regex_match( regexes.createFileOptions, request, 0, &matchInfo ) )
+	int                       status;
+	struct CacheCreateRequest create;
+	struct CacheCreateReply   reply;
+	const char                *path;
+	char                      *parentdir;
+	sqlite3_int64             parentId;
+	char                      *localfile = NULL;
+	sqlite3_int64             fileId;
+	int                       fileHandle;
+	char                      *bucket = NULL;
+
+	if( request->length <= sizeof( struct CacheCreateRequest ) )
+	{
+		status = -EINVAL;
+	}
+	else
 	{
-		parentUidStr         = g_match_info_fetch( matchInfo, 1 );
-		parentGidStr         = g_match_info_fetch( matchInfo, 2 );
-		parentPermissionsStr = g_match_info_fetch( matchInfo, 3 );
-		uidStr               = g_match_info_fetch( matchInfo, 4 );
-		gidStr               = g_match_info_fetch( matchInfo, 5 );
-		permissionsStr       = g_match_info_fetch( matchInfo, 6 );
-		mtimeStr             = g_match_info_fetch( matchInfo, 7 );
-		path                 = g_match_info_fetch( matchInfo, 8 );
-		g_match_info_free( matchInfo );
-		/* Create numeric values for uid, gid, permissions, and mtime. */
-		parentUid         = atoi( parentUidStr );
-		parentGid         = atoi( parentGidStr );
-		parentPermissions = atoi( parentPermissionsStr );
-		uid               = atoi( uidStr );
-		gid               = atoi( gidStr );
-		permissions       = atoi( permissionsStr );
-		mtime             = atoll( mtimeStr );
-		g_free( parentUidStr );
-		g_free( parentGidStr );
-		g_free( parentPermissionsStr );
-		g_free( uidStr );
-		g_free( gidStr );
-		g_free( permissionsStr );
-		g_free( mtimeStr );
-
-		filename = TrimString( path );
+		memcpy( &create, payload, sizeof( struct CacheCreateRequest ) );
+		path = &payload[ sizeof( struct CacheCreateRequest ) ];
+
 		/* Identify the directory name. */
 		parentdir = g_path_get_dirname( path );
 		if( strcmp( parentdir, "." ) == 0 )
@@ -989,49 +1410,53 @@ STATIC int ClientRequestsCreate(
 
 		/* Create a local name for the directory and get the ID of
 		   its database entry. */
-		parentId = CreateLocalDir( parentdir, parentUid,
-								   parentGid, parentPermissions );
-		free( parentdir );
+		parentId = CreateLocalDir( parentdir, create.parentUid,
+								   create.parentGid, create.parentPermissions );
+		g_free( parentdir );
 		if( 0 < parentId )
 		{
 			/* Create a local file for the filename and return the name.
 			   The creation automatically increments the subscription count. */
-			if( ( fileId = CreateLocalFile( clientConnection->bucket, filename,
-											uid, gid, permissions,
-											mtime, parentId, &localfile ) )
-				> 0 )
+			pthread_mutex_lock( &clientConnection->sendMutex );
+			if( clientConnection->bucket != NULL )
 			{
-				reply = malloc( strlen( "CREATED " ) + sizeof( localfile )
-								+ 15 + sizeof( char ) );
-				sprintf( reply, "CREATED %s %lld", localfile, fileId );
-				SendMessageToClient( clientConnection->connectionHandle,
-									 reply );
-				free( reply );
-				status = 0;
-			}
-			/* Couldn't create the local file. */
-			else
-			{
-				status = -EIO;
+				bucket = strdup( clientConnection->bucket );
 			}
+			pthread_mutex_unlock( &clientConnection->sendMutex );
+			fileId = CreateLocalFile( bucket, path,
+									  create.uid, create.gid,
+									  create.permissions, create.mtime,
+									  parentId, &localfile );
+			status = ( 0 < fileId ) ? 0 : -EIO;
 		}
 		/* Couldn't create the parent directory. */
 		else
 		{
 			status = -EIO;
-			SendMessageToClient( clientConnection->connectionHandle,
-								 "ERROR: cannot create local directory" );
 		}
 	}
+
+	if( status == 0 )
+	{
+		reply.fileId = fileId;
+		fileHandle = OpenLocalFile( clientConnection, fileId, path );
+		SendReplyToClient( clientConnection, request, status,
+						   &reply, sizeof( reply ), localfile, fileHandle );
+		if( 0 <= fileHandle )
+		{
+			close( fileHandle );
+		}
+#ifdef AUTOTEST
+		printf( "File ID: %lld\n", (long long) fileId );
+#endif
+	}
 	else
 	{
-		status = -EINVAL;
-		SendMessageToClient( clientConnection->connectionHandle,
-							 "ERROR: cannot parse request parameters" );
+		SendReplyToClient( clientConnection, request, status,
+						   NULL, 0, NULL, -1 );
 	}
-
-	free( filename );
-	g_regex_unref( regexes.createFileOptions );
+	free( localfile );
+	free( bucket );
 
 	return( status );
 }
@@ -1073,17 +1498,6 @@ CompileRegexes(
     void
 	           )
 {
-	/* Grep "bucket:uid:keyid:secretkey" from the parameter string. */
-	const char const *connectAuth =
-		"^\\s*([a-zA-Z0-9-\\+_]+)\\s*:\\s*([0-9]{1,5})\\s*:\\s*"
-		"([a-zA-Z0-9\\+/=]{20})\\s*:\\s*([a-zA-Z0-9\\+/=]{40})\\s*$";
-
-	/* Grep uid:gid:perm:mtime:string */
-	const char const *createFileOptions =
-		"([0-9]{1,5})\\s*:\\s*([0-9]{1,5})\\s*:\\s*([0-9]{1,3})\\s*:\\s*"
-		"([0-9]{1,5})\\s*:\\s*([0-9]{1,5})\\s*:\\s*([0-9]{1,3})\\s*:\\s*"
-		"([0-9]{1,20})\\s*:\\s*(.+)";
-
     /* Replace leading and trailing spaces. */
 	const char const *trimString = "^[\\s]+|[\\s]+$";
 
@@ -1108,8 +1522,6 @@ CompileRegexes(
     #define COMPILE_REGEX( regex ) regexes.regex = \
 			g_regex_new( regex, G_REGEX_OPTIMIZE, G_REGEX_MATCH_NOTEMPTY, NULL )
 
-	COMPILE_REGEX( connectAuth );
-	COMPILE_REGEX( createFileOptions );
 	COMPILE_REGEX( trimString );
 	COMPILE_REGEX( rename );
 	COMPILE_REGEX( hostname );
@@ -1130,8 +1542,6 @@ FreeRegexes(
 	void
 	        )
 {
-	g_regex_unref( regexes.connectAuth );
-	g_regex_unref( regexes.createFileOptions );
 	g_regex_unref( regexes.trimString );
 	g_regex_unref( regexes.rename );
 	g_regex_unref( regexes.hostname );
@@ -1144,8 +1554,9 @@ FreeRegexes(
 
 /**
  * This function tests that the permissions grant module is available.
- * @param clientConnection [in] Unused.
- * @param request [in] Unused.
+ * @param clientConnection [in] Client Connection structure.
+ * @param request [in] Request header.
+ * @param payload [in] Unused.
  * @return Always 0.
  * Test: none.
  */
@@ -1153,8 +1564,9 @@ FreeRegexes(
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 static int
 ClientRequestsDebugMessage(
-    struct CacheClientConnection *clientConnection,
-	const char                   *request
+    struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+	const char                      *payload
 	                       )
 {
 	char buffer[ 50 ];
@@ -1162,7 +1574,8 @@ ClientRequestsDebugMessage(
 	/* Send a message that does not carry a valid request. */
 	sprintf( buffer, "DEBUG test socket" );
 	SendGrantMessage( testSocket, buffer, buffer, sizeof( buffer ) );
-	SendMessageToClient( clientConnection->connectionHandle, buffer );
+	SendReplyToClient( clientConnection, request, 0,
+					   NULL, 0, buffer, -1 );
 	return( 0 );
 }
 #pragma GCC diagnostic pop
@@ -1173,13 +1586,15 @@ ClientRequestsDebugMessage(
  * Close a file, marking it ready for synchronization.
  * @param clientConnection [in/out] CacheClientConnection structure for the
  *        client.
- * @param request [in] File close request parameter string with the file ID.
+ * @param request [in] Request header.
+ * @param payload [in] Filename of the remote file.
  * @return Always \0.
  */
 static int
 ClientRequestsFileClose(
-	struct CacheClientConnection *clientConnection,
-    const char                   *request
+	struct CacheClientConnection    *clientConnection,
+	const struct CacheMessageHeader *request,
+    const char                      *payload
 	                    )
 {
 	sqlite3_int64 fileId;
@@ -1187,13 +1602,14 @@ ClientRequestsFileClose(
 
 	bool result;
 
-	fileId = FindFile( request, localname );
+	fileId = FindFile( payload, localname );
 	if( fileId > 0 )
 	{
 		result = Query_DecrementSubscriptionCount( fileId );
 		printf( "Decremented subscription count for %d with status %d\n", (int)fileId, result );
 	}
-	SendMessageToClient( clientConnection->connectionHandle, "OK" );
+	SendReplyToClient( clientConnection, request, 0,
+					   NULL, 0, NULL, -1 );
 	return( 0 );
 }
 
@@ -34,11 +34,37 @@
 /* The preferred upload part size for multipart uploads, in megabytes. */
 #define PREFERRED_CHUNK_SIZE 25
 
+/* Number of threads that serve requests from the filesystem clients, and
+   the number of client connections with pending requests that may wait for
+   them before the daemon stops reading requests. */
+#define CLIENT_WORKER_THREADS 4
+#define CLIENT_QUEUE_LIMIT 64
+
+/* Number of threads that wait for downloads on behalf of the clients, and
+   the number of download requests that may wait for them before the worker
+   that read a download request blocks. */
+#define DOWNLOAD_WAIT_THREADS 16
+#define DOWNLOAD_WAIT_QUEUE_LIMIT 64
+
+/* Number of client connection events collected by one epoll_wait( ). */
+#define CLIENT_EPOLL_EVENTS 32
+
+/* Number of threads that service requests in the permissions grant
+   process. */
+#define GRANT_THREADS 4
+
+/* Maximum size of a datagram to or from the permissions grant process. */
+#define GRANT_MESSAGE_SIZE 512
+
+/* The ETags of uploaded parts are committed to the cache database together,
+   at most this many milliseconds after the first update or when this many
+   updates have accumulated. */
+#define GROUP_COMMIT_INTERVAL 100
+#define GROUP_COMMIT_UPDATES 64
+
 
 struct RegularExpressions
 {
-	GRegex *connectAuth;
-	GRegex *createFileOptions;
 	GRegex *trimString;
 	GRegex *rename;
 	GRegex *hostname;
@@ -55,15 +81,16 @@ void ShutdownFileCache( void );
 void InitializeDownloadCache( void );
 void ShutdownDownloadQueue( void );
 bool ConnectToFileCache( const char *bucket, const char *keyId,
-						 const char *secretKey );
+						 const char *secretKey, enum ChecksumModes checksum );
 void DisconnectFromFileCache( void );
 int CreateCachedFile( const char *path, uid_t parentUid, gid_t parentGid,
 					  int parentPermissions, uid_t uid, gid_t gid,
-					  int permissions, time_t mtime );
-int DownloadCacheFile( const char *path );
+					  int permissions, time_t mtime, int *fileHandle );
+int DownloadCacheFile( const char *path, int *fileHandle );
 int CloseCacheFile( const char *path );
-const char *SendCacheRequest( const char *message );
-const char *ReceiveCacheReply( void );
+int SendCacheRequest( int opcode, const void *fields, size_t fieldsLength,
+					  const char *tail, void *reply, size_t replySize,
+					  int *fileHandle );
 void InitializePermissionsGrant( pid_t childPid, int socketHandle );
 void *ProcessTransferQueues( void *socket );
 void ReceiveDownload( sqlite3_int64 fileId, uid_t owner );
@@ -84,18 +111,21 @@ sqlite3_int64 Query_CreateLocalDir( const char *path, int uid, int gid,
 									int permissions, char *localdir,
 									bool *alreadyExists );
 bool Query_GetDownload( sqlite3_int64 fileId, char **bucket, char **remotepath,
-						char **localfile, char **keyId, char **secretKey );
+						char **localfile, char **keyId, char **secretKey,
+						enum ChecksumModes *checksum );
 bool Query_GetUpload( sqlite3_int64 fileId, int *part, char **bucket,
 					  char **remotePath, char **uploadId,
 					  uid_t *uid, gid_t *gid, int *permissions,
 					  long long int *filesize, char **localPath,
-					  char **keyId, char **secretKey );
+					  char **keyId, char **secretKey,
+					  enum ChecksumModes *checksum );
 bool Query_GetOwners( sqlite3_int64 fileId, char **parentdir,
 					  uid_t *parentUid, gid_t *parentGid, char **filename,
 					  uid_t *uid, gid_t *gid, int *permissions );
 bool Query_DeleteTransfer( sqlite3_int64 fileId );
 bool Query_AddDownload( sqlite3_int64 fileId, uid_t uid );
-bool Query_AddUser( uid_t uid, char keyId[ 21 ], char secretKey[ 41 ] );
+bool Query_AddUser( uid_t uid, char keyId[ 21 ], char secretKey[ 41 ],
+					enum ChecksumModes checksum );
 const char *Query_GetLocalPath( const char *remotename );
 bool Query_DecrementSubscriptionCount( sqlite3_int64 fileId );
 bool Query_IncrementSubscriptionCount( sqlite3_int64 fileId );
@@ -108,9 +138,13 @@ bool Query_AddUpload( sqlite3_int64 fileId, uid_t owner,
 					  long long int filesize );
 void Query_SetUploadId( sqlite3_int64, char *uploadId );
 sqlite3_int64 Query_FindPendingUpload( void );
-void Query_SetPartETag( sqlite3_int64 fileId, int part, const char *md5sum );
+void Query_SetPartETag( sqlite3_int64 fileId, int part, const char *etag,
+						const char *checksum );
 bool Query_AllPartsUploaded( sqlite3_int64 fileId );
-const char *Query_GetPartETag( sqlite3_int64 fileId, int part );
+const char *Query_GetPartETag( sqlite3_int64 fileId, int part,
+							   char **checksum );
+const char *Query_GetFileChecksum( sqlite3_int64 fileId );
+void Query_SetFileChecksum( sqlite3_int64 fileId, const char *checksum );
 bool Query_DeleteUploadTransfer( sqlite3_int64 fileId );
 
 
@@ -28,10 +28,14 @@
 #include <string.h>
 #include <malloc.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "aws-s3fs.h"
 #include "socket.h"
 #include "filecache.h"
+#include "cachestatus.h"
+#include "trace.h"
 
 
 
@@ -39,6 +43,35 @@
 static int                cacheSocketFd;
 static struct sockaddr_un cacheSocketAddress;
 
+/**
+ * A request to the file cache that is waiting for its reply.  FUSE calls the
+ * filesystem from several threads, and each of them may have a request
+ * outstanding on the single cache connection.  The cache may answer them in
+ * any order, so whichever thread is currently reading the socket hands each
+ * reply to the request with the matching request ID.
+ */
+struct CacheReply
+{
+	uint32_t          requestId;
+	int               opcode;
+	bool              received;
+	int               status;
+	void              *reply;
+	size_t            replySize;
+	int               *fileHandle;
+	struct CacheReply *next;
+};
+
+/* Requests are written to the socket one at a time. */
+static pthread_mutex_t   cacheSend_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+/* Requests waiting for replies from the file cache. */
+static pthread_mutex_t   cacheReply_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    cacheReply_cond  = PTHREAD_COND_INITIALIZER;
+static struct CacheReply *pendingCacheReplies = NULL;
+static uint32_t          lastRequestId = 0;
+static bool              cacheReceiverActive = false;
+
 
 /**
  * Connect to the file cache socket. The connection requires that the
@@ -48,40 +81,40 @@ static struct sockaddr_un cacheSocketAddress;
  * @param bucket [in] Bucket name in the Amazon S3 storage.
  * @param keyId [in] Amazon Access Key ID.
  * @param secretKey [in] Secret key ID.
+ * @param checksum [in] Checksum that protects the user's transfers.
  * @return \a true if successfully connected; \a false otherwise.
  * Test: none.
  */
 bool
 ConnectToFileCache(
-	const char *bucket,
-    const char *keyId,
-    const char *secretKey
+	const char         *bucket,
+    const char         *keyId,
+    const char         *secretKey,
+	enum ChecksumModes checksum
 	               )
 {
-    char *request;
-    char *reply;
-    bool success = false;
+	struct CacheConnectRequest request;
+    bool                       success = false;
 
 	/* Open socket connection to the cache server. */
 	CreateClientStreamSocket( SOCKET_NAME, &cacheSocketFd,
 							  &cacheSocketAddress );
 	if( 0 < cacheSocketFd )
 	{
-		/* Send connection data. */
-		request = malloc( strlen( "CONNECT :::" ) + sizeof( char )
-						  + strlen( bucket )
-						  + 5 * sizeof( char )
-						  + strlen( keyId ) + strlen( secretKey ) );
-		sprintf( request, "CONNECT %s:%d:%s:%s",
-				 bucket, (int) getuid( ), keyId, secretKey );
-		reply = (char*) SendCacheRequest( request );
-		free( request );
-
-		if( strcasecmp( reply, "CONNECTED" ) == 0 )
+		/* Send connection data.  The keys have fixed lengths and are not
+		   zero-terminated. */
+		memset( &request, 0, sizeof( request ) );
+		strncpy( request.keyId, keyId, sizeof( request.keyId ) );
+		strncpy( request.secretKey, secretKey, sizeof( request.secretKey ) );
+		request.checksum = checksum;
+		if( SendCacheRequest( CACHE_CONNECT, &request, sizeof( request ),
+							  bucket, NULL, 0, NULL ) == 0 )
 		{
 			success = true;
+			/* Answer status questions from the table that the cache
+			   publishes, if any. */
+			(void) OpenCacheStatusTable( );
 		}
-		free( reply );
 	}
 
     return( success );
@@ -94,43 +127,18 @@ DisconnectFromFileCache(
 	void
 	                    )
 {
-    char *reply;
-
-	reply = (char*) SendCacheRequest( "DISCONNECT" );
-	free( reply );
-}
-
-
-
-/**
- * Retrieve the garbled name of the cached file from the cache.
- * @param cachedFilename [in] Remote filename of the cached file.
- * @return The name of the file in the cache directory, or NULL if
- *         the file is not cached.
- */
-const char*
-GetCachedFilename(
-    const char *cachedFilename
-                  )
-{
-    char       *request;
-	char       *reply;
-	const char *cachedFile = NULL;
-
-    request = malloc( strlen( "FILE " ) + sizeof( char )
-					  + strlen( cachedFilename ) );
-	reply = (char*) SendCacheRequest( request );
-	free( request );
-
-	if( strcasecmp( request, "-" ) != 0 )
-	{
-		cachedFile = reply;
-	}
-	else
-	{
-		free( reply );
-	}
-	return( cachedFile );
+	uint32_t requestId;
+
+	/* The cache closes the connection without replying. */
+	pthread_mutex_lock( &cacheReply_mutex );
+	requestId = ++lastRequestId;
+	pthread_mutex_unlock( &cacheReply_mutex );
+	pthread_mutex_lock( &cacheSend_mutex );
+	(void) SocketSendCacheMessage( cacheSocketFd, CACHE_DISCONNECT,
+								   requestId, 0, NULL, 0, NULL, -1 );
+	close( cacheSocketFd );
+	pthread_mutex_unlock( &cacheSend_mutex );
+	CloseCacheStatusTable( );
 }
 
 
@@ -149,6 +157,8 @@ GetCachedFilename(
  * @param gid [in] The file's gid.
  * @param permissions [in] The file's permissions.
  * @param mtime [in] The file's last modification time.
+ * @param fileHandle [out] Read-only file descriptor for the local file, or
+ *        \a -1 if the cache did not pass one.
  * return 0 on success, or \a -errno on failure.
  */
 int
@@ -160,31 +170,24 @@ CreateCachedFile(
 	uid_t      uid,
 	gid_t      gid,
 	int        permissions,
-	time_t     mtime
+	time_t     mtime,
+	int        *fileHandle
 	             )
 {
-	char *request;
-	char *reply;
-	int  status;
-
-	/* Build a cache filename request. */
-	request = malloc( 7 + 6 + 6 + 6 + 6 + 6 + 6 + 21 + strlen( path ) + 1 );
-	sprintf( request, "CREATE %5d:%5d:%5d:%5d:%5d:%5d:%20lld:%s",
-			 (int) parentUid, (int) parentGid, parentPermissions,
-			 (int) uid, (int) gid, permissions, (long long) mtime, path );
-	reply = (char*) SendCacheRequest( request );
-	if( strncmp( reply, "CREATED ", 8 ) == 0 )
-	{
-		status = 0;
-	}
-	else
-	{
-		/* Reply = "ERROR errno" */
-		status = atoi( &reply[ 7 ] );
-	}
-	free( reply );
-	free( request );
-	return( status );
+	struct CacheCreateRequest request;
+	char                      reply[ sizeof( struct CacheCreateReply )
+									 + 6 + 1 ];
+
+	request.parentUid         = parentUid;
+	request.parentGid         = parentGid;
+	request.parentPermissions = parentPermissions;
+	request.uid               = uid;
+	request.gid               = gid;
+	request.permissions       = permissions;
+	request.mtime             = mtime;
+
+	return( SendCacheRequest( CACHE_CREATE, &request, sizeof( request ),
+							  path, reply, sizeof( reply ), fileHandle ) );
 }
 
 
@@ -194,35 +197,19 @@ CreateCachedFile(
  * file is already in the cache, the function returns immediately without
  * downloading the file.
  * @param path [in] Path of the file on the S3 drive.
+ * @param fileHandle [out] Read-only file descriptor for the cached file, or
+ *        \a -1 if the cache did not pass one.
  * @return 0 on success, or \a -errno on failure.
  */
 int
 DownloadCacheFile(
-    const char *path
+    const char *path,
+	int        *fileHandle
 	              )
 {
-	char *request;
-	char *reply;
-	int  status;
-
-	/* Build a cache filename request. */
-	request = malloc( strlen( "CACHE " ) + strlen( path ) + sizeof( char ) );
-	strcpy( request, "CACHE " );
-	strcat( request, path );
 	/* Tell the cache to start caching this file. */
-	reply = (char*) SendCacheRequest( request );
-	if( strncmp( reply, "OK", 2 ) == 0 )
-	{
-		status = 0;
-	}
-	else
-	{
-		/* Otherwise, ERROR n */
-		status = atoi( &reply[ 6 ] );
-	}
-	free( reply );
-
-	return( status );
+	return( SendCacheRequest( CACHE_DOWNLOAD, NULL, 0, path, NULL, 0,
+							  fileHandle ) );
 }
 
 
@@ -237,24 +224,24 @@ GetLocalFilename(
 	const char *remotepath
 	             )
 {
-	char *request;
-	char *reply;
-	char *localfile;
-
-	request = malloc( strlen( remotepath ) + strlen( "FILE  " ) );
-	strcpy( request, "FILE " );
-	strcat( request, remotepath );
-	reply = (char*) SendCacheRequest( request );
-	if( strncmp( reply, "FILE -", 6 ) != 0 )
+	char               reply[ 6 + 1 + 6 + 1 ];
+	char               *localfile;
+	struct CacheStatus status;
+
+	/* The cache publishes the names of the files that it knows. */
+	if( LookupCacheStatus( remotepath, &status ) )
 	{
-		localfile = strdup( &reply[ 5 ] );
+		localfile = strdup( status.localpath );
+	}
+	else if( SendCacheRequest( CACHE_FILE, NULL, 0, remotepath,
+							   reply, sizeof( reply ), NULL ) == 0 )
+	{
+		localfile = strdup( reply );
 	}
 	else
 	{
 		localfile = NULL;
 	}
-	free( reply );
-	free( request );
 	return( localfile );
 }
 
@@ -271,71 +258,13 @@ CloseCacheFile(
 	const char *path
 	           )
 {
-	char *request;
-	char *reply;
-
-	request = malloc( strlen( path ) + strlen( "DROP  " ) );
-	strcpy( request, "DROP " );
-	strcat( request, path );
-	reply = (char*) SendCacheRequest( request );
-	free( request );
-	free( reply );
+	(void) SendCacheRequest( CACHE_DROP, NULL, 0, path, NULL, 0, NULL );
 
 	return( 0 );
 }
 
 
 
-/**
- * Synchronize stat info for the cached files with the stat info in the stat
- * cache. The function sends all the S3FileStat files whose stat info have
- * changed to the file cache, which returns the files whose stat do not match.
- * @param filenames [in] Array of files that should be synced with the
- *        file cache.
- * @param nFiles [in] Number of files in the array.
- * @param dirtyFiles [out] Array of files that must be synchronized.
- * @return Number of files that must be synchronized.
- */
-int
-GetDirtyStatsList(
-    const char **filenames,
-	int        nFiles,
-	char       ***dirtyFiles
-	              )
-{
-	char request[ 20 ];
-	char **dirtyList = NULL;
-	int  nDirty;
-	int  i;
-	char *reply;
-
-	/* Send the number of files followed by a list of filenames. */
-	strcpy( request, "DIRTYSTAT %d" );
-	reply = (char*) SendCacheRequest( request );
-	for( i = 0; i < nFiles; i++ )
-	{
-		SendCacheRequest( filenames[ i ] );
-	}
-	/* Receive similar reply. */
-	reply = (char*) ReceiveCacheReply( );
-	if( strncasecmp( reply, "DIRTYSTAT ", strlen( "DIRTYSTAT " ) == 0 ) )
-	{
-		nDirty = atoi( &reply[ strlen( "DIRTYSTAT " ) ] );
-		free( reply );
-		/* Build list of dirty files. */
-		dirtyList = malloc( nDirty * sizeof( char* ) );
-		for( i = 0; i < nDirty; i++ )
-		{
-			reply = (char*) ReceiveCacheReply( );
-			dirtyList[ i ] = reply;
-		}
-	}
-	*dirtyFiles = dirtyList;
-	return( nDirty );
-}
-
-
-
 /*
  * Set a new atime for a possibly cached file. This will cause the file's atime
  * setting in the cache to become dirty, but will not trigger any action until
@@ -371,34 +300,204 @@ ReceiveCacheCommand(
 
 
 
-const char*
-SendCacheRequest(
-    const char *request
-                 )
+/**
+ * Hand a reply from the file cache to the request that is waiting for it.
+ * The reply mutex must be locked by the caller.
+ * @param header [in] Header of the reply.
+ * @param payload [in] Zero-terminated payload of the reply.
+ * @param fileHandle [in] File descriptor passed with the reply, or \a -1.
+ * @return Nothing.
+ */
+static void
+DeliverCacheReply(
+	const struct CacheMessageHeader *header,
+	const char                      *payload,
+	int                             fileHandle
+	              )
 {
-	/* Send the request and tell the cache server that a message is pending. */
-	(void) write( cacheSocketFd, request, strlen( request ) + sizeof( char ) );
-	/* Wait for the reply. */
-    return( ReceiveCacheReply( ) );
+	struct CacheReply *waiting;
+
+	for( waiting = pendingCacheReplies; waiting != NULL;
+		 waiting = waiting->next )
+	{
+		if( ( waiting->requestId == header->requestId ) && ! waiting->received )
+		{
+			break;
+		}
+	}
+	/* Replies to requests that nobody waits for are discarded, and so are
+	   file descriptors that the request did not ask for. */
+	if( ( waiting == NULL ) || ( waiting->fileHandle == NULL ) )
+	{
+		if( 0 <= fileHandle )
+		{
+			close( fileHandle );
+		}
+		fileHandle = -1;
+	}
+	if( waiting == NULL )
+	{
+		return;
+	}
+	if( waiting->fileHandle != NULL )
+	{
+		*waiting->fileHandle = fileHandle;
+	}
+
+	if( waiting->opcode != header->opcode )
+	{
+		waiting->status = -EPROTO;
+	}
+	else
+	{
+		waiting->status = header->status;
+		if( waiting->reply != NULL )
+		{
+			if( waiting->replySize <= header->length )
+			{
+				waiting->status = -EMSGSIZE;
+			}
+			else
+			{
+				memcpy( waiting->reply, payload,
+						header->length + sizeof( char ) );
+			}
+		}
+	}
+	waiting->received = true;
 }
 
 
 
-const char*
-ReceiveCacheReply(
-	void
-	              )
+/**
+ * Send a request to the file cache and wait for its reply.  Any number of
+ * threads may wait for replies at the same time; the reply is returned to
+ * the thread that sent the request even if other replies arrive first.
+ * @param opcode [in] Request opcode.
+ * @param fields [in] Fixed fields of the request, or \a NULL.
+ * @param fieldsLength [in] Size of the fixed fields.
+ * @param tail [in] String that follows the fixed fields, or \a NULL.
+ * @param reply [out] Buffer for the payload of the reply, which is
+ *        zero-terminated, or \a NULL if the payload should be discarded.
+ * @param replySize [in] Size of the reply buffer.
+ * @param fileHandle [out] File descriptor passed with the reply, or \a -1 if
+ *        there was none.  If \a NULL, a passed descriptor is closed.
+ * @return Status of the reply, or \a -errno if the request could not be
+ *         completed.
+ */
+int
+SendCacheRequest(
+	int        opcode,
+	const void *fields,
+	size_t     fieldsLength,
+	const char *tail,
+	void       *reply,
+	size_t     replySize,
+	int        *fileHandle
+                 )
 {
-    char buffer[ 4096 ];
-	int  nBytes;
+	struct CacheReply         request;
+	struct CacheReply         *waiting;
+	struct CacheReply         **link;
+	struct CacheMessageHeader header;
+	char                      payload[ CACHE_MAX_PAYLOAD + sizeof( char ) ];
+	int                       status;
+	int                       passedFd;
+	TRACE_SCOPE( "cache", "SendCacheRequest" );
+
+	if( fileHandle != NULL )
+	{
+		*fileHandle = -1;
+	}
 
-	nBytes = read( cacheSocketFd, buffer, sizeof( buffer ) );
-	if( nBytes < 0 )
-    {
-		sprintf( buffer, "ERROR" );
-    }
+	/* Register the request before sending it, because the reply may be
+	   picked up by another thread. */
+	pthread_mutex_lock( &cacheReply_mutex );
+	request.requestId   = ++lastRequestId;
+	request.opcode      = opcode;
+	request.received    = false;
+	request.status      = 0;
+	request.reply       = reply;
+	request.replySize   = replySize;
+	request.fileHandle  = fileHandle;
+	request.next        = pendingCacheReplies;
+	pendingCacheReplies = &request;
+	pthread_mutex_unlock( &cacheReply_mutex );
+
+	pthread_mutex_lock( &cacheSend_mutex );
+	status = SocketSendCacheMessage( cacheSocketFd, opcode, request.requestId,
+									 0, fields, fieldsLength, tail, -1 );
+	pthread_mutex_unlock( &cacheSend_mutex );
+
+	pthread_mutex_lock( &cacheReply_mutex );
+	if( status != 0 )
+	{
+		request.status   = status;
+		request.received = true;
+	}
+	/* One thread at a time reads replies from the socket and hands them to
+	   the waiting requests; the others wait until their replies have been
+	   handed to them. */
+	while( ! request.received )
+	{
+		if( cacheReceiverActive )
+		{
+			pthread_cond_wait( &cacheReply_cond, &cacheReply_mutex );
+			continue;
+		}
+		cacheReceiverActive = true;
+		pthread_mutex_unlock( &cacheReply_mutex );
+		status = SocketReceiveCacheMessage( cacheSocketFd, &header, payload,
+											CACHE_MAX_PAYLOAD, &passedFd );
+		pthread_mutex_lock( &cacheReply_mutex );
+		cacheReceiverActive = false;
+
+		if( 0 <= status )
+		{
+			DeliverCacheReply( &header, payload, passedFd );
+		}
+		/* The oversized reply was skipped and the stream is still in step,
+		   so only the request that the reply belongs to fails. */
+		else if( status == -EMSGSIZE )
+		{
+			for( waiting = pendingCacheReplies; waiting != NULL;
+				 waiting = waiting->next )
+			{
+				if( ( waiting->requestId == header.requestId )
+					&& ! waiting->received )
+				{
+					waiting->status   = status;
+					waiting->received = true;
+				}
+			}
+		}
+		/* The connection is lost, or the stream is out of step because the
+		   length of a reply could not be trusted; none of the replies will
+		   arrive.  The connection is shut down so that later requests fail
+		   at once instead of reading from the middle of a message.  The
+		   descriptor is closed when the client disconnects. */
+		else
+		{
+			shutdown( cacheSocketFd, SHUT_RDWR );
+			for( waiting = pendingCacheReplies; waiting != NULL;
+				 waiting = waiting->next )
+			{
+				if( ! waiting->received )
+				{
+					waiting->status   = status;
+					waiting->received = true;
+				}
+			}
+		}
+		pthread_cond_broadcast( &cacheReply_cond );
+	}
+	/* Unregister the request. */
+	for( link = &pendingCacheReplies; *link != &request;
+		 link = &( *link )->next )
+	{
+	}
+	*link = request.next;
+	pthread_mutex_unlock( &cacheReply_mutex );
 
-	return( strdup( buffer ) );
+	return( request.status );
 }
-
-
@@ -30,16 +30,45 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 #include <glib-2.0/glib.h>
 #include "aws-s3fs.h"
 #include "socket.h"
 #include "filecache.h"
+#include "cachestatus.h"
 
 
 static pthread_mutex_t cacheDatabase_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Group commit of small updates. The transaction is protected by
+   cacheDatabase_mutex. */
+static pthread_cond_t groupCommit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t      groupCommitThread;
+static bool           groupCommitRunning = false;
+static bool           transactionOpen    = false;
+static int            pendingUpdates     = 0;
+
+/* In-memory index of the `files` table for the lookups that the file cache
+   clients make on every request. Entries are loaded from the database on
+   the first lookup and updated whenever the database is updated. */
+struct IndexedFile
+{
+	sqlite3_int64 id;
+	char          *remotename;
+	char          localname[ 7 ];
+	char          parentname[ 7 ];
+	bool          iscached;
+	int           subscriptions;
+};
+static pthread_rwlock_t fileIndex_lock = PTHREAD_RWLOCK_INITIALIZER;
+static GHashTable       *fileIndexByName = NULL;
+static GHashTable       *fileIndexById   = NULL;
+static unsigned long    fileIndexGeneration = 0;
+static bool             fileIndexUpdating   = false;
+
 
-static struct
+/* A database connection with its own set of compiled queries. */
+struct CacheConnection
 {
     sqlite3 *cacheDb;
 
@@ -47,9 +76,8 @@ static struct
     sqlite3_stmt *fileStat;
     sqlite3_stmt *newFile;
 	sqlite3_stmt *newParent;
-    sqlite3_stmt *findFile;
+	sqlite3_stmt *indexFile;
 	sqlite3_stmt *findParent;
-	sqlite3_stmt *getLocalpath;
     sqlite3_stmt *incrementSubscription;
     sqlite3_stmt *decrementSubscription;
 	sqlite3_stmt *download;
@@ -67,9 +95,29 @@ static struct
 	sqlite3_stmt *allPartsComplete;
 	sqlite3_stmt *getEtag;
 	sqlite3_stmt *setEtag;
+	sqlite3_stmt *getFileChecksum;
+	sqlite3_stmt *setFileChecksum;
 	sqlite3_stmt *findUploadRequest;
 	sqlite3_stmt *deleteUploadTransfer;
-} cacheDatabase;
+
+	/* List of read connections, and the database generation that a read
+	   connection was opened for. */
+	struct CacheConnection *next;
+	unsigned int           epoch;
+};
+
+/* All updates go through a single connection that is protected by
+   cacheDatabase_mutex. Lookups use a connection per thread so that they
+   proceed concurrently with the updates. A read connection is only used
+   and closed by its own thread; when the database is shut down, the
+   connections become stale and their threads close them. */
+static struct CacheConnection cacheDatabase;
+static pthread_once_t         readConnectionOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t          readConnectionKey;
+static pthread_mutex_t        readConnections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct CacheConnection *readConnections = NULL;
+static unsigned int           readConnectionEpoch = 0;
+static unsigned int           openReadConnections = 0;
 
 
 struct CacheFileStat
@@ -79,10 +127,18 @@ struct CacheFileStat
 
 
 static void CreateDatabase( sqlite3* cacheDb; );
-static void CompileStandardQueries( sqlite3 *cacheDb );
+static void CompileStandardQueries( struct CacheConnection *connection );
 static bool CompileSqlStatement( sqlite3 *db, const char *const sql,
 								 sqlite3_stmt **query );
 STATIC sqlite3_int64 FindParent( const char *path, char *localname );
+static void *GroupCommitThread( void *unused );
+static void CommitTransaction( void );
+static void CloseConnection( struct CacheConnection *connection );
+static void CreateReadConnectionKey( void );
+static void CloseReadConnection( struct CacheConnection *connection );
+static void ReleaseReadConnection( void *data );
+static void FreeIndexedFile( gpointer data );
+static void PrepareIndexedFileUpdate( void );
 
 
 /* Convenience macro for creating a series of nested "if OK" clauses
@@ -90,10 +146,11 @@ STATIC sqlite3_int64 FindParent( const char *path, char *localname );
 #define BIND_QUERY( rc, stmt, next ) rc = sqlite3_bind_##stmt;   \
                                      if( rc == SQLITE_OK ) { next; }
 #define RESET_QUERY( query ) sqlite3_reset( cacheDatabase.query )
-/* Compile an SQL source entry and add the byte-code to the cacheDatabase
+#define RESET_READ_QUERY( query ) sqlite3_reset( connection->query )
+/* Compile an SQL source entry and add the byte-code to the connection
    structure. */
-#define COMPILESQL( stmt ) CompileSqlStatement( cacheDb, stmt##Sql,   \
-												&cacheDatabase.stmt )
+#define COMPILESQL( stmt ) CompileSqlStatement( connection->cacheDb,       \
+												stmt##Sql, &connection->stmt )
 
 
 
@@ -123,7 +180,8 @@ InitializeFileCacheDatabase(
     int     rc;
 
     /* Open the database. */
-    rc = sqlite3_config( SQLITE_CONFIG_SERIALIZED );
+    /* Each connection is used by one thread at a time. */
+    rc = sqlite3_config( SQLITE_CONFIG_MULTITHREAD );
     if( rc != SQLITE_OK )
     {
         fprintf( stderr, "Cannot open database: %s\n",
@@ -137,27 +195,57 @@ InitializeFileCacheDatabase(
 				 sqlite3_errmsg( cacheDb ) );
 		exit( EXIT_FAILURE );
     }
-    rc = sqlite3_enable_shared_cache( 1 );
+    rc = sqlite3_open( CACHE_DATABASE, &cacheDb );
     if( rc != SQLITE_OK )
     {
         fprintf( stderr, "Cannot open database: %s\n",
 				 sqlite3_errmsg( cacheDb ) );
 		exit( EXIT_FAILURE );
     }
-    rc = sqlite3_open( CACHE_DATABASE, &cacheDb );
+    cacheDatabase.cacheDb = cacheDb;
+
+	/* Use write-ahead logging, which only syncs the log at checkpoints
+	   instead of at every commit. A crash may lose the most recent
+	   transactions, but never corrupts the database. */
+	rc = sqlite3_exec( cacheDb, "PRAGMA journal_mode = WAL; "
+					   "PRAGMA synchronous = NORMAL;", NULL, NULL, NULL );
     if( rc != SQLITE_OK )
     {
-        fprintf( stderr, "Cannot open database: %s\n",
+        fprintf( stderr, "Cannot set journal mode: %s\n",
 				 sqlite3_errmsg( cacheDb ) );
-		exit( EXIT_FAILURE );
     }
-    cacheDatabase.cacheDb = cacheDb;
+	/* Wait for other processes that access the database, rather than
+	   failing immediately. */
+	sqlite3_busy_timeout( cacheDb, 5000 );
 
     /* Create tables if necessary. */
     CreateDatabase( cacheDb );
 
     /* Compile queries that are often used. */
-    CompileStandardQueries( cacheDb );
+    CompileStandardQueries( &cacheDatabase );
+
+	/* Read connections are opened by each thread as needed, and closed
+	   when the thread exits. The key outlives the database, because
+	   threads may exit after it has been shut down. */
+	pthread_once( &readConnectionOnce, CreateReadConnectionKey );
+
+	/* The file index shares its entries between the two tables; the name
+	   table owns them. */
+	fileIndexByName = g_hash_table_new_full( g_str_hash, g_str_equal, NULL,
+											 FreeIndexedFile );
+	fileIndexById   = g_hash_table_new( g_int64_hash, g_int64_equal );
+
+	/* Publish the indexed files to the clients. They ask the file cache
+	   about the files that are not published. */
+	(void) CreateCacheStatusTable( );
+
+	/* Start committing grouped updates. */
+	groupCommitRunning = true;
+	if( pthread_create( &groupCommitThread, NULL, GroupCommitThread, NULL )
+		!= 0 )
+	{
+		groupCommitRunning = false;
+	}
 }
 
 
@@ -173,13 +261,72 @@ ShutdownFileCacheDatabase(
     void
 		                 )
 {
-    #define CLEAR_QUERY( query ) sqlite3_finalize( cacheDatabase.query )
+	struct CacheConnection *connection;
+
+	/* Stop the group commit thread, which commits any pending updates. */
+	if( groupCommitRunning )
+	{
+		pthread_mutex_lock( &cacheDatabase_mutex );
+		groupCommitRunning = false;
+		pthread_cond_signal( &groupCommit_cond );
+		pthread_mutex_unlock( &cacheDatabase_mutex );
+		pthread_join( groupCommitThread, NULL );
+	}
+
+	/* Close the calling thread's read connection. The connections of the
+	   other threads may be in use, so they are only marked as stale; each
+	   thread closes its own when it next uses it or when it exits. */
+	connection = pthread_getspecific( readConnectionKey );
+	if( connection != NULL )
+	{
+		pthread_setspecific( readConnectionKey, NULL );
+		ReleaseReadConnection( connection );
+	}
+	__atomic_add_fetch( &readConnectionEpoch, 1, __ATOMIC_RELEASE );
+
+	pthread_mutex_lock( &cacheDatabase_mutex );
+	CloseConnection( &cacheDatabase );
+	pthread_mutex_unlock( &cacheDatabase_mutex );
+	/* SQLite may only be shut down once all its connections are closed.
+	   Otherwise its resources are released when the process exits. */
+	if( __atomic_load_n( &openReadConnections, __ATOMIC_ACQUIRE ) == 0 )
+	{
+		sqlite3_shutdown( );
+	}
+
+	DestroyCacheStatusTable( );
+
+	pthread_rwlock_wrlock( &fileIndex_lock );
+	g_hash_table_destroy( fileIndexById );
+	g_hash_table_destroy( fileIndexByName );
+	fileIndexById   = NULL;
+	fileIndexByName = NULL;
+	pthread_rwlock_unlock( &fileIndex_lock );
+}
+
+
+
+/**
+ * Finalize the compiled queries of a connection and close it.
+ * @param connection [in/out] Connection to close.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+CloseConnection(
+	struct CacheConnection *connection
+	            )
+{
+	if( connection->cacheDb == NULL )
+	{
+		return;
+	}
+    #define CLEAR_QUERY( query ) sqlite3_finalize( connection->query )
 	CLEAR_QUERY( fileStat );
 	CLEAR_QUERY( newFile );
 	CLEAR_QUERY( newParent );
-	CLEAR_QUERY( getLocalpath );
 	CLEAR_QUERY( findParent );
-	CLEAR_QUERY( findFile );
+	CLEAR_QUERY( indexFile );
 	CLEAR_QUERY( incrementSubscription );
 	CLEAR_QUERY( decrementSubscription );
 	CLEAR_QUERY( download );
@@ -196,11 +343,138 @@ ShutdownFileCacheDatabase(
 	CLEAR_QUERY( allPartsComplete );
 	CLEAR_QUERY( getEtag );
 	CLEAR_QUERY( setEtag );
+	CLEAR_QUERY( getFileChecksum );
+	CLEAR_QUERY( setFileChecksum );
 	CLEAR_QUERY( findUploadRequest );
 	CLEAR_QUERY( deleteUploadTransfer );
+	#undef CLEAR_QUERY
+
+    sqlite3_close( connection->cacheDb );
+	connection->cacheDb = NULL;
+}
+
+
 
-    sqlite3_close( cacheDatabase.cacheDb );
-	sqlite3_shutdown( );
+/**
+ * Create the key for the threads' read connections. This function is called
+ * only once.
+ * @return Nothing.
+ */
+static void
+CreateReadConnectionKey(
+	void
+	                    )
+{
+	pthread_key_create( &readConnectionKey, ReleaseReadConnection );
+}
+
+
+
+/**
+ * Close a read connection that was opened by the calling thread, e.g. when
+ * the thread exits.
+ * @param connection [in] The thread's read connection.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+CloseReadConnection(
+	struct CacheConnection *connection
+	                )
+{
+	if( connection->cacheDb != NULL )
+	{
+		CloseConnection( connection );
+		__atomic_sub_fetch( &openReadConnections, 1, __ATOMIC_RELEASE );
+	}
+}
+
+
+
+/**
+ * Close the calling thread's read connection when the thread exits.
+ * @param data [in] The thread's read connection.
+ * @return Nothing.
+ * Test: none.
+ */
+static void
+ReleaseReadConnection(
+	void *data
+	                  )
+{
+	struct CacheConnection *connection = data;
+	struct CacheConnection **link;
+
+	pthread_mutex_lock( &readConnections_mutex );
+	for( link = &readConnections; *link != NULL; link = &( *link )->next )
+	{
+		if( *link == connection )
+		{
+			*link = connection->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &readConnections_mutex );
+	CloseReadConnection( connection );
+	free( connection );
+}
+
+
+
+/**
+ * Get the calling thread's own connection for a lookup. The connection reads
+ * a snapshot of the committed database without waiting for the writer. Only
+ * the part ETags are committed in groups, and the lookups of the parts
+ * commit the group first; every other update is committed before the writer
+ * releases the cache lock.
+ * @return Connection for the lookup.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static struct CacheConnection*
+GetReadConnection(
+	void
+	              )
+{
+	struct CacheConnection *connection;
+	unsigned int           epoch;
+	int                    rc;
+
+	connection = pthread_getspecific( readConnectionKey );
+	if( connection == NULL )
+	{
+		connection = malloc( sizeof( struct CacheConnection ) );
+		assert( connection != NULL );
+		memset( connection, 0, sizeof( struct CacheConnection ) );
+		pthread_setspecific( readConnectionKey, connection );
+		pthread_mutex_lock( &readConnections_mutex );
+		connection->next = readConnections;
+		readConnections  = connection;
+		pthread_mutex_unlock( &readConnections_mutex );
+	}
+	/* Reopen a connection that was opened before the database was last
+	   shut down. */
+	epoch = __atomic_load_n( &readConnectionEpoch, __ATOMIC_ACQUIRE );
+	if( ( connection->cacheDb != NULL ) && ( connection->epoch != epoch ) )
+	{
+		CloseReadConnection( connection );
+	}
+	if( connection->cacheDb == NULL )
+	{
+		rc = sqlite3_open_v2( CACHE_DATABASE, &connection->cacheDb,
+							  SQLITE_OPEN_READWRITE, NULL );
+		if( rc != SQLITE_OK )
+		{
+			fprintf( stderr, "Cannot open database: %s\n",
+					 sqlite3_errmsg( connection->cacheDb ) );
+			exit( EXIT_FAILURE );
+		}
+		__atomic_add_fetch( &openReadConnections, 1, __ATOMIC_RELAXED );
+		connection->epoch = epoch;
+		sqlite3_busy_timeout( connection->cacheDb, 5000 );
+		CompileStandardQueries( connection );
+	}
+
+	return( connection );
 }
 
 
@@ -242,7 +516,9 @@ CreateDatabase(
 		   its own file stats since last time the file stat was synchronized
 		   with that of the stat cache.
 		   `fileinsync` indicates that the local file has not changed since
-		   the last time the file was synchronized with the remote host. */
+		   the last time the file was synchronized with the remote host.
+		   `checksum` is the CRC32C checksum that S3 stores with the file,
+		   if any, as of the last transfer. */
         "CREATE TABLE IF NOT EXISTS files(                     \
             id INTEGER PRIMARY KEY,                            \
             bucket VARCHAR( 128 ) NOT NULL,                    \
@@ -259,15 +535,18 @@ CreateDatabase(
             iscached BOOLEAN NOT NULL DEFAULT \'0\',           \
             statcacheinsync BOOLEAN NOT NULL DEFAULT \'1\',    \
             filechanged BOOLEAN NOT NULL DEFAULT \'0\',        \
+            checksum VARCHAR( 16 ) NULL,                       \
             FOREIGN KEY( parent ) REFERENCES parents( id )     \
         ); "
         "CREATE INDEX IF NOT EXISTS remotename_id ON files( remotename ); "
 
-		/* The `users` table contains users and their keys. */
+		/* The `users` table contains users, their keys, and the checksum
+		   that protects their transfers. */
 		"CREATE TABLE IF NOT EXISTS users(                 \
             uid INTEGER UNIQUE NOT NULL,                   \
             keyid VARCHAR( 21 ) NOT NULL,                  \
-            secretkey VARCHAR( 41 ) NOT NULL               \
+            secretkey VARCHAR( 41 ) NOT NULL,              \
+            checksum INTEGER NOT NULL DEFAULT \'0\'        \
         ); "
         "CREATE INDEX IF NOT EXISTS id ON users( uid ); "
 
@@ -296,12 +575,24 @@ CreateDatabase(
 	        inprogress BOOLEAN NOT NULL DEFAULT \'0\',              \
 	        completed  BOOLEAN NOT NULL DEFAULT \'0\',              \
             etag VARCHAR( 32 ) NULL,                                \
+            checksum VARCHAR( 8 ) NULL,                             \
             FOREIGN KEY( transfer ) REFERENCES transfers( id )      \
                 ON DELETE CASCADE				                    \
 	    ); "
 		"";
 
 
+    /* Columns that were added after the first release. The statements fail
+	   harmlessly if the tables already have the columns. */
+	static const char *const addColumnSql[ ] =
+	{
+		"ALTER TABLE files ADD COLUMN checksum VARCHAR( 16 ) NULL;",
+		"ALTER TABLE users ADD COLUMN checksum INTEGER NOT NULL DEFAULT '0';",
+		"ALTER TABLE transferparts ADD COLUMN checksum VARCHAR( 8 ) NULL;",
+		NULL
+	};
+	int i;
+
     rc = sqlite3_exec( cacheDb, createSql, NULL, NULL, &errMsg );
     if( rc != SQLITE_OK )
     {
@@ -310,20 +601,24 @@ CreateDatabase(
 		sqlite3_close( cacheDb );
 		exit( EXIT_FAILURE );
     }
+	for( i = 0; addColumnSql[ i ] != NULL; i++ )
+	{
+		(void) sqlite3_exec( cacheDb, addColumnSql[ i ], NULL, NULL, NULL );
+	}
 }
 
 
 
 /**
- * Precompile the often-used SQL queries and place them in the cacheDatabase
+ * Precompile the often-used SQL queries and place them in a connection
  * structure.
- * @param cacheDb [in] Opened SQLite database.
+ * @param connection [in/out] Connection with an opened SQLite database.
  * @return Nothing.
  * Test: implicit blackbox (test-filecache.c).
  */
 static void
 CompileStandardQueries(
-    sqlite3 *cacheDb
+    struct CacheConnection *connection
 	                  )
 {
 
@@ -343,13 +638,11 @@ CompileStandardQueries(
 	const char *findParentSql =
 		"SELECT id, localname FROM parents WHERE remotename = ?;";
 
-    const char *const findFileSql =
-        "SELECT id, localname FROM files WHERE remotename = ?;";
-
-	const char *const getLocalpathSql =
-		"SELECT files.localname, parents.localname           \
-         FROM parents                                        \
-             LEFT JOIN files ON files.parent = parents.id    \
+	const char *const indexFileSql =
+		"SELECT files.id, files.localname, parents.localname,     \
+                files.iscached, files.subscriptions               \
+         FROM files                                               \
+             LEFT JOIN parents ON files.parent = parents.id       \
          WHERE files.remotename = ?;";
 
     const char *const incrementSubscriptionSql = 
@@ -360,7 +653,7 @@ CompileStandardQueries(
 
 	const char *const downloadSql =
 		"SELECT files.bucket, files.remotename, files.localname,  \
-                users.keyid, users.secretkey                      \
+                users.keyid, users.secretkey, users.checksum      \
         FROM transfers                                            \
             LEFT JOIN files ON transfers.file = files.id          \
             LEFT JOIN users ON transfers.owner = users.uid        \
@@ -404,7 +697,8 @@ CompileStandardQueries(
         VALUES( ?, ?, ?, 'u' );";
 
 	const char *const addUserSql =
-		"INSERT INTO users( uid, keyid, secretkey ) VALUES( ?, ?, ? );";
+		"INSERT OR REPLACE INTO users( uid, keyid, secretkey, checksum ) "
+		"VALUES( ?, ?, ?, ? );";
 
 	const char *const setCachedFlagSql =
 		"UPDATE files SET iscached = '1' WHERE id = ?;";
@@ -425,7 +719,7 @@ CompileStandardQueries(
 		"    files.uid, files.gid, files.permissions, "
 		"    files.filesize, files.localname,"
 		"    parents.localname, "
-		"    users.keyid, users.secretkey "
+		"    users.keyid, users.secretkey, users.checksum "
 		"FROM files "
 		"INNER JOIN transfers ON files.id = transfers.file "
 		"INNER JOIN transferparts ON transferparts.transfer = transfers.id "
@@ -447,7 +741,7 @@ CompileStandardQueries(
 		"WHERE transfers.file = ?;";
 
 	const char *const getEtagSql =
-		"SELECT etag FROM transferparts "
+		"SELECT etag, transferparts.checksum FROM transferparts "
 		"LEFT JOIN transfers ON transfers.id = transferparts.transfer "
 		"WHERE transfers.file = ? AND part = ?;";
 
@@ -459,7 +753,7 @@ CompileStandardQueries(
 		   "WHERE t.file = ? AND p.part = ?; "; */
 	const char *const setEtagSql =
 		"UPDATE transferparts "
-		"SET etag = ? "
+		"SET etag = ?, checksum = ? "
 		"WHERE id IN "
 		"( "
 		"    SELECT transferparts.id FROM transferparts "
@@ -469,6 +763,12 @@ CompileStandardQueries(
 		"    AND   transferparts.part = ? "
 		"); ";
 
+	const char *const getFileChecksumSql =
+		"SELECT checksum FROM files WHERE id = ?;";
+
+	const char *const setFileChecksumSql =
+		"UPDATE files SET checksum = ? WHERE id = ?;";
+
 	const char *const findUploadRequestSql =
 		"SELECT file FROM transferparts "
 		"INNER JOIN transfers ON transferparts.transfer = transfers.id "
@@ -492,8 +792,7 @@ CompileStandardQueries(
     COMPILESQL( newFile );
     COMPILESQL( newParent );
     COMPILESQL( findParent );
-    COMPILESQL( findFile );
-    COMPILESQL( getLocalpath );
+    COMPILESQL( indexFile );
     COMPILESQL( incrementSubscription );
     COMPILESQL( decrementSubscription );
 	COMPILESQL( download );
@@ -511,6 +810,8 @@ CompileStandardQueries(
 	COMPILESQL( allPartsComplete );
 	COMPILESQL( getEtag );
 	COMPILESQL( setEtag );
+	COMPILESQL( getFileChecksum );
+	COMPILESQL( setFileChecksum );
 	COMPILESQL( findUploadRequest );
 	COMPILESQL( deleteUploadTransfer );
 }
@@ -552,7 +853,10 @@ CompileSqlStatement(
 
 
 /**
- * Prevent other threads from accessing the cache.
+ * Prevent other threads from accessing the cache. Grouped updates that are
+ * still open are committed, so that the updates made under the lock are
+ * committed as soon as they are made, and lookups see them without waiting
+ * for the group.
  * @return Nothing.
  * Test: implicit blackbox (test-filecache.c).
  */
@@ -560,6 +864,23 @@ static inline void
 LockCache(
     void
 	      )
+{
+    pthread_mutex_lock( &cacheDatabase_mutex );
+    CommitTransaction( );
+}
+
+
+
+/**
+ * Prevent other threads from accessing the cache in order to make an update
+ * that is committed together with other updates.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static inline void
+LockCacheForGroupedUpdate(
+    void
+	                      )
 {
     pthread_mutex_lock( &cacheDatabase_mutex );
 }
@@ -582,112 +903,406 @@ UnlockCache(
 
 
 /**
- * Determine if the specified file is cached.
- * @param path [in] Remote filename.
- * @param localname [out] The basename of the local file.
- * @return ID of the file if it is cached, or 0 otherwise.
- * Test: unit test (test-filecache.c).
+ * Begin a transaction for one or more updates unless one is already open.
+ * The caller must hold the cache lock.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
  */
-sqlite3_int64
-FindFile(
-    const char *path,
-	char       *localname
-         )
+static void
+BeginTransaction(
+    void
+	             )
 {
-    int           rc;
-    sqlite3_stmt  *searchQuery = cacheDatabase.findFile;
-    sqlite3_int64 fileId = 0;
-	const char    *basename;
+	int rc;
 
-    /* Search for the remote filename in the database. */
-    LockCache( );
-    BIND_QUERY( rc, text( searchQuery, 1, path, -1, NULL ), );
-    if( rc == SQLITE_OK )
+	if( ! transactionOpen )
 	{
-		/* Read the `id` for the path. */
-		while( ( rc = sqlite3_step( searchQuery ) ) == SQLITE_ROW )
+		rc = sqlite3_exec( cacheDatabase.cacheDb, "BEGIN", NULL, NULL, NULL );
+		if( rc == SQLITE_OK )
 		{
-			fileId = sqlite3_column_int64( searchQuery, 0 );
-			basename = (const char*) sqlite3_column_text( searchQuery, 1 );
-			strncpy( localname, basename, 6 );
+			transactionOpen = true;
+			pendingUpdates  = 0;
 		}
-		if( rc != SQLITE_DONE )
+		else
 		{
-			fprintf( stderr,
-					 "Select statement didn't finish with DONE (%i): %s\n",
+			fprintf( stderr, "Cannot begin transaction (%i): %s\n",
 					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
 		}
 	}
-	else
-    {
-        fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
-    }
-	RESET_QUERY( findFile );
-    UnlockCache( );
+}
 
-    return( fileId );
+
+
+/**
+ * Commit the open transaction, if any. The caller must hold the cache lock.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static void
+CommitTransaction(
+    void
+	              )
+{
+	int rc;
+
+	if( transactionOpen )
+	{
+		rc = sqlite3_exec( cacheDatabase.cacheDb, "COMMIT", NULL, NULL, NULL );
+		if( rc != SQLITE_OK )
+		{
+			fprintf( stderr, "Cannot commit transaction (%i): %s\n",
+					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+			sqlite3_exec( cacheDatabase.cacheDb, "ROLLBACK", NULL, NULL, NULL );
+		}
+		transactionOpen = false;
+		pendingUpdates  = 0;
+	}
 }
 
 
 
 /**
- * Return the local path (directory and filename) for a local file.
+ * Account for an update that may be committed together with other updates.
+ * The transaction is committed once enough updates have accumulated;
+ * otherwise the group commit thread commits it shortly, or the next update
+ * that is not grouped commits it. The caller must hold the cache lock from
+ * LockCacheForGroupedUpdate and must have called BeginTransaction before the
+ * update.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static void
+GroupCommit(
+    void
+	        )
+{
+	if( GROUP_COMMIT_UPDATES <= ++pendingUpdates )
+	{
+		CommitTransaction( );
+	}
+	else if( pendingUpdates == 1 )
+	{
+		pthread_cond_signal( &groupCommit_cond );
+	}
+}
+
+
+
+/**
+ * Commit grouped updates no later than GROUP_COMMIT_INTERVAL milliseconds
+ * after the first update in the group.
+ * @param unused [in] Unused.
+ * @return Nothing.
+ */
+static void*
+GroupCommitThread(
+    void *unused
+	              )
+{
+	struct timespec deadline;
+
+	(void) unused;
+
+	pthread_mutex_lock( &cacheDatabase_mutex );
+	while( groupCommitRunning )
+	{
+		if( ! transactionOpen )
+		{
+			pthread_cond_wait( &groupCommit_cond, &cacheDatabase_mutex );
+			continue;
+		}
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_nsec += GROUP_COMMIT_INTERVAL * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait( &groupCommit_cond, &cacheDatabase_mutex,
+								&deadline );
+		CommitTransaction( );
+	}
+	CommitTransaction( );
+	pthread_mutex_unlock( &cacheDatabase_mutex );
+
+	return( NULL );
+}
+
+
+
+/**
+ * Get a connection for a lookup of the parts of an upload. The part ETags
+ * are committed in groups, so any group that is still open is committed
+ * before the lookup.
+ * @return Connection for the lookup.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static struct CacheConnection*
+GetPartsReadConnection(
+	void
+	                   )
+{
+	LockCache( );
+	UnlockCache( );
+
+	return( GetReadConnection( ) );
+}
+
+
+
+/**
+ * Free an entry in the file index.
+ * @param data [in] The entry.
+ * @return Nothing.
+ */
+static void
+FreeIndexedFile(
+	gpointer data
+	            )
+{
+	struct IndexedFile *entry = data;
+
+	free( entry->remotename );
+	free( entry );
+}
+
+
+
+/**
+ * Publish the status of an indexed file to the clients. The caller must hold
+ * the write lock of the file index.
+ * @param entry [in] The entry.
+ * @return Nothing.
+ */
+static void
+PublishIndexedFile(
+	const struct IndexedFile *entry
+	               )
+{
+	if( ( entry->parentname[ 0 ] != '\0' )
+		&& ( entry->localname[ 0 ] != '\0' ) )
+	{
+		PublishCacheStatus( entry->remotename, entry->id, entry->parentname,
+							entry->localname, entry->iscached );
+	}
+}
+
+
+
+/**
+ * Look up a file in the file index, loading it from the database if it is
+ * not indexed yet.
  * @param remotename [in] Remote filename.
- * @return Path name or \a NULL if the file is not known by the file cache.
- * Test: unit test (test-filecache.c).
+ * @param file [out] Copy of the index entry.
+ * @return \a true if the file is known by the file cache, or \a false
+ *         otherwise.
+ * Test: implicit blackbox (test-filecache.c).
  */
-const char*
-Query_GetLocalPath(
-    const char *remotename
-                   )
+static bool
+LookupIndexedFile(
+	const char         *remotename,
+	struct IndexedFile *file
+	              )
 {
-    int           rc;
-    sqlite3_stmt  *searchQuery = cacheDatabase.getLocalpath;
-	const char    *dirname;
-	const char    *basename;
-	char          localpath[ 14 ];
-	const char    *toReturn    = NULL;
-	bool          found        = false;
+	struct CacheConnection *connection;
+	struct IndexedFile     *entry;
+	sqlite3_stmt           *indexQuery;
+	unsigned long          generation;
+	const char             *localname;
+	const char             *parentname;
+	bool                   found = false;
+	int                    rc;
+
+	pthread_rwlock_rdlock( &fileIndex_lock );
+	entry = g_hash_table_lookup( fileIndexByName, remotename );
+	if( entry != NULL )
+	{
+		*file = *entry;
+		found = true;
+	}
+	generation = fileIndexGeneration;
+	pthread_rwlock_unlock( &fileIndex_lock );
+	if( found )
+	{
+		return( true );
+	}
 
-    /* Search for the remote filename in the database. */
-    LockCache( );
-    BIND_QUERY( rc, text( searchQuery, 1, remotename, -1, NULL ), );
+	/* Load the entry from the database. */
+	connection = GetReadConnection( );
+	indexQuery = connection->indexFile;
+	memset( file, 0, sizeof( struct IndexedFile ) );
+    BIND_QUERY( rc, text( indexQuery, 1, remotename, -1, NULL ), );
     if( rc == SQLITE_OK )
 	{
-		while( ( rc = sqlite3_step( searchQuery ) ) == SQLITE_ROW )
+		while( ( rc = sqlite3_step( indexQuery ) ) == SQLITE_ROW )
 		{
-			/* Get the directory and the basename. */
-			basename = (const char*) sqlite3_column_text( searchQuery, 0 );
-			dirname  = (const char*) sqlite3_column_text( searchQuery, 1 );
-			if( ( dirname != NULL ) && ( basename != NULL ) )
+			file->id   = sqlite3_column_int64( indexQuery, 0 );
+			localname  = (const char*) sqlite3_column_text( indexQuery, 1 );
+			parentname = (const char*) sqlite3_column_text( indexQuery, 2 );
+			if( localname != NULL )
 			{
-				found = true;
-				strcpy( localpath, dirname );
-				strcat( localpath, "/" );
-				strcat( localpath, basename );
-				found = true;
+				strncpy( file->localname, localname, 6 );
 			}
+			if( parentname != NULL )
+			{
+				strncpy( file->parentname, parentname, 6 );
+			}
+			file->iscached      = sqlite3_column_int( indexQuery, 3 ) != 0;
+			file->subscriptions = sqlite3_column_int( indexQuery, 4 );
+			found = true;
 		}
 		if( rc != SQLITE_DONE )
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
     {
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
-	RESET_QUERY( getLocalpath );
-    UnlockCache( );
+	RESET_READ_QUERY( indexFile );
 
+	/* Add the entry to the index unless the database was updated while it
+	   was being read, in which case the entry may already be outdated, or
+	   an update is under way and the row may already include a change that
+	   has yet to be applied to the index. */
 	if( found )
 	{
+		pthread_rwlock_wrlock( &fileIndex_lock );
+		if( ( generation == fileIndexGeneration ) && ( ! fileIndexUpdating )
+			&& ( g_hash_table_lookup( fileIndexByName, remotename ) == NULL ) )
+		{
+			entry = malloc( sizeof( struct IndexedFile ) );
+			assert( entry != NULL );
+			*entry = *file;
+			entry->remotename = strdup( remotename );
+			g_hash_table_insert( fileIndexByName, entry->remotename, entry );
+			g_hash_table_insert( fileIndexById, &entry->id, entry );
+			PublishIndexedFile( entry );
+		}
+		pthread_rwlock_unlock( &fileIndex_lock );
+	}
+	file->remotename = NULL;
+
+	return( found );
+}
+
+
+
+/**
+ * Prevent lookups from adding entries to the file index until the update
+ * that is about to be made has been applied with UpdateIndexedFile( ). A
+ * lookup may otherwise read the updated row between the update and
+ * UpdateIndexedFile( ), and the change would be applied to the entry twice.
+ * The caller must hold the cache lock.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static void
+PrepareIndexedFileUpdate(
+	void
+	                     )
+{
+	pthread_rwlock_wrlock( &fileIndex_lock );
+	fileIndexGeneration++;
+	fileIndexUpdating = true;
+	pthread_rwlock_unlock( &fileIndex_lock );
+}
+
+
+
+/**
+ * Update the cache status or the subscription count of an indexed file after
+ * the database has been updated, and allow lookups to add entries to the
+ * index again. The caller must have called PrepareIndexedFileUpdate( ) before
+ * the update, and must still hold the cache lock so that the lookups see the
+ * new generation. If the update failed, the function is called with no
+ * changes.
+ * @param fileId [in] ID of the file.
+ * @param setCached [in] Mark the file as cached.
+ * @param subscriptionChange [in] Amount by which to change the subscription
+ *        count.
+ * @return Nothing.
+ * Test: implicit blackbox (test-filecache.c).
+ */
+static void
+UpdateIndexedFile(
+	sqlite3_int64 fileId,
+	bool          setCached,
+	int           subscriptionChange
+	              )
+{
+	struct IndexedFile *entry;
+
+	pthread_rwlock_wrlock( &fileIndex_lock );
+	fileIndexGeneration++;
+	fileIndexUpdating = false;
+	entry = g_hash_table_lookup( fileIndexById, &fileId );
+	if( entry != NULL )
+	{
+		entry->subscriptions = entry->subscriptions + subscriptionChange;
+		if( setCached && ! entry->iscached )
+		{
+			entry->iscached = true;
+			PublishIndexedFile( entry );
+		}
+	}
+	pthread_rwlock_unlock( &fileIndex_lock );
+}
+
+
+
+/**
+ * Determine if the specified file is cached.
+ * @param path [in] Remote filename.
+ * @param localname [out] The basename of the local file.
+ * @return ID of the file if it is cached, or 0 otherwise.
+ * Test: unit test (test-filecache.c).
+ */
+sqlite3_int64
+FindFile(
+    const char *path,
+	char       *localname
+         )
+{
+	struct IndexedFile file;
+    sqlite3_int64      fileId = 0;
+
+	if( LookupIndexedFile( path, &file ) )
+	{
+		fileId = file.id;
+		strncpy( localname, file.localname, 6 );
+	}
+
+    return( fileId );
+}
+
+
+
+/**
+ * Return the local path (directory and filename) for a local file.
+ * @param remotename [in] Remote filename.
+ * @return Path name or \a NULL if the file is not known by the file cache.
+ * Test: unit test (test-filecache.c).
+ */
+const char*
+Query_GetLocalPath(
+    const char *remotename
+                   )
+{
+	struct IndexedFile file;
+	char               localpath[ 14 ];
+	const char         *toReturn = NULL;
+
+	if( LookupIndexedFile( remotename, &file )
+		&& ( file.parentname[ 0 ] != '\0' ) && ( file.localname[ 0 ] != '\0' ) )
+	{
+		strcpy( localpath, file.parentname );
+		strcat( localpath, "/" );
+		strcat( localpath, file.localname );
 		toReturn = strdup( localpath );
 	}
+
     return( toReturn );
 }
 
@@ -868,12 +1483,12 @@ FindParent(
 	char       *localname
 	       )
 {
+	struct CacheConnection *connection = GetReadConnection( );
 	int           rc;
-    sqlite3_stmt  *parentQuery = cacheDatabase.findParent;
+    sqlite3_stmt  *parentQuery = connection->findParent;
 	sqlite3_int64 parentId = 0;
 	const char    *basename;
 
-	LockCache( );
     BIND_QUERY( rc, text( parentQuery, 1, parent, -1, NULL ), );
 	if( rc == SQLITE_OK )
     {
@@ -888,16 +1503,15 @@ FindParent(
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
 	{
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
-	RESET_QUERY( findParent );
-	UnlockCache( );
+	RESET_READ_QUERY( findParent );
 
 	return( parentId );
 }
@@ -913,25 +1527,28 @@ FindParent(
  * @param localPath [out] Pointer to the file's local path name string.
  * @param keyId [out] Pointer to the user's Amazon Key ID string.
  * @param secretKey [out] Pointer to the user's Secret Key string.
+ * @param checksum [out] Pointer to the checksum that protects the user's
+ *        transfers.
  * @return \a true if the information was found, or \a false otherwise.
  * Test: unit test (filecache.c).
  */
 bool
 Query_GetDownload(
-	sqlite3_int64 fileId,
-	char          **bucket,
-	char          **remotePath,
-	char          **localPath,
-	char          **keyId,
-    char          **secretKey
+	sqlite3_int64      fileId,
+	char               **bucket,
+	char               **remotePath,
+	char               **localPath,
+	char               **keyId,
+    char               **secretKey,
+	enum ChecksumModes *checksum
 	              )
 {
+	struct CacheConnection *connection = GetReadConnection( );
 	bool         status = false;
 	int          rc;
-    sqlite3_stmt *filenamesQuery = cacheDatabase.download;
+    sqlite3_stmt *filenamesQuery = connection->download;
 	int          rows = 0;
 
-	LockCache( );
     BIND_QUERY( rc, int64( filenamesQuery, 1, fileId ), );
 	if( rc == SQLITE_OK )
     {
@@ -957,19 +1574,20 @@ Query_GetDownload(
 								  sqlite3_column_text( filenamesQuery, 3 ) );
 			*secretKey  = strdup( (const char*)
 								  sqlite3_column_text( filenamesQuery, 4 ) );
+			*checksum   = sqlite3_column_int( filenamesQuery, 5 );
 			status = true;
 		}
 		if( rc != SQLITE_DONE )
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
 	{
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
 
 	#ifdef AUTOTEST
@@ -983,10 +1601,10 @@ Query_GetDownload(
 		*localPath  = NULL;
 		*keyId      = NULL;
 		*secretKey  = NULL;
+		*checksum   = CHECKSUM_MD5;
 	}
 
-	RESET_QUERY( download );
-	UnlockCache( );
+	RESET_READ_QUERY( download );
 
 	return( status );
 }
@@ -1019,13 +1637,13 @@ Query_GetOwners(
 	int           *permissions
 	            )
 {
+	struct CacheConnection *connection = GetReadConnection( );
 	bool         status = false;
 	int          rc;
-    sqlite3_stmt *ownersQuery   = cacheDatabase.allOwners;
+    sqlite3_stmt *ownersQuery   = connection->allOwners;
 	char         *resParentname = "";
 	char         *resFilename   = "";
 
-	LockCache( );
     BIND_QUERY( rc, int64( ownersQuery, 1, fileId ), );
 	if( rc == SQLITE_OK )
     {
@@ -1048,13 +1666,13 @@ Query_GetOwners(
 			status = false;
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
 	{
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
 
 	if( status != true )
@@ -1063,8 +1681,7 @@ Query_GetOwners(
 		*filename   = NULL;
 	}
 
-	RESET_QUERY( allOwners );
-	UnlockCache( );
+	RESET_READ_QUERY( allOwners );
 
 	return( status );
 }
@@ -1146,6 +1763,7 @@ Query_IncrementOrDecrement(
 	else           countQuery = cacheDatabase.decrementSubscription;
 
 	LockCache( );
+	PrepareIndexedFileUpdate( );
     BIND_QUERY( rc, int64( countQuery, 1, fileId ), );
 	if( rc == SQLITE_OK )
     {
@@ -1175,6 +1793,7 @@ Query_IncrementOrDecrement(
 
 	if( increment) RESET_QUERY( incrementSubscription );
 	else           RESET_QUERY( decrementSubscription );
+	UpdateIndexedFile( fileId, false, ! status ? 0 : ( increment ? 1 : -1 ) );
 	UnlockCache( );
 
 	return( status );
@@ -1240,15 +1859,18 @@ Query_AddDownload(
     if( rc == SQLITE_OK )
 	{
 		while( ( rc = sqlite3_step( addQuery ) ) == SQLITE_ROW )
+		{
+			/* No action. */
+		}
+		if( rc == SQLITE_DONE )
 		{
 			status = true;
 		}
-		if( rc != SQLITE_DONE )
+		else
 		{
 			fprintf( stderr,
-					 "Select statement didn't finish with DONE (%i): %s\n",
+					 "Insert statement didn't finish with DONE (%i): %s\n",
 					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
-			status = false;
 		}
 	}
 	else
@@ -1266,20 +1888,24 @@ Query_AddDownload(
 
 
 /**
- * Add a user to the database.
+ * Add a user to the database, or replace the keys and the checksum of a user
+ * who is already known.  The uid must be the one the kernel reported for
+ * the client's socket, since the row for that uid is overwritten.
  * @param uid [in] The user's uid.
  * @param keyId [in] The user's Amazon Access ID.
  * @param secretKey [in] The user's secret key.
+ * @param checksum [in] The checksum that protects the user's transfers.
  * @return \a true if the query succeeded, or \a false otherwise.
  */
 bool
 Query_AddUser(
-	uid_t uid,
-	char  keyId[ 21 ],
-	char  secretKey[ 41 ]
+	uid_t              uid,
+	char               keyId[ 21 ],
+	char               secretKey[ 41 ],
+	enum ChecksumModes checksum
 	          )
 {
-	bool          status;
+	bool          status = false;
     int           rc;
     sqlite3_stmt  *addQuery = cacheDatabase.addUser;
 
@@ -1287,7 +1913,8 @@ Query_AddUser(
     BIND_QUERY( rc, int( addQuery, 1, (int) uid ),
     BIND_QUERY( rc, text( addQuery, 2, keyId, -1, NULL ),
     BIND_QUERY( rc, text( addQuery, 3, secretKey, -1, NULL ),
-		) ) );
+    BIND_QUERY( rc, int( addQuery, 4, (int) checksum ),
+		) ) ) );
     if( rc == SQLITE_OK )
 	{
 		while( ( rc = sqlite3_step( addQuery ) ) == SQLITE_ROW )
@@ -1330,6 +1957,7 @@ Query_MarkFileAsCached(
     sqlite3_stmt  *setQuery = cacheDatabase.setCachedFlag;
 
     LockCache( );
+	PrepareIndexedFileUpdate( );
     BIND_QUERY( rc, int64( setQuery, 1, fileId ), );
     if( rc == SQLITE_OK )
 	{
@@ -1351,6 +1979,7 @@ Query_MarkFileAsCached(
     }
 
 	RESET_QUERY( setCachedFlag );
+	UpdateIndexedFile( fileId, rc == SQLITE_DONE, 0 );
     UnlockCache( );
 }
 
@@ -1366,11 +1995,28 @@ Query_IsFileCached(
 	sqlite3_int64 fileId
 	               )
 {
-    int           rc;
-    sqlite3_stmt  *checkQuery = cacheDatabase.checkCacheStatus;
-	int           cached;
+	struct CacheConnection *connection;
+	struct IndexedFile     *entry;
+    int                    rc;
+    sqlite3_stmt           *checkQuery;
+	int                    cached = 0;
+
+	/* Use the index if the file has been looked up before. */
+	pthread_rwlock_rdlock( &fileIndex_lock );
+	entry = g_hash_table_lookup( fileIndexById, &fileId );
+	if( entry != NULL )
+	{
+		cached = entry->iscached;
+	}
+	pthread_rwlock_unlock( &fileIndex_lock );
+	if( entry != NULL )
+	{
+		return( cached ? true : false );
+	}
+
+	connection = GetReadConnection( );
+	checkQuery = connection->checkCacheStatus;
 
-    LockCache( );
     BIND_QUERY( rc, int64( checkQuery, 1, fileId ), );
     if( rc == SQLITE_OK )
 	{
@@ -1382,16 +2028,15 @@ Query_IsFileCached(
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
     {
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
-	RESET_QUERY( checkCacheStatus );
-    UnlockCache( );
+	RESET_READ_QUERY( checkCacheStatus );
 
 	return( cached ? true : false );
 }
@@ -1419,7 +2064,9 @@ Query_CreateMultiparts(
     LockCache( );
 
 	/* Create "parts" entries in the database, each representing a multipart
-	   upload section. */
+	   upload section. The parts are inserted in a single transaction, which
+	   also takes any pending grouped updates along. */
+	BeginTransaction( );
 	check = 0;
 	for( i = 0; i < parts; i++ )
 	{
@@ -1451,6 +2098,7 @@ Query_CreateMultiparts(
 	{
 		fprintf( stderr, "Couldn't write all the parts to the database\n" );
 	}
+	CommitTransaction( );
 
     UnlockCache( );
 }
@@ -1525,28 +2173,31 @@ Query_AddUpload(
  * @param localPath [out] Local file name relative to the cache directory.
  * @param keyId [out] The user's Amazon Access ID.
  * @param secretKey [out] The user's secret key.
+ * @param checksum [out] The checksum that protects the user's transfers.
  * @return \a true if a file or a file part is ready for upload, or \a false
  *         if no file is currently available.
  * Test: unit test (in test-filecache.c).
  */
 bool
 Query_GetUpload(
-	sqlite3_int64 fileId,
-	int           *part,
-	char          **bucket,
-	char          **remotePath,
-	char          **uploadId,
-	uid_t         *uid,
-	gid_t         *gid,
-	int           *permissions,
-	long long int *filesize,
-	char          **localPath,
-	char          **keyId,
-	char          **secretKey
+	sqlite3_int64      fileId,
+	int                *part,
+	char               **bucket,
+	char               **remotePath,
+	char               **uploadId,
+	uid_t              *uid,
+	gid_t              *gid,
+	int                *permissions,
+	long long int      *filesize,
+	char               **localPath,
+	char               **keyId,
+	char               **secretKey,
+	enum ChecksumModes *checksum
 	            )
 {
+	struct CacheConnection *connection = GetPartsReadConnection( );
     int           rc;
-    sqlite3_stmt  *getQuery = cacheDatabase.getUpload;
+    sqlite3_stmt  *getQuery = connection->getUpload;
 	int           count;
 
 	const char *query_bucket;
@@ -1564,9 +2215,9 @@ Query_GetUpload(
 	*localPath  = NULL;
 	*keyId      = NULL;
 	*secretKey  = NULL;
+	*checksum   = CHECKSUM_MD5;
 
 	count = 0;
-    LockCache( );
     BIND_QUERY( rc, int64( getQuery, 1, fileId ), );
     if( rc == SQLITE_OK )
 	{
@@ -1584,6 +2235,7 @@ Query_GetUpload(
 			query_localname  = (const char*)sqlite3_column_text( getQuery, 9 );
 			query_keyId      = (const char*)sqlite3_column_text( getQuery, 10 );
 			query_secretKey  = (const char*)sqlite3_column_text( getQuery, 11 );
+			*checksum        = sqlite3_column_int( getQuery, 12 );
 
 			/* We expect no more than one row. */
 			count++;
@@ -1624,16 +2276,15 @@ Query_GetUpload(
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
     {
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
-	RESET_QUERY( getUpload );
-    UnlockCache( );
+	RESET_READ_QUERY( getUpload );
 
 	return( count ? true : false );
 }
@@ -1696,11 +2347,11 @@ Query_AllPartsUploaded(
 	sqlite3_int64 fileId
 	                   )
 {
+	struct CacheConnection *connection = GetPartsReadConnection( );
     int           rc;
-    sqlite3_stmt  *checkQuery = cacheDatabase.allPartsComplete;
+    sqlite3_stmt  *checkQuery = connection->allPartsComplete;
 	int           partCount;
 
-    LockCache( );
     BIND_QUERY( rc, int64( checkQuery, 1, fileId ), );
     if( rc == SQLITE_OK )
 	{
@@ -1712,17 +2363,16 @@ Query_AllPartsUploaded(
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
 	{
 		fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
 	}
 
-    RESET_QUERY( allPartsComplete );
-    UnlockCache( );
+    RESET_READ_QUERY( allPartsComplete );
 
 	return( partCount == 0 ? true : false );
 }
@@ -1730,24 +2380,30 @@ Query_AllPartsUploaded(
 
 
 /**
- * Get the ETag for a multipart upload part.
+ * Get the ETag and the checksum for a multipart upload part.
  * @param fileId [in] File ID for the file with multipart uploads.
  * @param part [in] Part number.
+ * @param checksum [out] Pointer to the part's CRC32C checksum, or to
+ *        \a NULL if the part was uploaded without one.
  * @return The multipart's ETag or \a "NULL" if no ETag was assigned.
  * Test: unit test (in test-filecache.c).
  */
 const char*
 Query_GetPartETag(
 	sqlite3_int64 fileId,
-	int           part
+	int           part,
+	char          **checksum
 	              )
 {
+	struct CacheConnection *connection = GetPartsReadConnection( );
     int           rc;
-    sqlite3_stmt  *etagQuery = cacheDatabase.getEtag;
+    sqlite3_stmt  *etagQuery = connection->getEtag;
 	const char    *query_etag;
+	const char    *query_checksum;
 	const char    *etag = NULL;
 
-    LockCache( );
+	*checksum = NULL;
+
     BIND_QUERY( rc, int64( etagQuery, 1, fileId ),;
 	BIND_QUERY( rc, int( etagQuery, 2, part ),
 		) );
@@ -1759,6 +2415,7 @@ Query_GetPartETag(
 			{
 				fprintf( stderr, "Multiple rows returned." );
 				free( (char*) etag );
+				free( *checksum );
 			}
 			query_etag = (const char*) sqlite3_column_text( etagQuery, 0 );
 			if( query_etag != NULL )
@@ -1769,21 +2426,29 @@ Query_GetPartETag(
 			{
 				etag = NULL;
 			}
+			query_checksum = (const char*) sqlite3_column_text( etagQuery, 1 );
+			if( query_checksum != NULL )
+			{
+				*checksum = strdup( query_checksum );
+			}
+			else
+			{
+				*checksum = NULL;
+			}
 		}
 		if( rc != SQLITE_DONE )
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
     {
         fprintf( stderr, "Can't prepare select query (%i): %s\n",
-				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
     }
-	RESET_QUERY( getEtag );
-    UnlockCache( );
+	RESET_READ_QUERY( getEtag );
 
 	return( etag );
 }
@@ -1791,10 +2456,12 @@ Query_GetPartETag(
 
 
 /**
- * Set the ETag for a multipart upload part.
+ * Set the ETag and the checksum for a multipart upload part.
  * @param fileId [in] File ID for the file with multipart uploads.
  * @param part [in] Part number.
  * @param etag [in] ETag for the part number.
+ * @param checksum [in] CRC32C checksum of the part, or \a NULL if the part
+ *        is uploaded without one.
  * @return Nothing.
  * Test: unit test (in test-filecache.c).
  */
@@ -1802,18 +2469,21 @@ void
 Query_SetPartETag(
 	sqlite3_int64 fileId,
 	int           part,
-	const char    *etag
+	const char    *etag,
+	const char    *checksum
 	              )
 {
     int          rc;
     sqlite3_stmt *etagQuery = cacheDatabase.setEtag;
 	int          changes;
 
-    LockCache( );
+    LockCacheForGroupedUpdate( );
+	BeginTransaction( );
     BIND_QUERY( rc, text( etagQuery, 1, etag, -1, NULL ),
-    BIND_QUERY( rc, int64( etagQuery, 2, fileId ),
-    BIND_QUERY( rc, int( etagQuery, 3, part ),
-		) ) );
+    BIND_QUERY( rc, text( etagQuery, 2, checksum, -1, NULL ),
+    BIND_QUERY( rc, int64( etagQuery, 3, fileId ),
+    BIND_QUERY( rc, int( etagQuery, 4, part ),
+		) ) ) );
     if( rc == SQLITE_OK )
 	{
 		if( ( rc = sqlite3_step( etagQuery ) ) == SQLITE_DONE )
@@ -1837,6 +2507,96 @@ Query_SetPartETag(
 				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
     }
 	RESET_QUERY( setEtag );
+	GroupCommit( );
+    UnlockCache( );
+}
+
+
+
+/**
+ * Get the checksum that S3 stores with a file, as of the last transfer.
+ * @param fileId [in] ID of the file.
+ * @return The file's CRC32C checksum, or \a NULL if it has none.
+ * Test: unit test (in test-filecache.c).
+ */
+const char*
+Query_GetFileChecksum(
+	sqlite3_int64 fileId
+	                  )
+{
+	struct CacheConnection *connection = GetReadConnection( );
+    int           rc;
+    sqlite3_stmt  *checksumQuery = connection->getFileChecksum;
+	const char    *query_checksum;
+	const char    *checksum = NULL;
+
+    BIND_QUERY( rc, int64( checksumQuery, 1, fileId ), );
+    if( rc == SQLITE_OK )
+	{
+		while( ( rc = sqlite3_step( checksumQuery ) ) == SQLITE_ROW )
+		{
+			query_checksum = (const char*)
+				sqlite3_column_text( checksumQuery, 0 );
+			if( query_checksum != NULL )
+			{
+				checksum = strdup( query_checksum );
+			}
+		}
+		if( rc != SQLITE_DONE )
+		{
+			fprintf( stderr,
+					 "Select statement didn't finish with DONE (%i): %s\n",
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
+		}
+	}
+	else
+    {
+        fprintf( stderr, "Can't prepare select query (%i): %s\n",
+				 rc, sqlite3_errmsg( connection->cacheDb ) );
+    }
+	RESET_READ_QUERY( getFileChecksum );
+
+	return( checksum );
+}
+
+
+
+/**
+ * Record the checksum that S3 stores with a file, so that the cached copy
+ * can be revalidated against S3 later.
+ * @param fileId [in] ID of the file.
+ * @param checksum [in] The file's CRC32C checksum as S3 reports it.
+ * @return Nothing.
+ * Test: unit test (in test-filecache.c).
+ */
+void
+Query_SetFileChecksum(
+	sqlite3_int64 fileId,
+	const char    *checksum
+	                  )
+{
+    int          rc;
+    sqlite3_stmt *checksumQuery = cacheDatabase.setFileChecksum;
+
+    LockCache( );
+    BIND_QUERY( rc, text( checksumQuery, 1, checksum, -1, NULL ),
+    BIND_QUERY( rc, int64( checksumQuery, 2, fileId ),
+		) );
+    if( rc == SQLITE_OK )
+	{
+		if( ( rc = sqlite3_step( checksumQuery ) ) != SQLITE_DONE )
+		{
+			fprintf( stderr,
+					 "Update statement didn't finish with DONE (%i): %s\n",
+					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+		}
+	}
+	else
+    {
+        fprintf( stderr, "Can't prepare update query (%i): %s\n",
+				 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+    }
+	RESET_QUERY( setFileChecksum );
     UnlockCache( );
 }
 
@@ -1853,11 +2613,11 @@ Query_FindPendingUpload(
 	void
 	                    )
 {
+	struct CacheConnection *connection = GetReadConnection( );
     int           rc;
-    sqlite3_stmt  *findQuery = cacheDatabase.findUploadRequest;
+    sqlite3_stmt  *findQuery = connection->findUploadRequest;
 	sqlite3_int64 fileId;
 
-    LockCache( );
 	if( ( rc = sqlite3_step( findQuery ) ) == SQLITE_ROW )
 	{
 		fileId = sqlite3_column_int( findQuery, 0 );
@@ -1866,15 +2626,14 @@ Query_FindPendingUpload(
 		{
 			fprintf( stderr,
 					 "Select statement didn't finish with DONE (%i): %s\n",
-					 rc, sqlite3_errmsg( cacheDatabase.cacheDb ) );
+					 rc, sqlite3_errmsg( connection->cacheDb ) );
 		}
 	}
 	else
 	{
 		fileId = 0;
 	}
-	RESET_QUERY( findUploadRequest );
-    UnlockCache( );
+	RESET_READ_QUERY( findUploadRequest );
 
 	return( fileId );
 }
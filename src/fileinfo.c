@@ -0,0 +1,90 @@
+/**
+ * \file fileinfo.c
+ * \brief Allocation of S3 File Info structures.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "s3if.h"
+#include "slab.h"
+
+
+/* The stat cache may hold millions of S3 File Info structures, so they are
+   allocated from a slab rather than with malloc. */
+static struct Slab    *fileInfoSlab = NULL;
+static pthread_once_t fileInfoSlabOnce = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * Create the slab for S3 File Info structures.
+ * @return Nothing.
+ */
+static void
+CreateFileInfoSlab(
+    void
+	           )
+{
+    fileInfoSlab = CreateSlab( sizeof( struct S3FileInfo ) );
+}
+
+
+
+/**
+ * Allocate an S3 File Info structure with all fields cleared.
+ * @return The new structure.
+ */
+struct S3FileInfo*
+AllocateS3FileInfo(
+    void
+	           )
+{
+    struct S3FileInfo *fileInfo;
+
+    pthread_once( &fileInfoSlabOnce, &CreateFileInfoSlab );
+    fileInfo = AllocateFromSlab( fileInfoSlab );
+    memset( fileInfo, 0, sizeof( struct S3FileInfo ) );
+    fileInfo->symlinkTarget = NULL;
+
+    return( fileInfo );
+}
+
+
+
+/**
+ * Free an S3 File Info structure that was allocated with
+ * \a AllocateS3FileInfo, including its symbolic link target.
+ * @param fileInfo [in] The structure, or \a NULL.
+ * @return Nothing.
+ */
+void
+FreeS3FileInfo(
+    struct S3FileInfo *fileInfo
+	       )
+{
+    if( fileInfo != NULL )
+    {
+        free( fileInfo->symlinkTarget );
+	ReturnToSlab( fileInfoSlab, fileInfo );
+    }
+}
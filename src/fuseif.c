@@ -39,6 +39,7 @@
 #include "aws-s3fs.h"
 #include "fuseif.h"
 #include "s3if.h"
+#include "trace.h"
 
 
 
@@ -64,7 +65,7 @@ static int s3fs_rmdir( const char* );
 static void s3fs_destroy( void* );
 static int s3fs_chmod( const char*, mode_t );
 static int s3fs_chown( const char*, uid_t , gid_t );
-//static void *s3fs_init( struct fuse_conn_info *conn );
+static void *s3fs_init( struct fuse_conn_info *conn );
 
 
 
@@ -125,8 +126,8 @@ struct fuse_operations s3fsOperations =
     .releasedir  = s3fs_releasedir,
     /*
     .fsyncdir    = s3fs_syncdir,
-    .init        = s3fs_init,
     */
+    .init        = s3fs_init,
     .destroy     = s3fs_destroy,
     .access      = s3fs_access,
     /*
@@ -815,6 +816,7 @@ s3fs_getattr(
 {
     int               status = 0;
     struct S3FileInfo *fileInfo;
+    TRACE_SCOPE( "fuse", "getattr" );
 
     if( ( path == NULL ) || ( strcmp( path, "" ) == 0 ) )
     {
@@ -864,10 +866,11 @@ s3fs_open(
 {
     int               status    = 0;
     struct S3FileInfo *fileInfo;
-    struct OpenFlags  *openFlags;
+    struct OpenFlags  openFlags;
     struct S3FileInfo *parentFi;
 
     char *parent;
+    TRACE_SCOPE( "fuse", "open" );
 
     printf( "s3fs_open: %s\n", path );
 
@@ -913,15 +916,14 @@ s3fs_open(
 		status = -EACCES;
 
 ////			Syslog( log_DEBUG, "File handle %d allocated\n", fh );
-		openFlags = &fileInfo->openFlags;
-		SetOpenFlags( openFlags, fi->flags );
+		SetOpenFlags( &openFlags, fi->flags );
 		/* Do not follow symbolic links. */
-		if( ( openFlags->of_NOFOLLOW ) && ( fileInfo->fileType == 'l' ) )
+		if( ( openFlags.of_NOFOLLOW ) && ( fileInfo->fileType == 'l' ) )
 		{
 			status = -EACCES;
 			goto open_end;
 		}
-		if( openFlags->of_WRONLY || openFlags->of_RDWR )
+		if( openFlags.of_WRONLY || openFlags.of_RDWR )
 		{
 			/* O_WRONLY or O_RDWR applied to a directory. */
 			if( fileInfo->fileType == 'd' )
@@ -941,15 +943,15 @@ s3fs_open(
 		   must also be set. However, this flag isn't passed to this
 		   function. Or? There's something about kernel 2.6 and FUSE.)
 		   See if the file exists and has write permissions. */
-		if( ( openFlags->of_WRONLY ) && IsWriteable( fileInfo ) )
+		if( ( openFlags.of_WRONLY ) && IsWriteable( fileInfo ) )
 		{
 			status = 0;
 		}
 		/* For O_RDONLY, the file must have read permissions. For
 		   O_RDWR and O_APPEND, the file must have both read and write
 		   permissions. */
-		else if( openFlags->of_RDONLY || openFlags->of_RDWR
-				 || openFlags->of_APPEND )
+		else if( openFlags.of_RDONLY || openFlags.of_RDWR
+				 || openFlags.of_APPEND )
 		{
 			/* Todo: if O_RDWR and O_TRUNC are set, the file will be
 			   created if necessary. The O_TRUNC indicates an atomic
@@ -958,7 +960,7 @@ s3fs_open(
 			{
 				status = 0;
 			}
-			if( ( openFlags->of_RDWR || openFlags->of_APPEND )
+			if( ( openFlags.of_RDWR || openFlags.of_APPEND )
 				&& ( ! IsWriteable( fileInfo ) ) )
 			{
 				status = -EACCES;
@@ -973,7 +975,7 @@ s3fs_open(
  open_end:
     if( status == 0 )
 	{
-		status = S3Open( path );
+		status = S3Open( path, &openFlags );
 	}
     return( status );
 }
@@ -999,6 +1001,7 @@ s3fs_opendir(
     struct S3FileInfo *fileInfo;
     int               status = 0;
     int               dh = 0;
+    TRACE_SCOPE( "fuse", "opendir" );
 
     /* Get information on the directory. */
     status = S3FileStat( dir, &fileInfo );
@@ -1060,6 +1063,7 @@ s3fs_readdir(
     int  nFiles        = 0;
     char *dirEntry;
     int  i;
+    TRACE_SCOPE( "fuse", "readdir" );
 
     printf( "s3fs_readdir: %s\n", dir );
 
@@ -1076,7 +1080,9 @@ s3fs_readdir(
 			{
 				status = filler( buffer, dirEntry, NULL, 0 );
 			}
+			free( dirEntry );
 	    }
+		free( s3Directory );
     }
 
     return( status );
@@ -1101,6 +1107,7 @@ s3fs_releasedir(
 	            )
 {
     int status;
+    TRACE_SCOPE( "fuse", "releasedir" );
 
 	status = 0;
     printf( "s3fs_releasedir %s, fh = %d\n", dir, (int)fi->fh );
@@ -1130,6 +1137,7 @@ s3fs_access(
     int               status;
     struct S3FileInfo *fileInfo;
     int               permissions = 0;
+    TRACE_SCOPE( "fuse", "access" );
 
     printf( "s3fs_access %s, mask %04o\n", path, mask );
 
@@ -1206,6 +1214,7 @@ s3fs_read(
 {
     int    status;
     size_t actuallyRead;
+    TRACE_SCOPE( "fuse", "read" );
 
     status = S3ReadFile( path, buf, size, offset, &actuallyRead );
     if( status == 0 )
@@ -1238,6 +1247,7 @@ s3fs_fgetattr(
 {
     struct S3FileInfo *fileInfo;
     int               status;
+    TRACE_SCOPE( "fuse", "fgetattr" );
 
     printf( "s3fs_fgetattr %s\n", path );
 
@@ -1268,6 +1278,7 @@ s3fs_flush(
 	   )
 {
     int status;
+    TRACE_SCOPE( "fuse", "flush" );
 
     printf( "s3fs_flush %s\n", path );
 
@@ -1296,6 +1307,7 @@ s3fs_release(
 	     )
 {
     int status;
+    TRACE_SCOPE( "fuse", "release" );
 
     status = S3FileClose( path );
 
@@ -1319,6 +1331,7 @@ s3fs_symlink(
 	     )
 {
     int status;
+    TRACE_SCOPE( "fuse", "symlink" );
 
     printf( "s3fs_symlink: link %s -> %s\n", path, target );
     status = S3CreateLink( path, target );
@@ -1343,6 +1356,7 @@ s3fs_readlink(
 {
     int  status;
     char *target;
+    TRACE_SCOPE( "fuse", "readlink" );
 
     status = S3ReadLink( linkname, &target );
     if( status == 0 )
@@ -1375,6 +1389,7 @@ s3fs_utimens(
     const time_t atime = tv[ 0 ].tv_sec;
     const time_t mtime = tv[ 0 ].tv_sec;
     int status;
+    TRACE_SCOPE( "fuse", "utimens" );
 
     status = S3ModifyTimeStamps( file, atime, mtime );
     return( status );
@@ -1382,6 +1397,28 @@ s3fs_utimens(
 
 
 
+/* Disable warning that conn is not used. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+/**
+ * Start the S3 interface's background work. FUSE calls this function after
+ * it has daemonized, so the threads run in the process that serves the
+ * file system.
+ * @param conn [in] Unused.
+ * @return NULL, which leaves the private data of the FUSE context empty.
+ */
+static void*
+s3fs_init(
+    struct fuse_conn_info *conn
+	  )
+{
+    S3Init( );
+    return( NULL );
+}
+#pragma GCC diagnostic pop
+
+
+
 /* Disable warning that data is not used. What is it, anyway? */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -1405,6 +1442,7 @@ s3fs_mkdir(
 	   )
 {
     int status;
+    TRACE_SCOPE( "fuse", "mkdir" );
 
     status = S3Mkdir( dirname, mode );
     return( status );
@@ -1423,6 +1461,7 @@ s3fs_unlink(
 	    )
 {
     int status;
+    TRACE_SCOPE( "fuse", "unlink" );
 
     status = S3Unlink( file );
     return( status );
@@ -1441,6 +1480,7 @@ s3fs_rmdir(
 	   )
 {
     int status;
+    TRACE_SCOPE( "fuse", "rmdir" );
 
     status = S3Rmdir( dirname );
     return( status );
@@ -1454,6 +1494,8 @@ s3fs_chmod(
     mode_t     mode
 	   )
 {
+    TRACE_SCOPE( "fuse", "chmod" );
+
     return( S3Chmod( path, mode ) );
 }
 
@@ -1466,6 +1508,8 @@ s3fs_chown(
     gid_t      gid
 	   )
 {
+    TRACE_SCOPE( "fuse", "chown" );
+
     return( S3Chown( path, uid, gid ) );
 }
 
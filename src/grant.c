@@ -29,9 +29,16 @@
 #include <malloc.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stdio.h>
+#include <pthread.h>
 #include "socket.h"
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 #include "aws-s3fs.h"
 #include "filecache.h"
 
@@ -41,6 +48,20 @@
 		( strncasecmp( x, y, strlen( y ) ) == 0 ) ) ? 0 : 1 )
 
 
+/* Ways of copying a file part into the in-progress directory, from the
+   cheapest to the most expensive. */
+enum ChunkCopyMethod
+{
+	COPY_REFLINK = 0,
+	COPY_IN_KERNEL,
+	COPY_USERSPACE
+};
+
+/* The cheapest copy method that the cache file system supports. */
+static enum ChunkCopyMethod chunkCopyMethod = COPY_USERSPACE;
+static pthread_once_t       chunkCopyDetection = PTHREAD_ONCE_INIT;
+
+
 /**
  * Extract the next integer parameter from a string whose parameters are
  * separated by ':'.
@@ -285,6 +306,294 @@ GrantChown( const char *parameters )
 
 
 
+/**
+ * Write a buffer to a file, retrying after short writes.
+ * @param fd [in] File descriptor of the destination file.
+ * @param buffer [in] Data to write.
+ * @param length [in] Number of bytes to write.
+ * @return \a true if all the data was written, or \a false otherwise.
+ */
+static bool
+WriteAll(
+	int                 fd,
+	const unsigned char *buffer,
+	size_t              length
+	     )
+{
+	ssize_t nBytes;
+
+	while( 0 < length )
+	{
+		nBytes = write( fd, buffer, length );
+		if( nBytes < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			return( false );
+		}
+		buffer = buffer + nBytes;
+		length = length - nBytes;
+	}
+	return( true );
+}
+
+
+
+/**
+ * Clone a range of a file into another file by sharing its extents. Both
+ * files must be on the same reflink-capable file system (such as XFS or
+ * btrfs), and the offset must be aligned to the file system block size.
+ * @param src [in] File descriptor of the source file.
+ * @param dest [in] File descriptor of the (empty) destination file.
+ * @param offset [in] Offset into the source file.
+ * @param size [in] Number of bytes to clone.
+ * @return \a true if the range was cloned, or \a false otherwise.
+ */
+static bool
+CloneRange(
+	int           src,
+	int           dest,
+	long long int offset,
+	long long int size
+	       )
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+
+	range.src_fd      = src;
+	range.src_offset  = offset;
+	range.src_length  = size;
+	range.dest_offset = 0;
+	return( ioctl( dest, FICLONERANGE, &range ) == 0 );
+#else
+	(void) src;
+	(void) dest;
+	(void) offset;
+	(void) size;
+	return( false );
+#endif
+}
+
+
+
+/**
+ * Copy a range of a file into another file without passing the data
+ * through userspace.
+ * @param src [in] File descriptor of the source file.
+ * @param dest [in] File descriptor of the (empty) destination file.
+ * @param offset [in] Offset into the source file.
+ * @param size [in] Number of bytes to copy.
+ * @return Number of bytes copied, which is short if the copy failed part-way,
+ *         or -1 if the kernel cannot copy the range.
+ */
+static long long int
+CopyRangeInKernel(
+	int           src,
+	int           dest,
+	long long int offset,
+	long long int size
+	              )
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t        srcOffset  = offset;
+	loff_t        destOffset = 0;
+	long long int copied     = 0;
+	ssize_t       nBytes;
+
+	while( copied < size )
+	{
+		nBytes = copy_file_range( src, &srcOffset, dest, &destOffset,
+								  size - copied, 0 );
+		if( nBytes < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			/* Nothing has been written if the very first call fails, so
+			   the caller may fall back to another method. */
+			return( copied == 0 ? -1 : copied );
+		}
+		else if( nBytes == 0 )
+		{
+			break;
+		}
+		copied = copied + nBytes;
+	}
+	return( copied );
+#else
+	(void) src;
+	(void) dest;
+	(void) offset;
+	(void) size;
+	return( -1 );
+#endif
+}
+
+
+
+/**
+ * Copy a range of a file into another file via a userspace buffer.
+ * @param src [in] File descriptor of the source file.
+ * @param dest [in] File descriptor of the (empty) destination file.
+ * @param offset [in] Offset into the source file.
+ * @param size [in] Number of bytes to copy.
+ * @return Number of bytes copied.
+ */
+static long long int
+CopyRangeInUserspace(
+	int           src,
+	int           dest,
+	long long int offset,
+	long long int size
+	                 )
+{
+	const int     copyChunkSize = 262144;
+	unsigned char *chunk;
+	long long int copied = 0;
+	ssize_t       nBytes;
+	int           chunkSize;
+
+	chunk = malloc( copyChunkSize );
+	if( chunk == NULL )
+	{
+		return( 0 );
+	}
+	while( copied < size )
+	{
+		chunkSize = copyChunkSize;
+		if( size - copied < chunkSize )
+		{
+			chunkSize = size - copied;
+		}
+		nBytes = pread( src, chunk, chunkSize, offset + copied );
+		if( nBytes < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			break;
+		}
+		if( ( nBytes == 0 ) || ( ! WriteAll( dest, chunk, nBytes ) ) )
+		{
+			break;
+		}
+		copied = copied + nBytes;
+	}
+	free( chunk );
+
+	return( copied );
+}
+
+
+
+/**
+ * Determine the cheapest way to copy file parts on the cache file system by
+ * trying each method on a pair of scratch files in the in-progress
+ * directory.
+ * @return Nothing.
+ */
+static void
+DetectChunkCopyMethod( void )
+{
+	char          srcName[ ]  = CACHE_INPROGRESS "probeXXXXXX";
+	char          destName[ ] = CACHE_INPROGRESS "probeXXXXXX";
+	unsigned char block[ 65536 ];
+	int           src;
+	int           dest;
+
+	/* If the probe cannot be set up, try the in-kernel copy first; each copy
+	   falls back to the userspace loop if it fails anyway. */
+	chunkCopyMethod = COPY_IN_KERNEL;
+
+	src  = mkstemp( srcName );
+	dest = mkstemp( destName );
+	if( ( 0 <= src ) && ( 0 <= dest ) )
+	{
+		memset( block, 0x5a, sizeof( block ) );
+		if( WriteAll( src, block, sizeof( block ) ) )
+		{
+			if( CloneRange( src, dest, 0, sizeof( block ) ) )
+			{
+				chunkCopyMethod = COPY_REFLINK;
+			}
+			else if( CopyRangeInKernel( src, dest, 0, sizeof( block ) )
+					 == sizeof( block ) )
+			{
+				chunkCopyMethod = COPY_IN_KERNEL;
+			}
+			else
+			{
+				chunkCopyMethod = COPY_USERSPACE;
+			}
+		}
+	}
+	if( 0 <= src )
+	{
+		close( src );
+		unlink( srcName );
+	}
+	if( 0 <= dest )
+	{
+		close( dest );
+		unlink( destName );
+	}
+}
+
+
+
+/**
+ * Copy a range of a file into an empty file using the cheapest method that
+ * works, falling back to more expensive methods if necessary.  If the
+ * in-kernel copy fails part-way, the userspace copy resumes where it
+ * stopped.
+ * @param src [in] File descriptor of the source file.
+ * @param dest [in] File descriptor of the (empty) destination file.
+ * @param offset [in] Offset into the source file.
+ * @param size [in] Number of bytes to copy.
+ * @return Number of bytes copied.
+ */
+static long long int
+CopyFileRange(
+	int           src,
+	int           dest,
+	long long int offset,
+	long long int size
+	          )
+{
+	long long int copied = -1;
+
+	pthread_once( &chunkCopyDetection, DetectChunkCopyMethod );
+
+	if( ( chunkCopyMethod <= COPY_REFLINK )
+		&& CloneRange( src, dest, offset, size ) )
+	{
+		copied = size;
+	}
+	if( ( copied < 0 ) && ( chunkCopyMethod <= COPY_IN_KERNEL ) )
+	{
+		copied = CopyRangeInKernel( src, dest, offset, size );
+	}
+	if( copied < 0 )
+	{
+		copied = 0;
+	}
+	/* The in-kernel copy does not move the file position of the
+	   destination, so the userspace copy seeks past what it copied. */
+	if( ( copied < size ) && ( lseek( dest, copied, SEEK_SET ) == copied ) )
+	{
+		copied = copied + CopyRangeInUserspace( src, dest, offset + copied,
+												 size - copied );
+	}
+
+	return( copied );
+}
+
+
+
 /**
  * Copy a chunk from a file into the in-progress directory, preparing it for
  * an S3 multipart upload.  The chunk offset and size is determined by the
@@ -303,22 +612,15 @@ CreateFileChunk( const char *parameters )
 	bool      valid;
 	bool      hasDirectory = false;
 	int       pos;
-	const int copyChunkSize = 262144;
 
 	struct stat   fileStat;
 	int           status;
 	long long int filesize;
 	int           parts;
-	int           partSize;
+	long long int partSize;
 	long long int offset;
 	int           src;
 	int           dest;
-	int           relativeOffset;
-	int           index;
-	int           bytesCopied;
-	int           chunkSize;
-	unsigned char *chunk;
-	int           nBytes;
 
 	/* Get the part number. */
 	pos = GetIntParameter( parameters, &part );
@@ -367,58 +669,47 @@ CreateFileChunk( const char *parameters )
 				strcpy( destfilepath, CACHE_INPROGRESS );
 				strcat( destfilepath, filename );
 
-				/* Copy the file chunk in, well, chunks. */
-				chunk = malloc( copyChunkSize );
-				if( chunk != NULL )
+				/* Calculate the number of bytes to copy and the offset
+				   into the source file. */
+				status = stat( srcfilepath, &fileStat );
+				if( 0 <= status )
 				{
-					/* Calculate the number of bytes to copy and the offset
-					   into the source file. */
-					status = stat( srcfilepath, &fileStat );
-					if( 0 <= status )
+					partSize = PREFERRED_CHUNK_SIZE * 1024 * 1024;
+					filesize = fileStat.st_size;
+					parts = NumberOfMultiparts( filesize );
+					offset = (long long int) (part - 1 )
+						* PREFERRED_CHUNK_SIZE * 1024 * 1024;
+					/* The last part holds the remainder of the file. */
+					if( part == parts )
 					{
-						partSize = PREFERRED_CHUNK_SIZE * 1024 * 1024;
-						/* The last part size is the remainder of the
-						   division. */
-						filesize = fileStat.st_size;
-						parts = NumberOfMultiparts( filesize );
-						if( part == parts )
-						{
-							partSize = filesize % partSize;
-						}
-						offset = (long long int) (part - 1 )
-							* PREFERRED_CHUNK_SIZE * 1024 * 1024;
-						/* Copy small chunks. */
-						src  = open( srcfilepath, O_RDONLY | O_LARGEFILE );
-						dest = open( destfilepath, O_TRUNC | O_WRONLY );
-						if( ( 0 <= src ) && ( 0 <= dest ) )
+						partSize = filesize - offset;
+					}
+					src  = open( srcfilepath, O_RDONLY | O_LARGEFILE );
+					dest = open( destfilepath, O_TRUNC | O_WRONLY );
+					if( ( 0 <= src ) && ( 0 <= dest ) && ( 0 < partSize ) )
+					{
+						/* Discard an incomplete part, so that the uploader
+						   does not send it. */
+						if( CopyFileRange( src, dest, offset, partSize )
+							!= partSize )
 						{
-							index       = 0;
-							bytesCopied = 0;
-							do
-							{
-								/* Determine size of the chunk to read. */
-								chunkSize = copyChunkSize;
-								/* Determine offset into the file. */
-								relativeOffset = index * chunkSize;
-								if( chunkSize + relativeOffset > partSize )
-								{
-									chunkSize = partSize - relativeOffset;
-								}
-								/* Copy the chunk. */
-								nBytes = pread( src, chunk, chunkSize,
-												offset + relativeOffset );
-								if( 0 < nBytes )
-								{
-									write( dest, chunk, nBytes );
-									bytesCopied = bytesCopied + nBytes;
-								}
-								index++;
-							} while( ( 0 < nBytes ) &&
-									 ( bytesCopied < partSize ) );
+							fprintf( stderr, "Couldn't copy part %d of %s\n",
+									 part, srcfilepath );
+							(void) ftruncate( dest, 0 );
 						}
 					}
+					if( 0 <= src )
+					{
+						close( src );
+					}
+					if( 0 <= dest )
+					{
+						close( dest );
+					}
 				}
+				free( destfilepath );
 			}
+			free( srcfilepath );
 		}
 	}
 }
@@ -426,57 +717,119 @@ CreateFileChunk( const char *parameters )
 
 
 /**
- * Initialize the Permission Grant module.
- * @param childPid [in] pid of the download queue; the permission grant module
- *        will accept socket communication only from a process with this pid.
- * @param socketHandle [in] Socket handle for communicating with the download
- *        queue.
+ * Perform a single privileged operation.
+ * @param operation [in] Null-terminated operation and its parameters.
  * @return Nothing.
  */
-void
-InitializePermissionsGrant(
-	pid_t childPid,
-	int   socketHandle
-	                       )
+static void
+ProcessGrantOperation(
+	const char *operation
+	                  )
 {
-	struct ucred credentials;
-	size_t       length;
-	char         request[ 100 ];
-	int          fd; /* unused */
+	size_t length = strlen( operation );
+
+	if( COMPARESTRINGS( operation, "CHOWN " ) == 0 )
+	{
+		GrantChown( &operation[ 6 ] );
+	}
+	else if( COMPARESTRINGS( operation, "PUBLISH " ) == 0 )
+	{
+		GrantPublish( &operation[ 8 ] );
+	}
+	else if( COMPARESTRINGS( operation, "CHUNK " ) == 0 )
+	{
+		CreateFileChunk( &operation[ 6 ] );
+	}
+	else if( COMPARESTRINGS( operation, "DELETE " ) == 0 )
+	{
+	}
+	else
+	{
+	}
+}
 
 
+
+/**
+ * Parameters for the threads that service the permissions grant socket.
+ */
+struct GrantService
+{
+	pid_t childPid;
+	int   socketHandle;
+};
+
+
+
+/**
+ * Service requests from the download queue. A request has the form
+ * "REQ <id>" followed by one or more newline-separated operations, which are
+ * performed in order before the reply "ACK <id>" is sent. A request without
+ * the "REQ" header holds a single operation and is acknowledged with "ACK".
+ * Several threads may service the socket at the same time; each datagram is
+ * received by exactly one of them.
+ * @param parameters [in] Pointer to a  GrantService structure.
+ * @return Nothing.
+ */
+static void*
+ServeGrantRequests(
+	void *parameters
+	               )
+{
+	const struct GrantService *service = parameters;
+	struct ucred  credentials;
+	char          request[ GRANT_MESSAGE_SIZE + 1 ];
+	char          reply[ 30 ];
+	char          *operation;
+	char          *nextOperation;
+	unsigned long requestId;
+	bool          hasRequestId;
+	int           fd; /* unused */
+
 	while( 1 )
 	{
 		/* Wait for a request from the download queue. */
-		length = SocketReceiveDatagramFromClient( socketHandle, request,
-												  sizeof( request ),
-												  &credentials, &fd );
+		memset( request, 0, sizeof( request ) );
+		SocketReceiveDatagramFromClient( service->socketHandle, request,
+										 GRANT_MESSAGE_SIZE,
+										 &credentials, &fd );
 
 		/* Validate the sender: it must have the pid of the download queue. */
-		if( credentials.pid == childPid )
+		if( credentials.pid == service->childPid )
 		{
-			/* Process the request. */
-			if( COMPARESTRINGS( request, "CHOWN " ) == 0 )
+			/* Extract the request ID, if any. */
+			operation    = request;
+			hasRequestId = false;
+			if( sscanf( request, "REQ %lu", &requestId ) == 1 )
 			{
-				GrantChown( &request[ 6 ] );
+				hasRequestId = true;
+				operation    = strchr( request, '\n' );
+				operation    = ( operation == NULL ) ? "" : operation + 1;
 			}
-			else if( COMPARESTRINGS( request, "PUBLISH " ) == 0 )
-			{
-				GrantPublish( &request[ 8 ] );
-			}
-			else if( COMPARESTRINGS( request, "CHUNK " ) == 0 )
+
+			/* Process the operations in the request. */
+			while( *operation != '\0' )
 			{
-				CreateFileChunk( &request[ 6 ] );
+				nextOperation = strchr( operation, '\n' );
+				if( nextOperation != NULL )
+				{
+					*nextOperation++ = '\0';
+				}
+				ProcessGrantOperation( operation );
+				operation = ( nextOperation == NULL ) ? "" : nextOperation;
 			}
-			else if( COMPARESTRINGS( request, "DELETE " ) == 0 )
+
+			/* Acknowledge the receipt. */
+			if( hasRequestId )
 			{
+				sprintf( reply, "ACK %lu", requestId );
 			}
 			else
 			{
+				strcpy( reply, "ACK" );
 			}
-
-			/* Acknowledge the receipt. */
-			SocketSendDatagramToClient( socketHandle, "ACK", 4, -1 );
+			SocketSendDatagramToClient( service->socketHandle, reply,
+										strlen( reply ) + 1, -1 );
 		}
 		/* Ignore the message if it was not sent from the download
 		   queue. */
@@ -484,10 +837,50 @@ InitializePermissionsGrant(
 		{
 			fprintf( stderr, "Warning: received socket message from an "
 					 "unauthorized source (pid = %d).\n", credentials.pid );
-			SocketSendDatagramToClient( socketHandle,
+			SocketSendDatagramToClient( service->socketHandle,
 										"Not authorized", 15, -1 );
 		}
 	}
+
+	return( NULL );
+}
+
+
+
+/**
+ * Initialize the Permission Grant module.
+ * @param childPid [in] pid of the download queue; the permission grant module
+ *        will accept socket communication only from a process with this pid.
+ * @param socketHandle [in] Socket handle for communicating with the download
+ *        queue.
+ * @return Nothing.
+ */
+void
+InitializePermissionsGrant(
+	pid_t childPid,
+	int   socketHandle
+	                       )
+{
+	static struct GrantService service;
+	pthread_t                  thread;
+	int                        threadNum;
+
+	service.childPid     = childPid;
+	service.socketHandle = socketHandle;
+
+	/* Find out how the cache file system can copy upload parts. */
+	pthread_once( &chunkCopyDetection, DetectChunkCopyMethod );
+
+	/* Service the socket from several threads so that a slow operation,
+	   such as copying a large upload part, does not hold up the others. */
+	for( threadNum = 1; threadNum < GRANT_THREADS; threadNum++ )
+	{
+		if( pthread_create( &thread, NULL, ServeGrantRequests, &service ) == 0 )
+		{
+			pthread_detach( thread );
+		}
+	}
+	ServeGrantRequests( &service );
 }
 
 
@@ -7,6 +7,10 @@
  * as intended. However, mutexes are applied to ensure that the log settings
  * do not change mid-flight while a thread is logging a message.
  *
+ * A thread that logs a message only records the format string and the
+ * arguments in a ring buffer of its own, without taking any locks. A writer
+ * thread formats the messages and writes them to the log.
+ *
  * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
  *
  * This file is part of aws-s3fs.
@@ -37,12 +41,27 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include "aws-s3fs.h"
 
 
 #define MAX_LOG_ENTRY_LENGTH 1024
 
+/* Number of arguments and number of bytes of string arguments that are
+   recorded for a message. Arguments beyond these limits are left out or
+   truncated. The string arguments may fill an entire message. */
+#define LOG_EVENT_ARGUMENTS 8
+#define LOG_EVENT_TEXT      MAX_LOG_ENTRY_LENGTH
+
+/* Number of messages in a thread's ring buffer, which must be a power of
+   two. */
+#define LOG_RING_EVENTS     256
+
+/* Milliseconds the writer thread sleeps when there is nothing to write. */
+#define LOG_WRITER_IDLE_MS  100
+
 
 pthread_mutex_t logger_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct
@@ -57,6 +76,152 @@ static struct
 } logger;
 
 
+/* A message as recorded by the thread that logs it. The format string is not
+   copied, so it must be a string literal. String arguments are copied into
+   text, and their arguments hold their offsets into text. */
+struct LogEvent
+{
+    const char *format;
+    time_t     time;
+    int        priority;
+    int        argument[ LOG_EVENT_ARGUMENTS ];
+    char       text[ LOG_EVENT_TEXT ];
+};
+
+/* Ring buffer of the messages logged by a thread. Only the owning thread
+   advances head, and only the writer advances tail, so neither needs a lock.
+   Rings are never freed; the ring of a thread that exits is handed to the
+   next thread that logs. */
+struct LogRing
+{
+    struct LogRing  *next;
+    bool            inUse;
+    bool            busy;
+    unsigned int    head;
+    unsigned int    tail;
+    struct LogEvent event[ LOG_RING_EVENTS ];
+};
+
+static pthread_once_t  logRingsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t   logRingKey;
+static pthread_mutex_t logRings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing  *logRings = NULL;
+
+/* The writer thread is started by the first message, so that it also runs
+   in the child when the process daemonizes. Rings are drained by the writer
+   thread or by FlushLog, one at a time. */
+static pthread_mutex_t logDrain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool            logWriterRunning = false;
+static bool            logWriterIdle = false;
+static sem_t           logWriterWakeup;
+
+static void FlushLog( void );
+
+
+
+/**
+ * Hand the ring buffer of an exiting thread over to the next thread that
+ * logs. Messages that are still in the ring are written as usual.
+ * @param ring [in] Ring buffer of the thread.
+ * @return Nothing.
+ */
+static void
+ReleaseLogRing(
+    void *ring
+	       )
+{
+    __atomic_store_n( &( (struct LogRing*) ring )->inUse, false,
+		      __ATOMIC_RELEASE );
+}
+
+
+
+/**
+ * Write the waiting messages and take the locks of the logging module before
+ * the process forks, so that the child does not inherit a lock that is held
+ * by another thread. The messages are written first because the parent may
+ * exit right after the fork, as it does when the process daemonizes.
+ * @return Nothing.
+ */
+static void
+LockLogBeforeFork(
+    void
+	          )
+{
+    FlushLog( );
+    pthread_mutex_lock( &logRings_mutex );
+    pthread_mutex_lock( &logDrain_mutex );
+    pthread_mutex_lock( &logger_mutex );
+}
+
+
+
+/**
+ * Release the locks of the logging module in the parent after a fork.
+ * @return Nothing.
+ */
+static void
+UnlockLogAfterFork(
+    void
+	           )
+{
+    pthread_mutex_unlock( &logger_mutex );
+    pthread_mutex_unlock( &logDrain_mutex );
+    pthread_mutex_unlock( &logRings_mutex );
+}
+
+
+
+/**
+ * Reset the logging module in the child after a fork. The messages that are
+ * in the rings were written before the fork or are written by the parent,
+ * and the only thread of the child is the one that forked, so the other
+ * threads' rings are released. A new writer thread is started by the next
+ * message.
+ * @return Nothing.
+ */
+static void
+ResetLogInChild(
+    void
+	        )
+{
+    struct LogRing *ring;
+    struct LogRing *ownRing = pthread_getspecific( logRingKey );
+
+    for( ring = logRings; ring != NULL; ring = ring->next )
+    {
+        ring->tail  = ring->head;
+	ring->inUse = ( ring == ownRing );
+    }
+    logWriterRunning = false;
+    logWriterIdle    = false;
+    sem_destroy( &logWriterWakeup );
+    sem_init( &logWriterWakeup, 0, 0 );
+
+    UnlockLogAfterFork( );
+}
+
+
+
+/**
+ * Prepare the ring buffers and the writer thread's wakeup semaphore. This
+ * function is called only once.
+ * @return Nothing.
+ */
+static void
+InitializeLogRings(
+    void
+	           )
+{
+    pthread_key_create( &logRingKey, ReleaseLogRing );
+    sem_init( &logWriterWakeup, 0, 0 );
+    pthread_atfork( LockLogBeforeFork, UnlockLogAfterFork, ResetLogInChild );
+    /* Write the messages that are still in the rings when the process
+       exits. */
+    atexit( FlushLog );
+}
+
+
 
 /**
  * Initialize the process context for the logging module.
@@ -77,6 +242,8 @@ void InitializeLoggingModule(
     logger.stdoutDisabled = false;
 
     pthread_mutex_unlock( &logger_mutex );
+
+    pthread_once( &logRingsOnce, InitializeLogRings );
 }
 
 
@@ -200,7 +367,8 @@ InitLog(
 
 
 /**
- * Close the log file for now.
+ * Close the log file for now. Messages that have been logged so far are
+ * written first.
  * @return Nothing.
  */
 void
@@ -208,6 +376,8 @@ CloseLog(
 	void
 	     )
 {
+    FlushLog( );
+
     pthread_mutex_lock( &logger_mutex );
     if( logger.logFh != NULL )
     {
@@ -222,6 +392,7 @@ CloseLog(
     if( logger.logFilename != NULL )
     {
         free( (char*) logger.logFilename );
+	logger.logFilename = NULL;
     }
     pthread_mutex_unlock( &logger_mutex );
 }
@@ -239,6 +410,7 @@ CloseLog(
  *        be set during signal handling.
  * @param priority [in] Whether the message is a LOG_ERR, LOG_WARNING, etc.
  * @param hostname [in] The name of the machine that runs the software.
+ * @param timestamp [in] The time when the message was logged.
  * @param message [in] String to append to the log.
  * @return Nothing.
  */
@@ -250,11 +422,11 @@ LogMessage(
     bool       stdoutDisabled,
     int        priority,
     const char *hostname,
+    time_t     timestamp,
     const char *message
 	      )
 {
-    time_t t                           = time( NULL );
-    struct tm tm                       = *localtime( &t );
+    struct tm tm;
     static const char const *months[ ] =
     {
         "Jan", "Feb", "Mar", "Apr", "May", "Jun",
@@ -271,11 +443,13 @@ LogMessage(
 	else
 	{
 	    /* Generate log message with preamble. */
-	    sprintf( logmessage, "%s %2d %02d:%02d:%02d %s aws-s3fs: %s",
-		     months[ tm.tm_mon + 1 ], tm.tm_mday,
-		     tm.tm_hour, tm.tm_min, tm.tm_sec,
-		     hostname,
-		     message );
+	    localtime_r( &timestamp, &tm );
+	    snprintf( logmessage, sizeof( logmessage ),
+		      "%s %2d %02d:%02d:%02d %s aws-s3fs: %s",
+		      months[ tm.tm_mon ], tm.tm_mday,
+		      tm.tm_hour, tm.tm_min, tm.tm_sec,
+		      hostname,
+		      message );
 	    if( logFh != NULL )
 	    {
 	        fputs( logmessage, logFh );
@@ -294,82 +468,436 @@ LogMessage(
 
 
 /**
- * Log a message to file, stdout, or syslog, depending on the log
- * initialization.
+ * Record a message and its arguments in a log event. Only %d, %u, and %s
+ * take arguments.
+ * @param event [out] Log event.
  * @param priority [in] Whether the message is a LOG_ERR, LOG_WARNING, etc.
  * @param format [in] Formatting string for the message.
- * @param ... [in] Variable number of arguments for the formatting string.
+ * @param arguments [in] Arguments for the formatting string.
  * @return Nothing.
  */
-void
-Syslog(
-    int        priority,
-    const char *format,
-               ...
-       )
+static void
+RecordLogEvent(
+    struct LogEvent *event,
+    int             priority,
+    const char      *format,
+    va_list         arguments
+	       )
 {
-    int ch;
-    int idx;
-    union {
-        int   d;
-        char  *s;
-    } printable;
-    char compile[ MAX_LOG_ENTRY_LENGTH + 1 ];
-    int  outIdx = 0;
-    char argument[ MAX_LOG_ENTRY_LENGTH + 1 ];
-    va_list v1;
-
-    va_start( v1, format );
-
-    /* Copy from the format string until a parameter is encountered. */
-    idx = 0;
+    int        ch;
+    int        idx = 0;
+    int        argIdx = 0;
+    int        value;
+    const char *string;
+    size_t     textIdx = 0;
+    size_t     length;
+
+    event->format   = format;
+    event->time     = time( NULL );
+    event->priority = priority;
+    /* The last byte terminates string arguments that are truncated, and
+       string arguments that did not fit at all point at it. */
+    event->text[ LOG_EVENT_TEXT - 1 ] = '\0';
+
     while( ( ch = format[ idx++ ] ) != '\0' )
     {
-        assert( outIdx < MAX_LOG_ENTRY_LENGTH );
         if( ch != '%' )
 	{
-	    compile[ outIdx++ ] = ch;
-        }
-        else
+	    continue;
+	}
+	switch( format[ idx++ ] )
+	{
+	    case '\0':
+	        return;
+	    case 'd':
+	    case 'u':
+	        value = va_arg( arguments, int );
+		if( argIdx < LOG_EVENT_ARGUMENTS )
+		{
+		    event->argument[ argIdx ] = value;
+		}
+		argIdx++;
+		break;
+	    case 's':
+	        string = va_arg( arguments, const char* );
+		if( string == NULL )
+		{
+		    string = "(null)";
+		}
+		length = strnlen( string, LOG_EVENT_TEXT - 1 - textIdx );
+		memcpy( &event->text[ textIdx ], string, length );
+		if( argIdx < LOG_EVENT_ARGUMENTS )
+		{
+		    event->argument[ argIdx ] = textIdx;
+		}
+		argIdx++;
+		textIdx += length;
+		if( textIdx < LOG_EVENT_TEXT - 1 )
+		{
+		    event->text[ textIdx++ ] = '\0';
+		}
+		break;
+	    default:
+	        break;
+	}
+    }
+}
+
+
+
+/**
+ * Format the message of a log event.
+ * @param event [in] Log event.
+ * @param message [out] Buffer of \a MAX_LOG_ENTRY_LENGTH + 1 bytes for the
+ *        message.
+ * @return Nothing.
+ */
+static void
+FormatLogEvent(
+    const struct LogEvent *event,
+    char                  *message
+	       )
+{
+    const char *format = event->format;
+    int        ch;
+    int        idx = 0;
+    int        argIdx = 0;
+    size_t     outIdx = 0;
+    size_t     length;
+    const char *insert;
+    char       number[ 16 ];
+
+    while( ( ( ch = format[ idx++ ] ) != '\0' )
+	   && ( outIdx < MAX_LOG_ENTRY_LENGTH ) )
+    {
+        if( ch != '%' )
+	{
+	    message[ outIdx++ ] = ch;
+	    continue;
+	}
+	if( ( ch = format[ idx++ ] ) == '\0' )
+	{
+	    break;
+	}
+	insert = "";
+	switch( ch )
+	{
+	    case '%':
+	        insert = "%";
+		break;
+	    case 'd':
+	    case 'u':
+	    case 's':
+	        if( argIdx < LOG_EVENT_ARGUMENTS )
+		{
+		    if( ch == 's' )
+		    {
+		        insert = &event->text[ event->argument[ argIdx ] ];
+		    }
+		    else
+		    {
+		        sprintf( number, ch == 'd' ? "%d" : "%u",
+				 event->argument[ argIdx ] );
+			insert = number;
+		    }
+		}
+		argIdx++;
+		break;
+	    default:
+	        break;
+	}
+	length = strlen( insert );
+	if( MAX_LOG_ENTRY_LENGTH - outIdx < length )
+	{
+	    length = MAX_LOG_ENTRY_LENGTH - outIdx;
+	}
+	memcpy( &message[ outIdx ], insert, length );
+	outIdx += length;
+    }
+    message[ outIdx ] = '\0';
+}
+
+
+
+/**
+ * Write a log event to the log, unless the log level has been changed to
+ * leave it out since it was logged. This function must be called from a
+ * mutex'ed function.
+ * @param event [in] Log event.
+ * @return Nothing.
+ */
+static void
+WriteLogEvent(
+    const struct LogEvent *event
+	      )
+{
+    char message[ MAX_LOG_ENTRY_LENGTH + 1 ];
+
+    if( event->priority <= (int) logger.logLevel )
+    {
+        FormatLogEvent( event, message );
+	LogMessage( logger.logFh, logger.loggingEnabled,
+		    logger.logToSyslog, logger.stdoutDisabled,
+		    event->priority, logger.hostname, event->time, message );
+    }
+}
+
+
+
+/**
+ * Write all messages that are waiting in the threads' ring buffers.
+ * @return Nothing.
+ */
+static void
+FlushLog(
+    void
+	 )
+{
+    struct LogRing *ring;
+    unsigned int   tail;
+    unsigned int   head;
+
+    pthread_mutex_lock( &logDrain_mutex );
+    pthread_mutex_lock( &logger_mutex );
+    for( ring = __atomic_load_n( &logRings, __ATOMIC_ACQUIRE ); ring != NULL;
+	 ring = ring->next )
+    {
+        tail = ring->tail;
+	head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+	while( tail != head )
+	{
+	    WriteLogEvent( &ring->event[ tail & ( LOG_RING_EVENTS - 1 ) ] );
+	    tail++;
+	    /* Return the slot to the thread right away. */
+	    __atomic_store_n( &ring->tail, tail, __ATOMIC_RELEASE );
+	}
+    }
+    if( logger.logFh != NULL )
+    {
+        fflush( logger.logFh );
+    }
+    pthread_mutex_unlock( &logger_mutex );
+    pthread_mutex_unlock( &logDrain_mutex );
+}
+
+
+
+/**
+ * Determine whether any thread has messages waiting in its ring buffer.
+ * @return \a true if messages are waiting, or \a false otherwise.
+ */
+static bool
+LogEventsWaiting(
+    void
+	         )
+{
+    struct LogRing *ring;
+
+    for( ring = __atomic_load_n( &logRings, __ATOMIC_ACQUIRE ); ring != NULL;
+	 ring = ring->next )
+    {
+        if( __atomic_load_n( &ring->head, __ATOMIC_SEQ_CST )
+	    != __atomic_load_n( &ring->tail, __ATOMIC_RELAXED ) )
 	{
-	    if( format[ idx ] == '%' )
+	    return( true );
+	}
+    }
+    return( false );
+}
+
+
+
+/**
+ * Write the messages that the threads log, until the process exits. This
+ * function is started as a thread.
+ * @param unused [in] Unused.
+ * @return Nothing.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void*
+WriteLogEvents(
+    void *unused
+	       )
+{
+    struct timespec wakeup;
+
+    for( ; ; )
+    {
+        FlushLog( );
+
+	/* Sleep until a thread logs a message. A message that is recorded
+	   before the writer is marked as idle does not wake it up, so check
+	   again once it is. */
+	__atomic_store_n( &logWriterIdle, true, __ATOMIC_SEQ_CST );
+	if( ! LogEventsWaiting( ) )
+	{
+	    clock_gettime( CLOCK_REALTIME, &wakeup );
+	    wakeup.tv_nsec += LOG_WRITER_IDLE_MS * 1000000l;
+	    if( wakeup.tv_nsec >= 1000000000l )
 	    {
-	        compile[ outIdx++ ] = ch;
+	        wakeup.tv_sec++;
+		wakeup.tv_nsec -= 1000000000l;
+	    }
+	    while( ( sem_timedwait( &logWriterWakeup, &wakeup ) != 0 )
+		   && ( errno == EINTR ) )
+	    {
+	        /* Restart the wait. */
+	    }
+	}
+	__atomic_store_n( &logWriterIdle, false, __ATOMIC_SEQ_CST );
+    }
+
+    return( NULL );
+}
+#pragma GCC diagnostic pop
+
+
+
+/**
+ * Wake up the writer thread if it is idle, or start it if it is not
+ * running yet.
+ * @return Nothing.
+ */
+static void
+WakeLogWriter(
+    void
+	      )
+{
+    pthread_t writer;
+
+    if( ! __atomic_load_n( &logWriterRunning, __ATOMIC_ACQUIRE ) )
+    {
+        if( ! __atomic_exchange_n( &logWriterRunning, true,
+				   __ATOMIC_ACQ_REL ) )
+	{
+	    if( pthread_create( &writer, NULL, WriteLogEvents, NULL ) == 0 )
+	    {
+	        pthread_detach( writer );
 	    }
 	    else
 	    {
-	        switch( format[ idx ] )
-		{
-		    case 'd':
-		        printable.d = va_arg( v1, int );
-			sprintf( argument, "%d", printable.d );
-		        break;
-		    case 's':
-		        printable.s = va_arg( v1, char* );
-			sprintf( argument, "%s", printable.s );
-		        break;
-		    default:
-		        argument[ 0 ] = '\0';
-		        break;
-		}
-		assert( outIdx + strlen( argument ) < MAX_LOG_ENTRY_LENGTH );
-		strcpy( &compile[ outIdx ], argument );
-		outIdx += strlen( argument );
+	        /* Try again with the next message. Until then, the messages
+		   wait in the rings. */
+	        __atomic_store_n( &logWriterRunning, false, __ATOMIC_RELEASE );
 	    }
-	    idx++;
 	}
     }
-    compile[ outIdx ] = '\0';
+    else if( __atomic_load_n( &logWriterIdle, __ATOMIC_SEQ_CST )
+	     && __atomic_exchange_n( &logWriterIdle, false, __ATOMIC_SEQ_CST ) )
+    {
+        sem_post( &logWriterWakeup );
+    }
+}
 
-    va_end( v1 );
 
-    pthread_mutex_lock( &logger_mutex );
-    if( priority <= (int) logger.logLevel )
+
+/**
+ * Return the ring buffer of the calling thread, and assign one to the
+ * thread if it does not have one yet.
+ * @return Ring buffer.
+ */
+static struct LogRing*
+GetLogRing(
+    void
+	   )
+{
+    struct LogRing *ring;
+
+    pthread_once( &logRingsOnce, InitializeLogRings );
+    ring = pthread_getspecific( logRingKey );
+    if( ring == NULL )
     {
-        LogMessage( logger.logFh, logger.loggingEnabled,
-		    logger.logToSyslog, logger.stdoutDisabled,
-		    priority, logger.hostname, compile );
+        pthread_mutex_lock( &logRings_mutex );
+	/* Take over the ring of a thread that has exited, if any. */
+	for( ring = logRings; ring != NULL; ring = ring->next )
+	{
+	    if( ! __atomic_load_n( &ring->inUse, __ATOMIC_ACQUIRE ) )
+	    {
+	        break;
+	    }
+	}
+	if( ring == NULL )
+	{
+	    ring = malloc( sizeof( struct LogRing ) );
+	    assert( ring != NULL );
+	    ring->head = 0;
+	    ring->tail = 0;
+	    ring->busy = false;
+	    ring->next = logRings;
+	    __atomic_store_n( &logRings, ring, __ATOMIC_RELEASE );
+	}
+	__atomic_store_n( &ring->inUse, true, __ATOMIC_RELAXED );
+	pthread_mutex_unlock( &logRings_mutex );
+	pthread_setspecific( logRingKey, ring );
     }
-    pthread_mutex_unlock( &logger_mutex );
+    return( ring );
 }
 
+
+
+/**
+ * Log a message to file, stdout, or syslog, depending on the log
+ * initialization. The message is recorded in the calling thread's ring
+ * buffer and written by the writer thread. The format string is not copied
+ * and must therefore be a string literal; only %d, %u, and %s are
+ * supported. At most LOG_EVENT_ARGUMENTS arguments are recorded, and the
+ * string arguments are truncated to LOG_EVENT_TEXT bytes in total.
+ * @param priority [in] Whether the message is a LOG_ERR, LOG_WARNING, etc.
+ * @param format [in] Formatting string for the message.
+ * @param ... [in] Variable number of arguments for the formatting string.
+ * @return Nothing.
+ */
+void
+Syslog(
+    int        priority,
+    const char *format,
+               ...
+       )
+{
+    struct LogRing  *ring;
+    struct LogEvent unqueued;
+    unsigned int    head;
+    va_list         v1;
+
+    /* Leave out the message before doing any work if it would not be
+       logged. The settings are read without locking, as they may change
+       at any time anyway. */
+    if( ( ! logger.loggingEnabled ) || ( priority > (int) logger.logLevel ) )
+    {
+        return;
+    }
+
+    ring = GetLogRing( );
+    head = ring->head;
+    /* The ring is busy if a signal handler logs a message while the thread
+       is recording one. */
+    if( ( ! ring->busy )
+	&& ( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE )
+	     < LOG_RING_EVENTS ) )
+    {
+        ring->busy = true;
+	__atomic_signal_fence( __ATOMIC_SEQ_CST );
+	va_start( v1, format );
+	RecordLogEvent( &ring->event[ head & ( LOG_RING_EVENTS - 1 ) ],
+			priority, format, v1 );
+	va_end( v1 );
+	__atomic_store_n( &ring->head, head + 1, __ATOMIC_SEQ_CST );
+	__atomic_signal_fence( __ATOMIC_SEQ_CST );
+	ring->busy = false;
+
+	WakeLogWriter( );
+    }
+    else
+    {
+        /* Write the message right away rather than lose it, after the
+	   messages that are already waiting. */
+        va_start( v1, format );
+	RecordLogEvent( &unqueued, priority, format, v1 );
+	va_end( v1 );
+	FlushLog( );
+	pthread_mutex_lock( &logger_mutex );
+	WriteLogEvent( &unqueued );
+	pthread_mutex_unlock( &logger_mutex );
+    }
+}
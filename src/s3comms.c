@@ -31,9 +31,11 @@
 #include <pthread.h>
 #include <curl/curl.h>
 #include <errno.h>
+#include <time.h>
 #include <glib.h>
 #include <assert.h>
 #include "s3comms.h"
+#include "trace.h"
 
 
 #ifdef AUTOTEST
@@ -51,6 +53,39 @@ struct CurlWriteBuffer
     size_t        size;
 };
 
+/* Response headers of a request, which are collected one after the other
+   in a single buffer. Each header is stored as a flag that tells whether
+   it has a value, the zero-terminated key, and the zero-terminated value,
+   if any. */
+struct CurlHeaderArena
+{
+    char   *data;
+    size_t length;
+    size_t capacity;
+    int    count;
+};
+
+/* Initial size of a header arena, which holds the headers of a typical S3
+   response. */
+#define HEADER_ARENA_SIZE 1024
+
+/* Define the custom data type that is passed by the CURL call-back for
+   passing headers received from S3 on to a receiver as they arrive. */
+struct CurlHeaderReceiver
+{
+    S3HeaderReceiver receiver;
+    void             *ctx;
+};
+
+/* Define the custom data type that is passed by the CURL call-back for
+   passing data received from S3 on to a receiver as it arrives. */
+struct CurlStreamBuffer
+{
+    CURL           *curl;
+    S3BodyReceiver receiver;
+    void           *ctx;
+};
+
 /* Define the custom data type that is passed by the CURL call-back for
    sending data to S3. */
 struct CurlReadBuffer
@@ -65,6 +100,47 @@ struct CurlReadBuffer
 static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
 static GSList *handles = NULL;
 
+/* DNS cache and TLS session cache shared by all CURL handles of the
+   process, and the locks that protect them. */
+static CURLSH          *curlShare = NULL;
+static pthread_mutex_t curlShare_mutex[ CURL_LOCK_DATA_LAST ];
+
+/* Requests that fail with a transient error are retried after a randomized,
+   exponentially growing delay. */
+#define S3_MAX_ATTEMPTS       6
+#define S3_BACKOFF_BASE_MS    50
+#define S3_BACKOFF_CEILING_MS 10000
+
+/* Seconds that a pre-connection may take before it is given up. */
+#define S3_PRECONNECT_TIMEOUT 10L
+
+/* The number of requests in flight is governed by an additive-increase/
+   multiplicative-decrease controller: the limit is halved when S3 signals
+   that it is throttling, and it grows by one for each limit's worth of
+   responses that arrive without throttling. */
+#define S3_MIN_CONCURRENCY    1
+#define S3_MAX_CONCURRENCY    16
+
+STATIC struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  slotAvailable;
+	int             limit;
+	int             inFlight;
+	int             cleanResponses;
+	/* Responses to requests that were already in flight when the limit was
+	   last decreased; these do not decrease the limit again. */
+	int             staleResponses;
+} congestion =
+{
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	S3_MAX_CONCURRENCY,
+	0,
+	0,
+	0
+};
+
 
 
 /**
@@ -94,6 +170,160 @@ UnlockCurl(
 
 
 
+/**
+ * Lock data in the shared CURL caches for a CURL handle.
+ * @param curl [in] CURL handle (unused).
+ * @param data [in] The cached data that is accessed.
+ * @param access [in] Shared or exclusive access (unused).
+ * @param ctx [in] Unused.
+ * @return Nothing.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void
+LockCurlShare(
+	CURL             *curl,
+	curl_lock_data   data,
+	curl_lock_access access,
+	void             *ctx
+	          )
+{
+	pthread_mutex_lock( &curlShare_mutex[ data ] );
+}
+
+
+/**
+ * Unlock data in the shared CURL caches.
+ * @param curl [in] CURL handle (unused).
+ * @param data [in] The cached data that was accessed.
+ * @param ctx [in] Unused.
+ * @return Nothing.
+ */
+static void
+UnlockCurlShare(
+	CURL           *curl,
+	curl_lock_data data,
+	void           *ctx
+	            )
+{
+	pthread_mutex_unlock( &curlShare_mutex[ data ] );
+}
+#pragma GCC diagnostic pop
+
+
+
+/**
+ * Initialize CURL for the process, and create the DNS cache and the TLS
+ * session cache that all CURL handles of the process share. This function
+ * must be called before any other thread uses CURL.
+ * @return Nothing.
+ */
+void
+s3_InitializeCurl(
+	void
+	              )
+{
+	int i;
+
+	curl_global_init( CURL_GLOBAL_ALL );
+
+	for( i = 0; i < CURL_LOCK_DATA_LAST; i++ )
+	{
+		pthread_mutex_init( &curlShare_mutex[ i ], NULL );
+	}
+	curlShare = curl_share_init( );
+	if( curlShare != NULL )
+	{
+		curl_share_setopt( curlShare, CURLSHOPT_LOCKFUNC, LockCurlShare );
+		curl_share_setopt( curlShare, CURLSHOPT_UNLOCKFUNC, UnlockCurlShare );
+		curl_share_setopt( curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+		curl_share_setopt( curlShare, CURLSHOPT_SHARE,
+						   CURL_LOCK_DATA_SSL_SESSION );
+		/* The connection cache is not shared, because CURL does not
+		   support sharing connections between threads that transfer
+		   concurrently. Each handle keeps its own connections alive, also
+		   across curl_easy_reset. */
+	}
+}
+
+
+
+/**
+ * Release the shared CURL caches and clean up CURL for the process. All
+ * CURL handles must have been cleaned up.
+ * @return Nothing.
+ */
+void
+s3_ShutdownCurl(
+	void
+	            )
+{
+	int i;
+
+	if( curlShare != NULL )
+	{
+		curl_share_cleanup( curlShare );
+		curlShare = NULL;
+	}
+	for( i = 0; i < CURL_LOCK_DATA_LAST; i++ )
+	{
+		pthread_mutex_destroy( &curlShare_mutex[ i ] );
+	}
+
+	curl_global_cleanup( );
+}
+
+
+
+/**
+ * Create a CURL handle that uses the shared DNS and TLS session caches.
+ * The caches remain attached when the handle is reset with
+ * curl_easy_reset.
+ * @return CURL handle, or \a NULL if an error occurred.
+ */
+CURL*
+s3_CreateCurlHandle(
+	void
+	                )
+{
+	CURL *curl;
+
+	curl = curl_easy_init( );
+	if( ( curl != NULL ) && ( curlShare != NULL ) )
+	{
+		curl_easy_setopt( curl, CURLOPT_SHARE, curlShare );
+	}
+	return( curl );
+}
+
+
+
+/**
+ * Return the HMAC key for signing requests with the handle's secret key,
+ * preparing it if the secret key has changed. The transferers of the file
+ * cache reuse their handles for the credentials of different users, so the
+ * key is prepared again only when the user changes.
+ * @param handle [in/out] Handle.
+ * @return HMAC key.
+ */
+static const struct HmacKey*
+GetSigningKey(
+	S3COMM *handle
+	          )
+{
+	if( ( handle->signingKey == NULL )
+		|| ( strcmp( handle->signingSecret, handle->secretKey ) != 0 ) )
+	{
+		DestroyHmacKey( handle->signingKey );
+		free( handle->signingSecret );
+		handle->signingKey    = CreateHmacKey( handle->secretKey, HASH_SHA1 );
+		handle->signingSecret = strdup( handle->secretKey );
+	}
+	return( handle->signingKey );
+}
+
+
+
 /**
  * Create a handle in the library in order to use the S3 functions.
  * (The hashing functions do not require this handle.)
@@ -116,13 +346,19 @@ s3_open(
 
 	/* Create a new instance, including a new CURL session. */
 	newInstance = malloc( sizeof( S3COMM ) );
-	newInstance->curl = curl_easy_init( );
+	newInstance->curl = s3_CreateCurlHandle( );
 	if( newInstance->curl != NULL )
 	{
-		newInstance->region     = region;
-		newInstance->bucket     = strdup( bucket );
-		newInstance->keyId      = strdup( keyId );
-		newInstance->secretKey  = strdup( secretKey );
+		newInstance->region        = region;
+		newInstance->bucket        = strdup( bucket );
+		newInstance->keyId         = strdup( keyId );
+		newInstance->secretKey     = strdup( secretKey );
+		newInstance->signingKey    = NULL;
+		newInstance->signingSecret = NULL;
+		newInstance->signatureV4   = true;
+		/* Prepare the signing key now, so that the threads that share the
+		   handle never have to. */
+		(void) GetSigningKey( newInstance );
 		memcpy( &newInstance->curl_mutex, &defaultMutex,
 				sizeof( pthread_mutex_t ) );
 
@@ -158,21 +394,145 @@ s3_close(
 	free( handle->bucket );
 	free( handle->keyId );
 	free( handle->secretKey );
+	DestroyHmacKey( handle->signingKey );
+	free( handle->signingSecret );
 	curl_easy_cleanup( handle->curl );
 	free( handle );
 }
 
 
 
+/**
+ * Connect the handle to the bucket's host ahead of the first request, so
+ * that the first request neither resolves the host name nor performs a TLS
+ * handshake. The connection is established with an unsigned HEAD request
+ * for the bucket, whose response (typically 403) is ignored; CURL keeps the
+ * connection alive in the handle's connection cache for the requests that
+ * follow.
+ * @param handle [in/out] Handle.
+ * @return Nothing.
+ */
+void
+s3_Preconnect(
+	S3COMM *handle
+	          )
+{
+	char *hostName;
+	char *url;
+
+	hostName = GetS3HostNameByRegion( handle->region, handle->bucket );
+	url = malloc( strlen( "https://" ) + strlen( hostName )
+				  + sizeof( char ) + strlen( handle->bucket )
+				  + sizeof( char ) + sizeof( char ) );
+	if( handle->region != US_STANDARD )
+	{
+		sprintf( url, "https://%s/", hostName );
+	}
+	else
+	{
+		sprintf( url, "https://%s/%s/", hostName, handle->bucket );
+	}
+
+	LockCurl( &handle->curl_mutex );
+	curl_easy_reset( handle->curl );
+	curl_easy_setopt( handle->curl, CURLOPT_NOBODY, 1 );
+	curl_easy_setopt( handle->curl, CURLOPT_URL, url );
+	curl_easy_setopt( handle->curl, CURLOPT_CONNECTTIMEOUT,
+					  S3_PRECONNECT_TIMEOUT );
+	curl_easy_setopt( handle->curl, CURLOPT_TIMEOUT, S3_PRECONNECT_TIMEOUT );
+	(void) curl_easy_perform( handle->curl );
+	UnlockCurl( &handle->curl_mutex );
+
+	free( hostName );
+	free( url );
+}
+
+
+
+/**
+ * Locate the key and the value of a header line received by CURL, without
+ * copying them. The key is everything up to ':', unless the key takes up
+ * the entire line. For example, "HTTP/1.1 200 OK" is returned without
+ * value.
+ * @param line [in] Header line, which is not zero-terminated.
+ * @param length [in] Number of bytes in the line.
+ * @param key [out] Beginning of the key.
+ * @param keyLength [out] Number of bytes in the key.
+ * @param value [out] Beginning of the value, or \a NULL if there is none.
+ * @param valueLength [out] Number of bytes in the value.
+ * @return \a true if the line holds a header, or \a false if it is empty.
+ */
+static bool
+SplitHeaderLine(
+    const char *line,
+    size_t     length,
+    const char **key,
+    size_t     *keyLength,
+    const char **value,
+    size_t     *valueLength
+	            )
+{
+    size_t i = 0;
+    size_t begin;
+
+    /* Skip all non-alphanumeric characters. */
+    while( ( i < length ) && ( ! isalnum( (unsigned char) line[ i ] ) ) )
+    {
+        i++;
+    }
+
+    /* Extract header key. */
+    begin = i;
+    while( ( i < length ) && ( line[ i ] != ':' )
+	   && ( line[ i ] != '\n' ) && ( line[ i ] != '\r' ) )
+    {
+        i++;
+    }
+    *key         = &line[ begin ];
+    *keyLength   = i - begin;
+    *value       = NULL;
+    *valueLength = 0;
+
+    /* Extract the value for this header key provided there is one. A
+       newline indicates the end of the header, without data. */
+    if( ( i < length ) && ( line[ i ] == ':' ) )
+    {
+        /* Skip ':[[:space:]]*' */
+        while( ( i < length )
+	       && ( ( line[ i ] == ':' ) || isspace( (unsigned char) line[ i ] ) ) )
+	{
+	    i++;
+	}
+	if( i < length )
+	{
+	    /* If the header value ends with a newline, terminate it
+	       prematurely. */
+	    begin = i;
+	    while( ( i < length ) && ( line[ i ] != '\0' )
+		   && ( line[ i ] != '\r' ) && ( line[ i ] != '\n' ) )
+	    {
+	        i++;
+	    }
+	    *value       = &line[ begin ];
+	    *valueLength = i - begin;
+	}
+    }
+
+    /* Ignore the line if it is empty. */
+    return( ( *keyLength != 0 ) || ( *value != NULL ) );
+}
+
+
+
 /**
  * Callback function for CURL write where header data is expected. The function
- * adds headers to an expanding array organized as {header-name, header-value}
- * pairs.
+ * appends each header to the request's header arena, so that all the headers
+ * of a response share a single buffer.
  * @param ptr [in] Source of the data from CURL.
  * @param size [in] The size of each data block.
  * @param nmemb [in] Number of data blocks.
  * @param userdata [in] Passed from the CURL write-back as a pointer to a
- *        struct CurlWriteBuffer.
+ *        struct CurlHeaderArena.
  * @return Number of bytes copied from \a ptr.
  */
 static size_t
@@ -183,114 +543,129 @@ CurlWriteHeader(
     void   *userdata
 	            )
 {
-    int    i;
-    int    bufIdx;
-    int    dataEndIdx;
-    size_t toCopy = size * nmemb;
-    size_t newSize;
-    char   *header;
-    char   *data = NULL;
-    bool   hasData = true;
-    struct CurlWriteBuffer *writeBuffer = userdata;
-
-    /* Allocate room for 10 headers at a time. */
-    static const int HEADER_ALLOC_AMOUNT = 10;
-
-    /* Skip all non-alphanumeric characters. */
-    while( ! isalnum( *ptr ) )
+    struct CurlHeaderArena *arena = userdata;
+    size_t                 toCopy = size * nmemb;
+    const char             *key;
+    size_t                 keyLength;
+    const char             *value;
+    size_t                 valueLength;
+    size_t                 recordLength;
+    char                   *record;
+
+    if( SplitHeaderLine( ptr, toCopy, &key, &keyLength, &value, &valueLength ) )
     {
-        ptr++;
+        /* Expand the arena if necessary. */
+        recordLength = 1 + keyLength + 1;
+	if( value != NULL )
+	{
+	    recordLength = recordLength + valueLength + 1;
+	}
+	if( arena->capacity < arena->length + recordLength )
+	{
+	    if( arena->capacity == 0 )
+	    {
+	        arena->capacity = HEADER_ARENA_SIZE;
+	    }
+	    while( arena->capacity < arena->length + recordLength )
+	    {
+	        arena->capacity = arena->capacity * 2;
+	    }
+	    arena->data = realloc( arena->data, arena->capacity );
+	}
+
+	/* Write the key and the value into the arena. */
+	record = &arena->data[ arena->length ];
+	*record++ = ( value != NULL );
+	memcpy( record, key, keyLength );
+	record[ keyLength ] = '\0';
+	if( value != NULL )
+	{
+	    record = &record[ keyLength + 1 ];
+	    memcpy( record, value, valueLength );
+	    record[ valueLength ] = '\0';
+	}
+	arena->length = arena->length + recordLength;
+	arena->count++;
     }
 
-    /* Extract header key, which is everything up to ':', unless the header
-       key takes up the entire line. For example, "HTTP/1.1 200 OK" is
-       returned without value. */
-    for( i = 0;
-		 ( i < (int) toCopy ) && ( ptr[ i ] != ':' ) &&
-			 ( ptr[ i ] != '\n' ) && ( ptr[ i ] != '\r' );
-		 i++ );
-    header = malloc( ( i + 1 ) * sizeof( char ) );
-    memcpy( header, ptr, i );
-    header[ i ] = '\0';
-    /* A newline indicates the end of the header, without data. If a
-       newline is encountered, rewind the pointer and indicate that only
-       the header key is available in this header. */
-    if( ( ptr[ i ] == '\n' ) || ( ptr[ i ] == '\r' ) )
+    return( toCopy );
+}
+
+
+
+/**
+ * Callback function for CURL write where header data is passed on to a
+ * receiver as it arrives, without being copied.
+ * @param ptr [in] Source of the data from CURL.
+ * @param size [in] The size of each data block.
+ * @param nmemb [in] Number of data blocks.
+ * @param userdata [in] Passed from the CURL write-back as a pointer to a
+ *        struct CurlHeaderReceiver.
+ * @return Number of bytes consumed from \a ptr.
+ */
+static size_t
+CurlReceiveHeader(
+    char   *ptr,
+    size_t size,
+    size_t nmemb,
+    void   *userdata
+	              )
+{
+    struct CurlHeaderReceiver *headerReceiver = userdata;
+    const char                *key;
+    size_t                    keyLength;
+    const char                *value;
+    size_t                    valueLength;
+
+    if( SplitHeaderLine( ptr, size * nmemb,
+			 &key, &keyLength, &value, &valueLength ) )
     {
-        hasData = false;
+        headerReceiver->receiver( key, keyLength, value, valueLength,
+				  headerReceiver->ctx );
     }
+    return( size * nmemb );
+}
+
+
+
+/**
+ * Convert the headers in a header arena to an array organized as
+ * {header-name, header-value} pairs. The array and the strings it points to
+ * are placed in a single allocation, which is freed with \a free.
+ * @param arena [in] Header arena.
+ * @return The header array, or \a NULL if there are no headers.
+ */
+static char**
+CollectResponseHeaders(
+    const struct CurlHeaderArena *arena
+	                   )
+{
+    char **headers;
+    char *record;
+    bool hasValue;
+    int  i;
 
-    /* Extract the value for this header key provided there is one. */
-    if( ( i != (int) toCopy ) && hasData )
+    if( arena->count == 0 )
     {
-        /* Extract data. Skip ':[[:space:]]*' */
-        while( i < (int) toCopy )
-		{
-			if( ( ptr[ i ] == ':' ) || isspace( ptr[ i ] ) )
-			{
-				i++;
-			}
-			else
-			{
-				break;
-			}
-		}
-		if( i != (int) toCopy )
-		{
-			/* Extract header value. If the header value ends with a newline,
-			   terminate it prematurely. */
-			dataEndIdx = i;
-			while( dataEndIdx < (int) toCopy )
-			{
-				if( ( ptr[ dataEndIdx ] == '\0' ) ||
-					( ptr[ dataEndIdx ] == '\r' ) ||
-					( ptr[ dataEndIdx ] == '\n' ) )
-				{
-					break;
-				}
-				dataEndIdx++;
-			}
-			data = malloc( ( dataEndIdx - i + 1 ) * sizeof( char ) );
-			memcpy( data, &ptr[ i ], dataEndIdx - i );
-			data[ dataEndIdx - i ] = '\0';
-		}
+        return( NULL );
     }
-
-    /* Ignore the header and data if it's an empty line. */
-    if( ( strlen( header ) != 0 ) || ( data != NULL ) )
+    headers = malloc( arena->count * 2 * sizeof( char* ) + arena->length );
+    record  = (char*) &headers[ arena->count * 2 ];
+    memcpy( record, arena->data, arena->length );
+    for( i = 0; i < arena->count; i++ )
     {
-        /* Allocate or expand the buffer to receive the new data. */
-        if( writeBuffer->data == NULL )
-		{
-			writeBuffer->size = 0;
-			writeBuffer->data = malloc( HEADER_ALLOC_AMOUNT *
-										2 * sizeof( char* ) );
-		}
-		else
-        {
-			/* Increase pair count. */
-			writeBuffer->size = writeBuffer->size + 1;
-			/* Expand the buffer by HEADER_ALLOC_AMOUNT items if necessary. */
-			if( ( writeBuffer->size % HEADER_ALLOC_AMOUNT ) == 0 )
-			{
-				newSize = ( writeBuffer->size + 1 ) * HEADER_ALLOC_AMOUNT;
-				writeBuffer->data = realloc( writeBuffer->data,
-											 newSize * 2 * sizeof( char* ) );
-				bufIdx = writeBuffer->size * 2;
-				for( i = 0; i < HEADER_ALLOC_AMOUNT; i++ )
-				{
-					( (char**)writeBuffer->data )[ bufIdx + i * 2 ] = NULL;
-				}
-			}
-		}
-
-		/* Write the key and the value into the buffer. */
-		bufIdx = writeBuffer->size * 2;
-		( (char**)writeBuffer->data )[ bufIdx     ] = header;
-		( (char**)writeBuffer->data )[ bufIdx + 1 ] = data;
+        hasValue = *record++;
+	headers[ i * 2 ] = record;
+	record = record + strlen( record ) + 1;
+	headers[ i * 2 + 1 ] = NULL;
+	if( hasValue )
+	{
+	    headers[ i * 2 + 1 ] = record;
+	    record = record + strlen( record ) + 1;
+	}
     }
 
-    return( toCopy );
+    return( headers );
 }
 
 
@@ -386,6 +761,40 @@ CurlWriteData(
 
 
 
+/**
+ * Callback function for CURL write where body data is passed on to a
+ * receiver instead of being buffered. The body of an error response is
+ * discarded, so that the receiver only sees the responses it expects.
+ * @param ptr [in] Source of the data from CURL.
+ * @param size [in] The size of each data block.
+ * @param nmemb [in] Number of data blocks.
+ * @param userdata [in] Passed from the CURL write-back as a pointer to a
+ *        struct CurlStreamBuffer.
+ * @return Number of bytes consumed from \a ptr, which is less than the
+ *         number of bytes received if the receiver rejects the data.
+ */
+static size_t
+CurlStreamData(
+    char   *ptr,
+    size_t size,
+    size_t nmemb,
+    void   *userdata
+	           )
+{
+    struct CurlStreamBuffer *streamBuffer = userdata;
+    long                    httpStatus = 0;
+
+    curl_easy_getinfo( streamBuffer->curl, CURLINFO_RESPONSE_CODE,
+		       &httpStatus );
+    if( ( httpStatus < 200 ) || ( 299 < httpStatus ) )
+    {
+        return( size * nmemb );
+    }
+    return( streamBuffer->receiver( ptr, size * nmemb, streamBuffer->ctx ) );
+}
+
+
+
 /**
  * Extract the \a value part from a header string formed as \a key:value.
  * @param headerString [in] Header string with key: value string.
@@ -569,18 +978,18 @@ SignablePath(
  * @param bucket [in] Bucket on the Amazon S3 storage.
  * @param path [in] Path of the requested file relative to the bucket.
  * @param keyId [in] User's Amazon Key ID.
- * @param secretKey [in] User's Secret Key.
+ * @param signingKey [in] HMAC key prepared from the user's Secret Key.
  * @return Nothing.
  */
 STATIC struct curl_slist*
 CreateAwsSignature(
-    const char         *httpMethod,	   
-    struct curl_slist  *headers,
-	enum bucketRegions region,
-	const char         *bucket,
-    const char         *path,
-	const char         *keyId,
-	const char         *secretKey
+    const char           *httpMethod,
+    struct curl_slist    *headers,
+	enum bucketRegions   region,
+	const char           *bucket,
+    const char           *path,
+	const char           *keyId,
+	const struct HmacKey *signingKey
 		           )
 {
     char              messageToSign[ 4096 ];
@@ -685,10 +1094,8 @@ CreateAwsSignature(
 	free( (char*) signablePath );
 
     /* Sign the message and add the Authorization header. */
-    signature = HMAC( (const unsigned char*) messageToSign,
-					  strlen( messageToSign ),
-					  (const char*) secretKey,
-					  HASH_SHA1, HASHENC_BASE64 );
+    signature = HMACWithKey( signingKey, (const unsigned char*) messageToSign,
+							 strlen( messageToSign ), HASHENC_BASE64 );
     awsHeader = malloc( 100 );
     sprintf( awsHeader, "Authorization: AWS %s:%s",
 			 keyId, signature );
@@ -699,36 +1106,470 @@ CreateAwsSignature(
 
 
 
+/* Region names that Signature Version 4 scopes the signing key to, ordered
+   according to the enumeration "bucketRegions". */
+static const char *const awsRegionNames[ ] =
+{
+	"us-east-1",      /* US_STANDARD */
+	"us-west-2",      /* OREGON */
+	"us-west-1",      /* NORTHERN_CALIFORNIA */
+	"eu-west-1",      /* IRELAND */
+	"ap-southeast-1", /* SINGAPORE */
+	"ap-northeast-1", /* TOKYO */
+	"sa-east-1"       /* SAO_PAULO */
+};
+
+/* SHA256 hash of an empty payload. */
+#define EMPTY_PAYLOAD_SHA256 \
+	"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/* Signature Version 4 derives a signing key from the secret key with four
+   chained HMACs over the date, region, and service of the request. The key
+   is valid for the entire day, so the derived keys are cached and the
+   derivation only runs when the date changes or a new user signs a
+   request. */
+#define SIGNING_KEY_CACHE_SIZE 8
+
+static struct SigningKeyCacheEntry
+{
+	/* The date, region, and service, e.g., "20130524/us-east-1/s3". */
+	char           scope[ 8 + 1 + 16 + 1 + 2 + 1 ];
+	char           *secretKey;
+	struct HmacKey *signingKey;
+	unsigned long  lastUse;
+} signingKeyCache[ SIGNING_KEY_CACHE_SIZE ];
+static pthread_mutex_t signingKeyCache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long   signingKeyCacheClock  = 0;
+
+/* Number of times a signing key has been derived. */
+STATIC int signingKeyDerivations = 0;
+
+
+
 /**
- * Completely purge a curl_slist linked list of its data, calling the self-
- * destruct function in each entry to deallocate any data.
- * @param toDelete [in] Pointer to the first entry in the curl_slist.
- * @return Nothing.
+ * Derive the Signature Version 4 signing key for a date, region, and
+ * service.
+ * @param secretKey [in] User's Amazon Secret Key.
+ * @param scope [in] Date, region, and service, separated by '/'.
+ * @return HMAC-SHA256 key for signing requests.
  */
-void
-DeleteCurlSlistAndContents(
-    struct curl_slist *toDelete
-	                       )
+static struct HmacKey*
+DeriveSigningKey(
+	const char *secretKey,
+	const char *scope
+	             )
 {
-    if( toDelete != NULL )
-    {
-		DeleteCurlSlistAndContents( toDelete->next );
-		free( toDelete->data );
-		free( toDelete );
-    }
+	char           *dateKey;
+	char           *scopeCopy;
+	char           *element;
+	char           *savePtr;
+	unsigned char  derivedKey[ 32 ];
+	struct HmacKey *key;
+
+	dateKey = malloc( strlen( "AWS4" ) + strlen( secretKey ) + sizeof( char ) );
+	sprintf( dateKey, "AWS4%s", secretKey );
+	key = CreateBinaryHmacKey( (const unsigned char*) dateKey,
+							   strlen( dateKey ), HASH_SHA256 );
+	memset( dateKey, 0, strlen( dateKey ) );
+	free( dateKey );
+
+	/* Sign each element of the scope with the key derived from the previous
+	   element, and finally sign the terminating string. */
+	scopeCopy = malloc( strlen( scope ) + strlen( "/aws4_request" )
+						+ sizeof( char ) );
+	sprintf( scopeCopy, "%s/aws4_request", scope );
+	element = strtok_r( scopeCopy, "/", &savePtr );
+	while( element != NULL )
+	{
+		HMACWithKeyToBuffer( key, (const unsigned char*) element,
+							 strlen( element ), (char*) derivedKey,
+							 HASHENC_BIN );
+		DestroyHmacKey( key );
+		key = CreateBinaryHmacKey( derivedKey, sizeof( derivedKey ),
+								   HASH_SHA256 );
+		element = strtok_r( NULL, "/", &savePtr );
+	}
+	free( scopeCopy );
+	memset( derivedKey, 0, sizeof( derivedKey ) );
+	signingKeyDerivations++;
+
+	return( key );
 }
 
 
 
 /**
- * Create a generic S3 request header which is used in all requests.
- * @param hostname [in] Amazon S3 host addressed in the request.
- * @return Header list.
+ * Sign a Signature Version 4 string-to-sign with the signing key for the
+ * scope, deriving the signing key only if it is not already cached.
+ * @param secretKey [in] User's Amazon Secret Key.
+ * @param scope [in] Date, region, and service, separated by '/'.
+ * @param stringToSign [in] String to sign.
+ * @param signature [out] Buffer for the 64 hex digits of the signature and
+ *        a terminating zero.
+ * @return Nothing.
  */
-STATIC struct curl_slist*
-BuildGenericHeader(
-	const char *hostname
-	               )
+static void
+SignWithCachedSigningKey(
+	const char *secretKey,
+	const char *scope,
+	const char *stringToSign,
+	char       *signature
+	                     )
+{
+	struct SigningKeyCacheEntry *entry = NULL;
+	struct SigningKeyCacheEntry *victim;
+	int                         i;
+
+	pthread_mutex_lock( &signingKeyCache_mutex );
+	victim = &signingKeyCache[ 0 ];
+	for( i = 0; i < SIGNING_KEY_CACHE_SIZE; i++ )
+	{
+		if( ( signingKeyCache[ i ].signingKey != NULL )
+			&& ( strcmp( signingKeyCache[ i ].scope, scope ) == 0 )
+			&& ( strcmp( signingKeyCache[ i ].secretKey, secretKey ) == 0 ) )
+		{
+			entry = &signingKeyCache[ i ];
+			break;
+		}
+		/* Unused entries have a zero timestamp, so they are replaced before
+		   the least recently used entry. */
+		if( signingKeyCache[ i ].lastUse < victim->lastUse )
+		{
+			victim = &signingKeyCache[ i ];
+		}
+	}
+	if( entry == NULL )
+	{
+		entry = victim;
+		DestroyHmacKey( entry->signingKey );
+		free( entry->secretKey );
+		strncpy( entry->scope, scope, sizeof( entry->scope ) - 1 );
+		entry->scope[ sizeof( entry->scope ) - 1 ] = '\0';
+		entry->secretKey  = strdup( secretKey );
+		entry->signingKey = DeriveSigningKey( secretKey, scope );
+	}
+	entry->lastUse = ++signingKeyCacheClock;
+
+	HMACWithKeyToBuffer( entry->signingKey,
+						 (const unsigned char*) stringToSign,
+						 strlen( stringToSign ), signature, HASHENC_HEX );
+	pthread_mutex_unlock( &signingKeyCache_mutex );
+}
+
+
+
+/**
+ * Append a string to a canonical request, URI-encoding every character
+ * except the unreserved ones. Characters that are already percent-encoded
+ * are copied as they are.
+ * @param canonical [in/out] Canonical request.
+ * @param string [in] String to encode.
+ * @param length [in] Number of characters of the string to encode.
+ * @param encodeSlash [in] Whether '/' is encoded.
+ * @return Nothing.
+ */
+static void
+AppendUriEncoded(
+	GString    *canonical,
+	const char *string,
+	size_t     length,
+	bool       encodeSlash
+	             )
+{
+	size_t        idx;
+	unsigned char ch;
+
+	for( idx = 0; idx < length; idx++ )
+	{
+		ch = (unsigned char) string[ idx ];
+		if( isalnum( ch ) || ( ch == '-' ) || ( ch == '_' ) || ( ch == '.' )
+			|| ( ch == '~' ) || ( ( ch == '/' ) && ! encodeSlash ) )
+		{
+			g_string_append_c( canonical, ch );
+		}
+		else if( ( ch == '%' ) && ( idx + 2 < length )
+				 && isxdigit( (unsigned char) string[ idx + 1 ] )
+				 && isxdigit( (unsigned char) string[ idx + 2 ] ) )
+		{
+			g_string_append_c( canonical, '%' );
+			g_string_append_c( canonical,
+							   toupper( (unsigned char) string[ ++idx ] ) );
+			g_string_append_c( canonical,
+							   toupper( (unsigned char) string[ ++idx ] ) );
+		}
+		else
+		{
+			g_string_append_printf( canonical, "%%%02X", ch );
+		}
+	}
+}
+
+
+
+/**
+ * Helper function for sorting canonical query parameters and headers.
+ * @param a [in] First string in the qsort comparison.
+ * @param b [in] Second string in the qsort comparison.
+ * @return Less than, equal to, or greater than \a 0 according to the byte
+ *         ordering of \a a and \a b.
+ */
+static int
+qsort_canonicalcmp( const void *a, const void *b )
+{
+    return( strcmp( *((const char**) a ), *((const char**) b ) ) );
+}
+
+
+
+/**
+ * Append the canonical query string of a query to a canonical request. The
+ * parameters are sorted, and parameters without a value are given an empty
+ * value.
+ * @param canonical [in/out] Canonical request.
+ * @param query [in] Query part of the path, without the leading '?'.
+ * @return Nothing.
+ */
+static void
+AppendCanonicalQuery(
+	GString    *canonical,
+	const char *query
+	                 )
+{
+	gchar      **parameters;
+	const char *separator;
+	bool       first = true;
+	int        count;
+	int        i;
+
+	parameters = g_strsplit( query, "&", -1 );
+	count      = g_strv_length( parameters );
+	qsort( parameters, count, sizeof( parameters[ 0 ] ), qsort_canonicalcmp );
+	for( i = 0; i < count; i++ )
+	{
+		if( parameters[ i ][ 0 ] == '\0' )
+		{
+			continue;
+		}
+		if( ! first )
+		{
+			g_string_append_c( canonical, '&' );
+		}
+		first = false;
+		separator = strchr( parameters[ i ], '=' );
+		if( separator == NULL )
+		{
+			AppendUriEncoded( canonical, parameters[ i ],
+							  strlen( parameters[ i ] ), true );
+			g_string_append_c( canonical, '=' );
+		}
+		else
+		{
+			AppendUriEncoded( canonical, parameters[ i ],
+							  separator - parameters[ i ], true );
+			g_string_append_c( canonical, '=' );
+			AppendUriEncoded( canonical, separator + 1,
+							  strlen( separator + 1 ), true );
+		}
+	}
+	g_strfreev( parameters );
+}
+
+
+
+/**
+ * Create an Amazon AWS Signature Version 4 for the headers and add it to the
+ * headers. All headers are signed. The headers must include x-amz-date and
+ * x-amz-content-sha256.
+ *
+ * @param httpMethod [in] HTTP method, e.g., "GET" or "PUT".
+ * @param headers [in/out] Request headers.
+ * @param region [in] Amazon S3 region.
+ * @param path [in] Path of the request, including any query.
+ * @param keyId [in] User's Amazon Key ID.
+ * @param secretKey [in] User's Amazon Secret Key.
+ * @return Headers with the Authorization header appended.
+ */
+STATIC struct curl_slist*
+CreateAwsSignatureV4(
+    const char         *httpMethod,
+    struct curl_slist  *headers,
+	enum bucketRegions region,
+    const char         *path,
+	const char         *keyId,
+	const char         *secretKey
+		             )
+{
+	char              *canonicalHeaders[ 100 ];
+	int               headerCount = 0;
+	struct curl_slist *currentHeader;
+	const char        *headerString;
+	const char        *value;
+	const char        *valueEnd;
+	char              *header;
+	int               nameLength;
+	int               idx;
+	const char        *amzDate     = "";
+	const char        *payloadHash = "UNSIGNED-PAYLOAD";
+	const char        *query;
+	GString           *canonical;
+	GString           *signedHeaders;
+	char              requestHash[ 2 * 32 + 1 ];
+	char              scope[ 8 + 1 + 16 + 1 + 2 + 1 ];
+	char              *stringToSign;
+	char              signature[ 2 * 32 + 1 ];
+	char              *authorization;
+
+	assert( region <= SAO_PAULO );
+	if( httpMethod == NULL )
+	{
+		httpMethod = "";
+	}
+
+	/* Convert the headers to lower-case names followed by trimmed
+	   values. */
+	for( currentHeader = headers;
+		 ( currentHeader != NULL )
+			 && ( headerCount < (int) ( sizeof( canonicalHeaders )
+										/ sizeof( char* ) ) );
+		 currentHeader = currentHeader->next )
+	{
+		headerString = currentHeader->data;
+		value        = strchr( headerString, ':' );
+		if( value == NULL )
+		{
+			continue;
+		}
+		nameLength = value - headerString;
+		do
+		{
+			value++;
+		} while( isspace( *value ) );
+		valueEnd = value + strlen( value );
+		while( ( valueEnd > value ) && isspace( valueEnd[ -1 ] ) )
+		{
+			valueEnd--;
+		}
+		/* CURL does not send headers without a value. */
+		if( ( valueEnd == value )
+			|| ( strncasecmp( headerString, "Authorization:",
+							  strlen( "Authorization:" ) ) == 0 ) )
+		{
+			continue;
+		}
+		header = g_strdup_printf( "%.*s:%.*s", nameLength, headerString,
+								  (int) ( valueEnd - value ), value );
+		for( idx = 0; idx < nameLength; idx++ )
+		{
+			header[ idx ] = tolower( header[ idx ] );
+		}
+		canonicalHeaders[ headerCount++ ] = header;
+
+		if( strncmp( header, "x-amz-date:", strlen( "x-amz-date:" ) ) == 0 )
+		{
+			amzDate = &header[ strlen( "x-amz-date:" ) ];
+		}
+		else if( strncmp( header, "x-amz-content-sha256:",
+						  strlen( "x-amz-content-sha256:" ) ) == 0 )
+		{
+			payloadHash = &header[ strlen( "x-amz-content-sha256:" ) ];
+		}
+	}
+	qsort( canonicalHeaders, headerCount, sizeof( canonicalHeaders[ 0 ] ),
+		   qsort_canonicalcmp );
+
+	/* Build the canonical request: the method, the URI, the query, the
+	   headers, the list of signed headers, and the payload hash. */
+	canonical = g_string_sized_new( 512 );
+	g_string_append_printf( canonical, "%s\n", httpMethod );
+	query = strchr( path, '?' );
+	if( path[ 0 ] != '/' )
+	{
+		g_string_append_c( canonical, '/' );
+	}
+	AppendUriEncoded( canonical, path,
+					  query != NULL ? (size_t) ( query - path ) : strlen( path ),
+					  false );
+	g_string_append_c( canonical, '\n' );
+	if( query != NULL )
+	{
+		AppendCanonicalQuery( canonical, query + 1 );
+	}
+	g_string_append_c( canonical, '\n' );
+
+	signedHeaders = g_string_sized_new( 128 );
+	for( idx = 0; idx < headerCount; idx++ )
+	{
+		g_string_append_printf( canonical, "%s\n", canonicalHeaders[ idx ] );
+		if( idx != 0 )
+		{
+			g_string_append_c( signedHeaders, ';' );
+		}
+		g_string_append_len( signedHeaders, canonicalHeaders[ idx ],
+							 strchr( canonicalHeaders[ idx ], ':' )
+							 - canonicalHeaders[ idx ] );
+	}
+	g_string_append_printf( canonical, "\n%s\n%s",
+							signedHeaders->str, payloadHash );
+
+	/* Sign the hash of the canonical request with the key for the date. */
+	DigestBuffer( (const unsigned char*) canonical->str, canonical->len,
+				  requestHash, HASH_SHA256, HASHENC_HEX );
+	g_string_free( canonical, TRUE );
+	snprintf( scope, sizeof( scope ), "%.8s/%s/s3",
+			  amzDate, awsRegionNames[ region ] );
+	stringToSign = g_strdup_printf( "AWS4-HMAC-SHA256\n%s\n%s/aws4_request\n%s",
+									amzDate, scope, requestHash );
+	SignWithCachedSigningKey( secretKey, scope, stringToSign, signature );
+	g_free( stringToSign );
+
+	authorization = g_strdup_printf( "Authorization: AWS4-HMAC-SHA256 "
+									 "Credential=%s/%s/aws4_request, "
+									 "SignedHeaders=%s, Signature=%s",
+									 keyId, scope, signedHeaders->str,
+									 signature );
+	g_string_free( signedHeaders, TRUE );
+	for( idx = 0; idx < headerCount; idx++ )
+	{
+		g_free( canonicalHeaders[ idx ] );
+	}
+
+	headers = curl_slist_append( headers, authorization );
+	g_free( authorization );
+	return( headers );
+}
+
+
+
+/**
+ * Completely purge a curl_slist linked list of its data, calling the self-
+ * destruct function in each entry to deallocate any data.
+ * @param toDelete [in] Pointer to the first entry in the curl_slist.
+ * @return Nothing.
+ */
+void
+DeleteCurlSlistAndContents(
+    struct curl_slist *toDelete
+	                       )
+{
+    if( toDelete != NULL )
+    {
+		DeleteCurlSlistAndContents( toDelete->next );
+		free( toDelete->data );
+		free( toDelete );
+    }
+}
+
+
+
+/**
+ * Create a generic S3 request header which is used in all requests.
+ * @param hostname [in] Amazon S3 host addressed in the request.
+ * @return Header list.
+ */
+STATIC struct curl_slist*
+BuildGenericHeader(
+	const char *hostname
+	               )
 {
     struct curl_slist *headers = NULL;
     char              headbuf[ 512 ];
@@ -776,6 +1617,62 @@ qsort_strcmp( const void *a, const void *b )
 
 
 
+/**
+ * Add the headers that Signature Version 4 requires: the time of the request
+ * and the SHA256 hash of the payload. Requests without a body are signed with
+ * the hash of the empty payload. Requests with a body, such as upload parts,
+ * are signed with an unsigned payload unless the caller supplies the hash;
+ * the integrity of their body is verified by S3 against their Content-MD5
+ * header instead.
+ * @param headers [in/out] Request headers.
+ * @param httpMethod [in] HTTP method, e.g., "GET" or "PUT".
+ * @param additionalHeaders [in] Headers supplied by the caller.
+ * @return Header list with the headers added.
+ */
+static struct curl_slist*
+AddSignatureV4Headers(
+	struct curl_slist       *headers,
+	const char              *httpMethod,
+	const struct curl_slist *additionalHeaders
+	                  )
+{
+	char                    headbuf[ 128 ];
+	time_t                  now;
+	struct tm               tnow;
+	const struct curl_slist *currentHeader;
+
+	now = time( NULL );
+	gmtime_r( &now, &tnow );
+	strftime( headbuf, sizeof( headbuf ), "x-amz-date: %Y%m%dT%H%M%SZ",
+			  &tnow );
+	headers = curl_slist_append( headers, headbuf );
+
+	for( currentHeader = additionalHeaders; currentHeader != NULL;
+		 currentHeader = currentHeader->next )
+	{
+		if( strncasecmp( currentHeader->data, "x-amz-content-sha256:",
+						 strlen( "x-amz-content-sha256:" ) ) == 0 )
+		{
+			return( headers );
+		}
+	}
+	if( ( strcmp( httpMethod, "GET" ) == 0 )
+		|| ( strcmp( httpMethod, "HEAD" ) == 0 )
+		|| ( strcmp( httpMethod, "DELETE" ) == 0 ) )
+	{
+		headers = curl_slist_append( headers, "x-amz-content-sha256: "
+									 EMPTY_PAYLOAD_SHA256 );
+	}
+	else
+	{
+		headers = curl_slist_append( headers,
+									 "x-amz-content-sha256: UNSIGNED-PAYLOAD" );
+	}
+	return( headers );
+}
+
+
+
 /**
  * Create an S3 request that is ready to be submitted via CURL.
  * @param instance [in] S3COMM handle.
@@ -800,9 +1697,15 @@ BuildS3Request(
     char              *extraHeaders[ 100 ];
     size_t            count;
     int               i;
+	char              *requestPath;
 
     /* Build basic headers. */
     allHeaders = BuildGenericHeader( hostname );
+	if( instance->signatureV4 )
+	{
+		allHeaders = AddSignatureV4Headers( allHeaders, httpMethod,
+											additionalHeaders );
+	}
 
     /* Add any additional headers, if any, in sorted order. */
     currentHeader = additionalHeaders;
@@ -826,10 +1729,34 @@ BuildS3Request(
     curl_slist_free_all( additionalHeaders );
 
     /* Add a signature header. */
-    allHeaders = CreateAwsSignature( httpMethod, allHeaders,
-									 instance->region, instance->bucket,
-									 filename,
-									 instance->keyId, instance->secretKey );
+	if( instance->signatureV4 )
+	{
+		/* US Standard addresses the bucket in the path rather than in the
+		   host name. */
+		if( instance->region == US_STANDARD )
+		{
+			requestPath = g_strdup_printf( "/%s%s%s", instance->bucket,
+										   filename[ 0 ] == '/' ? "" : "/",
+										   filename );
+		}
+		else
+		{
+			requestPath = g_strdup( filename );
+		}
+		allHeaders = CreateAwsSignatureV4( httpMethod, allHeaders,
+										   instance->region, requestPath,
+										   instance->keyId,
+										   instance->secretKey );
+		g_free( requestPath );
+	}
+	else
+	{
+		allHeaders = CreateAwsSignature( httpMethod, allHeaders,
+										 instance->region, instance->bucket,
+										 filename,
+										 instance->keyId,
+										 GetSigningKey( instance ) );
+	}
 
     return( allHeaders );
 }
@@ -919,11 +1846,284 @@ ConvertHttpStatusToErrno(
 
 
 
+/**
+ * Determine whether a failed request is likely to succeed if it is
+ * resubmitted.  Server errors other than "not implemented" and "version not
+ * supported" are transient, and so are transport errors where the request
+ * either did not reach the server or the response was lost.
+ * @param curlStatus [in] Result code from \a curl_easy_perform.
+ * @param httpStatus [in] HTTP response code.
+ * @return \a true if the request should be retried, or \a false otherwise.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC bool
+IsTransientFailure(
+	int  curlStatus,
+	long httpStatus
+	               )
+{
+	bool transient;
+
+	switch( curlStatus )
+	{
+		case CURLE_OK:
+			transient = ( httpStatus == 500 ) || ( httpStatus == 502 )
+				|| ( httpStatus == 503 ) || ( httpStatus == 504 );
+			break;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			transient = true;
+			break;
+		default:
+			transient = false;
+			break;
+	}
+
+	return( transient );
+}
+
+
+
+/**
+ * Determine whether a request that failed transiently may be resubmitted.
+ * Requests other than POST are idempotent and may always be resubmitted.  A
+ * POST, such as the initiation of a multipart upload, may have been carried
+ * out even though its response was lost, so it is resubmitted only if it
+ * cannot have reached S3: if the connection was never made, or if S3
+ * rejected it with "503 Slow Down".
+ * @param httpVerb [in] HTTP method (GET, HEAD, etc.).
+ * @param curlStatus [in] Result code from \a curl_easy_perform.
+ * @param httpStatus [in] HTTP response code.
+ * @return \a true if the request may be resubmitted, or \a false otherwise.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC bool
+IsSafeToRetry(
+	const char *httpVerb,
+	int        curlStatus,
+	long       httpStatus
+	          )
+{
+	bool safe;
+
+	if( strcmp( httpVerb, "POST" ) != 0 )
+	{
+		safe = true;
+	}
+	else
+	{
+		safe = ( curlStatus == CURLE_COULDNT_RESOLVE_HOST )
+			|| ( curlStatus == CURLE_COULDNT_CONNECT )
+			|| ( ( curlStatus == CURLE_OK ) && ( httpStatus == 503 ) );
+	}
+
+	return( safe );
+}
+
+
+
+/**
+ * Wait until the congestion controller admits another request, and count it
+ * as in flight.  Every call must be paired with a call to
+ * \a s3_ReleaseRequestSlot.
+ * @return Nothing.
+ */
+void
+s3_AcquireRequestSlot(
+	void
+	                  )
+{
+	pthread_mutex_lock( &congestion.mutex );
+	while( congestion.limit <= congestion.inFlight )
+	{
+		pthread_cond_wait( &congestion.slotAvailable, &congestion.mutex );
+	}
+	congestion.inFlight++;
+	pthread_mutex_unlock( &congestion.mutex );
+}
+
+
+
+/**
+ * Return a request slot to the congestion controller and adjust the number of
+ * requests allowed in flight according to the outcome of the request.  A
+ * "503 Slow Down" response or a timeout halves the limit; clean responses
+ * raise it by one per window.
+ * @param curlStatus [in] Result code from \a curl_easy_perform.
+ * @param httpStatus [in] HTTP response code.
+ * @return \a true if the request failed transiently and should be retried,
+ *         or \a false otherwise.
+ * Test: unit test (test-s3if.c).
+ */
+bool
+s3_ReleaseRequestSlot(
+	int  curlStatus,
+	long httpStatus
+	                  )
+{
+	bool throttled;
+	bool transient;
+
+	throttled = ( ( curlStatus == CURLE_OK ) && ( httpStatus == 503 ) )
+		|| ( curlStatus == CURLE_OPERATION_TIMEDOUT );
+	transient = IsTransientFailure( curlStatus, httpStatus );
+
+	pthread_mutex_lock( &congestion.mutex );
+	congestion.inFlight--;
+	if( 0 < congestion.staleResponses )
+	{
+		congestion.staleResponses--;
+	}
+	else if( throttled )
+	{
+		congestion.limit = congestion.limit / 2;
+		if( congestion.limit < S3_MIN_CONCURRENCY )
+		{
+			congestion.limit = S3_MIN_CONCURRENCY;
+		}
+		congestion.cleanResponses = 0;
+		congestion.staleResponses = congestion.inFlight;
+	}
+	if( ! transient )
+	{
+		congestion.cleanResponses++;
+		if( congestion.limit <= congestion.cleanResponses )
+		{
+			if( congestion.limit < S3_MAX_CONCURRENCY )
+			{
+				congestion.limit++;
+			}
+			congestion.cleanResponses = 0;
+		}
+	}
+	pthread_cond_broadcast( &congestion.slotAvailable );
+	pthread_mutex_unlock( &congestion.mutex );
+
+	return( transient );
+}
+
+
+
+/**
+ * Return the number of requests that the congestion controller currently
+ * allows in flight.
+ * @return Concurrency limit.
+ */
+int
+s3_ConcurrencyLimit(
+	void
+	                )
+{
+	int limit;
+
+	pthread_mutex_lock( &congestion.mutex );
+	limit = congestion.limit;
+	pthread_mutex_unlock( &congestion.mutex );
+
+	return( limit );
+}
+
+
+
+/**
+ * Sleep before resubmitting a failed request.  The delay is drawn uniformly
+ * between zero and an exponentially growing ceiling so that clients that were
+ * throttled at the same time do not retry in lockstep.
+ * @param attempt [in] Number of attempts that have failed so far, less one.
+ * @return \a true if the request may be retried, or \a false if the retry
+ *         budget is exhausted.
+ */
+bool
+s3_BackoffBeforeRetry(
+	int attempt
+	                  )
+{
+	long            ceiling;
+	long            delay;
+	struct timespec pause;
+
+	if( S3_MAX_ATTEMPTS <= attempt + 1 )
+	{
+		return( false );
+	}
+
+	ceiling = S3_BACKOFF_CEILING_MS;
+	if( attempt < 16 )
+	{
+		ceiling = S3_BACKOFF_BASE_MS << attempt;
+		if( S3_BACKOFF_CEILING_MS < ceiling )
+		{
+			ceiling = S3_BACKOFF_CEILING_MS;
+		}
+	}
+	delay = g_random_int_range( 0, ceiling + 1 );
+	pause.tv_sec  = delay / 1000;
+	pause.tv_nsec = ( delay % 1000 ) * 1000000l;
+	while( nanosleep( &pause, &pause ) != 0 && errno == EINTR );
+
+	return( true );
+}
+
+
+
+/**
+ * Copy a list of headers so that the original survives \a BuildS3Request,
+ * which takes ownership of the headers it is given.
+ * @param toCopy [in] Pointer to the first entry in the curl_slist.
+ * @return Copy of the list.
+ */
+static struct curl_slist*
+CopyCurlSlist(
+	const struct curl_slist *toCopy
+	          )
+{
+	struct curl_slist *copy = NULL;
+
+	while( toCopy != NULL )
+	{
+		copy   = curl_slist_append( copy, toCopy->data );
+		toCopy = toCopy->next;
+	}
+
+	return( copy );
+}
+
+
+
+/**
+ * Empty the response of a request that is about to be resubmitted. The
+ * header arena keeps its buffer for the next response.
+ * @param writeBuffer [in/out] Response body buffer, which is emptied.
+ * @param headerArena [in/out] Response header arena, which is emptied.
+ * @return Nothing.
+ */
+static void
+DiscardResponse(
+	struct CurlWriteBuffer *writeBuffer,
+	struct CurlHeaderArena *headerArena
+	            )
+{
+	free( writeBuffer->data );
+	writeBuffer->data   = NULL;
+	writeBuffer->size   = 0;
+	headerArena->length = 0;
+	headerArena->count  = 0;
+}
+
+
+
 /**
  * Submit a sequence of headers containing an S3 request and receive the
  * output in the local write buffer. The headers list is deallocated.
  * The request may include PUT requests, as long as there is no body data
- * to put.
+ * to put. Requests that fail transiently are resubmitted with a new
+ * signature after a backoff delay, unless they are POST requests that may
+ * already have been carried out.
  * @param instance [in] S3COMM handle.
  * @param httpVerb [in] HTTP method (GET, HEAD, etc.).
  * @param headers [in/out] The CURL list of headers with the S3 request.
@@ -947,49 +2147,173 @@ s3_SubmitS3Request(
     int                    urlLength;
     int                    status = 0;
     long                   httpStatus;
+    struct curl_slist      *requestHeaders;
+    bool                   headersOnly;
+    bool                   retry;
+    int                    attempt;
 	CURL                   *curl       = instance->curl;
     struct CurlWriteBuffer writeBuffer = { NULL, 0 };
+    struct CurlHeaderArena headerArena = { NULL, 0, 0, 0 };
+    TRACE_SCOPE( "s3", "SubmitS3Request" );
 
     printf( "s3if: SubmitS3Request (%s)\n", filename );
 
     /* Determine the virtual host name. */
     hostName = GetS3HostNameByRegion( instance->region, instance->bucket );
-    headers = BuildS3Request( instance, httpVerb, hostName, headers, filename );
-
-    /* Submit request via CURL and wait for the response. */
-    LockCurl( &instance->curl_mutex );
-    curl_easy_reset( curl );
-    /* Set callback function according to HTTP method. */
-    if( ( strcmp( httpVerb, "HEAD" ) == 0 )
-		|| ( strcmp( httpVerb, "DELETE" ) == 0 )
-		|| ( strcmp( httpVerb, "POST" ) == 0 ) )
+    /* Determine the length of the URL. */
+    urlLength = strlen( hostName )
+                + strlen( "https://" )
+                + strlen( instance->bucket ) + sizeof( char )
+                + strlen( filename )
+                + sizeof( char )
+                + sizeof( char );
+    /* Build the full URL, adding a '/' to the host if the filename does not
+       include it as its leading character. */
+    url = malloc( urlLength );
+    if( instance->region != US_STANDARD )
+    {
+        sprintf( url, "https://%s%s%s", hostName,
+				 filename[ 0 ] == '/' ? "" : "/",
+				 filename );
+    }
+    else
+    {
+        sprintf( url, "https://%s/%s%s%s", hostName,
+				 instance->bucket,
+				 filename[ 0 ] == '/' ? "" : "/",
+				 filename );
+    }
+    headersOnly = ( strcmp( httpVerb, "GET" ) != 0 );
+
+    attempt = 0;
+    do
     {
-        curl_easy_setopt( curl, CURLOPT_NOBODY, 1 );
-        curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, CurlWriteHeader );
-		curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &writeBuffer );
-		if( strcmp( httpVerb, "DELETE" ) == 0 )
+		/* The signature covers the request date, so the request is signed
+		   anew for every attempt. */
+		requestHeaders = BuildS3Request( instance, httpVerb, hostName,
+										 CopyCurlSlist( headers ), filename );
+		DiscardResponse( &writeBuffer, &headerArena );
+
+		/* Submit request via CURL and wait for the response. */
+		s3_AcquireRequestSlot( );
+		LockCurl( &instance->curl_mutex );
+		curl_easy_reset( curl );
+		/* Set callback function according to HTTP method. */
+		if( ( strcmp( httpVerb, "HEAD" ) == 0 )
+			|| ( strcmp( httpVerb, "DELETE" ) == 0 )
+			|| ( strcmp( httpVerb, "POST" ) == 0 ) )
 		{
-			curl_easy_setopt( curl, CURLOPT_CUSTOMREQUEST, "DELETE" );
+			curl_easy_setopt( curl, CURLOPT_NOBODY, 1 );
+			curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, CurlWriteHeader );
+			curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &headerArena );
+			if( strcmp( httpVerb, "DELETE" ) == 0 )
+			{
+				curl_easy_setopt( curl, CURLOPT_CUSTOMREQUEST, "DELETE" );
+			}
+			else if( strcmp( httpVerb, "POST" ) == 0 )
+			{
+				curl_easy_setopt( curl, CURLOPT_CUSTOMREQUEST, "POST" );
+			}
 		}
-		else if( strcmp( httpVerb, "POST" ) == 0 )
+		else if( strcmp( httpVerb, "GET" ) == 0 )
 		{
-			curl_easy_setopt( curl, CURLOPT_CUSTOMREQUEST, "POST" );
+			curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, CurlWriteData );
+			curl_easy_setopt( curl, CURLOPT_WRITEDATA, &writeBuffer );
 		}
+		else if( strcmp( httpVerb, "PUT" ) == 0 )
+		{
+			curl_easy_setopt( curl, CURLOPT_NOBODY, 1 );
+			curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, CurlWriteHeader );
+			curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &headerArena );
+			curl_easy_setopt( curl, CURLOPT_UPLOAD, true );
+			curl_easy_setopt( curl, CURLOPT_INFILESIZE, 0 );
+		}
+		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, requestHeaders );
+		curl_easy_setopt( curl, CURLOPT_URL, url );
+		/*
+		curl_easy_setopt( curl, CURLOPT_VERBOSE, 1 );
+		*/
+		httpStatus = 0;
+		status = curl_easy_perform( curl );
+		curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
+		UnlockCurl( &instance->curl_mutex );
+		retry = s3_ReleaseRequestSlot( status, httpStatus )
+			&& IsSafeToRetry( httpVerb, status, httpStatus );
+
+		DeleteCurlSlistAndContents( requestHeaders );
+    } while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+
+    /* Return the response. The headers are returned as an array of
+       {header-name, header-value} pairs in a single allocation. */
+    if( headersOnly )
+    {
+        free( writeBuffer.data );
+	writeBuffer.data = (unsigned char*) CollectResponseHeaders( &headerArena );
+	writeBuffer.size = headerArena.count;
     }
-    else if( strcmp( httpVerb, "GET" ) == 0 )
+    free( headerArena.data );
+    *data       = writeBuffer.data;
+    *dataLength = writeBuffer.size;
+
+    free( hostName );
+    free( url );
+    DeleteCurlSlistAndContents( headers );
+
+    /* Report errors back if necessary. */
+    if( status == 0 )
     {
-        curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, CurlWriteData );
-		curl_easy_setopt( curl, CURLOPT_WRITEDATA, &writeBuffer );
+        status = ConvertHttpStatusToErrno( httpStatus );
     }
-    else if( strcmp( httpVerb, "PUT" ) == 0 )
+    else
     {
-        curl_easy_setopt( curl, CURLOPT_NOBODY, 1 );
-        curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, CurlWriteHeader );
-		curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &writeBuffer );
-		curl_easy_setopt( curl, CURLOPT_UPLOAD, true );
-		curl_easy_setopt( curl, CURLOPT_INFILESIZE, 0 );
+        status = -EIO;
+	return( status );
     }
-    curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
+
+    return( status );
+}
+
+
+
+/**
+ * Submit a GET request and pass the response body to a receiver as it
+ * arrives, so that the receiver may process the response while it is
+ * still being transferred. The headers list is deallocated. Requests that
+ * fail transiently are resubmitted with a new signature after a backoff
+ * delay; the receiver is called with a \a NULL buffer before each attempt
+ * so that it can discard what it received from a previous attempt.
+ * @param instance [in] S3COMM handle.
+ * @param headers [in/out] The CURL list of headers with the S3 request.
+ * @param filename [in] Full path name of the file that is accessed.
+ * @param receiver [in] Function that receives the response body.
+ * @param ctx [in] Context passed to the receiver.
+ * @return 0 on success, or \a -errno on failure.
+ */
+int
+s3_SubmitS3StreamRequest(
+	S3COMM             *instance,
+    struct curl_slist  *headers,
+    const char         *filename,
+    S3BodyReceiver     receiver,
+    void               *ctx
+	                    )
+{
+    char                    *url;
+    char                    *hostName;
+    int                     urlLength;
+    int                     status = 0;
+    long                    httpStatus;
+    struct curl_slist       *requestHeaders;
+    bool                    retry;
+    int                     attempt;
+	CURL                    *curl        = instance->curl;
+    struct CurlStreamBuffer streamBuffer = { curl, receiver, ctx };
+    TRACE_SCOPE( "s3", "SubmitS3StreamRequest" );
+
+    printf( "s3if: SubmitS3StreamRequest (%s)\n", filename );
+
+    /* Determine the virtual host name. */
+    hostName = GetS3HostNameByRegion( instance->region, instance->bucket );
     /* Determine the length of the URL. */
     urlLength = strlen( hostName )
                 + strlen( "https://" )
@@ -1008,24 +2332,143 @@ s3_SubmitS3Request(
     }
     else
     {
-        sprintf( url, "https://%s/%s%s%s", hostName,
-				 instance->bucket,
+        sprintf( url, "https://%s/%s%s%s", hostName, instance->bucket,
 				 filename[ 0 ] == '/' ? "" : "/",
 				 filename );
     }
+
+    attempt = 0;
+    do
+    {
+		requestHeaders = BuildS3Request( instance, "GET", hostName,
+										 CopyCurlSlist( headers ), filename );
+		receiver( NULL, 0, ctx );
+
+		/* Submit request via CURL and process the response while it
+		   arrives. */
+		s3_AcquireRequestSlot( );
+		LockCurl( &instance->curl_mutex );
+		curl_easy_reset( curl );
+		curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, CurlStreamData );
+		curl_easy_setopt( curl, CURLOPT_WRITEDATA, &streamBuffer );
+		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, requestHeaders );
+		curl_easy_setopt( curl, CURLOPT_URL, url );
+		httpStatus = 0;
+		status = curl_easy_perform( curl );
+		curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
+		UnlockCurl( &instance->curl_mutex );
+		retry = s3_ReleaseRequestSlot( status, httpStatus );
+
+		DeleteCurlSlistAndContents( requestHeaders );
+    } while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+
     free( hostName );
-    curl_easy_setopt( curl, CURLOPT_URL, url );
-    /*
-	curl_easy_setopt( curl, CURLOPT_VERBOSE, 1 );
-    */
-    status = curl_easy_perform( curl );
-    curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
-    UnlockCurl( &instance->curl_mutex );
-
-    /* Return the response. */
-    *data       = writeBuffer.data;
-    *dataLength = writeBuffer.size;
+    free( url );
+    DeleteCurlSlistAndContents( headers );
+
+    /* Report errors back if necessary. */
+    if( status == 0 )
+    {
+        status = ConvertHttpStatusToErrno( httpStatus );
+    }
+    else
+    {
+        status = -EIO;
+    }
 
+    return( status );
+}
+
+
+
+/**
+ * Submit a HEAD request and pass each response header to a receiver as it
+ * arrives. The headers are not copied, so the request makes no heap
+ * allocations for them. The headers list is deallocated. Requests that fail
+ * transiently are resubmitted with a new signature after a backoff delay;
+ * the receiver is called with a \a NULL key before each attempt so that it
+ * can discard what it received from a previous attempt.
+ * @param instance [in] S3COMM handle.
+ * @param headers [in/out] The CURL list of headers with the S3 request.
+ * @param filename [in] Full path name of the file that is accessed.
+ * @param receiver [in] Function that receives the response headers.
+ * @param ctx [in] Context passed to the receiver.
+ * @return 0 on success, or \a -errno on failure.
+ */
+int
+s3_SubmitS3HeadRequest(
+	S3COMM             *instance,
+    struct curl_slist  *headers,
+    const char         *filename,
+    S3HeaderReceiver   receiver,
+    void               *ctx
+	                  )
+{
+    char                      *url;
+    char                      *hostName;
+    int                       urlLength;
+    int                       status = 0;
+    long                      httpStatus;
+    struct curl_slist         *requestHeaders;
+    bool                      retry;
+    int                       attempt;
+	CURL                      *curl          = instance->curl;
+    struct CurlHeaderReceiver headerReceiver = { receiver, ctx };
+    TRACE_SCOPE( "s3", "SubmitS3HeadRequest" );
+
+    printf( "s3if: SubmitS3HeadRequest (%s)\n", filename );
+
+    /* Determine the virtual host name. */
+    hostName = GetS3HostNameByRegion( instance->region, instance->bucket );
+    /* Determine the length of the URL. */
+    urlLength = strlen( hostName )
+                + strlen( "https://" )
+                + strlen( instance->bucket ) + sizeof( char )
+                + strlen( filename )
+                + sizeof( char )
+                + sizeof( char );
+    /* Build the full URL, adding a '/' to the host if the filename does not
+       include it as its leading character. */
+    url = malloc( urlLength );
+    if( instance->region != US_STANDARD )
+    {
+        sprintf( url, "https://%s%s%s", hostName,
+				 filename[ 0 ] == '/' ? "" : "/",
+				 filename );
+    }
+    else
+    {
+        sprintf( url, "https://%s/%s%s%s", hostName, instance->bucket,
+				 filename[ 0 ] == '/' ? "" : "/",
+				 filename );
+    }
+
+    attempt = 0;
+    do
+    {
+		requestHeaders = BuildS3Request( instance, "HEAD", hostName,
+										 CopyCurlSlist( headers ), filename );
+		receiver( NULL, 0, NULL, 0, ctx );
+
+		/* Submit request via CURL and wait for the response. */
+		s3_AcquireRequestSlot( );
+		LockCurl( &instance->curl_mutex );
+		curl_easy_reset( curl );
+		curl_easy_setopt( curl, CURLOPT_NOBODY, 1 );
+		curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, CurlReceiveHeader );
+		curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &headerReceiver );
+		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, requestHeaders );
+		curl_easy_setopt( curl, CURLOPT_URL, url );
+		httpStatus = 0;
+		status = curl_easy_perform( curl );
+		curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
+		UnlockCurl( &instance->curl_mutex );
+		retry = s3_ReleaseRequestSlot( status, httpStatus );
+
+		DeleteCurlSlistAndContents( requestHeaders );
+    } while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+
+    free( hostName );
     free( url );
     DeleteCurlSlistAndContents( headers );
 
@@ -1037,7 +2480,6 @@ s3_SubmitS3Request(
     else
     {
         status = -EIO;
-	return( status );
     }
 
     return( status );
@@ -1050,7 +2492,8 @@ s3_SubmitS3Request(
  * output in the local write buffer. The headers list is deallocated.
  * The request includes a body buffer for upload data; if none should be
  * uploaded, \a SubmitS3Request may be used instead. For large data,
- * use the multi-uploader.
+ * use the multi-uploader. Requests that fail transiently are resubmitted
+ * from the beginning of the body buffer.
  * @param instance [in] S3COMM handle.
  * @param headers [in/out] The CURL list of headers with the S3 request.
  * @param filename [in] Full path name of the file that is accessed.
@@ -1076,8 +2519,12 @@ s3_SubmitS3PutRequest(
     int        urlLength;
     int        status     = 0;
     long       httpStatus;
+    struct curl_slist     *requestHeaders;
+    bool                  retry;
+    int                   attempt;
 	CURL                  *curl      = instance->curl;
     struct CurlReadBuffer readBuffer = { bodyData, bodyLength, 0 };
+    TRACE_SCOPE( "s3", "SubmitS3PutRequest" );
 
 
     /* Determine the virtual host name. */
@@ -1104,20 +2551,32 @@ s3_SubmitS3PutRequest(
 				 filename[ 0 ] == '/' ? "" : "/",
 				 filename );
     }
-    headers = BuildS3Request( instance, "HEAD", hostName, headers, filename );
-    free( hostName );
 
-    /* Submit request via CURL and wait for the response. */
-    LockCurl( &instance->curl_mutex );
-    curl_easy_reset( curl );
-    curl_easy_setopt( curl, CURLOPT_READFUNCTION, CurlReadData );
-    curl_easy_setopt( curl, CURLOPT_READDATA, &readBuffer );
-    curl_easy_setopt( curl, CURLOPT_UPLOAD, true );
-    curl_easy_setopt( curl, CURLOPT_HTTPHEADER, headers );
-    curl_easy_setopt( curl, CURLOPT_URL, url );
-    status = curl_easy_perform( curl );
-    curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
-    UnlockCurl( &instance->curl_mutex );
+    attempt = 0;
+    do
+    {
+		requestHeaders = BuildS3Request( instance, "HEAD", hostName,
+										 CopyCurlSlist( headers ), filename );
+		readBuffer.offset = 0;
+
+		/* Submit request via CURL and wait for the response. */
+		s3_AcquireRequestSlot( );
+		LockCurl( &instance->curl_mutex );
+		curl_easy_reset( curl );
+		curl_easy_setopt( curl, CURLOPT_READFUNCTION, CurlReadData );
+		curl_easy_setopt( curl, CURLOPT_READDATA, &readBuffer );
+		curl_easy_setopt( curl, CURLOPT_UPLOAD, true );
+		curl_easy_setopt( curl, CURLOPT_HTTPHEADER, requestHeaders );
+		curl_easy_setopt( curl, CURLOPT_URL, url );
+		httpStatus = 0;
+		status = curl_easy_perform( curl );
+		curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &httpStatus );
+		UnlockCurl( &instance->curl_mutex );
+		retry = s3_ReleaseRequestSlot( status, httpStatus );
+
+		DeleteCurlSlistAndContents( requestHeaders );
+    } while( retry && s3_BackoffBeforeRetry( attempt++ ) );
+    free( hostName );
 
     /* Indicate that there is no response data. */
     *response             = NULL;
@@ -1139,6 +2598,3 @@ s3_SubmitS3PutRequest(
 
     return( status );
 }
-
-
-
@@ -28,6 +28,7 @@
 #include "base64.h"
 #include "digest.h"
 #include <pthread.h>
+#include <stdbool.h>
 
 enum bucketRegions
 {
@@ -49,19 +50,52 @@ typedef struct
 	char               *secretKey;
 	CURL               *curl;
 	pthread_mutex_t    curl_mutex;
+	/* HMAC key prepared from secretKey, and the secret key it was prepared
+	   from. */
+	struct HmacKey     *signingKey;
+	char               *signingSecret;
+	/* Whether requests are signed with Signature Version 4 rather than
+	   Version 2. */
+	bool               signatureV4;
 } S3COMM;
 
 
+/* Receives a part of the body of a response, and returns the number of
+   bytes it accepted. The receiver is called with a NULL buffer before the
+   request is sent and before it is resent, so that it can start over. */
+typedef size_t (*S3BodyReceiver)( const char *data, size_t length,
+								  void *ctx );
+
+/* Receives a response header. The key and the value point into CURL's
+   buffer and are not zero-terminated; the value is NULL if the header has
+   none. The receiver is called with a NULL key before the request is sent
+   and before it is resent, so that it can start over. */
+typedef void (*S3HeaderReceiver)( const char *key, size_t keyLength,
+								  const char *value, size_t valueLength,
+								  void *ctx );
+
+
 
 
 S3COMM *s3_open( enum bucketRegions region, const char *bucket,
 				 const char *keyId, const char *secretKey );
 void s3_close( S3COMM *handle );
+void s3_Preconnect( S3COMM *handle );
+
+void s3_InitializeCurl( void );
+void s3_ShutdownCurl( void );
+CURL *s3_CreateCurlHandle( void );
 
 
 int s3_SubmitS3Request( S3COMM *handle, const char *httpVerb,
 						struct curl_slist *headers, const char *filename,
 						void **data, int *dataLength );
+int s3_SubmitS3StreamRequest( S3COMM *handle, struct curl_slist *headers,
+							  const char *filename, S3BodyReceiver receiver,
+							  void *ctx );
+int s3_SubmitS3HeadRequest( S3COMM *handle, struct curl_slist *headers,
+							const char *filename, S3HeaderReceiver receiver,
+							void *ctx );
 int s3_SubmitS3PutRequest( S3COMM *handle, struct curl_slist *headers,
 						   const char *filename, void **response,
 						   int *responseLength, unsigned char *bodyData,
@@ -73,5 +107,10 @@ BuildS3Request( S3COMM *instance, const char *httpMethod,
 void DeleteCurlSlistAndContents( struct curl_slist *toDelete );
 char* GetS3HostNameByRegion( enum bucketRegions region, const char *bucket );
 
+void s3_AcquireRequestSlot( void );
+bool s3_ReleaseRequestSlot( int curlStatus, long httpStatus );
+bool s3_BackoffBeforeRetry( int attempt );
+int s3_ConcurrencyLimit( void );
+
 
 #endif /* __S3_COMMS_H */
@@ -40,6 +40,9 @@
 #include "dircache.h"
 #include "s3comms.h"
 #include "filecache.h"
+#include "cachesnapshot.h"
+#include "cachestatus.h"
+#include "trace.h"
 
 
 /* The REST interface does not allow the creation of directories. Instead,
@@ -62,15 +65,70 @@ struct HttpHeaders
     char       *content;
 };
 
+/* An S3 metadata request that is currently being resolved by one thread.
+   Other threads that need the same (verb, key) wait for it rather than
+   issuing an identical request of their own. */
+struct InFlightRequest
+{
+    const char             *verb;
+    char                   *key;
+    int                    users;
+    bool                   completed;
+    bool                   abandoned;
+    int                    status;
+    pthread_cond_t         done;
+    struct InFlightRequest *next;
+};
+
+/* State of an open file. It is kept apart from the S3 File Info in the stat
+   cache, because few files are open at any time, and because the stat cache
+   may expire an entry while its file is open. */
+struct OpenFile
+{
+    char             *path;
+    int              localFd;
+    struct OpenFlags openFlags;
+    struct OpenFile  *next;
+};
+
 /* For cache locking. */
 static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Open files; protected by the cache mutex. */
+static struct OpenFile *openFiles = NULL;
+
+/* Outstanding metadata requests; protected by the cache mutex. */
+static struct InFlightRequest *inFlightRequests = NULL;
+
 /* Initialized at start-up, then remains constant. */
 static long int localTimezone;
 
 /* Handle for the digest and S3 communications lib. */
 STATIC S3COMM *s3comm;
 
+/* A path that was served from the cache snapshot and must be checked
+   against S3. */
+struct Revalidation
+{
+    char                *path;
+    bool                isDirectory;
+    struct Revalidation *next;
+};
+
+/* Revalidation queue and periodic snapshots; protected by the snapshot
+   mutex. */
+static pthread_mutex_t     snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      snapshot_cond = PTHREAD_COND_INITIALIZER;
+static struct Revalidation *revalidationQueue = NULL;
+static struct Revalidation *revalidationTail = NULL;
+static bool                snapshotShutdown = false;
+static bool                snapshotThreadRunning = false;
+static pthread_t           snapshotThread;
+static char                *snapshotMountKey = NULL;
+
+static void QueueRevalidation( const char *path, bool isDirectory );
+static void *MaintainCacheSnapshot( void *unused );
+
 
 /**
  * Lock the file stat and directory caches by locking the mutex.
@@ -81,6 +139,7 @@ LockCaches(
 void
 	   )
 {
+    TRACE_SCOPE( "s3if", "LockCaches" );
     pthread_mutex_lock( &cache_mutex );
 }
 
@@ -99,6 +158,226 @@ void
 
 
 
+/**
+ * Find an outstanding request for the specified verb and key, or register
+ * a new one if there is none. The caller that registers the request becomes
+ * its leader and must submit it to S3 and then call
+ * \a CompleteInFlightRequest; any other caller must call
+ * \a WaitForInFlightRequest. This function must be called with the caches
+ * locked.
+ * @param verb [in] HTTP verb of the request, e.g. "HEAD".
+ * @param key [in] Path that the request refers to.
+ * @param isLeader [out] \a true if the caller registered the request.
+ * @return The in-flight request.
+ */
+static struct InFlightRequest*
+JoinInFlightRequest(
+    const char *verb,
+	const char *key,
+	bool       *isLeader
+	                )
+{
+    struct InFlightRequest *request = inFlightRequests;
+
+	while( request != NULL )
+	{
+		if( ( strcmp( request->verb, verb ) == 0 )
+			&& ( strcmp( request->key, key ) == 0 ) )
+		{
+			request->users++;
+			*isLeader = false;
+			return( request );
+		}
+		request = request->next;
+	}
+
+	request = malloc( sizeof( struct InFlightRequest ) );
+	assert( request != NULL );
+	request->verb      = verb;
+	request->key       = strdup( key );
+	request->users     = 1;
+	request->completed = false;
+	request->abandoned = false;
+	request->status    = 0;
+	pthread_cond_init( &request->done, NULL );
+	request->next      = inFlightRequests;
+	inFlightRequests   = request;
+	*isLeader = true;
+
+	return( request );
+}
+
+
+
+/**
+ * Drop a reference to an in-flight request, and delete it when there are
+ * no more references. This function must be called with the caches locked.
+ * @param request [in/out] The in-flight request.
+ * @return Nothing.
+ */
+static void
+ReleaseInFlightRequest(
+    struct InFlightRequest *request
+	                   )
+{
+    if( --request->users == 0 )
+	{
+		pthread_cond_destroy( &request->done );
+		free( request->key );
+		free( request );
+	}
+}
+
+
+
+/**
+ * Wait until the leader of an in-flight request has completed it. The
+ * caches mutex is released while waiting. This function must be called
+ * with the caches locked.
+ * @param request [in/out] The in-flight request.
+ * @return The status that the leader's S3 request returned.
+ */
+static int
+WaitForInFlightRequest(
+    struct InFlightRequest *request
+	                   )
+{
+    int status;
+
+	while( ! request->completed )
+	{
+		pthread_cond_wait( &request->done, &cache_mutex );
+	}
+	status = request->status;
+	ReleaseInFlightRequest( request );
+
+	return( status );
+}
+
+
+
+/**
+ * Mark an in-flight request as completed, remove it from the table of
+ * outstanding requests, and wake up the threads that wait for it. This
+ * function must be called by the leader with the caches locked.
+ * @param request [in/out] The in-flight request.
+ * @param status [in] Status of the S3 request.
+ * @return Nothing.
+ */
+static void
+CompleteInFlightRequest(
+    struct InFlightRequest *request,
+	int                    status
+	                    )
+{
+    struct InFlightRequest **link = &inFlightRequests;
+
+	while( *link != NULL )
+	{
+		if( *link == request )
+		{
+			*link = request->next;
+			break;
+		}
+		link = &( *link )->next;
+	}
+	request->status    = status;
+	request->completed = true;
+	pthread_cond_broadcast( &request->done );
+	ReleaseInFlightRequest( request );
+}
+
+
+
+/**
+ * Mark all outstanding requests for a path as abandoned, because the path
+ * was modified while they were in flight. The leaders of the requests will
+ * still return their results to the threads that wait for them, but they
+ * will not insert their now outdated results into the caches. This function
+ * must be called with the caches locked.
+ * @param key [in] Path that has been modified.
+ * @return Nothing.
+ */
+static void
+AbandonInFlightRequests(
+    const char *key
+	                    )
+{
+    struct InFlightRequest *request;
+
+	for( request = inFlightRequests; request != NULL; request = request->next )
+	{
+		if( strcmp( request->key, key ) == 0 )
+		{
+			request->abandoned = true;
+		}
+	}
+}
+
+
+
+/**
+ * Find the state of an open file, optionally creating it if the file is not
+ * yet open. This function must be called with the caches locked.
+ * @param path [in] Path of the file.
+ * @param create [in] \a true if the state should be created if necessary.
+ * @return The open file state, or \a NULL if the file is not open and
+ *         \a create is \a false.
+ */
+static struct OpenFile*
+FindOpenFile(
+    const char *path,
+	bool       create
+	         )
+{
+    struct OpenFile *openFile;
+
+	for( openFile = openFiles; openFile != NULL; openFile = openFile->next )
+	{
+		if( strcmp( openFile->path, path ) == 0 )
+		{
+			return( openFile );
+		}
+	}
+	if( create )
+	{
+		openFile = malloc( sizeof( struct OpenFile ) );
+		assert( openFile != NULL );
+		memset( openFile, 0, sizeof( struct OpenFile ) );
+		openFile->path    = strdup( path );
+		openFile->localFd = -1;
+		openFile->next    = openFiles;
+		openFiles         = openFile;
+	}
+	return( openFile );
+}
+
+
+
+/**
+ * Delete the state of an open file. This function must be called with the
+ * caches locked.
+ * @param openFile [in] The open file state.
+ * @return Nothing.
+ */
+static void
+ForgetOpenFile(
+    struct OpenFile *openFile
+	           )
+{
+    struct OpenFile **link = &openFiles;
+
+	while( *link != openFile )
+	{
+		link = &( *link )->next;
+	}
+	*link = openFile->next;
+	free( openFile->path );
+	free( openFile );
+}
+
+
+
 /**
  * Initialize the S3 Interface module.
  * @return Nothing.
@@ -113,13 +392,14 @@ InitializeS3If(
 
 	/* Connect to the file cache daemon. */
 	if( ! ConnectToFileCache( globalConfig.bucketName, 
-							  globalConfig.keyId, globalConfig.secretKey ) )
+							  globalConfig.keyId, globalConfig.secretKey,
+							  globalConfig.checksum ) )
 	{
 		fprintf( stderr, "Cannot connect to the file cache daemon\n" );
 	}
 
 	/* Initialize CURL. */
-	curl_global_init( CURL_GLOBAL_ALL );
+	s3_InitializeCurl( );
 
 	/* Load functions for digests, signing, and sending and receiving
 	 * messages to S3. */
@@ -132,11 +412,63 @@ InitializeS3If(
     LIBXML_TEST_VERSION
 
     InitializeDirectoryCache( );
+#ifndef AUTOTEST
+	SetStatCacheSize( globalConfig.statCacheSize );
+#endif
 
     /* Determine local timezone. */
     tnow = time( NULL );
     localtime_r( &tnow, &tm );
     localTimezone = tm.tm_gmtoff;
+
+	/* Pick up the caches from the previous mount of the same bucket and
+	   path, and keep the snapshot up to date. */
+	if( globalConfig.cacheSnapshot != NULL )
+	{
+		snapshotMountKey = malloc( strlen( globalConfig.bucketName )
+								   + strlen( globalConfig.path )
+								   + 2 * sizeof( char ) );
+		strcpy( snapshotMountKey, globalConfig.bucketName );
+		strcat( snapshotMountKey, ":" );
+		strcat( snapshotMountKey, globalConfig.path );
+		OpenCacheSnapshot( globalConfig.cacheSnapshot, snapshotMountKey );
+	}
+}
+
+
+
+/**
+ * Start the work of the S3 Interface module that must run in the process
+ * that serves the file system. FUSE forks when it daemonizes, so threads
+ * and connections that are started by InitializeS3If( ) would be left
+ * behind in the parent.
+ * @return Nothing.
+ */
+void
+S3Init(
+    void
+	   )
+{
+	/* Connect to S3 right away, so that the first file system operation
+	   does not have to wait for the handshake. The connection is made here
+	   rather than before FUSE daemonizes, so that it is not left behind in
+	   the parent and does not delay the mount. */
+#ifndef AUTOTEST
+	if( s3comm != NULL )
+	{
+		s3_Preconnect( s3comm );
+	}
+#endif
+
+	/* Keep the cache snapshot up to date. */
+	if( snapshotMountKey != NULL )
+	{
+		if( pthread_create( &snapshotThread, NULL,
+							&MaintainCacheSnapshot, NULL ) == 0 )
+		{
+			snapshotThreadRunning = true;
+		}
+	}
 }
 
 
@@ -151,16 +483,7 @@ static void DeleteS3FileInfoStructure(
     void *toDelete
 				      )
 {
-    struct S3FileInfo *fi = toDelete;
-
-    if( fi != NULL )
-    {
-        if( fi->symlinkTarget != NULL )
-	{
-	    free( fi->symlinkTarget );
-	}
-        free( fi );
-    }
+    FreeS3FileInfo( toDelete );
 }
 
 
@@ -356,200 +679,306 @@ GetHeaderTime(
 
 
 
+/* Response headers that S3GetFileStat translates to S3 File Info values. */
+enum FileStatHeader
+{
+    FILESTAT_IGNORED,
+    FILESTAT_UID,
+    FILESTAT_GID,
+    FILESTAT_MODE,
+    FILESTAT_CONTENT_TYPE,
+    FILESTAT_CONTENT_LENGTH,
+    FILESTAT_ATIME,
+    FILESTAT_CTIME,
+    FILESTAT_MTIME,
+    FILESTAT_LAST_MODIFIED
+};
+
+/* Context for the headers of a HEAD request that are translated as they are
+   received. */
+struct FileStatResponse
+{
+    const char        *filename;
+    struct S3FileInfo *fileInfo;
+    int               status;
+};
+
+
+
 /**
- * Retrieve information on a specific file in an S3 path. This function
- * must be called from a mutex'ed function.
+ * Identify a response header that S3GetFileStat cares about. The header
+ * length selects the candidates, so at most three comparisons are made.
+ * @param key [in] Header name, which need not be zero-terminated.
+ * @param length [in] Length of the header name.
+ * @return The header, or \a FILESTAT_IGNORED if it is not used.
+ */
+static enum FileStatHeader
+IdentifyFileStatHeader(
+    const char *key,
+    size_t     length
+	                   )
+{
+    /* HTTP/2 servers send lowercase header names. */
+#define FILESTAT_HEADER_IS( name ) ( strncasecmp( key, name, length ) == 0 )
+
+    switch( length )
+    {
+        case 12:
+			if( FILESTAT_HEADER_IS( "Content-Type" ) )
+				return( FILESTAT_CONTENT_TYPE );
+			break;
+        case 13:
+			if( FILESTAT_HEADER_IS( "Last-Modified" ) )
+				return( FILESTAT_LAST_MODIFIED );
+			break;
+        case 14:
+			if( FILESTAT_HEADER_IS( "Content-Length" ) )
+				return( FILESTAT_CONTENT_LENGTH );
+			if( FILESTAT_HEADER_IS( "x-amz-meta-uid" ) )
+				return( FILESTAT_UID );
+			if( FILESTAT_HEADER_IS( "x-amz-meta-gid" ) )
+				return( FILESTAT_GID );
+			break;
+        case 15:
+			if( FILESTAT_HEADER_IS( "x-amz-meta-mode" ) )
+				return( FILESTAT_MODE );
+			break;
+        case 16:
+			if( FILESTAT_HEADER_IS( "x-amz-meta-atime" ) )
+				return( FILESTAT_ATIME );
+			if( FILESTAT_HEADER_IS( "x-amz-meta-ctime" ) )
+				return( FILESTAT_CTIME );
+			if( FILESTAT_HEADER_IS( "x-amz-meta-mtime" ) )
+				return( FILESTAT_MTIME );
+			break;
+        default:
+			break;
+    }
+    return( FILESTAT_IGNORED );
+
+#undef FILESTAT_HEADER_IS
+}
+
+
+
+/**
+ * Set the default values of an S3 File Info structure before its headers
+ * are translated.
+ * @param fileInfo [out] S3 File Info structure.
  * @param filename [in] Full path of the file, relative to the bucket.
- * @param fileInfo [out] S3 FileInfo structure.
+ * @return Nothing.
+ */
+STATIC void
+SetDefaultFileStat(
+    struct S3FileInfo *fileInfo,
+    const char        *filename
+	               )
+{
+    memset( fileInfo, 0, sizeof( struct S3FileInfo ) );
+	/* If the file is known to not exist, cache that information here. */
+	fileInfo->filenotfound = false;
+	fileInfo->fileType    = 'f';
+	fileInfo->permissions = 0644;
+	/* A trailing slash in the filename indicates that it is a directory. */
+	if( filename[ strlen( filename ) - 1 ] == '/' )
+	{
+		fileInfo->fileType    = 'd';
+		fileInfo->permissions = 0755;
+	}
+	/* By default, the current user's uid and gid. */
+	fileInfo->uid = getuid( );
+	fileInfo->gid = getgid( );
+	/* If the file is a symbolic link, cache the target here. */
+	fileInfo->symlinkTarget = NULL;
+}
+
+
+
+/**
+ * Translate a response header to an S3 File Info value. Headers that are
+ * not used are ignored.
+ * @param fileInfo [in/out] S3 File Info structure.
+ * @param key [in] Header name, which need not be zero-terminated.
+ * @param keyLength [in] Length of the header name.
+ * @param value [in] Header value, which need not be zero-terminated.
+ * @param valueLength [in] Length of the header value.
  * @return 0 on success, or \a -errno on failure.
+ * Test: unit test (test-s3if.c).
  */
 STATIC int
-S3GetFileStat(
-    const char        *filename,
-    struct S3FileInfo **fileInfo
-	         )
+TranslateFileStatHeader(
+    struct S3FileInfo *fileInfo,
+    const char        *key,
+    size_t            keyLength,
+    const char        *value,
+    size_t            valueLength
+	                    )
 {
-    struct curl_slist *headers = NULL;
-    struct S3FileInfo *newFileInfo = NULL;
-    int               status = 0;
-    char              **response = NULL;
-    int               length     = 0;
-    int               headerIdx;
-    const char        *headerKey;
-    const char        *headerValue;
-    int               mode;
-    long long int     tempValue;
-
-    /* Create specific file information request headers. */
-    /* (None required.) */
+    enum FileStatHeader header;
+    char                valueString[ 64 ];
+    long long int       tempValue;
+    int                 mode;
+    int                 status = 0;
+
+    header = IdentifyFileStatHeader( key, keyLength );
+    if( ( header == FILESTAT_IGNORED ) || ( value == NULL ) )
+    {
+        return( 0 );
+    }
 
-    /* Make request via curl and wait for response. */
-    status = s3_SubmitS3Request( s3comm, "HEAD", headers, filename,
-								 (void**)&response, &length );
-    if( status == 0 )
+    /* The conversion functions expect a zero-terminated string. None of the
+       values that are used are anywhere near this long. */
+    if( sizeof( valueString ) <= valueLength )
     {
-        /* Prepare an S3 File Info structure. */
-        newFileInfo = malloc( sizeof (struct S3FileInfo ) );
-		assert( newFileInfo != NULL );
-		/* Set default values. */
-		memset( newFileInfo, 0, sizeof( struct S3FileInfo ) );
-		/* If the file is known to not exist, cache that information here. */
-		newFileInfo->filenotfound = false;
-		newFileInfo->fileType    = 'f';
-		newFileInfo->permissions = 0644;
-		/* A trailing slash in the filename indicates that it is a directory. */
-		if( filename[ strlen( filename ) - 1 ] == '/' )
-		{
-			newFileInfo->fileType    = 'd';
-			newFileInfo->permissions = 0755;
-		}
-		/* By default, the current user's uid and gid. */
-		newFileInfo->uid = getuid( );
-		newFileInfo->gid = getgid( );
-		/* If the file is a symbolic link, cache the target here. */
-		newFileInfo->symlinkTarget = NULL;
-		/* No local file handle yet. */
-		newFileInfo->localFd = -1;
-		/* Translate header values to S3 File Info values. */
-		for( headerIdx = 0; headerIdx < length; headerIdx++ )
-		{
-			headerKey   = response[ headerIdx * 2     ];
-			headerValue = response[ headerIdx * 2 + 1 ];
+        valueLength = sizeof( valueString ) - 1;
+    }
+    memcpy( valueString, value, valueLength );
+    valueString[ valueLength ] = '\0';
 
-			if( strcmp( headerKey, "x-amz-meta-uid" ) == 0 )
+    switch( header )
+    {
+        case FILESTAT_UID:
+			if( ( status = GetHeaderInt( valueString, &tempValue ) ) == 0 )
 			{
-				if( ( status = GetHeaderInt( headerValue, &tempValue ) ) != 0 )
-				{
-					break;
-				}
-				newFileInfo->uid = tempValue;
+				fileInfo->uid = tempValue;
 			}
-			else if( strcmp( headerKey, "x-amz-meta-gid" ) == 0 )
+			break;
+        case FILESTAT_GID:
+			if( ( status = GetHeaderInt( valueString, &tempValue ) ) == 0 )
 			{
-				if( ( status = GetHeaderInt( headerValue, &tempValue ) ) != 0 )
-				{
-					break;
-				}
-				newFileInfo->gid = tempValue;
+				fileInfo->gid = tempValue;
 			}
-			else if( strcmp( headerKey, "x-amz-meta-mode" ) == 0 )
+			break;
+        case FILESTAT_MODE:
+			if( ( status = GetHeaderInt( valueString, &tempValue ) ) == 0 )
 			{
-				if( ( status = GetHeaderInt( headerValue, &tempValue ) ) != 0 )
-				{
-					break;
-				}
 				mode = tempValue;
-				newFileInfo->permissions = mode & 0777;
-				newFileInfo->exeUid      = ( mode & S_ISUID ) ? true : false;
-				newFileInfo->exeGid      = ( mode & S_ISGID ) ? true : false;
-				newFileInfo->sticky      = ( mode & S_ISVTX ) ? true : false;
+				fileInfo->permissions = mode & 0777;
+				fileInfo->exeUid      = ( mode & S_ISUID ) ? true : false;
+				fileInfo->exeGid      = ( mode & S_ISGID ) ? true : false;
+				fileInfo->sticky      = ( mode & S_ISVTX ) ? true : false;
 			}
-			else if( strcmp( headerKey, "Content-Type" ) == 0 )
+			break;
+        case FILESTAT_CONTENT_TYPE:
+			if( strncmp( valueString, "application/x-directory", 23 ) == 0 )
 			{
-				if( strncmp( headerValue,
-							 "application/x-directory", 23 ) == 0 )
-				{
-					newFileInfo->fileType = 'd';
-				}
-				else if( strncmp( headerValue,
-								  "application/x-symlink", 21 ) == 0 )
-				{
-					newFileInfo->fileType = 'l';
-				}
+				fileInfo->fileType = 'd';
 			}
-			else if( strcmp( headerKey, "Content-Length" ) == 0 )
+			else if( strncmp( valueString,
+							  "application/x-symlink", 21 ) == 0 )
 			{
-				if( ( status = GetHeaderInt( headerValue, &tempValue ) ) != 0 )
-				{
-					break;
-				}
-				newFileInfo->size = tempValue;
+				fileInfo->fileType = 'l';
 			}
-			else if( strcmp( headerKey, "x-amz-meta-atime" ) == 0 )
+			break;
+        case FILESTAT_CONTENT_LENGTH:
+			if( ( status = GetHeaderInt( valueString, &tempValue ) ) == 0 )
 			{
-				if( ( status =
-					  GetHeaderTime( headerValue, &newFileInfo->atime ) ) != 0 )
-				{
-					break;
-				}
+				fileInfo->size = tempValue;
 			}
-			else if( strcmp( headerKey, "x-amz-meta-ctime" ) == 0 )
+			break;
+        case FILESTAT_ATIME:
+			status = GetHeaderTime( valueString, &fileInfo->atime );
+			break;
+        case FILESTAT_CTIME:
+			status = GetHeaderTime( valueString, &fileInfo->ctime );
+			break;
+		/* For s3fs compatibility. However, there is already a
+		   "Last-Modified" header, which contains this data. Use that
+		   instead if possible. */
+        case FILESTAT_MTIME:
+			/* Do not override the Last-Modified header. */
+			if( fileInfo->mtime != 0l )
 			{
-				if( ( status =
-					  GetHeaderTime( headerValue, &newFileInfo->ctime ) ) != 0 )
-				{
-					break;
-				}
-			}
-			/* For s3fs compatibility. However, there is already a
-			   "Last-Modified" header, which contains this data. Use that
-			   instead if possible. */
-			else if( strcmp( headerKey, "x-amz-meta-mtime" ) == 0 )
-			{
-				/* Do not override the Last-Modified header. */
-				if( newFileInfo->mtime != 0l )
-				{
-					if( ( status =
-						  GetHeaderTime( headerValue, &newFileInfo->mtime ) )
-						!= 0 )
-					{
-						break;
-					}
-				}
+				status = GetHeaderTime( valueString, &fileInfo->mtime );
 			}
-			else if( strcmp( headerKey, "Last-Modified" ) == 0 )
-			{
-				/* Last-Modified overrides the x-amz-meta-mtime header. */
-				if( ( status =
-					  GetHeaderTime( headerValue, &newFileInfo->mtime ) ) != 0 )
-				{
-					break;
-				}
-			}
-		}
-		free( response );
+			break;
+        case FILESTAT_LAST_MODIFIED:
+			/* Last-Modified overrides the x-amz-meta-mtime header. */
+			status = GetHeaderTime( valueString, &fileInfo->mtime );
+			break;
+        default:
+			break;
     }
+    return( status );
+}
 
-    if( status == 0 )
+
+
+/**
+ * Receive the headers of a HEAD response for S3GetFileStat. A \a NULL key
+ * means that the request is about to be (re)sent.
+ * @param key [in] Header name, which is not zero-terminated.
+ * @param keyLength [in] Length of the header name.
+ * @param value [in] Header value, which is not zero-terminated.
+ * @param valueLength [in] Length of the header value.
+ * @param ctx [in/out] The FileStatResponse of the request.
+ * @return Nothing.
+ */
+static void
+ReceiveFileStatHeader(
+    const char *key,
+    size_t     keyLength,
+    const char *value,
+    size_t     valueLength,
+    void       *ctx
+	                  )
+{
+    struct FileStatResponse *response = ctx;
+
+    if( key == NULL )
     {
-        *fileInfo = newFileInfo;
+        SetDefaultFileStat( response->fileInfo, response->filename );
+		response->status = 0;
     }
-    else
+    else if( response->status == 0 )
     {
-        if( newFileInfo != NULL )
-		{
-			free( newFileInfo );
-		}
+        response->status = TranslateFileStatHeader( response->fileInfo,
+													key, keyLength,
+													value, valueLength );
     }
-    return( status );
 }
 
 
 
 /**
- * Read the specified file's attributes from S3 and insert them into
- * the stat cache.
- * @param filename [in] Full path of the file to be stat'ed.
- * @param fi [out] Where the S3 File Info pointer should be stored.
- * @param hashAs [in] Filename to use for hashing by the cache.
- * @return 0 if successful, or \a -errno on failure.
+ * Retrieve information on a specific file in an S3 path. This function
+ * must be called from a mutex'ed function.
+ * @param filename [in] Full path of the file, relative to the bucket.
+ * @param fileInfo [out] S3 FileInfo structure.
+ * @return 0 on success, or \a -errno on failure.
  */
-static int
-ResolveS3FileStatCacheMiss(
+STATIC int
+S3GetFileStat(
     const char        *filename,
-    struct S3FileInfo **fi,
-    const char        *hashAs
-	                      )
+    struct S3FileInfo **fileInfo
+	         )
 {
-    int               status;
-    struct S3FileInfo *newFileInfo = NULL;
+    struct curl_slist       *headers = NULL;
+    struct FileStatResponse response;
+    int                     status;
+
+    /* Create specific file information request headers. */
+    /* (None required.) */
+
+    /* Make request via curl and translate the response headers into an
+       S3 File Info structure as they arrive. */
+    response.filename = filename;
+    response.fileInfo = AllocateS3FileInfo( );
+    response.status   = 0;
+    status = s3_SubmitS3HeadRequest( s3comm, headers, filename,
+									 ReceiveFileStatHeader, &response );
+    if( status == 0 )
+    {
+        status = response.status;
+    }
 
-    /* Read the file attributes for the specified file. */
-    status = S3GetFileStat( filename, &newFileInfo );
     if( status == 0 )
     {
-        InsertCacheElement( hashAs, newFileInfo, &DeleteS3FileInfoStructure );
-		*fi = newFileInfo;
+        *fileInfo = response.fileInfo;
+    }
+    else
+    {
+        FreeS3FileInfo( response.fileInfo );
     }
     return( status );
 }
@@ -681,6 +1110,51 @@ AddTrailingSlash(
 
 
 
+/**
+ * Read the specified file's attributes from S3. If the file does not exist,
+ * attempt the directory name version of it and finally the directory's
+ * "secret" file. This function must be called without the caches locked so
+ * that cache hits are not held up by the S3 requests.
+ * @param filename [in] Full path of the file to be stat'ed.
+ * @param fi [out] Where the S3 File Info pointer should be stored.
+ * @return 0 if successful, or \a -errno on failure.
+ */
+static int
+ResolveS3FileStatCacheMiss(
+    const char        *filename,
+    struct S3FileInfo **fi
+	                      )
+{
+    int  status;
+    char *dirname;
+
+    /* Read the file stat from S3. */
+    status = S3GetFileStat( filename, fi );
+	/* If unsuccessful, attempt the directory name version with a
+	   trailing slash. */
+	if( status != 0 )
+	{
+		/* Prepare a directory name version of the file. */
+		dirname = AddTrailingSlash( filename );
+		status = S3GetFileStat( dirname, fi );
+		free( dirname );
+		/* If that is also unsuccessful, attempt to stat the "secret file"
+		   in the directory. */
+		if( status != 0 )
+		{
+			dirname = malloc( strlen( filename ) + sizeof( char )
+							  + strlen( IS_S3_DIRECTORY_FILE ) );
+			strcpy( dirname, filename );
+			strcat( dirname, IS_S3_DIRECTORY_FILE );
+			status = S3GetFileStat( dirname, fi );
+			free( dirname );
+		}
+	}
+    return( status );
+}
+
+
+
 /**
  * Return the S3 File Info for the specified file.
  * @param file [in] Filename of the file.
@@ -696,9 +1170,12 @@ S3FileStat(
     int               stripIdx = 0;
     char              *filename;
     int               secretIdx = 0;
-    struct S3FileInfo *fileInfo;
-    int               status;
-    char              *dirname;
+    struct S3FileInfo      *fileInfo;
+    int                    status;
+    struct InFlightRequest *request;
+    bool                   isLeader;
+    bool                   resolved = false;
+    TRACE_SCOPE( "s3if", "S3FileStat" );
 
     /* Make sure there is exactly one leading slash in the filename. */
     while( file[ stripIdx ] == '/' )
@@ -727,50 +1204,73 @@ S3FileStat(
     status = 0;
     fileInfo = SearchStatEntry( filename );
 
-    /* If the file info is not available, resolve the cache miss. */
-    if( fileInfo == NULL )
+    /* If the file info is not available, resolve the cache miss. Only one
+       thread resolves a particular cache miss; any other thread that stats
+       the same file in the meantime waits for its result. */
+    while( ( fileInfo == NULL ) && ( ! resolved ) )
     {
-        /* Read the file stat from S3. */
-        status = ResolveS3FileStatCacheMiss( filename, &fileInfo, filename );
-		/* If unsuccessful, attempt the directory name version with a
-		   trailing slash. */
-		if( status != 0 )
+        request = JoinInFlightRequest( "HEAD", filename, &isLeader );
+		if( isLeader )
 		{
-			/* Prepare a directory name version of the file. */
-			dirname = AddTrailingSlash( filename );
-			status = ResolveS3FileStatCacheMiss( dirname, &fileInfo, filename );
-			free( dirname );
-			/* If that is also unsuccessful, attempt to stat the "secret file"
-			   in the directory. */
+			/* Read the file stat from the cache snapshot, which is checked
+			   against S3 in the background, or otherwise from S3 without
+			   holding up the caches. */
+			UnlockCaches( );
+			fileInfo = LookupStatSnapshot( filename );
+			if( fileInfo != NULL )
+			{
+				status = 0;
+				QueueRevalidation( filename, false );
+			}
+			else
+			{
+				status = ResolveS3FileStatCacheMiss( filename, &fileInfo );
+			}
+			/* If unsuccessful, create a "file not found" entry. */
 			if( status != 0 )
 			{
-				dirname = malloc( strlen( filename ) + sizeof( char )
-								  + strlen( IS_S3_DIRECTORY_FILE ) );
-				strcpy( dirname, filename );
-				strcat( dirname, IS_S3_DIRECTORY_FILE );
-				status = ResolveS3FileStatCacheMiss( dirname, &fileInfo,
-													 filename );
-				free( dirname );
-				/* If still yet unsuccessful, create a "file not found" entry
-				   in the stat cache. */
-				if( status != 0 )
-				{
-					fileInfo = malloc( sizeof( struct S3FileInfo ) );
-					fileInfo->symlinkTarget = NULL; /* For later free() */
-					fileInfo->filenotfound  = true;
-					InsertCacheElement( filename, fileInfo,
-										&DeleteS3FileInfoStructure );
-				}
+				fileInfo = AllocateS3FileInfo( );
+				fileInfo->filenotfound  = true;
 			}
+			/* Indicate that we do not have to bother the file cache with
+			   inquiries until the file itself is cached. */
+			fileInfo->statonly = true;
+			LockCaches( );
+			/* Cache the result unless the file was modified while the
+			   request was in flight, in which case the modified file must
+			   be stat'ed again. */
+			if( ! request->abandoned )
+			{
+				InsertCacheElement( filename, fileInfo,
+									&DeleteS3FileInfoStructure );
+				resolved = true;
+			}
+			else
+			{
+				DeleteS3FileInfoStructure( fileInfo );
+				fileInfo = NULL;
+			}
+			CompleteInFlightRequest( request, status );
 		}
-		/* Indicate that we do not have to bother the file cache with
-		   inquiries until the file itself is cached. */
-		if( fileInfo != NULL )
+		else
 		{
-			fileInfo->statonly = true;
+			/* Share the leader's result via the stat cache. If the result
+			   is not in the cache, the leader's request failed or the
+			   result has already been dropped from the cache; in the latter
+			   case, try again. */
+			status   = WaitForInFlightRequest( request );
+			fileInfo = SearchStatEntry( filename );
+			if( ( fileInfo == NULL ) && ( status != 0 ) )
+			{
+				resolved = true;
+			}
+			else
+			{
+				status = 0;
+			}
 		}
     }
-    else
+    if( ( status == 0 ) && ( fileInfo != NULL ) )
     {
         /* If the file is known to not exist, return an error. */
         if( bool_equal( fileInfo->filenotfound, true ) )
@@ -846,93 +1346,550 @@ EncodeUrl(
 
 
 
+/* Longest key that S3 stores, in bytes. */
+#define S3_MAX_KEY_LENGTH 1024
+
+/* Elements of a ListBucketResult whose contents are used. */
+enum ListBucketElement
+{
+    LIST_OTHER,
+    LIST_KEY,
+    LIST_NEXTMARKER,
+    LIST_ISTRUNCATED
+};
+
+/* An incremental parser that decodes the pages of a directory listing as
+   they arrive from S3. The entries are collected without building a
+   document tree; only the text of the current element is kept. */
+struct ListBucketParser
+{
+    xmlParserCtxtPtr       context;
+    int                    prefixLength;
+    /* Entries of all pages. The entries of the current page begin at
+       pageBegin, so that they can be discarded if the page is resent. */
+    struct curl_slist      *entries;
+    struct curl_slist      **pageBegin;
+    struct curl_slist      **tail;
+    int                    nFiles;
+    int                    pageFiles;
+    /* Where the next page begins, if the current page is truncated. */
+    bool                   truncated;
+    char                   nextMarker[ S3_MAX_KEY_LENGTH + 1 ];
+    char                   lastKey[ S3_MAX_KEY_LENGTH + 1 ];
+    /* Text of the element that is being parsed. */
+    enum ListBucketElement element;
+    char                   text[ S3_MAX_KEY_LENGTH + 1 ];
+    int                    textLength;
+};
+
+
+
 /**
- * Recursive function that parses an XML file and adds the contents of
- * all occurrences of \a \<key\> to a linked list. In addition, if the function
- * encounters a \a \<marker\> node, it records its contents.
- * @param node [in] Current XML node.
- * @param prefixLength [in] Number of bytes in the prefix which are skipped.
- * @param directory [in/out] Pointer to linked list of directory entries.
- * @param marker [out] Name of the marker, if found.
- * @param nFiles [out] Number of files in the directory.
+ * SAX callback for the beginning of an element in a ListBucketResult.
+ * "Key" and "Prefix" contain file and directory names, respectively.
+ * @param ctx [in] ListBucketParser structure.
+ * @param localname [in] Name of the element.
  * @return Nothing.
  */
+#pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
-#pragma GCC diagnostic ignored "-Wunused-variable"
 static void
-ReadXmlDirectory(
-    xmlNode           *node,
-    int               prefixLength,
-    struct curl_slist **directory,
-    char              **marker,
-    int               *nFiles
- 	            )
-{
-    xmlNode    *currentNode;
-    char       *direntry;
-    const char *nodeName;
-    const char *nodeValue;
-    char       *newMarker;
-
-    /* Search the XML tree depth first (not that it really matters, because
-       the tree is very shallow). */
-    for( currentNode = node; currentNode; currentNode = currentNode->next )
-    {
-        if( currentNode->type == XML_ELEMENT_NODE )
+ListBucketStartElement(
+    void          *ctx,
+    const xmlChar *localname,
+    const xmlChar *prefix,
+    const xmlChar *URI,
+    int           nbNamespaces,
+    const xmlChar **namespaces,
+    int           nbAttributes,
+    int           nbDefaulted,
+    const xmlChar **attributes
+	                   )
+{
+    struct ListBucketParser *parser = ctx;
+    const char              *name   = (const char*) localname;
+
+    if( ( strcmp( name, "Key" ) == 0 ) || ( strcmp( name, "Prefix" ) == 0 ) )
+    {
+        parser->element = LIST_KEY;
+    }
+    else if( strcmp( name, "NextMarker" ) == 0 )
+    {
+        parser->element = LIST_NEXTMARKER;
+    }
+    else if( strcmp( name, "IsTruncated" ) == 0 )
+    {
+        parser->element = LIST_ISTRUNCATED;
+    }
+    else
+    {
+        parser->element = LIST_OTHER;
+    }
+    parser->textLength = 0;
+}
+
+
+
+/**
+ * SAX callback for text within an element in a ListBucketResult. The text
+ * may arrive in several pieces.
+ * @param ctx [in] ListBucketParser structure.
+ * @param text [in] Text, which is not zero-terminated.
+ * @param length [in] Number of bytes of text.
+ * @return Nothing.
+ */
+static void
+ListBucketCharacters(
+    void          *ctx,
+    const xmlChar *text,
+    int           length
+	                 )
+{
+    struct ListBucketParser *parser = ctx;
+
+    if( parser->element == LIST_OTHER )
+    {
+        return;
+    }
+    if( (int) sizeof( parser->text ) - 1 - parser->textLength < length )
+    {
+        length = (int) sizeof( parser->text ) - 1 - parser->textLength;
+    }
+    memcpy( &parser->text[ parser->textLength ], text, length );
+    parser->textLength += length;
+}
+
+
+
+/**
+ * SAX callback for the end of an element in a ListBucketResult. File and
+ * directory names are added to the directory entries without the prefix.
+ * @param ctx [in] ListBucketParser structure.
+ * @param localname [in] Name of the element.
+ * @return Nothing.
+ */
+static void
+ListBucketEndElement(
+    void          *ctx,
+    const xmlChar *localname,
+    const xmlChar *prefix,
+    const xmlChar *URI
+	                 )
+{
+    struct ListBucketParser *parser = ctx;
+    struct curl_slist       *entry;
+
+    parser->text[ parser->textLength ] = '\0';
+    switch( parser->element )
+    {
+        case LIST_KEY:
+			/* The prefix itself is not an entry in the directory. */
+			strcpy( parser->lastKey, parser->text );
+			if( parser->prefixLength < parser->textLength )
+			{
+				entry = malloc( sizeof( struct curl_slist ) );
+				entry->data = strdup( &parser->text[ parser->prefixLength ] );
+				entry->next = NULL;
+				*parser->tail = entry;
+				parser->tail  = &entry->next;
+				parser->pageFiles++;
+			}
+			break;
+		case LIST_NEXTMARKER:
+			strcpy( parser->nextMarker, parser->text );
+			break;
+		case LIST_ISTRUNCATED:
+			parser->truncated = ( strcmp( parser->text, "true" ) == 0 );
+			break;
+		default:
+			break;
+    }
+    parser->element = LIST_OTHER;
+}
+#pragma GCC diagnostic pop
+
+
+
+/* Only the elements and their text are of interest. */
+static xmlSAXHandler listBucketHandler =
+{
+    .initialized    = XML_SAX2_MAGIC,
+    .startElementNs = ListBucketStartElement,
+    .endElementNs   = ListBucketEndElement,
+    .characters     = ListBucketCharacters
+};
+
+
+
+/**
+ * Create a parser for the pages of a directory listing.
+ * @param prefixLength [in] Number of bytes in the prefix which are skipped.
+ * @return Parser.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC struct ListBucketParser*
+NewListBucketParser(
+    int prefixLength
+	                )
+{
+    struct ListBucketParser *parser;
+
+    parser = malloc( sizeof( struct ListBucketParser ) );
+    assert( parser != NULL );
+    parser->context      = NULL;
+    parser->prefixLength = prefixLength;
+    parser->entries      = NULL;
+    parser->pageBegin    = &parser->entries;
+    parser->tail         = &parser->entries;
+    parser->nFiles       = 0;
+    parser->pageFiles    = 0;
+
+    return( parser );
+}
+
+
+
+/**
+ * Discard the entries of the current page and stop parsing it.
+ * @param parser [in/out] Parser.
+ * @return Nothing.
+ */
+static void
+DiscardListBucketPage(
+    struct ListBucketParser *parser
+	                  )
+{
+    struct curl_slist *entry;
+    struct curl_slist *nextEntry;
+
+    for( entry = *parser->pageBegin; entry != NULL; entry = nextEntry )
+    {
+        nextEntry = entry->next;
+		free( entry->data );
+		free( entry );
+    }
+    *parser->pageBegin = NULL;
+    parser->tail       = parser->pageBegin;
+    parser->pageFiles  = 0;
+
+    parser->truncated       = false;
+    parser->nextMarker[ 0 ] = '\0';
+    parser->lastKey[ 0 ]    = '\0';
+    parser->element         = LIST_OTHER;
+    parser->textLength      = 0;
+
+    if( parser->context != NULL )
+    {
+        xmlFreeParserCtxt( parser->context );
+		parser->context = NULL;
+    }
+}
+
+
+
+/**
+ * Receive a part of a ListBucketResult page and parse it. The receiver is
+ * called from the CURL write callback, so the page is parsed while it is
+ * being transferred.
+ * @param data [in] Part of the page, or \a NULL to begin a new page.
+ * @param length [in] Number of bytes in the part.
+ * @param ctx [in] ListBucketParser structure.
+ * @return Number of bytes accepted, which is 0 if the page is malformed.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC size_t
+ReceiveListBucketData(
+    const char *data,
+    size_t     length,
+    void       *ctx
+	                  )
+{
+    struct ListBucketParser *parser = ctx;
+
+    if( data == NULL )
+    {
+        DiscardListBucketPage( parser );
+		parser->context = xmlCreatePushParserCtxt( &listBucketHandler, parser,
+												   NULL, 0, "readdir.xml" );
+		return( 0 );
+    }
+    if( ( parser->context == NULL )
+		|| ( xmlParseChunk( parser->context, data, length, 0 ) != 0 ) )
+    {
+        return( 0 );
+    }
+    return( length );
+}
+
+
+
+/**
+ * Finish parsing a page and keep its entries. If the page is malformed,
+ * its entries are discarded.
+ * @param parser [in/out] Parser.
+ * @param marker [out] Name from which the next page must be listed, or
+ *        \a NULL if this was the last page.
+ * @return 0 on success, or \a -EIO if the page is malformed.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC int
+FinishListBucketPage(
+    struct ListBucketParser *parser,
+    char                    **marker
+	                 )
+{
+    int status = -EIO;
+
+    *marker = NULL;
+    if( parser->context != NULL )
+    {
+        xmlParseChunk( parser->context, NULL, 0, 1 );
+		if( parser->context->wellFormed )
+		{
+			status = 0;
+		}
+		xmlFreeParserCtxt( parser->context );
+		parser->context = NULL;
+    }
+
+    if( status == 0 )
+    {
+        /* A truncated page continues from NextMarker, which S3 only
+		   includes when a delimiter is specified, or otherwise from the
+		   last name on the page. */
+		if( parser->truncated )
+		{
+			if( parser->nextMarker[ 0 ] != '\0' )
+			{
+				*marker = strdup( parser->nextMarker );
+			}
+			else if( parser->lastKey[ 0 ] != '\0' )
+			{
+				*marker = strdup( parser->lastKey );
+			}
+		}
+		parser->nFiles    += parser->pageFiles;
+		parser->pageFiles  = 0;
+		parser->pageBegin  = parser->tail;
+    }
+    else
+    {
+        DiscardListBucketPage( parser );
+    }
+
+    return( status );
+}
+
+
+
+/**
+ * Free a parser and return the entries of the pages that were parsed.
+ * @param parser [in] Parser.
+ * @param nFiles [out] Number of entries.
+ * @return Linked list of entries.
+ * Test: unit test (test-s3if.c).
+ */
+STATIC struct curl_slist*
+CloseListBucketParser(
+    struct ListBucketParser *parser,
+    int                     *nFiles
+	                  )
+{
+    struct curl_slist *entries;
+
+    DiscardListBucketPage( parser );
+    entries = parser->entries;
+    *nFiles = parser->nFiles;
+    free( parser );
+
+    return( entries );
+}
+
+
+
+/**
+ * List the contents of a directory on S3 without consulting the directory
+ * cache.
+ * @param prefix [in] Path of the directory without leading or trailing
+ *        slashes, or an empty string for the root directory.
+ * @param maxRead [in] The maximum number of directory entries to read. If -1,
+ *        read the entire directory.
+ * @param nameArray [out] Pointer to where the newly allocated directory
+ *        contents (an array of strings) is stored.
+ * @param nFiles [out] The number of files in the directory, including '.'
+ *        and "..".
+ * @return 0 on success, or \a -errno on failure.
+ */
+static int
+ListS3Directory(
+    const char *prefix,
+    int        maxRead,
+    char       ***nameArray,
+    int        *nFiles
+	            )
+{
+    int        status = 0;
+
+    const char *delimiter = "/";
+    char       *queryBase;
+    const char *urlSafePrefix;
+    char       *relativeRoot;
+
+    char              *query;
+    char              *fromFile = NULL;
+    char              *urlSafeFromFile;
+    struct curl_slist *headers = NULL;
+    struct curl_slist *directory;
+    int               prefixToSkip;
+    struct ListBucketParser *parser;
+    int               fileCounter;
+    int               fileLimit;
+
+    char              **dirArray;
+    int               dirIdx;
+    struct curl_slist *nextEntry;
+    char              *path;
+    int               s3dirfilePos;
+
+    /* Create the base query. */
+    urlSafePrefix = EncodeUrl( prefix );
+	relativeRoot = malloc( strlen( globalConfig.bucketName )
+						   + strlen( prefix ) + 5 * sizeof( char ) );
+	relativeRoot[ 0 ] = '/';
+	relativeRoot[ 1 ] = '\0';
+	strcpy( relativeRoot, globalConfig.bucketName );
+	strcpy( relativeRoot, "/" );
+	if( strlen( prefix ) > 0 )
+	{
+		strcpy( relativeRoot, prefix );
+		strcpy( relativeRoot, "/" );
+	}
+	queryBase = malloc( strlen( prefix )
+						+ sizeof( char )
+						+ strlen( urlSafePrefix )
+						+ strlen( "/?prefix=/&delimiter=" )
+						+ strlen( delimiter )
+						+ strlen( "&max-keys=xxxxx" )
+						+ sizeof( char ) );
+
+	/* Add a non-encoded trailing slash to the prefix in the query.
+	   Omit the prefix if the root folder was specified.
+	   The reason for the multiple tests for max-keys is that Amazon
+	   will probably soon require all the parameters in the query
+	   to be ordered alphabetically. */
+	if( strlen( prefix ) == 0 )
+	{
+		sprintf( queryBase, "%s?delimiter=%s", relativeRoot, delimiter );
+		if( maxRead != -1 )
+		{
+			sprintf( &queryBase[ strlen( queryBase ) ],
+					 "&max-keys=%d", maxRead );
+		}
+	}
+	else
+	{
+		sprintf( queryBase, "%s?delimiter=%s", relativeRoot, delimiter );
+		if( maxRead != -1 )
+		{
+			sprintf( &queryBase[ strlen( queryBase ) ],
+					 "&max-keys=%d", maxRead );
+		}
+		sprintf( &queryBase[ strlen( queryBase ) ], "&prefix=%s/",
+				 urlSafePrefix );
+	}
+	free( (char*) urlSafePrefix );
+
+	/* Skip the prefix and slash... */
+	prefixToSkip = strlen( prefix ) + 1;
+	/* ... except at the root folder which has neither. */
+	if( prefixToSkip == 1 )
+	{
+		prefixToSkip = 0;
+	}
+	parser = NewListBucketParser( prefixToSkip );
+
+	fileCounter = 0;
+	fileLimit   = ( maxRead == -1 ) ? 999999l : maxRead;
+	/* Retrieve truncated directory lists by specifying the base query plus
+	   a marker. */
+	do
+	{
+		/* Get an XML list of directories and decode the directory
+		   contents. */
+		query = queryBase;
+		if( fromFile != NULL )
+		{
+			urlSafeFromFile = EncodeUrl( fromFile );
+			query = malloc( strlen( queryBase )
+							+ strlen( "&marker=" )
+							+ strlen( urlSafeFromFile )
+							+ sizeof( char ) );
+			strcpy( query, queryBase );
+			strcat( query, "&marker=" );
+			strcat( query, urlSafeFromFile );
+			free( urlSafeFromFile );
+		}
+		/* query now contains the path for the S3 request. The response is
+		   parsed while it arrives. */
+		status = s3_SubmitS3StreamRequest( s3comm, headers, query,
+										   ReceiveListBucketData, parser );
+		if( query != queryBase )
+		{
+			free( query );
+		}
+		free( fromFile );
+		fromFile = NULL;
+		if( status == 0 )
 		{
-			/* "Key" and "Prefix" mark file or directory names,
-			   respectively. */
-			nodeName =  (char*) currentNode->name;
-			nodeValue = (char*) xmlNodeGetContent( currentNode );
-			if( ( strcmp( nodeName, "Key" ) == 0 ) ||
-				( strcmp( nodeName, "Prefix" ) == 0 ) )
-			{
-				/* Strip the prefix from the path and add the directory. */
-				if( strcmp( &nodeValue[ prefixLength ], "" ) != 0 )
-				{
-					direntry = malloc( strlen( nodeValue )
-									   - prefixLength
-									   + 2 * sizeof( char ) );
-					strcpy( direntry, &nodeValue[ prefixLength ] );
-					*directory = curl_slist_append( *directory, direntry );
-					(*nFiles)++;
-				}
-			}
-			/* Record marker names that might be encountered. */
-			else if( strcmp( nodeName, "NextMarker" ) == 0 )
-			{
-				if( strlen( nodeValue ) != 0 )
-				{	
-					if( *marker != NULL )
-					{
-						free( *marker );
-					}
-					*marker = malloc( strlen( nodeValue ) + sizeof( char ) );
-					strcpy( *marker, nodeValue );
-				}
-			}
-			/* If this is the last entry, clear the "marker" data to
-			   indicate that the directory chunk loop may end. (IsTruncated
-			   is actually redundant, because the presence of "NextMarker"
-			   implies that the directory listing was truncated.) */
-			else if( strcmp( nodeName, "IsTruncated" ) == 0 )
-			{
-				if( strcmp( nodeValue, "false" ) == 0 )
-				{
-					if( *marker != NULL )
-					{
-						free( *marker );
-						*marker = NULL;
-					}
-				}
-			}
+			status = FinishListBucketPage( parser, &fromFile );
 		}
-		
-		ReadXmlDirectory( currentNode->children, prefixLength,
-						  directory, marker, nFiles );
-    }
+		else
+		{
+			DiscardListBucketPage( parser );
+		}
+		fileCounter = parser->nFiles;
+	} while( ( fromFile != NULL ) && ( fileCounter <= fileLimit ) );
+	free( fromFile );
+	directory = CloseListBucketParser( parser, &fileCounter );
+
+	free( queryBase );
+	free( relativeRoot );
+
+	/* Move the linked-list file names into an array. Add two entries for
+	   the directories "." and "..". */
+	fileCounter += 2;
+	dirArray = malloc( sizeof( char* ) * fileCounter );
+	assert( dirArray != NULL );
+	dirIdx   = 0;
+	/* Fake the "." and ".." paths. */
+	dirArray[ dirIdx++ ] = strdup( "." );
+	dirArray[ dirIdx++ ] = strdup( ".." );
+	while( directory )
+    {
+		path = StripTrailingSlash( directory->data, false );
+		/* Don't report the IS_S3_DIRECTORY_FILE. */
+		s3dirfilePos = strlen( path )
+			           - strlen( &IS_S3_DIRECTORY_FILE[ 1 ] );
+		if( ( 0 <= s3dirfilePos )
+			&& ( strcmp( path, &IS_S3_DIRECTORY_FILE[ 1 ] ) == 0 ) )
+		{
+			free( path );
+			fileCounter--;
+		}
+		else
+		{
+			dirArray[ dirIdx++ ] = path;
+		}
+		nextEntry = directory->next;
+		free( directory );
+		directory = nextEntry;
+	}
+
+    *nFiles    = fileCounter;
+    *nameArray = dirArray;
+
+    return( status );
 }
-#pragma GCC diagnostic pop
 
 
 
@@ -942,7 +1899,8 @@ ReadXmlDirectory(
  * mark it as least recently used.
  * @param dirname [in] Path name of the directory.
  * @param nameArray [out] Pointer to where the directory contents (an array
- *        of strings) is stored.
+ *        of strings) is stored.  The array and its strings are the caller's
+ *        own and must be freed.
  * @param nFiles [out] The number of files in the directory, including '.'
  *        and "..".
  * @param maxRead [in] The maximum number of directory entries to read. If -1,
@@ -959,200 +1917,88 @@ S3ReadDir(
 {
     int        status = 0;
 
-    const char *delimiter;
     const char *prefix;
     char       *parentDir;
-    char       *queryBase;
-    const char *urlSafePrefix;
     int        toSkip = 0;
-    char       *relativeRoot;
-
-    char              *query;
-    char              *fromFile = NULL;
-    char              *urlSafeFromFile;
-    struct curl_slist *headers = NULL;
-    struct curl_slist *directory = NULL;
-    int               prefixToSkip;
-    char              *xmlData;
-    int               xmlDataLength;
-    xmlDocPtr         xmlResponse;
-    xmlNode           *rootNode;
-    int               fileCounter;
-    int               fileLimit;
-
-    char              **dirArray;
-    int               dirIdx;
-    struct curl_slist *nextEntry;
-    char              *path;
-    int               s3dirfilePos;
+    int        fileCounter = 0;
+    char       **dirArray;
+    char       **cachedArray;
+    int        dirIdx;
 
-    /* Construct a base query with a prefix and a delimiter. */
+    struct InFlightRequest *request;
+    bool                   isLeader;
 
     /* Skip any leading slashes in the dirname. */
     while( dirname[ toSkip ] == '/' )
     {
         toSkip++;
     }
-    /* Create prefix and a delimiter for the S3 list. The prefix is the entire
-       path including dirname plus trailing slash, so add a slash to the
-       dirname if it is not already specified. The delimiter is a '/'. */
+    /* The prefix for the S3 list is the entire path including dirname
+       without a trailing slash. */
     prefix    = StripTrailingSlash( (char*) &dirname[ toSkip ], true );
-    delimiter = "/";
     parentDir = malloc( strlen( prefix ) + 2 * sizeof( char ) );
     parentDir[ 0 ] = '/';
     strcpy( &parentDir[ 1 ], prefix );
 
     /* Lookup in the directory cache. */
-    dirArray = (char**) LookupInDirectoryCache( parentDir, &fileCounter );
-    if( dirArray == NULL )
-    {
-        /* Create the base query. */
-        urlSafePrefix = EncodeUrl( prefix );
-		relativeRoot = malloc( strlen( globalConfig.bucketName )
-							   + strlen( prefix ) + 5 * sizeof( char ) );
-		relativeRoot[ 0 ] = '/';
-		relativeRoot[ 1 ] = '\0';
-		strcpy( relativeRoot, globalConfig.bucketName );
-		strcpy( relativeRoot, "/" );
-		if( strlen( prefix ) > 0 )
+    dirArray = LookupInDirectoryCache( parentDir, &fileCounter );
+    while( dirArray == NULL )
+    {
+        /* If another thread is already listing the directory, wait for it
+		   and use its result. */
+        LockCaches( );
+		request = JoinInFlightRequest( "GET", parentDir, &isLeader );
+		if( ! isLeader )
 		{
-			strcpy( relativeRoot, prefix );
-			strcpy( relativeRoot, "/" );
+			status = WaitForInFlightRequest( request );
+			UnlockCaches( );
+			dirArray = LookupInDirectoryCache( parentDir, &fileCounter );
+			if( ( dirArray == NULL ) && ( status != 0 ) )
+			{
+				break;
+			}
+			status = 0;
+			continue;
 		}
-		queryBase = malloc( strlen( prefix )
-							+ sizeof( char )
-							+ strlen( urlSafePrefix )
-							+ strlen( "/?prefix=/&delimiter=" )
-							+ strlen( delimiter )
-							+ strlen( "&max-keys=xxxxx" )
-							+ sizeof( char ) );
+		UnlockCaches( );
 
-		/* Add a non-encoded trailing slash to the prefix in the query.
-		   Omit the prefix if the root folder was specified.
-		   The reason for the multiple tests for max-keys is that Amazon
-		   will probably soon require all the parameters in the query
-		   to be ordered alphabetically. */
-		if( strlen( prefix ) == 0 )
+		/* A directory that was cached before the file system was remounted
+		   is taken from the cache snapshot and listed again in the
+		   background. */
+		dirArray = LookupDirectorySnapshot( parentDir, &fileCounter );
+		if( dirArray != NULL )
 		{
-			sprintf( queryBase, "%s?delimiter=%s", relativeRoot, delimiter );
-			if( maxRead != -1 )
-			{
-				sprintf( &queryBase[ strlen( queryBase ) ],
-						 "&max-keys=%d", maxRead );
-			}
+			QueueRevalidation( parentDir, true );
 		}
 		else
 		{
-			sprintf( queryBase, "%s?delimiter=%s", relativeRoot, delimiter );
-			if( maxRead != -1 )
-			{
-				sprintf( &queryBase[ strlen( queryBase ) ],
-						 "&max-keys=%d", maxRead );
-			}
-			sprintf( &queryBase[ strlen( queryBase ) ], "&prefix=%s/",
-					 urlSafePrefix );
+			status = ListS3Directory( prefix, maxRead,
+									  &dirArray, &fileCounter );
 		}
-		free( (char*) urlSafePrefix );
 
-		fileCounter = 0;
-		fileLimit   = ( maxRead == -1 ) ? 999999l : maxRead;
-		/* Retrieve truncated directory lists by specifying the base query plus
-		   a marker. */
+		/* Cache the directory unless it was modified while it was being
+		   listed, in which case the modified directory must be listed
+		   again.  The cache owns the listing and may free it at any time,
+		   so the caller is given a copy. */
 		LockCaches( );
-		do
+		if( ! request->abandoned )
 		{
-			/* Get an XML list of directories and decode the directory
-			   contents. */
-			query = queryBase;
-			if( fromFile != NULL )
-			{
-				urlSafeFromFile = EncodeUrl( fromFile );
-				query = malloc( strlen( queryBase )
-								+ strlen( "&marker=" )
-								+ strlen( urlSafeFromFile )
-								+ sizeof( char ) );
-				strcpy( query, queryBase );
-				strcat( query, "&marker=" );
-				strcat( query, urlSafeFromFile );
-				free( urlSafeFromFile );
-			}
-			/* query now contains the path for the S3 request. */
-			status = s3_SubmitS3Request( s3comm, "GET", headers, query,
-										   (void**) &xmlData, &xmlDataLength );
-			if( query != queryBase )
-			{
-				free( query );
-			}
-			if( status == 0 )
-			{
-				/* Decode the XML response. */
-				xmlResponse = xmlReadMemory( xmlData, xmlDataLength,
-											 "readdir.xml", NULL, 0 );
-				if( xmlResponse == NULL )
-				{
-					status = -EIO;
-				}
-				else
-				{
-					/* Begin a depth-first traversal from the root node. */
-					rootNode = xmlDocGetRootElement( xmlResponse );
-					if( rootNode == NULL )
-					{
-						status = -EIO;
-					}
-					else
-					{
-						/* Skip the prefix and slash... */
-						prefixToSkip = strlen( prefix ) + 1;
-						/* ... except at the root folder which has neither. */
-						if( prefixToSkip == 1 )
-						{
-							prefixToSkip = 0;
-						}
-						ReadXmlDirectory( rootNode, prefixToSkip,
-										  &directory, &fromFile, &fileCounter );
-					}
-					/*
-					  xmlCleanupParser( );
-					*/
-					xmlFreeDoc( xmlResponse );
-				}
-			}
-		} while( ( fromFile != NULL ) && ( fileCounter <= fileLimit ) );
-
-		free( relativeRoot );
-
-		/* Move the linked-list file names into an array. Add two entries for
-		   the directories "." and "..". */
-		fileCounter += 2;
-		dirArray = malloc( sizeof( char* ) * fileCounter );
-		assert( dirArray != NULL );
-		dirIdx   = 0;
-		/* Fake the "." and ".." paths. */
-		dirArray[ dirIdx++ ] = strdup( "." );
-		dirArray[ dirIdx++ ] = strdup( ".." );
-		while( directory )
-        {
-			path = StripTrailingSlash( directory->data, false );
-			/* Don't report the IS_S3_DIRECTORY_FILE. */
-			s3dirfilePos = strlen( path )
-				           - strlen( &IS_S3_DIRECTORY_FILE[ 1 ] );
-			if( ( 0 <= s3dirfilePos )
-				&& ( strcmp( path, &IS_S3_DIRECTORY_FILE[ 1 ] ) == 0 ) )
-			{
-				free( path );
-				fileCounter--;
-			}
-			else
+			cachedArray = dirArray;
+			dirArray    = CopyDirectoryContents( fileCounter,
+												 (const char**) cachedArray );
+			InsertInDirectoryCache( strdup( parentDir ), fileCounter,
+									(const char**) cachedArray );
+		}
+		else
+		{
+			for( dirIdx = 0; dirIdx < fileCounter; dirIdx++ )
 			{
-				dirArray[ dirIdx++ ] = path;
+				free( dirArray[ dirIdx ] );
 			}
-			nextEntry = directory->next;
-			free( directory );
-			directory = nextEntry;
+			free( dirArray );
+			dirArray = NULL;
 		}
-		InsertInDirectoryCache( strdup( parentDir ), fileCounter,
-								(const char**) dirArray );
+		CompleteInFlightRequest( request, status );
 		UnlockCaches( );
     }
 
@@ -1167,6 +2013,265 @@ S3ReadDir(
 
 
 
+/**
+ * Queue a path that was served from the cache snapshot for revalidation
+ * against S3. Nothing is queued unless the snapshot thread is running.
+ * @param path [in] Path of the file or directory.
+ * @param isDirectory [in] \a true if the path refers to a directory listing.
+ * @return Nothing.
+ */
+static void
+QueueRevalidation(
+    const char *path,
+	bool       isDirectory
+	              )
+{
+    struct Revalidation *revalidation;
+
+	if( ! snapshotThreadRunning )
+	{
+		return;
+	}
+	revalidation = malloc( sizeof( struct Revalidation ) );
+	assert( revalidation != NULL );
+	revalidation->path        = strdup( path );
+	revalidation->isDirectory = isDirectory;
+	revalidation->next        = NULL;
+
+	pthread_mutex_lock( &snapshot_mutex );
+	if( revalidationTail == NULL )
+	{
+		revalidationQueue = revalidation;
+	}
+	else
+	{
+		revalidationTail->next = revalidation;
+	}
+	revalidationTail = revalidation;
+	pthread_cond_signal( &snapshot_cond );
+	pthread_mutex_unlock( &snapshot_mutex );
+}
+
+
+
+/**
+ * Stat a file in S3 and update its stat cache entry in place, so that
+ * pointers to the entry that other threads hold remain valid. If the file
+ * has since been deleted, the entry is marked as "file not found."
+ * @param filename [in] Full path of the file.
+ * @return Nothing.
+ */
+static void
+RevalidateStatEntry(
+    const char *filename
+	                )
+{
+    struct InFlightRequest *request;
+    bool                   isLeader;
+    struct S3FileInfo      *fresh = NULL;
+    struct S3FileInfo      *cached;
+    int                    status;
+
+	LockCaches( );
+	request = JoinInFlightRequest( "HEAD", filename, &isLeader );
+	if( ! isLeader )
+	{
+		/* Someone else is already asking S3. */
+		WaitForInFlightRequest( request );
+		UnlockCaches( );
+		return;
+	}
+	UnlockCaches( );
+
+	status = ResolveS3FileStatCacheMiss( filename, &fresh );
+
+	LockCaches( );
+	cached = SearchStatEntry( filename );
+	if( ( cached != NULL ) && ( ! request->abandoned ) )
+	{
+		if( status == 0 )
+		{
+			free( cached->symlinkTarget );
+			cached->uid           = fresh->uid;
+			cached->gid           = fresh->gid;
+			cached->permissions   = fresh->permissions;
+			cached->fileType      = fresh->fileType;
+			cached->exeUid        = fresh->exeUid;
+			cached->exeGid        = fresh->exeGid;
+			cached->sticky        = fresh->sticky;
+			cached->filenotfound  = false;
+			cached->symlinkTarget = fresh->symlinkTarget;
+			cached->size          = fresh->size;
+			cached->atime         = fresh->atime;
+			cached->mtime         = fresh->mtime;
+			cached->ctime         = fresh->ctime;
+			fresh->symlinkTarget  = NULL;
+		}
+		else if( status == -ENOENT )
+		{
+			cached->filenotfound = true;
+		}
+	}
+	CompleteInFlightRequest( request, status );
+	UnlockCaches( );
+
+	if( fresh != NULL )
+	{
+		DeleteS3FileInfoStructure( fresh );
+	}
+}
+
+
+
+/**
+ * List a directory in S3 and replace its directory cache entry.
+ * @param parentDir [in] Directory name with a single leading slash.
+ * @return Nothing.
+ */
+static void
+RevalidateDirectory(
+    const char *parentDir
+	                )
+{
+    struct InFlightRequest *request;
+    bool                   isLeader;
+    char                   **dirArray = NULL;
+    int                    fileCounter = 0;
+    int                    dirIdx;
+    int                    status;
+
+	LockCaches( );
+	request = JoinInFlightRequest( "GET", parentDir, &isLeader );
+	if( ! isLeader )
+	{
+		WaitForInFlightRequest( request );
+		UnlockCaches( );
+		return;
+	}
+	UnlockCaches( );
+
+	status = ListS3Directory( &parentDir[ 1 ], -1, &dirArray, &fileCounter );
+
+	LockCaches( );
+	if( ( status == 0 ) && ( ! request->abandoned ) )
+	{
+		InvalidateDirectoryCacheElement( parentDir );
+		InsertInDirectoryCache( strdup( parentDir ), fileCounter,
+								(const char**) dirArray );
+	}
+	else if( dirArray != NULL )
+	{
+		for( dirIdx = 0; dirIdx < fileCounter; dirIdx++ )
+		{
+			free( dirArray[ dirIdx ] );
+		}
+		free( dirArray );
+	}
+	CompleteInFlightRequest( request, status );
+	UnlockCaches( );
+}
+
+
+
+/**
+ * Write the stat and directory caches to the snapshot file. The entries are
+ * copied with the caches locked, because the revalidation replaces their
+ * fields under the same lock, and written after the lock is released.
+ * @return Nothing.
+ */
+static void
+SaveCacheSnapshot(
+    void
+	              )
+{
+    struct SnapshotBuilder *collected;
+
+	LockCaches( );
+	collected = CollectCacheSnapshot( );
+	UnlockCaches( );
+	WriteCacheSnapshot( globalConfig.cacheSnapshot, snapshotMountKey,
+						collected );
+}
+
+
+
+/**
+ * Thread that revalidates the entries that were served from the cache
+ * snapshot, and writes the stat and directory caches to the snapshot file
+ * at regular intervals and when the file system is unmounted.
+ * @param unused [in] Unused.
+ * @return \a NULL.
+ */
+static void*
+MaintainCacheSnapshot(
+    void *unused
+	                  )
+{
+    struct Revalidation *revalidation;
+    struct timespec     deadline;
+
+	(void) unused;
+
+	clock_gettime( CLOCK_REALTIME, &deadline );
+	deadline.tv_sec += globalConfig.snapshotInterval;
+
+	pthread_mutex_lock( &snapshot_mutex );
+	while( ! snapshotShutdown )
+	{
+		if( revalidationQueue != NULL )
+		{
+			revalidation      = revalidationQueue;
+			revalidationQueue = revalidation->next;
+			if( revalidationQueue == NULL )
+			{
+				revalidationTail = NULL;
+			}
+			pthread_mutex_unlock( &snapshot_mutex );
+			if( revalidation->isDirectory )
+			{
+				RevalidateDirectory( revalidation->path );
+			}
+			else
+			{
+				RevalidateStatEntry( revalidation->path );
+			}
+			free( revalidation->path );
+			free( revalidation );
+			pthread_mutex_lock( &snapshot_mutex );
+		}
+		else if( globalConfig.snapshotInterval == 0 )
+		{
+			pthread_cond_wait( &snapshot_cond, &snapshot_mutex );
+		}
+		else if( pthread_cond_timedwait( &snapshot_cond, &snapshot_mutex,
+										 &deadline ) == ETIMEDOUT )
+		{
+			pthread_mutex_unlock( &snapshot_mutex );
+			SaveCacheSnapshot( );
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			deadline.tv_sec += globalConfig.snapshotInterval;
+			pthread_mutex_lock( &snapshot_mutex );
+		}
+	}
+	/* Entries that were never revalidated are written back as they were
+	   read, and will be revalidated after the next mount. */
+	while( revalidationQueue != NULL )
+	{
+		revalidation      = revalidationQueue;
+		revalidationQueue = revalidation->next;
+		free( revalidation->path );
+		free( revalidation );
+	}
+	revalidationTail = NULL;
+	pthread_mutex_unlock( &snapshot_mutex );
+
+	SaveCacheSnapshot( );
+
+	return( NULL );
+}
+
+
+
 /**
  * Convert an OpenFlags structure to the value that is accepted by the open( )
  * function.
@@ -1218,6 +2323,7 @@ S3Create(
 	     )
 {
 	struct S3FileInfo *fi;
+	struct OpenFile   *openFile;
 	int               status;
 	char              *localname;
 
@@ -1230,18 +2336,22 @@ S3Create(
 		{
 			/* Delete the local file first. */
 			LockCaches( );
-			if( fi->openFlags.of_TRUNC || fi->openFlags.of_CREAT )
+			openFile = FindOpenFile( path, true );
+			if( openFile->openFlags.of_TRUNC || openFile->openFlags.of_CREAT )
 			{
 				unlink( localname );
 			}
 			/* Create the file with the specified open and permissions flags. */
 			status = creat( localname,
 							permissions );
+			if( 0 <= status )
+			{
+				openFile->localFd = status;
+			}
 			UnlockCaches( );
 
 			if( 0 <= status )
 			{
-				fi->localFd = status;
 				/* Set access time to now. */
 				fi->atime = time( NULL );
 				status = 0;
@@ -1288,27 +2398,36 @@ PrependHttpsToPath(
  * Open a file. The function assumes that the FUSE interface has already
  * determined that file access is allowed according to the open flags.
  * @param path [in] Path name of the file.
+ * @param openFlags [in] Flags that the file is opened with.
  * @return 0 on success, or \a -errno on failure.
  */
 int
 S3Open(
-	const char *path
+	const char             *path,
+	const struct OpenFlags *openFlags
 	  )
 {
 	struct S3FileInfo *fi;
+	struct OpenFile   *openFile;
 	int               status;
 	struct S3FileInfo *parentFi;
 	char              *parentDir;
 	char              *url;
+	int               localFd;
 
 	printf( "s3Open %s\n", path );
 
 	status = S3FileStat( path, &fi );
 	if( status == 0 )
 	{
+		LockCaches( );
+		openFile = FindOpenFile( path, true );
+		openFile->openFlags = *openFlags;
+		UnlockCaches( );
+
 		/* Prepare to cache the file. */
-		if( fi->openFlags.of_RDONLY || fi->openFlags.of_RDWR
-			|| fi->openFlags.of_APPEND )
+		if( openFlags->of_RDONLY || openFlags->of_RDWR
+			|| openFlags->of_APPEND )
 		{
 			parentDir = g_path_get_dirname( path );
 			status = S3FileStat( parentDir, &parentFi );
@@ -1319,11 +2438,24 @@ S3Open(
 				status = CreateCachedFile( url, parentFi->uid, parentFi->gid,
 										   parentFi->permissions,
 										   fi->uid, fi->gid, fi->permissions,
-										   fi->mtime );
+										   fi->mtime, &localFd );
 				free( url );
-				if( status == 0 )
+				/* Keep the file descriptor that the cache passed for the
+				   local file; reads use it once the file is downloaded. */
+				if( 0 <= localFd )
 				{
-
+					LockCaches( );
+					openFile = FindOpenFile( path, true );
+					if( openFile->localFd < 0 )
+					{
+						openFile->localFd = localFd;
+						localFd = -1;
+					}
+					UnlockCaches( );
+					if( 0 <= localFd )
+					{
+						close( localFd );
+					}
 				}
 			}
 		}
@@ -1332,16 +2464,19 @@ S3Open(
 		if( status == 0 )
 		{
 			LockCaches( );
-			if( fi->openFlags.of_TRUNC || fi->openFlags.of_CREAT )
+			if( openFlags->of_TRUNC || openFlags->of_CREAT )
 			{
 				unlink( localname );
 			}
 //			status = open( localname,
-//						   ConvertOpenFlagsToValue( &fi->openFlags ) );
+//						   ConvertOpenFlagsToValue( openFlags ) );
+			if( 0 <= status )
+			{
+				openFile->localFd = status;
+			}
 			UnlockCaches( );
 			if( 0 <= status )
 			{
-				fi->localFd = status;
 				/* Set access time to now. */
 				fi->atime = time( NULL );
 				status = 0;
@@ -1367,17 +2502,22 @@ S3FileClose(
 	const char *path
 	        )
 {
-	struct S3FileInfo *fi;
-	int               success;
-	char              *url;
+	struct OpenFile *openFile;
+	int             success = 0;
+	char            *url;
 
 	printf( "S3FileClose %s\n", path );
-	success = S3FileStat( path, &fi );
-	if( success == 0 )
+	LockCaches( );
+	openFile = FindOpenFile( path, false );
+	if( openFile != NULL )
 	{
-		success = close( fi->localFd );
-		fi->localFd = -1;
+		if( 0 <= openFile->localFd )
+		{
+			success = close( openFile->localFd );
+		}
+		ForgetOpenFile( openFile );
 	}
+	UnlockCaches( );
 	url = PrependHttpsToPath( path );
 	CloseCacheFile( url );
 	free( url );
@@ -1406,12 +2546,15 @@ S3ReadFile(
     size_t     *actuallyRead
 	       )
 {
-    struct S3FileInfo *fi;
-    int               status;
-	char              *url;
-	const char        *localname;
-	char              *localpath;
-	int               nBytes;
+    struct S3FileInfo  *fi;
+    struct OpenFile    *openFile;
+    int                status;
+	char               *url;
+	const char         *localname;
+	char               *localpath;
+	int                localFd;
+	int                nBytes;
+	struct CacheStatus cacheStatus;
 
 	printf( "s3ReadFile %s\n", path );
 
@@ -1420,29 +2563,74 @@ S3ReadFile(
     {
 		if( fi->fileType == 'f' )
 		{
-			/* Queue file for download and wait until it is received. */
 			url = PrependHttpsToPath( path );
-			status = DownloadCacheFile( url );
-			/* Then turn over the file read to the local read function now
-			   that the file is stored locally. */
-			if( status == 0 )
+			/* If the cache has published that the file is downloaded, read
+			   it directly from the local file that is already open. */
+			localFd = -1;
+			if( LookupCacheStatus( url, &cacheStatus )
+				&& cacheStatus.iscached )
+			{
+				LockCaches( );
+				openFile = FindOpenFile( path, false );
+				if( openFile != NULL )
+				{
+					localFd = openFile->localFd;
+				}
+				UnlockCaches( );
+			}
+			if( 0 <= localFd )
 			{
-				if( fi->localFd < 0 )
+				status = 0;
+			}
+			/* Otherwise, queue file for download and wait until it is
+			   received. Then turn over the file read to the local read
+			   function now that the file is stored locally. */
+			else if( ( status = DownloadCacheFile( url, &localFd ) ) == 0 )
+			{
+				LockCaches( );
+				openFile = FindOpenFile( path, true );
+				if( ( openFile->localFd < 0 ) && ( localFd < 0 ) )
 				{
-					/* First access: open the file. */
+					/* First access without a file descriptor from the cache:
+					   open the file by name. The caches are unlocked while
+					   the name is requested, because the request waits for
+					   the file cache. */
+					UnlockCaches( );
 					localname = GetLocalFilename( url );
-					localpath = malloc( strlen( CACHE_FILES ) +
-										strlen( localname ) + sizeof( char ) );
-					strcpy( localpath, CACHE_FILES );
-					strcat( localpath, localname );
-					printf( "Attempting to open %s\n", localpath );
-					/* TODO: change the open flags to those requested by the
-					   open( ) function. */
-					fi->localFd = open( localpath, O_RDONLY );
-					free( localpath );
-					free( (char*) localname );
+					if( localname != NULL )
+					{
+						localpath = malloc( strlen( CACHE_FILES ) +
+											strlen( localname )
+											+ sizeof( char ) );
+						strcpy( localpath, CACHE_FILES );
+						strcat( localpath, localname );
+						printf( "Attempting to open %s\n", localpath );
+						/* TODO: change the open flags to those requested by
+						   the open( ) function. */
+						localFd = open( localpath, O_RDONLY );
+						free( localpath );
+						free( (char*) localname );
+					}
+					LockCaches( );
+					openFile = FindOpenFile( path, true );
+				}
+				/* Use the file descriptor that the cache passed or that was
+				   opened, unless the file has been opened in the meantime. */
+				if( ( openFile->localFd < 0 ) && ( 0 <= localFd ) )
+				{
+					openFile->localFd = localFd;
+					localFd = -1;
+				}
+				if( 0 <= localFd )
+				{
+					close( localFd );
 				}
-				nBytes = pread( fi->localFd, buf, maxSize, offset );
+				localFd = openFile->localFd;
+				UnlockCaches( );
+			}
+			if( status == 0 )
+			{
+				nBytes = pread( localFd, buf, maxSize, offset );
 				if( 0 <= nBytes )
 				{
 					*actuallyRead = nBytes;
@@ -1717,7 +2905,7 @@ S3CreateLink(
     char              sizeHeader[ 25 ];
 
     /* Create a new FileInfo structure to the symbolic link. */
-    fi = malloc( sizeof( struct S3FileInfo ) );
+    fi = AllocateS3FileInfo( );
     fi->uid           = getuid( );
     fi->gid           = getgid( );
     fi->permissions   = 0777;
@@ -1750,17 +2938,21 @@ S3CreateLink(
        is a very short message. */
     headers = curl_slist_append( headers, strdup( "Expect:" ) );
     headers = curl_slist_append( headers, strdup( "Transfer-Encoding:" ) );
-    /* Create standard headers. */
-    LockCaches( );
+    /* Create standard headers.  The caches are not locked while S3 is
+       busy, which may take several backoff delays; a lookup that runs in the
+       meantime is abandoned below. */
     status = s3_SubmitS3PutRequest( s3comm, headers, linkname,
 									(void**) &response, &responseLength,
 									(unsigned char*) path, pathLength );
     /* We already have the FileInfo structure, so because the file will be
        stat'ed as soon as we return, let's add it to the stat cache. Delete
        whatever might already be in the cache. */
+    LockCaches( );
     DeleteStatEntry( linkname );
     InsertCacheElement( linkname, fi, &DeleteS3FileInfoStructure );
     InvalidateDirectoryCacheElement( parentDir );
+    AbandonInFlightRequests( linkname );
+    AbandonInFlightRequests( parentDir );
     UnlockCaches( );
 
     return( status );
@@ -1777,6 +2969,21 @@ S3Destroy(
     void
 	      )
 {
+	/* Stop revalidating and write the final cache snapshot while the
+	   caches are still intact. */
+	if( snapshotThreadRunning )
+	{
+		pthread_mutex_lock( &snapshot_mutex );
+		snapshotShutdown = true;
+		pthread_cond_signal( &snapshot_cond );
+		pthread_mutex_unlock( &snapshot_mutex );
+		pthread_join( snapshotThread, NULL );
+		snapshotThreadRunning = false;
+	}
+	CloseCacheSnapshot( );
+	free( snapshotMountKey );
+	snapshotMountKey = NULL;
+
     ShutdownDirectoryCache( );
     TruncateCache( 0 );
     /* Cleanup libxml. */
@@ -1785,7 +2992,7 @@ S3Destroy(
 	/* Close the S3 communications library. */
 	s3_close( s3comm );
 #endif
-	curl_global_cleanup( );
+	s3_ShutdownCurl( );
 
 	DisconnectFromFileCache( );
 }
@@ -1904,10 +3111,13 @@ S3Mkdir(
     headers = CreateHeadersFromFileInfo( &newFi, headers );
     headers = curl_slist_append( headers, strdup( "Expect:" ) );
     headers = curl_slist_append( headers, strdup( "Transfer-Encoding:" ) );
-    LockCaches( );
     status  = s3_SubmitS3Request( s3comm, "PUT", headers, secretFile,
 								  (void**) &response, &responseLength );
+    /* Lookups that ran while S3 was busy are abandoned. */
+    LockCaches( );
     InvalidateDirectoryCacheElement( parentDir );
+    AbandonInFlightRequests( parentDir );
+    AbandonInFlightRequests( cleanName );
     /* Update the stat cache entry for the directory. */
     free( (char*) parentDir );
     free( secretFile );
@@ -1947,11 +3157,14 @@ S3Unlink( const char *filename )
     cleanName = CleanPath( filename );
     parentDir = GetParentDir( cleanName );
 
-    LockCaches( );
     status  = s3_SubmitS3Request( s3comm, "DELETE", headers, cleanName,
 								  (void**) &response, &responseLength );
+    /* Lookups that ran while S3 was busy are abandoned. */
+    LockCaches( );
     InvalidateDirectoryCacheElement( parentDir );
     DeleteStatEntry( cleanName );
+    AbandonInFlightRequests( parentDir );
+    AbandonInFlightRequests( cleanName );
     UnlockCaches( );
     free( (char*) parentDir );
     free( (char*) cleanName );
@@ -1981,6 +3194,7 @@ IsDirectoryEmpty(
     char **directory;
     int  nFiles;
     int  status;
+    int  i;
 
     /* Read four files so that we can account for the secret file, the ".",
        the "..", and finally any file that makes the directory non-empty. */
@@ -1994,6 +3208,11 @@ IsDirectoryEmpty(
 		{
 			success = true;
 		}
+		for( i = 0; i < nFiles; i++ )
+		{
+			free( directory[ i ] );
+		}
+		free( directory );
     }
 
     return( success );
@@ -2039,12 +3258,14 @@ S3Rmdir( const char *dirname )
 				status = S3Unlink( secretFile );
 				if( status == 0 )
 				{
-					LockCaches( );
 					status = s3_SubmitS3Request( s3comm, "DELETE", headers,
 												 cleanName, (void**) &response,
 												 &responseLength );
+					LockCaches( );
 					InvalidateDirectoryCacheElement( parentDir );
 					DeleteStatEntry( cleanName );
+					AbandonInFlightRequests( parentDir );
+					AbandonInFlightRequests( cleanName );
 					UnlockCaches( );
 					free( (char*) parentDir );
 					free( (char*) cleanName );
@@ -2090,18 +3311,23 @@ S3Chmod(
 	)
 {
     struct S3FileInfo *fi;
+    struct S3FileInfo updated;
     int               status;
     time_t            now = time( NULL );
 
     status = S3FileStat( file, &fi );
     if( status == 0 )
     {
+        /* Update the stat cache entry, and send a copy of it to S3 without
+		   holding the caches locked while S3 is busy. */
         LockCaches( );
 		fi->mtime       = now;
 		fi->permissions = mode;
-		
-		status = UpdateAmzHeaders( file, fi, NULL );
+		memcpy( &updated, fi, sizeof( struct S3FileInfo ) );
 		UnlockCaches( );
+		updated.symlinkTarget = NULL;
+
+		status = UpdateAmzHeaders( file, &updated, NULL );
     }
     return( status );
 }
@@ -2123,19 +3349,24 @@ S3Chown(
 	)
 {
     struct S3FileInfo *fi;
+    struct S3FileInfo updated;
     int               status;
     time_t            now = time( NULL );
 
     status = S3FileStat( file, &fi );
     if( status == 0 )
     {
+        /* Update the stat cache entry, and send a copy of it to S3 without
+		   holding the caches locked while S3 is busy. */
         LockCaches( );
 		fi->mtime                     = now;
 		if( (int) uid != -1 ) fi->uid = uid;
 		if( (int) gid != -1 ) fi->gid = gid;
-
-		status = UpdateAmzHeaders( file, fi, NULL );
+		memcpy( &updated, fi, sizeof( struct S3FileInfo ) );
 		UnlockCaches( );
+		updated.symlinkTarget = NULL;
+
+		status = UpdateAmzHeaders( file, &updated, NULL );
     }
     return( status );
 }
@@ -53,11 +53,19 @@ struct OpenFlags
 };
 
 
+/* The metadata of a cached file. Fields are ordered by size so that the
+   structure is not padded; state that only matters while a file is open is
+   kept separately by s3if.c. */
 struct S3FileInfo
 {
+    off_t            size;
+    time_t           atime;
+    time_t           mtime;
+    time_t           ctime;
+    char             *symlinkTarget;
     uid_t            uid;
     gid_t            gid;
-    unsigned int     permissions;
+    unsigned short   permissions;
     char             fileType;
     bool             exeUid : 1;
     bool             exeGid : 1;
@@ -69,22 +77,18 @@ struct S3FileInfo
 	   that is, only the stat information is available. This is used to
 	   avoid bothering the file cache with stat inquiries. */
 	bool             statonly : 1;
-    char             *symlinkTarget;
-    off_t            size;
-    time_t           atime;
-    time_t           mtime;
-    time_t           ctime;
-	/* File handle for the locally cached file. */
-	int              localFd;
-	struct OpenFlags openFlags;
 };
 
 
 void InitializeS3If( void );
+void S3Init( void );
 void S3Destroy( void );
 
+struct S3FileInfo *AllocateS3FileInfo( void );
+void FreeS3FileInfo( struct S3FileInfo *fileInfo );
+
 int S3FileStat( const char *path, struct S3FileInfo ** );
-int S3Open( const char *path );
+int S3Open( const char *path, const struct OpenFlags *openFlags );
 int S3Create( const char *path, mode_t permissions );
 int S3FileClose( const char *path );
 int S3ReadLink( const char *link, char **target );
@@ -0,0 +1,183 @@
+/**
+ * \file slab.c
+ * \brief Slab allocator for small fixed-size objects.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "aws-s3fs.h"
+#include "slab.h"
+
+
+/* Objects are carved out of chunks of this size. Chunks are large enough to
+   be mapped directly by malloc, so they carry no per-object overhead. */
+#define SLAB_CHUNK_SIZE ( 256 * 1024 )
+
+
+/* Chunks are kept in a list so that they can be released when the slab is
+   destroyed. The objects follow the chunk header. */
+struct SlabChunk
+{
+    struct SlabChunk *next;
+};
+
+/* Freed objects are kept in a list that is threaded through the objects
+   themselves. */
+struct FreeObject
+{
+    struct FreeObject *next;
+};
+
+struct Slab
+{
+    pthread_mutex_t   mutex;
+    size_t            objectSize;
+    struct SlabChunk  *chunks;
+    struct FreeObject *freeObjects;
+    /* Unused remainder of the most recently allocated chunk. */
+    char              *unusedBegin;
+    char              *unusedEnd;
+};
+
+
+
+/**
+ * Create a slab for objects of the specified size. The objects are aligned
+ * on pointer boundaries.
+ * @param objectSize [in] Size of the objects.
+ * @return New slab.
+ */
+struct Slab*
+CreateSlab(
+    size_t objectSize
+	   )
+{
+    struct Slab *slab;
+
+    slab = malloc( sizeof( struct Slab ) );
+    assert( slab != NULL );
+    pthread_mutex_init( &slab->mutex, NULL );
+    if( objectSize < sizeof( struct FreeObject ) )
+    {
+        objectSize = sizeof( struct FreeObject );
+    }
+    slab->objectSize  = ( objectSize + sizeof( void* ) - 1 )
+                        & ~( sizeof( void* ) - 1 );
+    slab->chunks      = NULL;
+    slab->freeObjects = NULL;
+    slab->unusedBegin = NULL;
+    slab->unusedEnd   = NULL;
+
+    return( slab );
+}
+
+
+
+/**
+ * Allocate an object from a slab. The contents of the object are undefined.
+ * @param slab [in/out] Slab to allocate from.
+ * @return Pointer to the object.
+ */
+void*
+AllocateFromSlab(
+    struct Slab *slab
+		 )
+{
+    struct SlabChunk *chunk;
+    void             *object;
+
+    pthread_mutex_lock( &slab->mutex );
+    if( slab->freeObjects != NULL )
+    {
+        object            = slab->freeObjects;
+	slab->freeObjects = slab->freeObjects->next;
+    }
+    else
+    {
+        if( (size_t) ( slab->unusedEnd - slab->unusedBegin )
+	    < slab->objectSize )
+	{
+	    chunk = malloc( SLAB_CHUNK_SIZE );
+	    assert( chunk != NULL );
+	    chunk->next       = slab->chunks;
+	    slab->chunks      = chunk;
+	    slab->unusedBegin = (char*) ( chunk + 1 );
+	    slab->unusedEnd   = (char*) chunk + SLAB_CHUNK_SIZE;
+	}
+	object             = slab->unusedBegin;
+	slab->unusedBegin += slab->objectSize;
+    }
+    pthread_mutex_unlock( &slab->mutex );
+
+    return( object );
+}
+
+
+
+/**
+ * Return an object to the slab that it was allocated from. The memory is
+ * reused for the next allocation but is not returned to the system until
+ * the slab is destroyed.
+ * @param slab [in/out] Slab that the object was allocated from.
+ * @param object [in] The object.
+ * @return Nothing.
+ */
+void
+ReturnToSlab(
+    struct Slab *slab,
+    void        *object
+	     )
+{
+    struct FreeObject *freeObject = object;
+
+    if( object != NULL )
+    {
+        pthread_mutex_lock( &slab->mutex );
+	freeObject->next  = slab->freeObjects;
+	slab->freeObjects = freeObject;
+	pthread_mutex_unlock( &slab->mutex );
+    }
+}
+
+
+
+/**
+ * Release a slab and all the objects that were allocated from it.
+ * @param slab [in] The slab.
+ * @return Nothing.
+ */
+void
+DestroySlab(
+    struct Slab *slab
+	    )
+{
+    struct SlabChunk *chunk;
+
+    while( slab->chunks != NULL )
+    {
+        chunk        = slab->chunks;
+	slab->chunks = chunk->next;
+	free( chunk );
+    }
+    pthread_mutex_destroy( &slab->mutex );
+    free( slab );
+}
@@ -26,6 +26,8 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -382,3 +384,275 @@ SocketReceiveDatagramFromServer(
 
     return( nBytes );
 }
+
+
+
+/**
+ * Read exactly \a size bytes from a stream socket, continuing after partial
+ * reads and interrupted calls.  A file descriptor that arrives as ancillary
+ * data is returned to the caller, or closed if the caller does not want it.
+ * @param socketFd [in] File descriptor for the socket connection.
+ * @param buffer [out] Destination buffer.
+ * @param size [in] Number of bytes to read.
+ * @param fileHandle [in/out] File descriptor received with the data, or
+ *        \a NULL.  It is left untouched if no descriptor was received.
+ * @return 0 on success, \a -ENOTCONN if the peer closed the connection, or
+ *         \a -errno on failure.
+ * Test: none.
+ */
+static int
+ReadFully(
+    int    socketFd,
+	void   *buffer,
+	size_t size,
+	int    *fileHandle
+	      )
+{
+	char           control[ CMSG_SPACE( sizeof( int ) ) ];
+	struct msghdr  message;
+	struct cmsghdr *cmessage;
+	struct iovec   iovector;
+	size_t         received = 0;
+	ssize_t        nBytes;
+	int            passedFd;
+
+	while( received < size )
+	{
+		iovector.iov_base = (char*) buffer + received;
+		iovector.iov_len  = size - received;
+		memset( &message, 0, sizeof( struct msghdr ) );
+		message.msg_iov        = &iovector;
+		message.msg_iovlen     = 1;
+		message.msg_control    = control;
+		message.msg_controllen = sizeof( control );
+		nBytes = recvmsg( socketFd, &message, MSG_CMSG_CLOEXEC );
+		if( nBytes == 0 )
+		{
+			return( -ENOTCONN );
+		}
+		else if( nBytes < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			return( -errno );
+		}
+		received += nBytes;
+
+		for( cmessage = CMSG_FIRSTHDR( &message ); cmessage != NULL;
+			 cmessage = CMSG_NXTHDR( &message, cmessage ) )
+		{
+			if( ( cmessage->cmsg_level == SOL_SOCKET )
+				&& ( cmessage->cmsg_type == SCM_RIGHTS ) )
+			{
+				memcpy( &passedFd, CMSG_DATA( cmessage ), sizeof( int ) );
+				if( ( fileHandle != NULL ) && ( *fileHandle < 0 ) )
+				{
+					*fileHandle = passedFd;
+				}
+				else
+				{
+					close( passedFd );
+				}
+			}
+		}
+	}
+
+	return( 0 );
+}
+
+
+
+/**
+ * Send a framed message between the filesystem frontend and the file cache.
+ * The header, the fixed fields, and the trailing string are gathered into a
+ * single write.  SIGPIPE is suppressed; a disconnected peer is reported as
+ * \a -EPIPE.
+ * @param socketFd [in] Socket file handle.
+ * @param opcode [in] Request opcode.
+ * @param requestId [in] ID that pairs a reply with its request.
+ * @param status [in] Status of a reply, or 0 for requests.
+ * @param fields [in] Fixed fields of the opcode, or \a NULL.
+ * @param fieldsLength [in] Size of the fixed fields.
+ * @param tail [in] String that follows the fixed fields, or \a NULL.
+ * @param fileHandle [in] File descriptor to pass to the peer, or \a -1.
+ * @return 0 if the message was sent, or \a -errno on failure.
+ * Test: implied blackbox (test-process.c).
+ */
+int
+SocketSendCacheMessage(
+    int        socketFd,
+	int        opcode,
+	uint32_t   requestId,
+	int        status,
+	const void *fields,
+	size_t     fieldsLength,
+	const char *tail,
+	int        fileHandle
+	                   )
+{
+	struct CacheMessageHeader header;
+	struct iovec              iovector[ 3 ];
+	struct msghdr             message;
+	struct cmsghdr            *cmessage;
+	char                      control[ CMSG_SPACE( sizeof( int ) ) ];
+	size_t                    tailLength;
+	ssize_t                   nBytes;
+
+	tailLength = ( tail != NULL ) ? strlen( tail ) : 0;
+	if( CACHE_MAX_PAYLOAD < fieldsLength + tailLength )
+	{
+		return( -EMSGSIZE );
+	}
+
+	header.length    = fieldsLength + tailLength;
+	header.version   = CACHE_PROTOCOL_VERSION;
+	header.opcode    = opcode;
+	header.requestId = requestId;
+	header.status    = status;
+
+	iovector[ 0 ].iov_base = &header;
+	iovector[ 0 ].iov_len  = sizeof( header );
+	iovector[ 1 ].iov_base = (void*) fields;
+	iovector[ 1 ].iov_len  = fieldsLength;
+	iovector[ 2 ].iov_base = (char*) tail;
+	iovector[ 2 ].iov_len  = tailLength;
+	memset( &message, 0, sizeof( struct msghdr ) );
+	message.msg_iov    = iovector;
+	message.msg_iovlen = 3;
+
+	/* Attach the file descriptor to the first byte of the message. */
+	if( 0 <= fileHandle )
+	{
+		memset( control, 0, sizeof( control ) );
+		message.msg_control    = control;
+		message.msg_controllen = sizeof( control );
+		cmessage = CMSG_FIRSTHDR( &message );
+		cmessage->cmsg_level = SOL_SOCKET;
+		cmessage->cmsg_type  = SCM_RIGHTS;
+		cmessage->cmsg_len   = CMSG_LEN( sizeof( int ) );
+		memcpy( CMSG_DATA( cmessage ), &fileHandle, sizeof( int ) );
+	}
+
+	/* Keep sending until the entire message is written; a stream socket may
+	   accept only part of it. */
+	while( 0 < message.msg_iovlen )
+	{
+		nBytes = sendmsg( socketFd, &message, MSG_NOSIGNAL );
+		if( nBytes < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			return( -errno );
+		}
+		/* The file descriptor has been passed with the first part. */
+		message.msg_control    = NULL;
+		message.msg_controllen = 0;
+		while( ( 0 < message.msg_iovlen )
+			   && ( message.msg_iov->iov_len <= (size_t) nBytes ) )
+		{
+			nBytes -= message.msg_iov->iov_len;
+			message.msg_iov++;
+			message.msg_iovlen--;
+		}
+		if( 0 < message.msg_iovlen )
+		{
+			message.msg_iov->iov_base = (char*) message.msg_iov->iov_base
+				+ nBytes;
+			message.msg_iov->iov_len -= nBytes;
+		}
+	}
+
+	return( 0 );
+}
+
+
+
+/**
+ * Receive a framed message between the filesystem frontend and the file
+ * cache.  The payload is zero-terminated so that its trailing string may be
+ * used directly.
+ * @param socketFd [in] File descriptor for the socket connection.
+ * @param header [out] Message header.
+ * @param payload [out] Destination buffer for the payload, which must have
+ *        room for \a size bytes plus a zero terminator.
+ * @param size [in] Maximum length of the payload.
+ * @param fileHandle [out] File descriptor passed with the message, or \a -1
+ *        if there was none.  If \a NULL, a passed descriptor is closed.
+ * @return Length of the payload, \a -EPROTO if the peer speaks another
+ *         protocol version, \a -EMSGSIZE if the payload is too large, in
+ *         which case it is read and discarded, \a -ENOTCONN if the peer has
+ *         disconnected, or \a -errno on other failures.
+ * Test: implied blackbox (test-process.c).
+ */
+int
+SocketReceiveCacheMessage(
+    int                       socketFd,
+	struct CacheMessageHeader *header,
+	char                      *payload,
+	size_t                    size,
+	int                       *fileHandle
+	                      )
+{
+	int      status;
+	int      passedFd = -1;
+	char     discard[ 512 ];
+	uint32_t remaining;
+	uint32_t chunk;
+
+	status = ReadFully( socketFd, header, sizeof( struct CacheMessageHeader ),
+						&passedFd );
+	/* Don't trust the length of a message from another protocol version. */
+	if( ( status == 0 ) && ( header->version != CACHE_PROTOCOL_VERSION ) )
+	{
+		status = -EPROTO;
+	}
+	/* Skip a payload that is too large, so that the next message is read
+	   from its beginning. */
+	if( ( status == 0 ) && ( size < header->length ) )
+	{
+		remaining = header->length;
+		while( ( status == 0 ) && ( 0 < remaining ) )
+		{
+			chunk = sizeof( discard );
+			if( remaining < chunk )
+			{
+				chunk = remaining;
+			}
+			status = ReadFully( socketFd, discard, chunk, &passedFd );
+			remaining -= chunk;
+		}
+		if( status == 0 )
+		{
+			status = -EMSGSIZE;
+		}
+	}
+	if( status == 0 )
+	{
+		status = ReadFully( socketFd, payload, header->length, &passedFd );
+	}
+
+	if( status == 0 )
+	{
+		payload[ header->length ] = '\0';
+		status = header->length;
+	}
+	else if( 0 <= passedFd )
+	{
+		close( passedFd );
+		passedFd = -1;
+	}
+	if( fileHandle != NULL )
+	{
+		*fileHandle = passedFd;
+	}
+	else if( 0 <= passedFd )
+	{
+		close( passedFd );
+	}
+
+	return( status );
+}
@@ -25,10 +25,77 @@
 
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 
 
+/* Version of the protocol spoken between the filesystem frontend and the
+   file cache daemon.  Increment it whenever the layout of a message
+   changes; the daemon rejects clients that speak another version. */
+#define CACHE_PROTOCOL_VERSION 3
+
+/* Largest payload that may follow a message header: fixed fields plus a
+   path name. */
+#define CACHE_MAX_PAYLOAD ( 4096 + 256 )
+
+/* Requests from the filesystem frontend to the file cache.  A reply carries
+   the opcode and the request ID of the request it answers.  Replies to
+   CACHE_CREATE and CACHE_DOWNLOAD may pass a read-only file descriptor for
+   the local file as ancillary data. */
+enum CacheOpcode
+{
+	CACHE_CONNECT = 1,
+	CACHE_DISCONNECT,
+	CACHE_FILE,
+	CACHE_CREATE,
+	CACHE_DOWNLOAD,
+	CACHE_DROP,
+	CACHE_QUIT,
+	CACHE_DEBUG
+};
+
+/* Every message starts with this header, which is followed by \a length
+   bytes of payload.  The payload consists of the fixed fields of the
+   opcode, if any, and a string that is not zero-terminated.  Both ends of
+   the socket run on the same host, so the fields are in host byte order. */
+struct CacheMessageHeader
+{
+	uint32_t length;
+	uint16_t version;
+	uint16_t opcode;
+	uint32_t requestId;
+	int32_t  status;
+};
+
+/* CACHE_CONNECT request; the bucket name follows.  \a checksum is one of
+   the ChecksumModes. */
+struct CacheConnectRequest
+{
+	char     keyId[ 20 ];
+	char     secretKey[ 40 ];
+	uint32_t checksum;
+};
+
+/* CACHE_CREATE request; the path name of the file follows. */
+struct CacheCreateRequest
+{
+	uint32_t parentUid;
+	uint32_t parentGid;
+	uint32_t parentPermissions;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t permissions;
+	int64_t  mtime;
+};
+
+/* CACHE_CREATE reply; the local name of the file follows. */
+struct CacheCreateReply
+{
+	int64_t fileId;
+};
+
+
 bool CreateServerStreamSocket( const char *socketPath, int *socketFd,
 			 struct sockaddr_un *socketAddress );
 
@@ -44,6 +111,14 @@ bool SocketSendDatagramToServer( int socketFd, const char *buffer,
 int SocketReceiveDatagramFromServer( int socketFd, char *buffer, size_t size,
 									 int *fileHandle );
 
+int SocketSendCacheMessage( int socketFd, int opcode, uint32_t requestId,
+							int status, const void *fields,
+							size_t fieldsLength, const char *tail,
+							int fileHandle );
+int SocketReceiveCacheMessage( int socketFd,
+							   struct CacheMessageHeader *header,
+							   char *payload, size_t size, int *fileHandle );
+
 
 
 #endif /* __S3FS_SOCKET_H */
@@ -22,9 +22,13 @@
 
 
 #include <config.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
-#include <uthash.h>
 #include "statcache.h"
+#include "slab.h"
 #include "aws-s3fs.h"
 
 #ifdef AUTOTEST
@@ -32,21 +36,480 @@
 #define MAX_STAT_CACHE_SIZE 4
 #endif
 
+/* Entries are allocated from slabs in size classes of this granularity, up
+   to the limit. Entries with longer filenames are malloc'ed. */
+#define SIZE_CLASS_GRANULARITY 16
+#define SIZE_CLASS_LIMIT       256
 
-pthread_mutex_t mutex_statCache = PTHREAD_MUTEX_INITIALIZER;
-static struct StatCacheEntry *statCache = NULL;
+/* Number of hash buckets that the tables start with. */
+#define INITIAL_BUCKETS 64
 
 
-struct StatCacheEntry
+/* A directory path that is shared by all the cached entries in that
+   directory, so that each entry needs to store only its own name. */
+struct PathPrefix
 {
-    const char *filename;
-    void       *data;
-    void       (*dataDeleteFunction)( void* );
+    struct PathPrefix *chain;
+    uint32_t          hash;
+    uint32_t          references;
+    size_t            length;
+    char              path[ ];
+};
 
-    UT_hash_handle hh;
+/* A cache entry is a single allocation that holds the hash chain link, the
+   links of the LRU list, and the last component of the filename. */
+struct StatCacheEntry
+{
+    struct StatCacheEntry *chain;
+    struct StatCacheEntry *older;
+    struct StatCacheEntry *newer;
+    /* NULL if the filename contains no slash. */
+    struct PathPrefix     *parent;
+    void                  *data;
+    void                  (*dataDeleteFunction)( void* );
+    uint32_t              hash;
+    char                  name[ ];
 };
 
 
+pthread_mutex_t mutex_statCache = PTHREAD_MUTEX_INITIALIZER;
+
+/* The entry table and the prefix table are protected by the stat cache
+   mutex. */
+static struct StatCacheEntry **statCache = NULL;
+static size_t                statCacheBuckets = 0;
+static long                  statCacheCount = 0;
+static struct StatCacheEntry *oldestEntry = NULL;
+static struct StatCacheEntry *newestEntry = NULL;
+static long                  maxStatCacheSize = MAX_STAT_CACHE_SIZE;
+
+static struct PathPrefix     **prefixes = NULL;
+static size_t                prefixBuckets = 0;
+static size_t                prefixCount = 0;
+
+static struct Slab *entrySlabs[ SIZE_CLASS_LIMIT / SIZE_CLASS_GRANULARITY + 1 ];
+
+
+
+/**
+ * Compute the FNV-1a hash of a path.
+ * @param path [in] The path.
+ * @param length [in] Number of characters to hash.
+ * @return The hash value.
+ */
+static uint32_t
+HashPath(
+    const char *path,
+    size_t     length
+	 )
+{
+    uint32_t hash = 2166136261u;
+    size_t   i;
+
+    for( i = 0; i < length; i++ )
+    {
+        hash ^= (unsigned char) path[ i ];
+	hash *= 16777619u;
+    }
+    return( hash );
+}
+
+
+
+/**
+ * Find the shared copy of a directory path, adding it to the prefix table
+ * if necessary, and take a reference to it. This function must be called
+ * with the stat cache locked.
+ * @param path [in] Directory path, not necessarily NUL-terminated.
+ * @param length [in] Length of the directory path.
+ * @return The shared directory path.
+ */
+static struct PathPrefix*
+InternPrefix(
+    const char *path,
+    size_t     length
+	     )
+{
+    uint32_t          hash = HashPath( path, length );
+    struct PathPrefix *prefix;
+    struct PathPrefix **newBuckets;
+    struct PathPrefix *next;
+    size_t            newSize;
+    size_t            i;
+
+    if( prefixes != NULL )
+    {
+        for( prefix = prefixes[ hash & ( prefixBuckets - 1 ) ];
+	     prefix != NULL; prefix = prefix->chain )
+	{
+	    if( ( prefix->hash == hash ) && ( prefix->length == length )
+		&& ( memcmp( prefix->path, path, length ) == 0 ) )
+	    {
+	        prefix->references++;
+		return( prefix );
+	    }
+	}
+    }
+
+    /* Keep the load factor at most 1. */
+    if( prefixBuckets <= prefixCount )
+    {
+        newSize    = prefixBuckets == 0 ? INITIAL_BUCKETS : 2 * prefixBuckets;
+	newBuckets = calloc( newSize, sizeof( struct PathPrefix* ) );
+	assert( newBuckets != NULL );
+	for( i = 0; i < prefixBuckets; i++ )
+	{
+	    for( prefix = prefixes[ i ]; prefix != NULL; prefix = next )
+	    {
+	        next          = prefix->chain;
+		prefix->chain = newBuckets[ prefix->hash & ( newSize - 1 ) ];
+		newBuckets[ prefix->hash & ( newSize - 1 ) ] = prefix;
+	    }
+	}
+	free( prefixes );
+	prefixes      = newBuckets;
+	prefixBuckets = newSize;
+    }
+
+    prefix = malloc( sizeof( struct PathPrefix ) + length + sizeof( char ) );
+    assert( prefix != NULL );
+    prefix->hash       = hash;
+    prefix->references = 1;
+    prefix->length     = length;
+    memcpy( prefix->path, path, length );
+    prefix->path[ length ] = '\0';
+    prefix->chain = prefixes[ hash & ( prefixBuckets - 1 ) ];
+    prefixes[ hash & ( prefixBuckets - 1 ) ] = prefix;
+    prefixCount++;
+
+    return( prefix );
+}
+
+
+
+/**
+ * Drop a reference to a shared directory path, and delete it when there are
+ * no more references. This function must be called with the stat cache
+ * locked.
+ * @param prefix [in/out] The shared directory path, or \a NULL.
+ * @return Nothing.
+ */
+static void
+ReleasePrefix(
+    struct PathPrefix *prefix
+	      )
+{
+    struct PathPrefix **link;
+
+    if( ( prefix == NULL ) || ( --prefix->references != 0 ) )
+    {
+        return;
+    }
+    link = &prefixes[ prefix->hash & ( prefixBuckets - 1 ) ];
+    while( *link != prefix )
+    {
+        link = &( *link )->chain;
+    }
+    *link = prefix->chain;
+    prefixCount--;
+    free( prefix );
+}
+
+
+
+/**
+ * Determine the size class of an entry with the specified name length.
+ * @param nameLength [in] Length of the last component of the filename.
+ * @param size [out] Number of bytes to allocate for the entry.
+ * @return Index of the size class, or -1 if the entry is too large for the
+ *         slabs.
+ */
+static int
+EntrySizeClass(
+    size_t nameLength,
+    size_t *size
+	       )
+{
+    int sizeClass;
+
+    *size     = offsetof( struct StatCacheEntry, name ) + nameLength
+                + sizeof( char );
+    sizeClass = ( *size + SIZE_CLASS_GRANULARITY - 1 )
+                / SIZE_CLASS_GRANULARITY;
+    if( SIZE_CLASS_LIMIT / SIZE_CLASS_GRANULARITY < sizeClass )
+    {
+        return( -1 );
+    }
+    *size = sizeClass * SIZE_CLASS_GRANULARITY;
+    return( sizeClass );
+}
+
+
+
+/**
+ * Allocate a cache entry for a name of the specified length. This function
+ * must be called with the stat cache locked.
+ * @param nameLength [in] Length of the last component of the filename.
+ * @return The uninitialized entry.
+ */
+static struct StatCacheEntry*
+AllocateEntry(
+    size_t nameLength
+	      )
+{
+    struct StatCacheEntry *entry;
+    size_t                size;
+    int                   sizeClass;
+
+    sizeClass = EntrySizeClass( nameLength, &size );
+    if( sizeClass < 0 )
+    {
+        entry = malloc( size );
+    }
+    else
+    {
+        if( entrySlabs[ sizeClass ] == NULL )
+	{
+	    entrySlabs[ sizeClass ] = CreateSlab( size );
+	}
+	entry = AllocateFromSlab( entrySlabs[ sizeClass ] );
+    }
+    assert( entry != NULL );
+    return( entry );
+}
+
+
+
+/**
+ * Delete a cache entry that has already been unlinked from the cache,
+ * including its data if it has a delete function. This function must be
+ * called with the stat cache locked.
+ * @param entry [in] The entry.
+ * @return Nothing.
+ */
+static void
+DestroyEntry(
+    struct StatCacheEntry *entry
+	     )
+{
+    size_t size;
+    int    sizeClass;
+
+    if( entry->dataDeleteFunction != NULL )
+    {
+        (entry->dataDeleteFunction)( entry->data );
+    }
+    ReleasePrefix( entry->parent );
+    sizeClass = EntrySizeClass( strlen( entry->name ), &size );
+    if( sizeClass < 0 )
+    {
+        free( entry );
+    }
+    else
+    {
+        ReturnToSlab( entrySlabs[ sizeClass ], entry );
+    }
+}
+
+
+
+/**
+ * Determine whether a cache entry holds the specified filename.
+ * @param entry [in] The cache entry.
+ * @param filename [in] Full filename.
+ * @param hash [in] Hash of the full filename.
+ * @return \a true if the entry holds the filename, or \a false otherwise.
+ */
+static bool
+EntryMatches(
+    const struct StatCacheEntry *entry,
+    const char                  *filename,
+    uint32_t                    hash
+	     )
+{
+    const struct PathPrefix *parent = entry->parent;
+
+    if( entry->hash != hash )
+    {
+        return( false );
+    }
+    if( parent == NULL )
+    {
+        return( strcmp( entry->name, filename ) == 0 );
+    }
+    return( ( strncmp( filename, parent->path, parent->length ) == 0 )
+	    && ( filename[ parent->length ] == '/' )
+	    && ( strcmp( &filename[ parent->length + 1 ], entry->name ) == 0 ) );
+}
+
+
+
+/**
+ * Find the hash chain link that points to the entry for a filename. This
+ * function must be called with the stat cache locked.
+ * @param filename [in] Full filename.
+ * @param hash [in] Hash of the full filename.
+ * @return The link to the entry, or a link to \a NULL if the filename is
+ *         not cached.
+ */
+static struct StatCacheEntry**
+FindEntryLink(
+    const char *filename,
+    uint32_t   hash
+	      )
+{
+    static struct StatCacheEntry *noEntry = NULL;
+    struct StatCacheEntry        **link;
+
+    if( statCache == NULL )
+    {
+        return( &noEntry );
+    }
+    link = &statCache[ hash & ( statCacheBuckets - 1 ) ];
+    while( ( *link != NULL ) && ( ! EntryMatches( *link, filename, hash ) ) )
+    {
+        link = &( *link )->chain;
+    }
+    return( link );
+}
+
+
+
+/**
+ * Find the hash chain link that points to a cached entry. This function
+ * must be called with the stat cache locked.
+ * @param entry [in] The entry.
+ * @return The link to the entry.
+ */
+static struct StatCacheEntry**
+LinkToEntry(
+    const struct StatCacheEntry *entry
+	    )
+{
+    struct StatCacheEntry **link;
+
+    link = &statCache[ entry->hash & ( statCacheBuckets - 1 ) ];
+    while( *link != entry )
+    {
+        link = &( *link )->chain;
+    }
+    return( link );
+}
+
+
+
+/**
+ * Remove an entry from the LRU list. This function must be called with the
+ * stat cache locked.
+ * @param entry [in/out] The entry.
+ * @return Nothing.
+ */
+static void
+UnlinkFromLru(
+    struct StatCacheEntry *entry
+	      )
+{
+    if( entry->older != NULL )
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        oldestEntry = entry->newer;
+    }
+    if( entry->newer != NULL )
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        newestEntry = entry->older;
+    }
+}
+
+
+
+/**
+ * Make an entry the most recently used entry in the LRU list. This function
+ * must be called with the stat cache locked.
+ * @param entry [in/out] The entry, which is not in the list.
+ * @return Nothing.
+ */
+static void
+AppendToLru(
+    struct StatCacheEntry *entry
+	    )
+{
+    entry->older = newestEntry;
+    entry->newer = NULL;
+    if( newestEntry != NULL )
+    {
+        newestEntry->newer = entry;
+    }
+    else
+    {
+        oldestEntry = entry;
+    }
+    newestEntry = entry;
+}
+
+
+
+/**
+ * Remove an entry from the cache and delete it. This function must be
+ * called with the stat cache locked.
+ * @param link [in/out] Hash chain link that points to the entry.
+ * @return Nothing.
+ */
+static void
+RemoveEntry(
+    struct StatCacheEntry **link
+	    )
+{
+    struct StatCacheEntry *entry = *link;
+
+    *link = entry->chain;
+    UnlinkFromLru( entry );
+    statCacheCount--;
+    DestroyEntry( entry );
+}
+
+
+
+/**
+ * Double the number of hash buckets. This function must be called with the
+ * stat cache locked.
+ * @return Nothing.
+ */
+static void
+GrowStatCache(
+    void
+	      )
+{
+    struct StatCacheEntry **newBuckets;
+    struct StatCacheEntry *entry;
+    struct StatCacheEntry *next;
+    size_t                newSize;
+    size_t                i;
+
+    newSize = statCacheBuckets == 0 ? INITIAL_BUCKETS : 2 * statCacheBuckets;
+    newBuckets = calloc( newSize, sizeof( struct StatCacheEntry* ) );
+    assert( newBuckets != NULL );
+    for( i = 0; i < statCacheBuckets; i++ )
+    {
+        for( entry = statCache[ i ]; entry != NULL; entry = next )
+	{
+	    next         = entry->chain;
+	    entry->chain = newBuckets[ entry->hash & ( newSize - 1 ) ];
+	    newBuckets[ entry->hash & ( newSize - 1 ) ] = entry;
+	}
+    }
+    free( statCache );
+    statCache        = newBuckets;
+    statCacheBuckets = newSize;
+}
+
+
 
 /**
  * Search for an entry in the stat cache log based on the filename.
@@ -62,14 +525,12 @@ SearchStatEntry(
     void                  *toReturn = NULL;
 
     pthread_mutex_lock( &mutex_statCache );
-    HASH_FIND_STR( statCache, filename, entry );
+    entry = *FindEntryLink( filename, HashPath( filename, strlen( filename ) ) );
     if( entry != NULL )
     {
-        /* Remove the entry and re-add it, which makes it the last item in
-	   the list. */
-        HASH_DELETE( hh, statCache, entry );
-        HASH_ADD_KEYPTR( hh, statCache, 
-			 entry->filename, strlen( entry->filename ), entry );
+        /* Move the entry to the most recently used end of the list. */
+        UnlinkFromLru( entry );
+	AppendToLru( entry );
 	toReturn = entry->data;
     }
     pthread_mutex_unlock( &mutex_statCache );
@@ -100,21 +561,15 @@ DeleteStatEntry(
     const char                     *filename
 		)
 {
-    struct StatCacheEntry *entry;
+    struct StatCacheEntry **link;
     bool                  deleted = false;
 
     pthread_mutex_lock( &mutex_statCache );
 
-    HASH_FIND_STR( statCache, filename, entry );
-    if( entry != NULL )
+    link = FindEntryLink( filename, HashPath( filename, strlen( filename ) ) );
+    if( *link != NULL )
     {
-        HASH_DEL( statCache, entry );
-	free( (char*) entry->filename );
-	if( entry->dataDeleteFunction != NULL )
-	{
-	    (entry->dataDeleteFunction)( entry->data );
-	}
-	free( entry );
+        RemoveEntry( link );
 	deleted = true;
     }
 
@@ -136,7 +591,7 @@ DeleteStatEntry(
  * Expire the least recently used cache entries until the cache reaches the
  * specified size.
  * @param truncateTo [in] The maximum number of entries in the cache. To use
- *        the MAX_STAT_CACHE_SIZE value, specify -1 for \a truncateTo.
+ *        the configured cache size, specify -1 for \a truncateTo.
  * @return Nothing.
  */
 void
@@ -145,44 +600,33 @@ TruncateCache(
 	      )
 {
     struct StatCacheEntry *entry;
-    struct StatCacheEntry *tmpEntry;
-    int                   cacheSize     = HASH_COUNT( statCache );
-    int                   toDelete;
+    long                  toDelete;
     int                   numberDeleted = 0;
 
+    pthread_mutex_lock( &mutex_statCache );
+
     if( truncateTo != -1 )
     {
-        toDelete = cacheSize - truncateTo;
+        toDelete = statCacheCount - truncateTo;
     }
     else
     {
-        toDelete = cacheSize - MAX_STAT_CACHE_SIZE;
+        toDelete = statCacheCount - maxStatCacheSize;
     }
 
-    if( 0 < toDelete )
+    /* Delete from the beginning of the list where the oldest entries are
+       stored. */
+    while( numberDeleted < toDelete )
     {
-        /* Delete from the beginning of the list where the oldest entries are
-	   stored. */
-        pthread_mutex_lock( &mutex_statCache );
-
-	HASH_ITER( hh, statCache, entry, tmpEntry )
-	{
-	    HASH_DELETE( hh, statCache, entry );
-	    free( (char*) entry->filename );
-	    if( entry->dataDeleteFunction != NULL )
-	    {
-		(entry->dataDeleteFunction)( entry->data );
-	    }
-	    free( entry );
-	    numberDeleted++;
-	    if( numberDeleted == toDelete )
-	    {
-	        break;
-	    }
-	}
+        entry = oldestEntry;
+	RemoveEntry( LinkToEntry( entry ) );
+	numberDeleted++;
+    }
 
-        pthread_mutex_unlock( &mutex_statCache );
+    pthread_mutex_unlock( &mutex_statCache );
 
+    if( 0 < numberDeleted )
+    {
 	Syslog( log_DEBUG, "%d entr%s expired from cache\n",
 		numberDeleted, numberDeleted == 1 ? "y" : "ies" );
     }
@@ -190,6 +634,25 @@ TruncateCache(
 
 
 
+/**
+ * Set the maximum number of entries in the cache, expiring the least
+ * recently used entries if the cache holds more than that.
+ * @param maxEntries [in] The maximum number of entries.
+ * @return Nothing.
+ */
+void
+SetStatCacheSize(
+    long maxEntries
+		 )
+{
+    pthread_mutex_lock( &mutex_statCache );
+    maxStatCacheSize = maxEntries;
+    pthread_mutex_unlock( &mutex_statCache );
+    TruncateCache( -1 );
+}
+
+
+
 /**
  * Add an element to the cache.
  * @param filename [in] Name of the file.
@@ -207,28 +670,94 @@ InsertCacheElement(
     void                           (*deleteFun)(void *)
 		   )
 {
+    struct StatCacheEntry **link;
     struct StatCacheEntry *entry;
-    struct StatCacheEntry *toFind;
-
-    entry = malloc( sizeof( struct StatCacheEntry ) );
-    assert( entry != NULL );
-    entry->filename = strdup( filename );
-    assert( entry->filename != NULL );
-    entry->data = data;
-    entry->dataDeleteFunction = deleteFun;
+    const char            *name;
+    uint32_t              hash = HashPath( filename, strlen( filename ) );
 
+    pthread_mutex_lock( &mutex_statCache );
     /* Ensure that the cache element has not already been inserted by some
        other thread while, e.g., the entry contents were built by the caller. */
-    pthread_mutex_lock( &mutex_statCache );
-    HASH_FIND_STR( statCache, filename, toFind );
-    if( toFind == NULL )
+    link = FindEntryLink( filename, hash );
+    if( *link == NULL )
     {
-        /* Insert the element. */
-        HASH_ADD_KEYPTR( hh, statCache, 
-			 entry->filename, strlen( entry->filename ), entry );
+        name  = strrchr( filename, '/' );
+	entry = AllocateEntry( strlen( name != NULL ? &name[ 1 ] : filename ) );
+	if( name != NULL )
+	{
+	    entry->parent = InternPrefix( filename, name - filename );
+	    strcpy( entry->name, &name[ 1 ] );
+	}
+	else
+	{
+	    entry->parent = NULL;
+	    strcpy( entry->name, filename );
+	}
+	entry->data               = data;
+	entry->dataDeleteFunction = deleteFun;
+	entry->hash               = hash;
+
+	/* Keep the load factor at most 1. */
+	if( statCacheBuckets <= (size_t) statCacheCount )
+	{
+	    GrowStatCache( );
+	}
+	entry->chain = statCache[ hash & ( statCacheBuckets - 1 ) ];
+	statCache[ hash & ( statCacheBuckets - 1 ) ] = entry;
+	AppendToLru( entry );
+	statCacheCount++;
     }
     pthread_mutex_unlock( &mutex_statCache );
     Syslog( log_DEBUG, "Entry added to stat cache\n" );
 
     TruncateCache( -1 );
 }
+
+
+
+/**
+ * Call a function for every entry in the cache, from the least recently used
+ * to the most recently used. The cache is locked while the function is
+ * called, so the function must not access the cache itself.
+ * @param callback [in] Function that is called with the filename and the data
+ *        of each entry.
+ * @param context [in] Passed on to \a callback.
+ * @return Nothing.
+ */
+void
+ForEachStatEntry(
+    void                           (*callback)( const char *filename,
+						void *data, void *context ),
+    void                           *context
+		 )
+{
+    struct StatCacheEntry *entry;
+    char                  *filename = NULL;
+    size_t                filenameSize = 0;
+    size_t                length;
+    size_t                prefixLength;
+
+    pthread_mutex_lock( &mutex_statCache );
+    for( entry = oldestEntry; entry != NULL; entry = entry->newer )
+    {
+        /* Reassemble the full filename from the directory and the name. */
+        prefixLength = entry->parent != NULL ? entry->parent->length + 1 : 0;
+	length       = prefixLength + strlen( entry->name ) + sizeof( char );
+	if( filenameSize < length )
+	{
+	    filenameSize = 2 * length;
+	    free( filename );
+	    filename = malloc( filenameSize );
+	    assert( filename != NULL );
+	}
+	if( entry->parent != NULL )
+	{
+	    memcpy( filename, entry->parent->path, entry->parent->length );
+	    filename[ entry->parent->length ] = '/';
+	}
+	strcpy( &filename[ prefixLength ], entry->name );
+        callback( filename, entry->data, context );
+    }
+    pthread_mutex_unlock( &mutex_statCache );
+    free( filename );
+}
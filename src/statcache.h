@@ -32,6 +32,12 @@ DeleteStatEntry( const char *filename );
 
 void TruncateCache( long );
 
+void SetStatCacheSize( long maxEntries );
+
+void ForEachStatEntry( void (*callback)( const char *filename, void *data,
+					 void *context ),
+		       void *context );
+
 void
 InsertCacheElement(
     const char                     *filename,
@@ -0,0 +1,479 @@
+/**
+ * \file trace.c
+ * \brief Latency trace spans that can be exported in Chrome trace format.
+ *
+ * Each stage of an operation records a span with its start time and its
+ * duration in a ring buffer that is shared by all threads of the process.
+ * When the process receives TRACE_SIGNAL, it writes the spans in the Chrome
+ * trace event format, which chrome://tracing and other flame chart viewers
+ * read. The processes stamp their spans with the same monotonic clock, so
+ * the traces of the file system and the file cache can be viewed together.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+
+/* Number of times a span that is being written is read before it is left
+   out of the trace. */
+#define TRACE_READ_RETRIES 4
+
+
+/* A span is written like a slot in the cache status table: the sequence
+   number is odd while the span is updated, and a reader that sees the same
+   even sequence number before and after copying the span has a consistent
+   copy. */
+struct TraceSpan
+{
+	uint32_t   sequence;
+	uint32_t   thread;
+	const char *category;
+	const char *name;
+	uint64_t   start;
+	uint64_t   duration;
+};
+
+/* Buffered output that is written with write( ), because the trace is
+   written from a signal handler. */
+struct TraceOutput
+{
+	int    fd;
+	int    status;
+	size_t length;
+	char   buffer[ 4096 ];
+};
+
+
+static struct TraceSpan traceSpans[ TRACE_SPANS ];
+static uint64_t         traceNextSpan = 0;
+
+/* Thread ID of each thread, plus one so that 0 means unknown. */
+static pthread_once_t   traceThreadOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t    traceThreadKey;
+
+/* Number of the next trace file that the process writes. */
+static unsigned int     traceFileNumber = 0;
+
+
+
+/**
+ * Create the key for the threads' IDs. This function is called only once.
+ * @return Nothing.
+ */
+static void
+CreateTraceThreadKey(
+	void
+	                 )
+{
+	pthread_key_create( &traceThreadKey, NULL );
+}
+
+
+
+/**
+ * Return the kernel's ID of the calling thread, which is what trace viewers
+ * expect as the thread ID.
+ * @return Thread ID.
+ */
+static uint32_t
+GetTraceThread(
+	void
+	           )
+{
+	uintptr_t thread;
+
+	pthread_once( &traceThreadOnce, CreateTraceThreadKey );
+	thread = (uintptr_t) pthread_getspecific( traceThreadKey );
+	if( thread == 0 )
+	{
+		thread = (uintptr_t) syscall( SYS_gettid ) + 1;
+		pthread_setspecific( traceThreadKey, (void*) thread );
+	}
+	return( thread - 1 );
+}
+
+
+
+/**
+ * Record a span that ends now. This function is called when a TraceScope
+ * goes out of scope, but may also be called directly.
+ * @param scope [in] The span that ends.
+ * @return Nothing.
+ * Test: unit test (test-trace.c).
+ */
+void
+EndTraceScope(
+	struct TraceScope *scope
+	          )
+{
+	uint64_t         end = TraceClock( );
+	uint32_t         thread = GetTraceThread( );
+	uint64_t         index;
+	struct TraceSpan *span;
+	uint32_t         sequence;
+
+	index = __atomic_fetch_add( &traceNextSpan, 1, __ATOMIC_RELAXED );
+	span  = &traceSpans[ index & ( TRACE_SPANS - 1 ) ];
+
+	/* Claim the span by making its sequence number odd. If the ring has
+	   wrapped around and another thread is still writing the span, this
+	   span is dropped rather than mixed with the other. */
+	sequence = __atomic_load_n( &span->sequence, __ATOMIC_RELAXED );
+	if( ( ( sequence & 1 ) != 0 )
+		|| ! __atomic_compare_exchange_n( &span->sequence, &sequence,
+										  sequence + 1, false,
+										  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+	{
+		return;
+	}
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	__atomic_store_n( &span->thread, thread, __ATOMIC_RELAXED );
+	__atomic_store_n( &span->category, scope->category, __ATOMIC_RELAXED );
+	__atomic_store_n( &span->name, scope->name, __ATOMIC_RELAXED );
+	__atomic_store_n( &span->start, scope->start, __ATOMIC_RELAXED );
+	__atomic_store_n( &span->duration, end - scope->start,
+					  __ATOMIC_RELAXED );
+
+	__atomic_store_n( &span->sequence, sequence + 2, __ATOMIC_RELEASE );
+}
+
+
+
+/**
+ * Make a consistent copy of a span.
+ * @param span [in] Span in the ring buffer.
+ * @param copy [out] Copy of the span.
+ * @return \a true if the copy is consistent, or \a false if the span kept
+ *         changing while it was copied.
+ */
+static bool
+ReadTraceSpan(
+	const struct TraceSpan *span,
+	struct TraceSpan       *copy
+	          )
+{
+	uint32_t sequence;
+	int      attempt;
+
+	for( attempt = 0; attempt < TRACE_READ_RETRIES; attempt++ )
+	{
+		sequence = __atomic_load_n( &span->sequence, __ATOMIC_ACQUIRE );
+		if( ( sequence & 1 ) == 0 )
+		{
+			copy->thread   = __atomic_load_n( &span->thread, __ATOMIC_RELAXED );
+			copy->category = __atomic_load_n( &span->category,
+											  __ATOMIC_RELAXED );
+			copy->name     = __atomic_load_n( &span->name, __ATOMIC_RELAXED );
+			copy->start    = __atomic_load_n( &span->start, __ATOMIC_RELAXED );
+			copy->duration = __atomic_load_n( &span->duration,
+											  __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &span->sequence, __ATOMIC_RELAXED )
+				== sequence )
+			{
+				return( sequence != 0 );
+			}
+		}
+	}
+	return( false );
+}
+
+
+
+/**
+ * Write the buffered trace output to its file.
+ * @param output [in/out] Trace output.
+ * @return Nothing.
+ */
+static void
+FlushTraceOutput(
+	struct TraceOutput *output
+	             )
+{
+	size_t  written = 0;
+	ssize_t nBytes;
+
+	while( ( written < output->length ) && ( output->status == 0 ) )
+	{
+		nBytes = write( output->fd, &output->buffer[ written ],
+						output->length - written );
+		if( 0 <= nBytes )
+		{
+			written += nBytes;
+		}
+		else if( errno != EINTR )
+		{
+			output->status = -errno;
+		}
+	}
+	output->length = 0;
+}
+
+
+
+/**
+ * Append a string to the trace output.
+ * @param output [in/out] Trace output.
+ * @param string [in] String to append.
+ * @return Nothing.
+ */
+static void
+AppendTraceString(
+	struct TraceOutput *output,
+	const char         *string
+	              )
+{
+	while( *string != '\0' )
+	{
+		if( output->length == sizeof( output->buffer ) )
+		{
+			FlushTraceOutput( output );
+		}
+		output->buffer[ output->length++ ] = *string++;
+	}
+}
+
+
+
+/**
+ * Format a number in decimal without the help of the stdio functions, which
+ * may not be called from a signal handler.
+ * @param value [in] Number.
+ * @param digits [out] Buffer of at least 21 bytes for the digits.
+ * @return \a digits.
+ */
+static const char*
+FormatTraceNumber(
+	uint64_t value,
+	char     *digits
+	              )
+{
+	char reversed[ 20 ];
+	int  length = 0;
+	int  i;
+
+	do
+	{
+		reversed[ length++ ] = '0' + value % 10;
+		value /= 10;
+	} while( value != 0 );
+	for( i = 0; i < length; i++ )
+	{
+		digits[ i ] = reversed[ length - 1 - i ];
+	}
+	digits[ length ] = '\0';
+	return( digits );
+}
+
+
+
+/**
+ * Append a time in nanoseconds to the trace output as microseconds, which is
+ * the unit of Chrome trace events.
+ * @param output [in/out] Trace output.
+ * @param nanoseconds [in] Time.
+ * @return Nothing.
+ */
+static void
+AppendTraceMicroseconds(
+	struct TraceOutput *output,
+	uint64_t           nanoseconds
+	                    )
+{
+	char digits[ 21 ];
+	char fraction[ 5 ];
+
+	AppendTraceString( output,
+					   FormatTraceNumber( nanoseconds / 1000, digits ) );
+	fraction[ 0 ] = '.';
+	fraction[ 1 ] = '0' + ( nanoseconds / 100 ) % 10;
+	fraction[ 2 ] = '0' + ( nanoseconds / 10 ) % 10;
+	fraction[ 3 ] = '0' + nanoseconds % 10;
+	fraction[ 4 ] = '\0';
+	AppendTraceString( output, fraction );
+}
+
+
+
+/**
+ * Write the recorded spans to a file in Chrome trace event format. The
+ * function may be called from a signal handler.
+ * @param fd [in] File descriptor of the file.
+ * @return 0 on success, or \a -errno on failure.
+ * Test: unit test (test-trace.c).
+ */
+int
+WriteTrace(
+	int fd
+	       )
+{
+	struct TraceOutput output;
+	struct TraceSpan   span;
+	uint64_t           next;
+	uint64_t           index;
+	char               pid[ 21 ];
+	char               thread[ 21 ];
+
+	output.fd     = fd;
+	output.status = 0;
+	output.length = 0;
+	FormatTraceNumber( getpid( ), pid );
+
+	AppendTraceString( &output, "{\"traceEvents\":[\n"
+					   "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" );
+	AppendTraceString( &output, pid );
+	AppendTraceString( &output, ",\"args\":{\"name\":\"" );
+	AppendTraceString( &output, program_invocation_short_name );
+	AppendTraceString( &output, "\"}}" );
+
+	next  = __atomic_load_n( &traceNextSpan, __ATOMIC_ACQUIRE );
+	index = ( TRACE_SPANS < next ) ? next - TRACE_SPANS : 0;
+	for( ; index < next; index++ )
+	{
+		/* Spans that are being written are left out. */
+		if( ! ReadTraceSpan( &traceSpans[ index & ( TRACE_SPANS - 1 ) ],
+							 &span ) )
+		{
+			continue;
+		}
+		AppendTraceString( &output, ",\n{\"cat\":\"" );
+		AppendTraceString( &output, span.category );
+		AppendTraceString( &output, "\",\"name\":\"" );
+		AppendTraceString( &output, span.name );
+		AppendTraceString( &output, "\",\"ph\":\"X\",\"pid\":" );
+		AppendTraceString( &output, pid );
+		AppendTraceString( &output, ",\"tid\":" );
+		AppendTraceString( &output, FormatTraceNumber( span.thread, thread ) );
+		AppendTraceString( &output, ",\"ts\":" );
+		AppendTraceMicroseconds( &output, span.start );
+		AppendTraceString( &output, ",\"dur\":" );
+		AppendTraceMicroseconds( &output, span.duration );
+		AppendTraceString( &output, "}" );
+	}
+	AppendTraceString( &output, "\n],\"displayTimeUnit\":\"ms\"}\n" );
+	FlushTraceOutput( &output );
+
+	return( output.status );
+}
+
+
+
+/**
+ * Write the recorded spans to a new file in TRACE_DIRECTORY, named
+ * aws-s3fs-trace-<pid>-<n>.json. The function may be called from a signal
+ * handler.
+ * @return Nothing.
+ * Test: none.
+ */
+void
+WriteTraceFile(
+	void
+	           )
+{
+	char path[ sizeof( TRACE_DIRECTORY ) + 64 ];
+	char digits[ 21 ];
+	int  fd;
+	int  attempt;
+
+	/* Never overwrite a file, which might be a link planted by someone
+	   else. */
+	for( attempt = 0; attempt < 100; attempt++ )
+	{
+		strcpy( path, TRACE_DIRECTORY "/aws-s3fs-trace-" );
+		strcat( path, FormatTraceNumber( getpid( ), digits ) );
+		strcat( path, "-" );
+		strcat( path, FormatTraceNumber(
+					__atomic_fetch_add( &traceFileNumber, 1,
+										__ATOMIC_RELAXED ), digits ) );
+		strcat( path, ".json" );
+		fd = open( path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+				   0600 );
+		if( 0 <= fd )
+		{
+			(void) WriteTrace( fd );
+			close( fd );
+			return;
+		}
+		if( errno != EEXIST )
+		{
+			return;
+		}
+	}
+}
+
+
+
+/**
+ * Write the trace when the process receives TRACE_SIGNAL.
+ * @param signal [in] Unused.
+ * @return Nothing.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void
+TraceSignalHandler(
+	int signal
+	               )
+{
+	int savedErrno = errno;
+
+	WriteTraceFile( );
+	errno = savedErrno;
+}
+#pragma GCC diagnostic pop
+
+
+
+/**
+ * Make the process write its trace whenever it receives TRACE_SIGNAL.
+ * @return 0 on success, or \a -errno on failure.
+ * Test: none.
+ */
+int
+RegisterTraceSignal(
+	void
+	                )
+{
+	struct sigaction sigAction;
+
+	memset( &sigAction, 0, sizeof( sigAction ) );
+	sigAction.sa_handler = TraceSignalHandler;
+	/* Do not interrupt the system calls of the thread that takes the
+	   signal. */
+	sigAction.sa_flags = SA_RESTART;
+	sigemptyset( &sigAction.sa_mask );
+	if( sigaction( TRACE_SIGNAL, &sigAction, NULL ) < 0 )
+	{
+		return( -errno );
+	}
+	return( 0 );
+}
@@ -0,0 +1,81 @@
+/**
+ * \file trace.h
+ * \brief Latency trace spans that can be exported in Chrome trace format.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+
+#include <config.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/* Directory in which a process writes its trace when it receives
+   TRACE_SIGNAL. */
+#define TRACE_DIRECTORY "/tmp"
+#define TRACE_SIGNAL    SIGUSR1
+
+/* Number of spans that are kept, which must be a power of two. Older spans
+   are overwritten. */
+#define TRACE_SPANS     8192
+
+
+/* A span that is being timed. */
+struct TraceScope
+{
+	const char *category;
+	const char *name;
+	uint64_t   start;
+};
+
+
+/**
+ * Read the monotonic clock that trace spans are stamped with.
+ * @return Nanoseconds since an arbitrary point in time, which is the same
+ *         for all processes.
+ */
+static inline uint64_t
+TraceClock(
+	void
+	       )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return( (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec );
+}
+
+
+/* Time the rest of the enclosing block as a span. The category and the name
+   are not copied, so they must be string literals. */
+#define TRACE_SCOPE( category, name )									\
+	struct TraceScope traceScope __attribute__(( cleanup( EndTraceScope ) )) \
+		= { ( category ), ( name ), TraceClock( ) }
+
+
+void EndTraceScope( struct TraceScope *scope );
+int WriteTrace( int fd );
+void WriteTraceFile( void );
+int RegisterTraceSignal( void );
+
+
+#endif /* __TRACE_H */
@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -119,3 +120,34 @@ SocketReceiveDatagramFromServer(
 {
     return( 0 );
 }
+
+
+
+int
+SocketSendCacheMessage(
+    int        socketFd,
+	int        opcode,
+	uint32_t   requestId,
+	int        status,
+	const void *fields,
+	size_t     fieldsLength,
+	const char *tail,
+	int        fileHandle
+	                   )
+{
+	return( 0 );
+}
+
+
+
+int
+SocketReceiveCacheMessage(
+    int                       socketFd,
+	struct CacheMessageHeader *header,
+	char                      *payload,
+	size_t                    size,
+	int                       *fileHandle
+	                      )
+{
+	return( -ENOTCONN );
+}
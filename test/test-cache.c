@@ -22,8 +22,13 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "aws-s3fs.h"
 #include "statcache.h"
+#include "dircache.h"
+#include "cachesnapshot.h"
 #include "testfunctions.h"
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -35,6 +40,8 @@ static void test_AddEntry( const char *parms );
 static void test_FindEntry( const char *parms );
 static void test_Overfill( const char *parms );
 static void test_DeleteEntry( const char *parms );
+static void test_CacheSnapshot( const char *parms );
+static void test_MemoryPerEntry( const char *parms );
 
 
 const struct dispatchTable dispatchTable[ ] =
@@ -43,6 +50,8 @@ const struct dispatchTable dispatchTable[ ] =
     { "FindEntry", test_FindEntry },
     { "Overfill", test_Overfill },
     { "DeleteEntry", test_DeleteEntry },
+    { "CacheSnapshot", test_CacheSnapshot },
+    { "MemoryPerEntry", test_MemoryPerEntry },
     { NULL, NULL }
 };
 
@@ -214,3 +223,138 @@ void test_DeleteEntry( const char *parms )
     CloseLog( );
 }
 
+
+
+void test_CacheSnapshot( const char *parms )
+{
+    struct S3FileInfo file;
+    struct S3FileInfo link;
+    struct S3FileInfo *found;
+    char              **contents;
+    char              **listing;
+    int               size;
+    int               i;
+    const char        *snapshotFile = "cache.snapshot";
+
+    InitLogging( );
+    DisableLogging( );
+    InitializeDirectoryCache( );
+
+    memset( &file, 0, sizeof( struct S3FileInfo ) );
+    file.uid         = 1000;
+    file.gid         = 100;
+    file.permissions = 0644;
+    file.fileType    = 'f';
+    file.size        = 1234;
+    file.mtime       = 1350000000;
+    memset( &link, 0, sizeof( struct S3FileInfo ) );
+    link.fileType      = 'l';
+    link.symlinkTarget = "file";
+    InsertCacheElement( "/dir/file", &file, NULL );
+    InsertCacheElement( "/dir/link", &link, NULL );
+    contents = malloc( 2 * sizeof( char* ) );
+    contents[ 0 ] = strdup( "file" );
+    contents[ 1 ] = strdup( "link" );
+    InsertInDirectoryCache( strdup( "/dir" ), 2, (const char**) contents );
+
+    printf( "1: %d\n", WriteCacheSnapshot( snapshotFile, "bucket:/",
+					    CollectCacheSnapshot( ) ) );
+    printf( "2: %d\n", OpenCacheSnapshot( snapshotFile, "other:/" ) );
+    printf( "3: %d\n", OpenCacheSnapshot( snapshotFile, "bucket:/" ) );
+
+    found = LookupStatSnapshot( "/dir/file" );
+    printf( "4: %d %d %o %c %lld %ld\n", found->uid, found->gid,
+	    found->permissions, found->fileType, (long long) found->size,
+	    (long) found->mtime );
+    FreeS3FileInfo( found );
+    found = LookupStatSnapshot( "/dir/file" );
+    printf( "5: %s\n", found == NULL ? "consumed" : "found" );
+    found = LookupStatSnapshot( "/dir/link" );
+    printf( "6: %s\n", found->symlinkTarget );
+    FreeS3FileInfo( found );
+    found = LookupStatSnapshot( "/dir/missing" );
+    printf( "7: %s\n", found == NULL ? "missing" : "found" );
+
+    listing = LookupDirectorySnapshot( "/dir", &size );
+    printf( "8: %d", size );
+    for( i = 0; i < size; i++ )
+    {
+        printf( " %s", listing[ i ] );
+	free( listing[ i ] );
+    }
+    printf( "\n" );
+    free( listing );
+    listing = LookupDirectorySnapshot( "/dir", &size );
+    printf( "9: %s\n", listing == NULL ? "consumed" : "found" );
+
+    CloseCacheSnapshot( );
+    ShutdownDirectoryCache( );
+    unlink( snapshotFile );
+    CloseLog( );
+}
+
+
+static void DeleteFileInfo( void *fileInfo )
+{
+    FreeS3FileInfo( fileInfo );
+}
+
+
+static long ResidentBytes( void )
+{
+    FILE *statm;
+    long size;
+    long resident = 0;
+
+    statm = fopen( "/proc/self/statm", "r" );
+    if( statm != NULL )
+    {
+        if( fscanf( statm, "%ld %ld", &size, &resident ) != 2 )
+	{
+	    resident = 0;
+	}
+	fclose( statm );
+    }
+    return( resident * sysconf( _SC_PAGESIZE ) );
+}
+
+
+/* Cache a large number of files in a few hundred directories, as after
+   listing a big bucket, and report the memory used per entry. */
+void test_MemoryPerEntry( const char *parms )
+{
+    long              entries;
+    long              i;
+    long              before;
+    long              after;
+    char              filename[ 80 ];
+    struct S3FileInfo *fileInfo;
+
+    entries = atol( parms );
+    InitLogging( );
+    DisableLogging( );
+    SetStatCacheSize( entries );
+
+    /* Warm up the allocators so that their own overhead is not counted. */
+    fileInfo = AllocateS3FileInfo( );
+    InsertCacheElement( "/warm-up", fileInfo, &DeleteFileInfo );
+
+    before = ResidentBytes( );
+    for( i = 0; i < entries; i++ )
+    {
+        sprintf( filename, "/photos/2012/album-%03ld/IMG_%06ld.JPG",
+		 i / 1000, i );
+	fileInfo = AllocateS3FileInfo( );
+	fileInfo->fileType    = 'f';
+	fileInfo->permissions = 0644;
+	fileInfo->size        = 2000000 + i;
+	InsertCacheElement( filename, fileInfo, &DeleteFileInfo );
+    }
+    after = ResidentBytes( );
+
+    printf( "Entries: %ld\n", entries );
+    printf( "Bytes per entry: %ld\n", ( after - before ) / entries );
+
+    TruncateCache( 0 );
+    CloseLog( );
+}
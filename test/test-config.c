@@ -38,11 +38,13 @@ extern void CopyDefaultString( char **, const char * );
 
 void test_InitializeConfiguration( const char * );
 void test_ConfigSetRegion( const char * );
+void test_ConfigSetChecksum( const char * );
 void test_ConfigSetPath( const char * );
 void test_ConfigSetKey( const char * );
 void test_ExtractKey( const char * );
 void test_CopyDefaultString( const char * );
 void test_Configure( const char * );
+void test_ReadConfigFile( const char * );
 
 void DoNotDaemonize( void ) { }
 
@@ -54,11 +56,13 @@ const struct dispatchTable dispatchTable[ ] =
 {
     { "InitializeConfiguration", &test_InitializeConfiguration },
     { "ConfigSetRegion", &test_ConfigSetRegion },
+    { "ConfigSetChecksum", &test_ConfigSetChecksum },
     { "ConfigSetPath", &test_ConfigSetPath },
     { "ConfigSetKey", &test_ConfigSetKey },
     { "ExtractKey", &test_ExtractKey },
     { "CopyDefaultString", &test_CopyDefaultString },
     { "Configure", &test_Configure },
+    { "ReadConfigFile", &test_ReadConfigFile },
     { NULL, NULL }
 };
 
@@ -94,6 +98,19 @@ void test_InitializeConfiguration( const char *parms )
     printf( "logfile: %s vs %s\n", config.logfile, DEFAULT_LOG_FILE );
     printf( "verbose.value: %d vs %d\n", config.verbose.value, DEFAULT_VERBOSE );
     printf( "verbose.isset: %d vs %d\n", config.verbose.isset, false );
+    printf( "entryTimeout: %d vs %d\n", config.entryTimeout,
+	    DEFAULT_ENTRY_TIMEOUT );
+    printf( "attrTimeout: %d vs %d\n", config.attrTimeout,
+	    DEFAULT_ATTR_TIMEOUT );
+    printf( "negativeTimeout: %d vs %d\n", config.negativeTimeout,
+	    DEFAULT_NEGATIVE_TIMEOUT );
+    printf( "cacheSnapshot: %s\n",
+	    config.cacheSnapshot == NULL ? "(null)" : config.cacheSnapshot );
+    printf( "snapshotInterval: %d vs %d\n", config.snapshotInterval,
+	    DEFAULT_SNAPSHOT_INTERVAL );
+    printf( "statCacheSize: %ld vs %ld\n", config.statCacheSize,
+	    MAX_STAT_CACHE_SIZE );
+    printf( "checksum: %d vs %d\n", config.checksum, CHECKSUM_MD5 );
 }
 
 
@@ -122,6 +139,21 @@ void test_ConfigSetRegion( const char *parms )
 }
 
 
+void test_ConfigSetChecksum( const char *parms )
+{
+    enum ChecksumModes checksum = CHECKSUM_MD5;
+    bool configError = false;
+
+    ConfigSetChecksum( &checksum, "CRC32C", &configError );
+    printf( "1: %d %d\n", checksum, configError );
+    ConfigSetChecksum( &checksum, "crc64", &configError );
+    printf( "2: %d %d\n", checksum, configError );
+    configError = false;
+    ConfigSetChecksum( &checksum, "md5", &configError );
+    printf( "3: %d %d\n", checksum, configError );
+}
+
+
 void test_ConfigSetPath( const char *parms )
 {
     char *path = NULL;
@@ -268,3 +300,30 @@ void test_Configure( const char *parms )
     PrintConfig( testNumber, &cmdlineConfig, configuration.verbose.value );
     ReleaseConfig( &cmdlineConfig );
 }
+
+
+
+void test_ReadConfigFile( const char *parms )
+{
+    struct Configuration config;
+    bool                 success;
+
+    /* All the timeouts are set. */
+    InitializeConfiguration( &config );
+    success = ReadConfigFile( "../../testdata/config-5.conf", &config );
+    printf( "1: %d %d %d %d\n", config.entryTimeout, config.attrTimeout,
+	    config.negativeTimeout, success );
+
+    /* A negative timeout is rejected and leaves the default in place,
+       while the other timeouts are still read. */
+    InitializeConfiguration( &config );
+    success = ReadConfigFile( "../../testdata/config-6.conf", &config );
+    printf( "2: %d %d %d %d\n", config.entryTimeout, config.attrTimeout,
+	    config.negativeTimeout, success );
+
+    /* Timeouts that are not in the file keep their defaults. */
+    InitializeConfiguration( &config );
+    success = ReadConfigFile( "../../testdata/config-3.conf", &config );
+    printf( "3: %d %d %d %d\n", config.entryTimeout, config.attrTimeout,
+	    config.negativeTimeout, success );
+}
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include "aws-s3fs.h"
 #include "filecache.h"
+#include "socket.h"
 #include "testfunctions.h"
 
 
@@ -113,7 +114,8 @@ int s3_SubmitS3Request( S3COMM *handle, const char *httpVerb,
 	return( 0 );
 }
 /* Dummy function for testing. */
-int ReadEntireMessage( int connectionHandle, char **clientMessage )
+int ReadClientMessage( int connectionHandle, struct CacheMessageHeader *header,
+					   char *payload )
 {
 	return( 0 );
 }
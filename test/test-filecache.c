@@ -23,12 +23,15 @@
 #include <config.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sqlite3.h>
 #include "aws-s3fs.h"
 #include "filecache.h"
+#include "socket.h"
+#include "cachestatus.h"
 #include "testfunctions.h"
 
 
@@ -39,14 +42,17 @@ struct Configuration globalConfig;
 
 struct CacheClientConnection
 {
-	int       connectionHandle;
-	pthread_t thread;
-	pid_t     pid;
-	uid_t     uid;
-	gid_t     gid;
-	char      *bucket;
-	char      keyId[ 21 ];
-	char      secretKey[ 41 ];
+	int             connectionHandle;
+	pthread_t       thread;
+	pid_t           pid;
+	uid_t           uid;
+	gid_t           gid;
+	char            *bucket;
+	char            keyId[ 21 ];
+	char            secretKey[ 41 ];
+	pthread_mutex_t sendMutex;
+	bool            closed;
+	int             references;
 };
 
 
@@ -63,20 +69,25 @@ extern sqlite3_int64 CreateLocalFile( const char *bucket, const char *path,
 									  time_t mtime, sqlite3_int64 parentId,
 									  char **localfile );
 extern int ClientConnects( struct CacheClientConnection *clientConnection,
-						   const char *request );
+						   const struct CacheMessageHeader *request,
+						   const char *payload );
 extern int ClientRequestsCreate( struct CacheClientConnection *clientConnection,
-								 const char *request );
+								 const struct CacheMessageHeader *request,
+								 const char *payload );
 extern int ClientRequestsLocalFilename(
-	struct CacheClientConnection *clientConnection, const char *request );
-extern void *ReceiveRequests( void *data );
+	struct CacheClientConnection *clientConnection,
+	const struct CacheMessageHeader *request, const char *payload );
+extern int ServeClientRequest( struct CacheClientConnection *clientConnection );
 extern int CommandDispatcher( struct CacheClientConnection *clientConnection,
-							  const char *message );
+							  const struct CacheMessageHeader *request,
+							  const char *payload );
 void FillDatabase( void );
 
 static void test_InitializeFileCacheDatabase( const char *param );
 static void test_FindFile( const char *param );
 static void test_FindParent( const char *param );
 static void test_GetLocalPathQuery( const char *param );
+static void test_CacheStatusTable( const char *param );
 static void test_CreateLocalFileQuery( const char *param );
 static void test_CreateLocalDirQuery( const char *param );
 static void test_GetDownload( const char *param );
@@ -87,7 +98,7 @@ static void test_CreateLocalDir( const char *param );
 static void test_CreateLocalFile( const char *param );
 static void test_ClientConnects( const char *param );
 static void test_ClientRequestsCreate( const char *param );
-static void test_ReceiveRequests( const char *param );
+static void test_ServeClientRequest( const char *param );
 static void test_CommandDispatcher( const char *param );
 static void test_ClientRequestsLocalFilename( const char *param );
 static void test_AddUploadQuery( const char *param );
@@ -96,6 +107,7 @@ static void test_GetUpload( const char *param );
 static void test_SetUploadId( const char *param );
 static void test_AllPartsUploaded( const char *param );
 static void test_PartETag( const char *param );
+static void test_FileChecksum( const char *param );
 static void test_FindPendingUpload( const char *param );
 
 
@@ -108,6 +120,7 @@ const struct dispatchTable dispatchTable[ ] =
 	DISPATCHENTRY( FindFile ),
 	DISPATCHENTRY( FindParent ),
 	DISPATCHENTRY( GetLocalPathQuery ),
+	DISPATCHENTRY( CacheStatusTable ),
 	DISPATCHENTRY( CreateLocalFileQuery ),
 	DISPATCHENTRY( CreateLocalDirQuery ),
 	DISPATCHENTRY( GetDownload ),
@@ -119,6 +132,7 @@ const struct dispatchTable dispatchTable[ ] =
 	DISPATCHENTRY( SetUploadId ),
 	DISPATCHENTRY( AllPartsUploaded ),
 	DISPATCHENTRY( PartETag ),
+	DISPATCHENTRY( FileChecksum ),
 	DISPATCHENTRY( FindPendingUpload ),
 
 	DISPATCHENTRY( TrimString ),
@@ -127,7 +141,7 @@ const struct dispatchTable dispatchTable[ ] =
 	DISPATCHENTRY( ClientConnects ),
 	DISPATCHENTRY( ClientRequestsCreate ),
 	DISPATCHENTRY( ClientRequestsLocalFilename ),
-	DISPATCHENTRY( ReceiveRequests ),
+	DISPATCHENTRY( ServeClientRequest ),
 	DISPATCHENTRY( CommandDispatcher ),
 
     { NULL, NULL }
@@ -245,15 +259,17 @@ static void test_GetDownload( const char *param )
 	char          *localPath = NULL;
 	char          *keyId = NULL;
 	char          *secretKey = NULL;
+	enum ChecksumModes checksum;
 
 	FillDatabase( );
 
 	status = Query_GetDownload( 2, &bucket, &remotePath, &localPath,
-								&keyId, &secretKey );
+								&keyId, &secretKey, &checksum );
 	printf( "1: %d - %s, %s, %s, %s, %s\n", status, bucket, remotePath,
 			localPath, keyId, secretKey );
+	printf( "1: checksum %d\n", checksum );
 	status = Query_GetDownload( 1, &bucket, &remotePath, &localPath,
-								&keyId, &secretKey );
+								&keyId, &secretKey, &checksum );
 	printf( "2: %d - %s, %s, %s, %s, %s\n", status, bucket, remotePath,
 			localPath, keyId, secretKey );
 }
@@ -389,22 +405,103 @@ static void test_CreateLocalFile( const char *param )
 
 
 
+/* Compose a message as it would be received from a client. */
+static void BuildRequest( struct CacheMessageHeader *header, char *payload,
+						  int opcode, const void *fields, size_t fieldsLength,
+						  const char *tail )
+{
+	header->version   = CACHE_PROTOCOL_VERSION;
+	header->opcode    = opcode;
+	header->requestId = 1;
+	header->status    = 0;
+	header->length    = fieldsLength + strlen( tail );
+	memcpy( payload, fields, fieldsLength );
+	strcpy( &payload[ fieldsLength ], tail );
+}
+
+
+
+static void BuildConnectRequest( struct CacheMessageHeader *header,
+								 char *payload, const char *bucket,
+								 const char *keyId, const char *secretKey )
+{
+	struct CacheConnectRequest connect;
+
+	strncpy( connect.keyId, keyId, sizeof( connect.keyId ) );
+	strncpy( connect.secretKey, secretKey, sizeof( connect.secretKey ) );
+	connect.checksum = CHECKSUM_MD5;
+	BuildRequest( header, payload, CACHE_CONNECT,
+				  &connect, sizeof( connect ), bucket );
+}
+
+
+
+static void BuildCreateRequest( struct CacheMessageHeader *header,
+								char *payload, const char *path )
+{
+	struct CacheCreateRequest create =
+	{
+		.parentUid = 1001, .parentGid = 1002, .parentPermissions = 0755,
+		.uid = 1000, .gid = 1003, .permissions = 0644, .mtime = 100
+	};
+
+	BuildRequest( header, payload, CACHE_CREATE,
+				  &create, sizeof( create ), path );
+}
+
+
+
+static int PrintUserCallback( void *dummy, int columns, char **data,
+							  char **names )
+{
+	printf( "%s %s\n", data[ 0 ], data[ 1 ] );
+	return( 0 );
+}
+
+
+
 static void test_ClientConnects( const char *param )
 {
 	struct CacheClientConnection clientConnection;
+	struct CacheMessageHeader    header;
+	char                         payload[ CACHE_MAX_PAYLOAD + 1 ];
 
 	FillDatabase( );
 	CompileRegexes( );
+	memset( &clientConnection, 0, sizeof( clientConnection ) );
+	clientConnection.uid = 1000;
+	pthread_mutex_init( &clientConnection.sendMutex, NULL );
 
 	printf( "1: " );
-	ClientConnects( &clientConnection, " bucketname : 1000 : aAzZ56789+1/34567890 : 123/5+7aAzZ23456789012345678901234567890 " );
+	BuildConnectRequest( &header, payload, "bucketname", "aAzZ56789+1/34567890", "123/5+7aAzZ23456789012345678901234567890" );
+	ClientConnects( &clientConnection, &header, payload );
 	printf( "1: %s, %s:%s\n", clientConnection.bucket, clientConnection.keyId, clientConnection.secretKey );
 	printf( "2: " );
-	ClientConnects( &clientConnection, " bucketname : 1001: 2345678901234567890 : 1234567890123456789012345678901234567890 " );
+	BuildConnectRequest( &header, payload, "bucketname", "2345678901234567890", "1234567890123456789012345678901234567890" );
+	ClientConnects( &clientConnection, &header, payload );
 	printf( "3: " );
-	ClientConnects( &clientConnection, " bucketname : 1002: 12345678901234567890 : 12345678901234567890123456789012345678901 " );
+	BuildConnectRequest( &header, payload, "bucketname", "12345678901234567890", "1234567890123456789012345678901234567890" );
+	header.length = sizeof( struct CacheConnectRequest ) - 1;
+	ClientConnects( &clientConnection, &header, payload );
 	printf( "4: " );
-	ClientConnects( &clientConnection, " bucketname : 1003 : 12345678901234567890 ; 1234567890123456789012345678901234567890 " );
+	BuildConnectRequest( &header, payload, "bucket;name", "12345678901234567890", "1234567890123456789012345678901234567890" );
+	ClientConnects( &clientConnection, &header, payload );
+	/* Connecting again with another key replaces the user's key. */
+	printf( "5: " );
+	BuildConnectRequest( &header, payload, "bucketname", "bAzZ56789+1/34567890", "123/5+7aAzZ23456789012345678901234567890" );
+	ClientConnects( &clientConnection, &header, payload );
+	printf( "5: " );
+	sqlite3_exec( GetCacheDatabase( ),
+				  "SELECT uid, keyid FROM users WHERE uid = 1000;",
+				  PrintUserCallback, NULL, NULL );
+	/* Another user's connection cannot replace the first user's key. */
+	printf( "6: " );
+	clientConnection.uid = 1001;
+	BuildConnectRequest( &header, payload, "bucketname", "cAzZ56789+1/34567890", "123/5+7aAzZ23456789012345678901234567890" );
+	ClientConnects( &clientConnection, &header, payload );
+	sqlite3_exec( GetCacheDatabase( ),
+				  "SELECT uid, keyid FROM users WHERE uid IN ( 1000, 1001 );",
+				  PrintUserCallback, NULL, NULL );
 }
 
 
@@ -465,14 +562,19 @@ static void PrintFileFromDatabase( const char *remotename )
 static void test_ClientRequestsCreate( const char *param )
 {
 	struct CacheClientConnection clientConnection;
+	struct CacheMessageHeader    header;
+	char                         payload[ CACHE_MAX_PAYLOAD + 1 ];
 
 	FillDatabase( );
 	CompileRegexes( );
 
+	memset( &clientConnection, 0, sizeof( clientConnection ) );
+	pthread_mutex_init( &clientConnection.sendMutex, NULL );
 	clientConnection.bucket = "bucketname";
 
 	printf( "1: " );
-	ClientRequestsCreate( &clientConnection, " 1001:1002:493:1000:1003:420:100:http://remotetest1" );
+	BuildCreateRequest( &header, payload, "http://remotetest1" );
+	ClientRequestsCreate( &clientConnection, &header, payload );
 	printf( "1: " );
 	PrintFileFromDatabase( "http://remotetest1" );
 }
@@ -480,58 +582,66 @@ static void test_ClientRequestsCreate( const char *param )
 
 
 /* Simulation function. */
-int ReadEntireMessage( int connectionHandle, char **clientMessage )
+int ReadClientMessage( int connectionHandle, struct CacheMessageHeader *header,
+					   char *payload )
 {
 	static int messageNumber = 0;
-	char       *message;
-	char       *messages[ ] =
-	{
-		"CONNECT bucketname:1000:12345678901234567890:1234567890123456789012345678901234567890",
-		"CREATE 1001:1002:493:1000:1003:420:100:http://remotetest1",
-		"DISCONNECT",
-		NULL
-	};
-
-	message = messages[ messageNumber++ ];
 
-	if( *clientMessage != NULL )
-	{
-		*clientMessage = strdup( message );
-		return( strlen( message ) );
-	}
-	else
+	switch( messageNumber++ )
 	{
-		*clientMessage = NULL;
-		return( -1 );
+		case 0:
+			BuildConnectRequest( header, payload, "bucketname", "12345678901234567890",
+								 "1234567890123456789012345678901234567890" );
+			return( header->length );
+		case 1:
+			BuildCreateRequest( header, payload, "http://remotetest1" );
+			return( header->length );
+		default:
+			/* A client that speaks the old text protocol. */
+			memcpy( header, "CONNECT bucketname", sizeof( *header ) );
+			return( -EPROTO );
 	}
 }
 
 
-static void test_ReceiveRequests( const char *param )
+static void test_ServeClientRequest( const char *param )
 {
 	struct CacheClientConnection clientConnection;
-	pthread_t                    thread;
+	int                          status;
 
 	FillDatabase( );
 	CompileRegexes( );
 
-	/* The function uses the simulated ReceiveAllMessages function, above. */
-	pthread_create( &thread, NULL, ReceiveRequests, &clientConnection );
-	pthread_join( thread, NULL );
+	memset( &clientConnection, 0, sizeof( clientConnection ) );
+	pthread_mutex_init( &clientConnection.sendMutex, NULL );
+	clientConnection.references = 1;
+
+	/* The function uses the simulated ReadClientMessage function, above. */
+	do
+	{
+		status = ServeClientRequest( &clientConnection );
+	} while( 0 <= status );
+	printf( "Status: %d\n", status );
 }
 
 
 static void test_CommandDispatcher( const char *param )
 {
 	struct CacheClientConnection clientConnection;
+	struct CacheMessageHeader    header;
+	char                         payload[ CACHE_MAX_PAYLOAD + 1 ];
 	int                          status;
 
 	FillDatabase( );
 	CompileRegexes( );
+	memset( &clientConnection, 0, sizeof( clientConnection ) );
+	pthread_mutex_init( &clientConnection.sendMutex, NULL );
 
-	status = CommandDispatcher( &clientConnection, "CONNECT bucketname:1000:12345678901234567890:1234567890123456789012345678901234567890" );
+	BuildConnectRequest( &header, payload, "bucketname", "12345678901234567890", "1234567890123456789012345678901234567890" );
+	status = CommandDispatcher( &clientConnection, &header, payload );
 	printf( "1: Status: %d\n", status );
-	status = CommandDispatcher( &clientConnection, "And now for something completely different" );
+	BuildRequest( &header, payload, 99, NULL, 0, "And now for something completely different" );
+	status = CommandDispatcher( &clientConnection, &header, payload );
 	printf( "2: Status: %d\n", status );
 }
 
@@ -552,17 +662,58 @@ static void test_GetLocalPathQuery( const char *param )
 
 
 
+static void PrintCacheStatus( int testNumber, const char *remotename )
+{
+	struct CacheStatus status;
+
+	if( LookupCacheStatus( remotename, &status ) )
+	{
+		printf( "%d: id=%d, path=%s, cached=%d, generation=%d\n", testNumber,
+				(int) status.fileId, status.localpath, status.iscached,
+				(int) status.generation );
+	}
+	else
+	{
+		printf( "%d: not published\n", testNumber );
+	}
+}
+
+
+
+static void test_CacheStatusTable( const char *param )
+{
+	char localfile[ 10 ];
+
+	FillDatabase( );
+	printf( "Open: %d\n", OpenCacheStatusTable( ) );
+
+	PrintCacheStatus( 1, "http://remote1" );
+	(void) FindFile( "http://remote1", localfile );
+	PrintCacheStatus( 2, "http://remote1" );
+	Query_MarkFileAsCached( 1 );
+	PrintCacheStatus( 3, "http://remote1" );
+	PrintCacheStatus( 4, "http://remote5" );
+
+	CloseCacheStatusTable( );
+}
+
+
+
 static void test_ClientRequestsLocalFilename( const char *param )
 {
 	struct CacheClientConnection clientConnection;
+	struct CacheMessageHeader    header;
+	char                         payload[ CACHE_MAX_PAYLOAD + 1 ];
 
 	FillDatabase( );
 	CompileRegexes( );
 
 	printf( "1: " );
-	ClientRequestsLocalFilename( &clientConnection, "http://remote1" );
+	BuildRequest( &header, payload, CACHE_FILE, NULL, 0, "http://remote1" );
+	ClientRequestsLocalFilename( &clientConnection, &header, payload );
 	printf( "2: " );
-	ClientRequestsLocalFilename( &clientConnection, "http://nonexistent" );
+	BuildRequest( &header, payload, CACHE_FILE, NULL, 0, "http://nonexistent" );
+	ClientRequestsLocalFilename( &clientConnection, &header, payload );
 }
 
 
@@ -611,6 +762,7 @@ static void test_GetUpload( const char *param )
 	char          *localpath;
 	char          *keyid;
 	char          *secretkey;
+	enum ChecksumModes checksum;
 	bool          status;
 
 	CheckSQLiteUtil( );
@@ -621,7 +773,7 @@ static void test_GetUpload( const char *param )
 
 	status = Query_GetUpload( 4, &part, &bucket, &remotepath, &uploadid,
 							  &uid, &gid, &permissions, &filesize,
-							  &localpath, &keyid, &secretkey );
+							  &localpath, &keyid, &secretkey, &checksum );
 	printf( "%d - %s : %s : %s : %d:%d - %d : %lld %s %s %s\n", status,
 			bucket, remotepath, uploadid, (int)uid, (int)gid, permissions,
 			filesize, localpath, keyid, secretkey );
@@ -642,6 +794,7 @@ static void test_SetUploadId( const char *param )
 	char          *localpath;
 	char          *keyid;
 	char          *secretkey;
+	enum ChecksumModes checksum;
 	bool          status;
 
 	CheckSQLiteUtil( );
@@ -653,7 +806,7 @@ static void test_SetUploadId( const char *param )
 
 	status = Query_GetUpload( 4, &part, &bucket, &remotepath, &uploadid,
 							  &uid, &gid, &permissions, &filesize,
-							  &localpath, &keyid, &secretkey );
+							  &localpath, &keyid, &secretkey, &checksum );
 	printf( "%d - %s : %s : %s : %d:%d - %d : %lld %s %s %s\n", status,
 			bucket, remotepath, uploadid, (int)uid, (int)gid, permissions,
 			filesize, localpath, keyid, secretkey );
@@ -690,17 +843,32 @@ static void test_AllPartsUploaded( const char *param )
 static void test_PartETag( const char *param )
 {
 	const char *etag;
+	char       *checksum;
 
 	FillDatabase( );
 
 	Query_AddUpload( 4, 1005, 70*1024*1024 );
 	Query_CreateMultiparts( 4, 3 );
-	Query_SetPartETag( 4, 2, "Etag 1" );
+	Query_SetPartETag( 4, 2, "Etag 1", "4waSgw==" );
 
-	etag = Query_GetPartETag( 4, 2 );
+	etag = Query_GetPartETag( 4, 2, &checksum );
 	printf( "1: Etag = %s\n", etag );
-	etag = Query_GetPartETag( 4, 1 );
+	printf( "3: Checksum = %s\n", checksum );
+	etag = Query_GetPartETag( 4, 1, &checksum );
 	printf( "2: Etag = %s\n", etag );
+	printf( "4: Checksum = %s\n", checksum );
+}
+
+
+
+static void test_FileChecksum( const char *param )
+{
+	FillDatabase( );
+
+	printf( "1: %s\n", Query_GetFileChecksum( 1 ) );
+	Query_SetFileChecksum( 1, "4waSgw==" );
+	printf( "2: %s\n", Query_GetFileChecksum( 1 ) );
+	printf( "3: %s\n", Query_GetFileChecksum( 2 ) );
 }
 
 
@@ -23,6 +23,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <aws-s3fs.h>
 #include "testfunctions.h"
 #include "digest.h"
@@ -32,6 +33,9 @@
 
 struct Configuration globalConfig; /*unused*/
 
+extern int digestAcceleration;
+extern int base64Acceleration;
+
 static void test_MD5DigestBuffer( const char *parms );
 static void test_MD5DigestStream( const char *parms );
 #ifdef MAKE_OPENSSL_TESTS
@@ -39,19 +43,28 @@ static void test_MD5Signature( const char *parms );
 #endif
 static void test_SHA1DigestBuffer( const char *parms );
 static void test_SHA1DigestStream( const char *parms );
+static void test_SHA256DigestBuffer( const char *parms );
+static void test_SHA256DigestStream( const char *parms );
 #ifdef MAKE_OPENSSL_TESTS
 static void test_SHA1Signature( const char *parms );
+static void test_SHA1KeyedSignature( const char *parms );
 #endif
+static void test_DigestKernels( const char *parms );
+static void test_DigestThroughput( const char *parms );
+static void test_Crc32c( const char *parms );
 static void test_EncodeBase64( const char *parms );
 static void test_DecodeBase64( const char *parms );
+static void test_Base64Kernels( const char *parms );
 
 
 #ifdef MAKE_OPENSSL_TESTS
 #define MD5Signature     test_MD5Signature
 #define SHA1Signature    test_SHA1Signature
+#define SHA1KeyedSignature test_SHA1KeyedSignature
 #else
 #define MD5Signature     SkipTest
 #define SHA1Signature    SkipTest
+#define SHA1KeyedSignature SkipTest
 
 static void SkipTest( const char *parms ) { exit( 77 ); }
 #endif
@@ -68,8 +81,15 @@ const struct dispatchTable dispatchTable[ ] =
     { "SHA1DigestBuffer", test_SHA1DigestBuffer },
     { "SHA1DigestStream", test_SHA1DigestStream },
     { "SHA1Signature", SHA1Signature },
+    { "SHA1KeyedSignature", SHA1KeyedSignature },
+    { "SHA256DigestBuffer", test_SHA256DigestBuffer },
+    { "SHA256DigestStream", test_SHA256DigestStream },
+    { "DigestKernels", test_DigestKernels },
+    { "DigestThroughput", test_DigestThroughput },
+    { "Crc32c", test_Crc32c },
     { "EncodeBase64", test_EncodeBase64 },
     { "DecodeBase64", test_DecodeBase64 },
+    { "Base64Kernels", test_Base64Kernels },
     { NULL, NULL }
 };
 
@@ -144,6 +164,239 @@ static void test_SHA1DigestStream( const char *parms )
 
 
 
+static void test_SHA256DigestBuffer( const char *parms )
+{
+    char sha256sum[ 65 ];
+    FILE* fh;
+    int nBytes;
+
+    fh = fopen( parms, "r" );
+    if( fh == NULL ) exit( EXIT_FAILURE );
+    nBytes = fread( &filebuf, 1, sizeof( filebuf ), fh );
+    fclose( fh );
+    if( nBytes == 0 ) exit( EXIT_FAILURE );
+    DigestBuffer( &filebuf[ 0 ], nBytes, &sha256sum[ 0 ], HASH_SHA256, HASHENC_HEX );
+    sha256sum[ 64 ] = '\0';
+    printf( "%s  %s\n", sha256sum, parms );
+}
+
+
+
+static void test_SHA256DigestStream( const char *parms )
+{
+    char sha256sum[ 65 ];
+    FILE* fh;
+    int success;
+
+    fh = fopen( parms, "r" );
+    if( fh == NULL ) exit( EXIT_FAILURE );
+    success = DigestStream( fh, &sha256sum[ 0 ], HASH_SHA256, HASHENC_HEX );
+    fclose( fh );
+    if( success != 0 ) exit( EXIT_FAILURE );
+    sha256sum[ 64 ] = '\0';
+    printf( "%s  %s\n", sha256sum, parms );
+}
+
+
+
+/* Compare the digests computed with the processor's instruction set
+   extensions against the portable kernels, for messages of every length
+   around the block boundaries and for batches of buffers. */
+static void test_DigestKernels( const char *parms )
+{
+    const enum HashFunctions functions[ ] = { HASH_MD5, HASH_SHA1, HASH_SHA256 };
+    unsigned char *message;
+    const unsigned char *buffers[ 11 ];
+    size_t lengths[ 11 ];
+    char *digests[ 11 ];
+    char accelerated[ 65 ];
+    char portable[ 65 ];
+    int mismatches = 0;
+    size_t length;
+    int f;
+    int i;
+
+    message = malloc( 70000 );
+    for( i = 0; i < 70000; i++ )
+    {
+        message[ i ] = (unsigned char) ( i * 7 + ( i >> 8 ) );
+    }
+
+    for( f = 0; f < 3; f++ )
+    {
+        for( length = 0; length < 70000; length += ( length < 300 ? 1 : 997 ) )
+	{
+	    digestAcceleration = -1;
+	    DigestBuffer( &message[ 1 ], length, accelerated, functions[ f ], HASHENC_HEX );
+	    digestAcceleration = 0;
+	    DigestBuffer( &message[ 1 ], length, portable, functions[ f ], HASHENC_HEX );
+	    if( strcmp( accelerated, portable ) != 0 ) mismatches++;
+	}
+    }
+
+    /* Batches of MD5 messages with equal and with different lengths. */
+    for( i = 0; i < 11; i++ )
+    {
+        buffers[ i ] = &message[ i * 3 ];
+	lengths[ i ] = ( i % 2 == 0 ) ? 65536 : 1000 * i + i;
+	digests[ i ] = malloc( 33 );
+    }
+    for( length = 1; length <= 11; length++ )
+    {
+        digestAcceleration = -1;
+	DigestBuffers( buffers, lengths, length, digests, HASH_MD5, HASHENC_HEX );
+	digestAcceleration = 0;
+	for( i = 0; i < (int) length; i++ )
+	{
+	    DigestBuffer( buffers[ i ], lengths[ i ], portable, HASH_MD5, HASHENC_HEX );
+	    if( strcmp( digests[ i ], portable ) != 0 ) mismatches++;
+	}
+    }
+    for( i = 0; i < 11; i++ )
+    {
+        free( digests[ i ] );
+    }
+    free( message );
+
+    printf( "mismatches: %d\n", mismatches );
+}
+
+
+
+static double ElapsedSeconds( const struct timespec *start )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return( ( now.tv_sec - start->tv_sec )
+	    + ( now.tv_nsec - start->tv_nsec ) / 1e9 );
+}
+
+
+
+/* Report the throughput of each hash function with the portable kernels
+   and with the processor's instruction set extensions. */
+static void test_DigestThroughput( const char *parms )
+{
+    const enum HashFunctions functions[ ] = { HASH_MD5, HASH_SHA1, HASH_SHA256 };
+    const char *names[ ] = { "MD5", "SHA1", "SHA256" };
+    const size_t size = 8 * 1024 * 1024;
+    unsigned char *message;
+    const unsigned char *buffers[ 8 ];
+    size_t lengths[ 8 ];
+    char *digests[ 8 ];
+    char digest[ 65 ];
+    struct timespec start;
+    int accelerated;
+    int f;
+    int i;
+
+    message = malloc( size );
+    for( i = 0; i < (int) size; i++ )
+    {
+        message[ i ] = (unsigned char) i;
+    }
+    for( i = 0; i < 8; i++ )
+    {
+        buffers[ i ] = message;
+	lengths[ i ] = size / 8;
+	digests[ i ] = malloc( 33 );
+    }
+
+    for( accelerated = 0; accelerated <= 1; accelerated++ )
+    {
+        for( f = 0; f < 3; f++ )
+	{
+	    digestAcceleration = accelerated ? -1 : 0;
+	    clock_gettime( CLOCK_MONOTONIC, &start );
+	    DigestBuffer( message, size, digest, functions[ f ], HASHENC_HEX );
+	    printf( "%s (%s): %.0f MB/s\n", names[ f ],
+		    accelerated ? "accelerated" : "portable",
+		    size / 1e6 / ElapsedSeconds( &start ) );
+	}
+	digestAcceleration = accelerated ? -1 : 0;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	DigestBuffers( buffers, lengths, 8, digests, HASH_MD5, HASHENC_HEX );
+	printf( "MD5x8 (%s): %.0f MB/s\n",
+		accelerated ? "accelerated" : "portable",
+		size / 1e6 / ElapsedSeconds( &start ) );
+	digestAcceleration = accelerated ? -1 : 0;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	Crc32c( 0, message, size );
+	printf( "CRC32C (%s): %.0f MB/s\n",
+		accelerated ? "accelerated" : "portable",
+		size / 1e6 / ElapsedSeconds( &start ) );
+    }
+
+    for( i = 0; i < 8; i++ )
+    {
+        free( digests[ i ] );
+    }
+    free( message );
+}
+
+
+
+/* Check the CRC32C checksum against known values, and compare the
+   checksums computed with SSE4.2 against the portable kernel for messages
+   of many lengths and alignments, in one piece, in two pieces, and
+   combined from the checksums of two pieces. */
+static void test_Crc32c( const char *parms )
+{
+    unsigned char *message;
+    unsigned char bytes[ 32 ];
+    char encoded[ 9 ];
+    uint32_t accelerated;
+    uint32_t portable;
+    uint32_t pieces;
+    uint32_t combined;
+    int mismatches = 0;
+    size_t length;
+    int offset;
+    int i;
+
+    printf( "1: %08x\n", Crc32c( 0, "123456789", 9 ) );
+    memset( bytes, 0x00, sizeof( bytes ) );
+    printf( "2: %08x\n", Crc32c( 0, bytes, sizeof( bytes ) ) );
+    memset( bytes, 0xff, sizeof( bytes ) );
+    printf( "3: %08x\n", Crc32c( 0, bytes, sizeof( bytes ) ) );
+    EncodeCrc32c( Crc32c( 0, "123456789", 9 ), encoded );
+    printf( "4: %s\n", encoded );
+
+    message = malloc( 100000 );
+    for( i = 0; i < 100000; i++ )
+    {
+        message[ i ] = (unsigned char) ( i * 7 + ( i >> 8 ) );
+    }
+    for( length = 0; length < 99990; length += ( length < 600 ? 1 : 331 ) )
+    {
+        for( offset = 0; offset < 3; offset++ )
+	{
+	    digestAcceleration = -1;
+	    accelerated = Crc32c( 0, &message[ offset ], length );
+	    digestAcceleration = 0;
+	    portable = Crc32c( 0, &message[ offset ], length );
+	    pieces = Crc32c( Crc32c( 0, &message[ offset ], length / 3 ),
+			     &message[ offset + length / 3 ],
+			     length - length / 3 );
+	    combined = Crc32cCombine(
+		Crc32c( 0, &message[ offset ], length / 3 ),
+		Crc32c( 0, &message[ offset + length / 3 ], length - length / 3 ),
+		length - length / 3 );
+	    if( ( accelerated != portable ) || ( pieces != portable )
+		|| ( combined != portable ) )
+	    {
+	        mismatches++;
+	    }
+	}
+    }
+    free( message );
+
+    printf( "mismatches: %d\n", mismatches );
+}
+
+
+
 #ifdef MAKE_OPENSSL_TESTS
 static void test_SHA1Signature( const char *parms )
 {
@@ -165,6 +418,38 @@ static void test_SHA1Signature( const char *parms )
 
 
 
+#ifdef MAKE_OPENSSL_TESTS
+/* Sign the file twice with the same prepared key, which is longer than the
+   SHA1 block size. */
+static void test_SHA1KeyedSignature( const char *parms )
+{
+    FILE* fh;
+    int nBytes;
+    struct HmacKey *hmacKey;
+    const char *signature1;
+    const char *signature2;
+
+    fh = fopen( parms, "r" );
+    if( fh == NULL ) exit( EXIT_FAILURE );
+    nBytes = fread( &filebuf, 1, sizeof( filebuf ), fh );
+    fclose( fh );
+    if( nBytes == 0 ) exit( EXIT_FAILURE );
+    hmacKey = CreateHmacKey( "TestSecretKeyTestSecretKeyTestSecretKey"
+			     "TestSecretKeyTestSecretKeyTestSecretKey",
+			     HASH_SHA1 );
+    signature1 = HMACWithKey( hmacKey, filebuf, nBytes, HASHENC_HEX );
+    signature2 = HMACWithKey( hmacKey, filebuf, nBytes, HASHENC_HEX );
+    DestroyHmacKey( hmacKey );
+    if( strcmp( signature1, signature2 ) != 0 ) exit( EXIT_FAILURE );
+    printf( "HMAC-SHA1(%s)= %s\n", parms, signature1 );
+
+    free( (char*)signature1 );
+    free( (char*)signature2 );
+}
+#endif
+
+
+
 #ifdef MAKE_OPENSSL_TESTS
 static void test_MD5Signature( const char *parms )
 {
@@ -240,3 +525,83 @@ static void test_DecodeBase64( const char *parms )
         printf( "Success\n" );
     }
 }
+
+
+
+/* Compare the base64 encodings and decodings of the SSSE3 and AVX2 kernels
+   against the portable code for many lengths, and check that decoding stops
+   at the same invalid character. */
+static void test_Base64Kernels( const char *parms )
+{
+    unsigned char message[ 1000 ];
+    char encoded[ 2 ][ BASE64_ENCODED_SIZE( 1000 ) ];
+    unsigned char decoded[ 2 ][ BASE64_DECODED_SIZE( 1336 ) ];
+    int decodedLength[ 2 ];
+    int levels[ 3 ];
+    int mismatches = 0;
+    int length;
+    int level;
+    int position;
+    int ch;
+    int i;
+
+    for( i = 0; i < 1000; i++ )
+    {
+        message[ i ] = (unsigned char) ( i * 7 + ( i >> 8 ) );
+    }
+
+    /* Portable code, SSSE3 only, and all of the supported kernels. */
+    base64Acceleration = -1;
+    free( EncodeBase64( message, 1 ) );
+    levels[ 0 ] = 0;
+    levels[ 1 ] = base64Acceleration & 0x01;
+    levels[ 2 ] = base64Acceleration;
+
+    for( level = 1; level < 3; level++ )
+    {
+        for( length = 0; length < 1000; length++ )
+	{
+	    base64Acceleration = 0;
+	    EncodeBase64Buffer( message, length, encoded[ 0 ] );
+	    base64Acceleration = levels[ level ];
+	    EncodeBase64Buffer( message, length, encoded[ 1 ] );
+	    decodedLength[ 1 ] = DecodeBase64Buffer( encoded[ 1 ],
+						     strlen( encoded[ 1 ] ),
+						     decoded[ 1 ] );
+	    if( ( strcmp( encoded[ 0 ], encoded[ 1 ] ) != 0 )
+		|| ( decodedLength[ 1 ] != length )
+		|| ( memcmp( decoded[ 1 ], message, length ) != 0 ) )
+	    {
+	        mismatches++;
+	    }
+	}
+
+	/* Place every possible character at a number of positions. */
+	base64Acceleration = 0;
+	EncodeBase64Buffer( message, 300, encoded[ 0 ] );
+	for( position = 0; position < 400; position += 13 )
+	{
+	    for( ch = 1; ch < 256; ch++ )
+	    {
+	        strcpy( encoded[ 1 ], encoded[ 0 ] );
+		encoded[ 1 ][ position ] = (char) ch;
+		base64Acceleration = 0;
+		decodedLength[ 0 ] = DecodeBase64Buffer( encoded[ 1 ],
+							 strlen( encoded[ 1 ] ),
+							 decoded[ 0 ] );
+		base64Acceleration = levels[ level ];
+		decodedLength[ 1 ] = DecodeBase64Buffer( encoded[ 1 ],
+							 strlen( encoded[ 1 ] ),
+							 decoded[ 1 ] );
+		if( ( decodedLength[ 0 ] != decodedLength[ 1 ] )
+		    || ( memcmp( decoded[ 0 ], decoded[ 1 ],
+				 decodedLength[ 0 ] ) != 0 ) )
+		{
+		    mismatches++;
+		}
+	    }
+	}
+    }
+
+    printf( "mismatches: %d\n", mismatches );
+}
@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "aws-s3fs.h"
 #include "testfunctions.h"
 
@@ -30,6 +31,7 @@
 struct Configuration globalConfig; /*unused*/
 
 void test_Syslog( const char * );
+static void *LogFromThread( void *threadNumber );
 
 
 const struct dispatchTable dispatchTable[ ] =
@@ -42,7 +44,11 @@ const struct dispatchTable dispatchTable[ ] =
 
 void test_Syslog( const char *parms )
 {
-    int testNumber;
+    int       testNumber;
+    pthread_t threads[ 4 ];
+    int       threadNumber[ 4 ];
+    int       i;
+
     sscanf( parms, "%d", &testNumber );
     InitializeLoggingModule( );
 
@@ -81,6 +87,36 @@ void test_Syslog( const char *parms )
 	    CloseLog( );
 	    printf( "\"\n" );
 	    break;
+
+        case 5:
+	    InitLog( "test-log.log", log_DEBUG );
+	    EnableLogging( );
+	    for( i = 0; i < 4; i++ )
+	    {
+	        threadNumber[ i ] = i;
+		pthread_create( &threads[ i ], NULL, LogFromThread,
+				&threadNumber[ i ] );
+	    }
+	    for( i = 0; i < 4; i++ )
+	    {
+	        pthread_join( threads[ i ], NULL );
+	    }
+	    CloseLog( );
+	    break;
+    }
+}
+
+
+
+static void *LogFromThread( void *threadNumber )
+{
+    int i;
+
+    for( i = 0; i < 2000; i++ )
+    {
+        Syslog( log_DEBUG, "Thread %d message %d %s\n",
+		* (int*) threadNumber, i, "Test" );
     }
+    return( NULL );
 }
 
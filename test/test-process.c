@@ -52,22 +52,58 @@ const struct dispatchTable dispatchTable[ ] =
 
 
 /* Dummy function. */
-int ReadEntireMessage( int connectionHandle, char **clientMessage )
+int ReadClientMessage( int connectionHandle, struct CacheMessageHeader *header,
+					   char *payload )
 {
 	return( 0 );
 }
 
 
 
+/* Send a request to the file cache and wait for the reply. */
+static int Request( int socketFd, int opcode, const void *fields,
+					size_t fieldsLength, const char *tail, char *reply )
+{
+	static uint32_t           requestId = 0;
+	struct CacheMessageHeader header;
+	int                       status;
+
+	status = SocketSendCacheMessage( socketFd, opcode, ++requestId, 0,
+									 fields, fieldsLength, tail, -1 );
+	if( status == 0 )
+	{
+		status = SocketReceiveCacheMessage( socketFd, &header, reply,
+											CACHE_MAX_PAYLOAD, NULL );
+	}
+	if( 0 <= status )
+	{
+		status = header.status;
+	}
+	return( status );
+}
+
+
+
+static void BuildConnectRequest( struct CacheConnectRequest *request,
+								 const char *keyId, const char *secretKey )
+{
+	strncpy( request->keyId, keyId, sizeof( request->keyId ) );
+	strncpy( request->secretKey, secretKey, sizeof( request->secretKey ) );
+	request->checksum = CHECKSUM_MD5;
+}
+
+
+
 /* Test that the file cache and the permissions grant modules work when
    daemonized. */
 static void test_Daemon( const char *param )
 {
-    int                socketFd;
-    struct sockaddr_un socketAddress;
-    char buffer[ 100 ];
-	struct stat        statInfo;
-	pid_t              pid;
+    int                        socketFd;
+    struct sockaddr_un         socketAddress;
+    char                       buffer[ CACHE_MAX_PAYLOAD + 1 ];
+	struct CacheConnectRequest connect;
+	struct stat                statInfo;
+	pid_t                      pid;
 
 	/* Create a directory for the socket. */
 	mkdir( CACHE_DIR, 0750 );
@@ -83,14 +119,15 @@ static void test_Daemon( const char *param )
 
     if( socketFd != -1 )
     {
-		strcpy( buffer, "CONNECT bucket:1000:12345678901234567890:"
-				"1234567890123456789012345678901234567890" );
-		write( socketFd, buffer, strlen( buffer ) );
-		read( socketFd, buffer, 100 );
-		printf( "Reply: %s\n", buffer );
-
-		strcpy( buffer, "QUIT" );
-		write( socketFd, buffer, strlen( buffer ) );
+		BuildConnectRequest( &connect, "12345678901234567890",
+							 "1234567890123456789012345678901234567890" );
+		if( Request( socketFd, CACHE_CONNECT, &connect, sizeof( connect ),
+					 "bucket", buffer ) == 0 )
+		{
+			printf( "Reply: CONNECTED\n" );
+		}
+
+		SocketSendCacheMessage( socketFd, CACHE_QUIT, 0, 0, NULL, 0, NULL, -1 );
 		printf( "Process terminated\n" );
 	}
 
@@ -108,14 +145,12 @@ static void test_Daemon( const char *param )
 	   that is capable of communicating with the grant process, so we can send
 	   a test message even if it is guaranteed to receive with a "don't even
 	   bother" reply via the "DEBUG" message. */
-	strcpy( buffer, "DEBUG: expect a \"bugger-off\" reply" );
-	write( socketFd, buffer, strlen( buffer ) );
-	read( socketFd, buffer, 100 );
+	Request( socketFd, CACHE_DEBUG, NULL, 0, "expect a \"bugger-off\" reply",
+			 buffer );
 	printf( "Reply: %s\n", buffer );
 
 	/* Terminate the server. */
-	strcpy( buffer, "QUIT" );
-	write( socketFd, buffer, strlen( buffer ) );
+	SocketSendCacheMessage( socketFd, CACHE_QUIT, 0, 0, NULL, 0, NULL, -1 );
 	printf( "Process terminated\n" );
 }
 
@@ -139,10 +174,15 @@ void test_LiveDownload( const char *param )
 
 	char          url[ 200 ];
 	char          request[ 200 ];
-	char          reply[ 40 ];
+	char          reply[ CACHE_MAX_PAYLOAD + 1 ];
 	uid_t         uid;
 	gid_t         gid;
 
+	struct CacheConnectRequest connect;
+	struct CacheCreateRequest  create;
+	struct CacheCreateReply    created;
+	int                        status;
+
 	ReadLiveConfig( param );
 
 	mkdir( CACHE_DIR, 0750 );
@@ -156,11 +196,10 @@ void test_LiveDownload( const char *param )
     CreateClientStreamSocket( SOCKET_NAME, &socketFd, &socketAddress );
 
 	/* Connect to the daemon. */
-	sprintf( request, "CONNECT %s:%d:%s:%s", globalConfig.bucketName,
-			 getuid( ), globalConfig.keyId, globalConfig.secretKey );
-	write( socketFd, request, strlen( request ) );
-	read( socketFd, reply, sizeof( reply ) );
-	if( strncmp( reply, "CONNECTED", strlen( "CONNECTED" ) ) != 0 )
+	BuildConnectRequest( &connect, globalConfig.keyId,
+						 globalConfig.secretKey );
+	if( Request( socketFd, CACHE_CONNECT, &connect, sizeof( connect ),
+				 globalConfig.bucketName, reply ) != 0 )
 	{
 		printf( "Not connected\n" );
 		exit( 1 );
@@ -179,12 +218,19 @@ void test_LiveDownload( const char *param )
 	}
 	uid = getuid( );
 	gid = getgid( );
-	sprintf( request, "CREATE %d:%d:%d:%d:%d:%d:100:%s",
-			 (int) uid, (int) gid, 0750, (int) uid, (int) gid, 0640, url );
-	write( socketFd, request, strlen( request ) );
-	read( socketFd, reply, sizeof( reply ) );
-	printf( "Reply: %s\n", reply );
-	if( strncmp( reply, "CREATED", 7 ) != 0 )
+	create.parentUid         = uid;
+	create.parentGid         = gid;
+	create.parentPermissions = 0750;
+	create.uid               = uid;
+	create.gid               = gid;
+	create.permissions       = 0640;
+	create.mtime             = 100;
+	status = Request( socketFd, CACHE_CREATE, &create, sizeof( create ),
+					  url, reply );
+	memcpy( &created, reply, sizeof( created ) );
+	printf( "Reply: CREATED %s %lld\n", &reply[ sizeof( created ) ],
+			(long long) created.fileId );
+	if( status != 0 )
 	{
 		printf( "Could not create local files\n" );
 		exit( 1 );
@@ -194,13 +240,9 @@ void test_LiveDownload( const char *param )
 
 	/* Request download of the file. */
 	printf( "Requesting download of file %s\n", url );
-	sprintf( request, "CACHE %s", url );
-	write( socketFd, request, strlen( request ) );
-	read( socketFd, reply, sizeof( reply ) );
-	printf( "Reply: %s\n", reply );
-
-	strcpy( request, "QUIT" );
-	write( socketFd, request, strlen( request ) );
-	read( socketFd, reply, sizeof( reply ) );
+	status = Request( socketFd, CACHE_DOWNLOAD, NULL, 0, url, reply );
+	printf( "Reply: %d\n", status );
+
+	SocketSendCacheMessage( socketFd, CACHE_QUIT, 0, 0, NULL, 0, NULL, -1 );
 }
 
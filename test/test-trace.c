@@ -0,0 +1,95 @@
+/**
+ * \file test-trace.c
+ * \brief Test the latency trace spans.
+ *
+ * Copyright (C) 2012 Ole Wolf <wolf@blazingangles.com>
+ *
+ * This file is part of aws-s3fs.
+ *
+ * aws-s3fs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "aws-s3fs.h"
+#include "trace.h"
+#include "testfunctions.h"
+
+
+struct Configuration globalConfig; /*unused*/
+
+void test_TraceSpans( const char * );
+static void *TraceFromThread( void *spans );
+
+
+const struct dispatchTable dispatchTable[ ] =
+{
+    { "TraceSpans", &test_TraceSpans },
+    { NULL, NULL }
+};
+
+
+
+void test_TraceSpans( const char *parms )
+{
+    int       testNumber;
+    pthread_t threads[ 2 ];
+    int       spans;
+    int       i;
+
+    sscanf( parms, "%d", &testNumber );
+
+    switch( testNumber )
+    {
+        /* Spans from two threads. */
+        case 1:
+	    spans = 100;
+	    break;
+
+        /* More spans than the ring holds, so that the oldest are dropped. */
+        case 2:
+	    spans = TRACE_SPANS;
+	    break;
+
+        default:
+	    return;
+    }
+
+    for( i = 0; i < 2; i++ )
+    {
+        pthread_create( &threads[ i ], NULL, TraceFromThread, &spans );
+    }
+    for( i = 0; i < 2; i++ )
+    {
+        pthread_join( threads[ i ], NULL );
+    }
+    fflush( stdout );
+    printf( "\nStatus: %d\n", WriteTrace( STDOUT_FILENO ) );
+}
+
+
+
+static void *TraceFromThread( void *spans )
+{
+    int i;
+
+    for( i = 0; i < * (int*) spans; i++ )
+    {
+        TRACE_SCOPE( "test", "TraceFromThread" );
+    }
+    return( NULL );
+}
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include "aws-s3fs.h"
 #include "filecache.h"
+#include "socket.h"
 #include "testfunctions.h"
 
 
@@ -81,7 +82,8 @@ int s3_SubmitS3Request( S3COMM *handle, const char *httpVerb,
 	return( 0 );
 }
 /* Dummy function for testing. */
-int ReadEntireMessage( int connectionHandle, char **clientMessage )
+int ReadClientMessage( int connectionHandle, struct CacheMessageHeader *header,
+					   char *payload )
 {
 	return( 0 );
 }
@@ -262,4 +264,9 @@ static void test_CreateFileChunk( const char *param )
 	CreateFileChunk( "1:hJire8/kj6Upq:dChnk1" );
 	CreateFileChunk( "2:hJire8/kj6Upq:dChnk2" );
 	system( "ls -1 -g -o " CACHE_INPROGRESS );
+	/* Verify the contents of the chunks. */
+	system( "cmp -n 26214400 " CACHE_FILES "hJire8/kj6Upq " CACHE_INPROGRESS
+			"dChnk1 && echo \"dChnk1 matches\"" );
+	system( "cmp -i 26214400:0 " CACHE_FILES "hJire8/kj6Upq " CACHE_INPROGRESS
+			"dChnk2 && echo \"dChnk2 matches\"" );
 }